@@ -0,0 +1,43 @@
+#include <string.h>
+#include "bench.h"
+
+typedef struct {
+    const char *name;
+    int (*run)(int argc, char **argv);
+    const char *usage;
+} bench_entry_t;
+
+static const bench_entry_t benches[] = {
+    {"layout",   bench_layout,   "[width] [height] [runs]  contiguous vs row-pointer images"},
+    {"convolve", bench_convolve, "[width] [height] [threads] [runs]  fixed vs float blur, thread scaling"},
+    {"fused",    bench_fused,    "[width] [height] [steps] [runs]  iterated vs fused multi-step blur"},
+    {"unfilter", bench_unfilter, "[width] [rows] [runs]    SIMD vs scalar unfilter, checked bit-exact"},
+    {"crc",      bench_crc,      "[megabytes] [runs]       CRC-32 paths vs bytewise reference and memcpy"},
+    {"pipeline", bench_pipeline, "[width] [height] [runs]  separate vs fused gray + convolution, checked bit-exact"},
+    {"resample", bench_resample, "[width] [height] [runs]  resampling filters vs double reference and old upscaler"},
+    {"unpack",   bench_unpack,   "[samples] [runs]         bit depth kernels vs scalar references, checked exact"},
+    {"codec",    bench_codec,    "[width] [height] [runs]  encode and decode throughput vs threads, strip layout"},
+    {"stages",   bench_stages,   "[runs] [--json] [--quick] every stage over a synthetic corpus, percentiles"},
+    {"server",   bench_server,   "[requests] [runs]        --serve round trips, checked replies incl. a failed write"},
+};
+
+#define BENCH_COUNT (sizeof(benches) / sizeof(benches[0]))
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: %s <benchmark> [args]\n\nBenchmarks:\n", argv[0]);
+        for (size_t i = 0; i < BENCH_COUNT; i++) {
+            printf("  %-10s %s\n", benches[i].name, benches[i].usage);
+        }
+        return 1;
+    }
+
+    for (size_t i = 0; i < BENCH_COUNT; i++) {
+        if (!strcmp(argv[1], benches[i].name)) {
+            return benches[i].run(argc - 1, argv + 1);
+        }
+    }
+
+    fprintf(stderr, "ERROR: Unknown benchmark %s\n", argv[1]);
+    return 1;
+}
@@ -0,0 +1,72 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../include/image.h"
+
+static inline double bench_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// xorshift32: advances `state` and returns it, deterministic across runs
+static inline uint32_t bench_xorshift32(uint32_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// Same size, channels and pixels, row padding ignored
+static inline bool bench_images_equal(const image_t *a, const image_t *b) {
+    if (!a || !b || a->width != b->width || a->height != b->height || a->channels != b->channels) {
+        return false;
+    }
+    for (uint32_t y = 0; y < a->height; y++) {
+        if (memcmp(image_row(a, y), image_row(b, y), image_row_bytes(a)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Closer to a photo than noise: gradients that differ per channel, flat
+// blocks `block` pixels wide raised above their surroundings for hard edges
+// (0 = none) and xorshift noise masked by `noise`, from a nonzero `seed`.
+// 8-bit images of any channel count
+static inline void bench_fill_scene(image_t *image, uint32_t block, uint32_t noise, uint32_t seed) {
+    uint32_t state = seed;
+    for (uint32_t y = 0; y < image->height; y++) {
+        uint8_t *row = image_row(image, y);
+        for (uint32_t x = 0; x < image->width; x++) {
+            uint8_t *pixel = row + (size_t)x * image->channels;
+            bool raised = block && (x / block + y / block) % 3 == 0;
+            for (uint32_t c = 0; c < image->channels; c++) {
+                uint32_t value = (x * (c + 1) * 255 / image->width + y * 255 / image->height) / (c + 2) +
+                                 (raised ? 96 : 0) + (bench_xorshift32(&state) & noise);
+                pixel[c] = (uint8_t)(value > 255 ? 255 : value);
+            }
+        }
+    }
+}
+
+// Each benchmark takes the arguments after its name and returns an exit code
+int bench_layout(int argc, char **argv);
+int bench_convolve(int argc, char **argv);
+int bench_fused(int argc, char **argv);
+int bench_unfilter(int argc, char **argv);
+int bench_crc(int argc, char **argv);
+int bench_pipeline(int argc, char **argv);
+int bench_resample(int argc, char **argv);
+int bench_unpack(int argc, char **argv);
+int bench_codec(int argc, char **argv);
+int bench_stages(int argc, char **argv);
+int bench_server(int argc, char **argv);
+
+#endif
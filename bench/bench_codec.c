@@ -0,0 +1,101 @@
+/**
+ * Whole-file encode and decode throughput against the thread count. One
+ * thread writes a single deflate stream; more threads write the strip
+ * layout (see PNG_STRIP_BYTES), which the decoder then splits again. Every
+ * decode is checked against the source pixels, and stripped files are also
+ * read back serially, the way any other decoder sees them.
+ *
+ * Usage: png_bench codec [width] [height] [runs]
+ */
+#include <unistd.h>
+#include <sys/stat.h>
+#include "bench.h"
+#include "../include/processor.h"
+
+static image_t *load(const char *path, uint32_t threads, bool *stripped) {
+    png_reader_t reader;
+    if (!png_reader_open(path, &reader)) {
+        return NULL;
+    }
+    if (stripped) {
+        *stripped = reader.strip_index != NULL;
+    }
+    image_t *image = decode_png_image(&reader, false, threads);
+    png_reader_close(&reader);
+    return image;
+}
+
+int bench_codec(int argc, char **argv) {
+    uint32_t width = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 10) : 3840;
+    uint32_t height = (argc > 2) ? (uint32_t)strtoul(argv[2], NULL, 10) : 2160;
+    int runs = (argc > 3) ? atoi(argv[3]) : 3;
+
+    image_t *input = image_create(width, height, 3);
+    if (!input) {
+        return 1;
+    }
+    // Mild noise, so deflate has work closer to a photo
+    bench_fill_scene(input, 0, 7, 2463534242u);
+
+    char path[] = "/tmp/png_bench_codec_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Could not create a temporary file\n");
+        image_free(input);
+        return 1;
+    }
+    close(fd);
+
+    double megabytes = (double)image_row_bytes(input) * height / 1e6;
+    printf("Codec benchmark: %u x %u RGB (%.1f MB raw), %d runs (best time), %u cores\n",
+           width, height, megabytes, runs, cpu_count());
+    printf("%-8s %12s %10s %12s %12s %10s %8s %8s\n", "threads", "encode (ms)", "MB/s", "size",
+           "decode (ms)", "MB/s", "strips", "exact");
+
+    static const uint32_t thread_counts[] = {1, 2, 4, 8};
+    bool all_exact = true;
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+        png_write_options_t options;
+        png_write_options_default(&options);
+        options.threads = thread_counts[t];
+
+        double encode = 1e30;
+        double decode = 1e30;
+        bool exact = true;
+        bool stripped = false;
+        for (int run = 0; run < runs && exact; run++) {
+            double t0 = bench_now_ms();
+            if (!save_png(path, input, 2, &options)) {
+                unlink(path);
+                image_free(input);
+                return 1;
+            }
+            double t1 = bench_now_ms();
+            image_t *decoded = load(path, thread_counts[t], &stripped);
+            double t2 = bench_now_ms();
+            exact = bench_images_equal(input, decoded);
+            image_free(decoded);
+
+            if (t1 - t0 < encode) encode = t1 - t0;
+            if (t2 - t1 < decode) decode = t2 - t1;
+        }
+
+        // Any decoder reads the stitched stream front to back
+        if (exact && stripped) {
+            image_t *serial = load(path, 1, NULL);
+            exact = bench_images_equal(input, serial);
+            image_free(serial);
+        }
+        all_exact = all_exact && exact;
+
+        struct stat st;
+        long long size = (stat(path, &st) == 0) ? (long long)st.st_size : -1;
+        printf("%-8u %12.1f %10.1f %12lld %12.1f %10.1f %8s %8s\n", thread_counts[t], encode,
+               megabytes / (encode / 1e3), size, decode, megabytes / (decode / 1e3),
+               stripped ? "yes" : "no", exact ? "yes" : "NO");
+    }
+
+    unlink(path);
+    image_free(input);
+    return all_exact ? 0 : 1;
+}
@@ -0,0 +1,280 @@
+/**
+ * Thread scaling of apply_convolution() on a large grayscale image. Every
+ * thread count must reproduce the single-threaded output byte for byte.
+ * The fixed-point Gaussian and box blur are first checked against exactly
+ * rounded integer sums on odd sizes and timed against the float reference.
+ * Interleaved RGB/RGBA convolution is checked against convolving each
+ * channel as its own plane, and the two are timed on an RGB image.
+ * In-place convolution must match apply_convolution() for every kernel,
+ * layout, bit depth and band count, images smaller than 3 x 3 included.
+ *
+ * Usage: png_bench convolve [width] [height] [max threads] [runs]
+ */
+#include <string.h>
+#include "bench.h"
+#include "../include/convolution.h"
+
+static void fill_pattern(image_t *image) {
+    for (uint32_t y = 0; y < image->height; y++) {
+        uint8_t *row = image_row(image, y);
+        for (uint32_t x = 0; x < image_row_bytes(image); x++) {
+            row[x] = (uint8_t)(x * 7 + y * 13 + ((x ^ y) & 31) + (x * y >> 5));
+        }
+    }
+}
+
+// Compare the separable path with sum / divisor rounded to nearest, and
+// report the largest difference to the truncating float reference
+static bool verify_separable(kernel_type type, uint32_t width, uint32_t height, int *max_float_diff) {
+    static const int weights[3] = {1, 2, 1};
+    int divisor = (type == KERNEL_GAUSSIAN) ? 16 : 9;
+    image_t *input = image_create(width, height, 1);
+    image_t *fixed = image_create(width, height, 1);
+    image_t *reference = image_create(width, height, 1);
+    if (!input || !fixed || !reference) {
+        exit(1);
+    }
+    fill_pattern(input);
+    apply_convolution(input, fixed, type, 1);
+    apply_convolution_reference(input, reference, type);
+
+    bool ok = true;
+    for (uint32_t y = 1; y + 1 < height; y++) {
+        for (uint32_t x = 1; x + 1 < width; x++) {
+            int sum = 0;
+            for (int ky = -1; ky <= 1; ky++) {
+                for (int kx = -1; kx <= 1; kx++) {
+                    int w = (type == KERNEL_GAUSSIAN) ? weights[ky + 1] * weights[kx + 1] : 1;
+                    sum += w * image_row(input, y + ky)[x + kx];
+                }
+            }
+            int expected = (sum + divisor / 2) / divisor;
+            int actual = image_row(fixed, y)[x];
+            int diff = abs(actual - image_row(reference, y)[x]);
+            if (actual != expected) {
+                ok = false;
+            }
+            if (diff > *max_float_diff) {
+                *max_float_diff = diff;
+            }
+        }
+    }
+
+    image_free(input);
+    image_free(fixed);
+    image_free(reference);
+    return ok;
+}
+
+// Convolve each colour channel as a separate plane, the way RGB images were
+// processed before the kernels took a channel stride
+static void convolve_planar(const image_t *input, image_t *output, kernel_type type) {
+    image_t *plane = image_create(input->width, input->height, 1);
+    image_t *result = image_create(input->width, input->height, 1);
+    if (!plane || !result) {
+        exit(1);
+    }
+    image_copy(output, input);
+
+    for (uint32_t c = 0; c < image_color_channels(input); c++) {
+        for (uint32_t y = 0; y < input->height; y++) {
+            const uint8_t *src = image_row(input, y);
+            uint8_t *dst = image_row(plane, y);
+            for (uint32_t x = 0; x < input->width; x++) {
+                dst[x] = src[x * input->channels + c];
+            }
+        }
+        apply_convolution(plane, result, type, 1);
+        for (uint32_t y = 0; y < input->height; y++) {
+            const uint8_t *src = image_row(result, y);
+            uint8_t *dst = image_row(output, y);
+            for (uint32_t x = 0; x < input->width; x++) {
+                dst[x * input->channels + c] = src[x];
+            }
+        }
+    }
+
+    image_free(plane);
+    image_free(result);
+}
+
+// Interleaved and planar results must match byte for byte, alpha included
+static bool verify_interleaved(kernel_type type, uint32_t channels, uint32_t width, uint32_t height) {
+    image_t *input = image_create(width, height, channels);
+    image_t *interleaved = image_create(width, height, channels);
+    image_t *planar = image_create(width, height, channels);
+    if (!input || !interleaved || !planar) {
+        exit(1);
+    }
+    fill_pattern(input);
+    apply_convolution(input, interleaved, type, 1);
+    convolve_planar(input, planar, type);
+
+    bool ok = bench_images_equal(interleaved, planar);
+    image_free(input);
+    image_free(interleaved);
+    image_free(planar);
+    return ok;
+}
+
+// apply_convolution_in_place() against apply_convolution() into a second
+// image, split into `threads` bands
+static bool verify_in_place(kernel_type type, uint32_t channels, uint32_t bit_depth,
+                            uint32_t width, uint32_t height, uint32_t threads) {
+    image_t *image = image_create_depth(width, height, channels, bit_depth);
+    image_t *expected = image_create_depth(width, height, channels, bit_depth);
+    if (!image || !expected) {
+        exit(1);
+    }
+    fill_pattern(image);
+    apply_convolution(image, expected, type, 1);
+    bool ok = apply_convolution_in_place(image, type, threads) && bench_images_equal(image, expected);
+    image_free(image);
+    image_free(expected);
+    return ok;
+}
+
+int bench_convolve(int argc, char **argv) {
+    // 8K UHD by default
+    uint32_t width = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 10) : 7680;
+    uint32_t height = (argc > 2) ? (uint32_t)strtoul(argv[2], NULL, 10) : 4320;
+    uint32_t max_threads = (argc > 3) ? (uint32_t)strtoul(argv[3], NULL, 10) : cpu_count();
+    int runs = (argc > 4) ? atoi(argv[4]) : 3;
+    if (max_threads == 0) {
+        max_threads = 1;
+    }
+
+    printf("Convolution scaling benchmark: %u x %u, 1-%u threads, %u cores, %d runs (best time)\n",
+           width, height, max_threads, cpu_count(), runs);
+
+    image_t *input = image_create(width, height, 1);
+    image_t *reference = image_create(width, height, 1);
+    image_t *output = image_create(width, height, 1);
+    if (!input || !reference || !output) {
+        return 1;
+    }
+    fill_pattern(input);
+
+    static const kernel_type kernels[] = {KERNEL_GAUSSIAN, KERNEL_BLUR, KERNEL_SOBEL_COMBINED};
+    static const char *names[] = {"gaussian", "blur", "sobel"};
+    static const uint32_t sizes[][2] = {{3, 3}, {17, 5}, {18, 4}, {33, 9}, {100, 7}, {257, 31}};
+    int status = 0;
+
+    printf("%-10s %14s %14s %12s\n", "kernel", "float (ms)", "fixed (ms)", "max |diff|");
+    for (size_t k = 0; k < 2; k++) {
+        int max_float_diff = 0;
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            if (!verify_separable(kernels[k], sizes[i][0], sizes[i][1], &max_float_diff)) {
+                fprintf(stderr, "ERROR: %s is not exactly rounded at %u x %u\n",
+                        names[k], sizes[i][0], sizes[i][1]);
+                status = 1;
+            }
+        }
+
+        double best[2] = {1e30, 1e30};
+        for (int run = 0; run < runs; run++) {
+            double t0 = bench_now_ms();
+            apply_convolution_reference(input, reference, kernels[k]);
+            double t1 = bench_now_ms();
+            apply_convolution(input, output, kernels[k], 1);
+            double t2 = bench_now_ms();
+            if (t1 - t0 < best[0]) best[0] = t1 - t0;
+            if (t2 - t1 < best[1]) best[1] = t2 - t1;
+        }
+        printf("%-10s %14.3f %14.3f %12d\n", names[k], best[0], best[1], max_float_diff);
+        if (max_float_diff > 1) {
+            status = 1;
+        }
+    }
+    printf("\n");
+
+    static const kernel_type interleaved_kernels[] = {KERNEL_GAUSSIAN, KERNEL_BLUR, KERNEL_SOBEL_COMBINED, KERNEL_SHARPEN};
+    for (size_t k = 0; k < sizeof(interleaved_kernels) / sizeof(interleaved_kernels[0]); k++) {
+        for (uint32_t channels = 2; channels <= 4; channels++) {
+            for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+                if (!verify_interleaved(interleaved_kernels[k], channels, sizes[i][0], sizes[i][1])) {
+                    fprintf(stderr, "ERROR: Interleaved kernel %d differs from planar at %u x %u x %u\n",
+                            interleaved_kernels[k], sizes[i][0], sizes[i][1], channels);
+                    status = 1;
+                }
+            }
+        }
+    }
+
+    static const uint32_t in_place_sizes[][2] = {{1, 1}, {2, 9}, {9, 2}, {3, 3}, {17, 5}, {33, 9}, {100, 31}};
+    for (int type = KERNEL_SOBEL_X; type <= KERNEL_NONE; type++) {
+        for (uint32_t channels = 1; channels <= 4; channels++) {
+            for (uint32_t bit_depth = 8; bit_depth <= 16; bit_depth += 8) {
+                for (size_t i = 0; i < sizeof(in_place_sizes) / sizeof(in_place_sizes[0]); i++) {
+                    for (uint32_t threads = 1; threads <= 5; threads += 2) {
+                        if (!verify_in_place((kernel_type)type, channels, bit_depth, in_place_sizes[i][0],
+                                             in_place_sizes[i][1], threads)) {
+                            fprintf(stderr, "ERROR: In-place kernel %d differs at %u x %u x %u, %u-bit, %u threads\n",
+                                    type, in_place_sizes[i][0], in_place_sizes[i][1], channels, bit_depth, threads);
+                            status = 1;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    image_t *rgb_input = image_create(width, height, 3);
+    image_t *rgb_output = image_create(width, height, 3);
+    if (!rgb_input || !rgb_output) {
+        return 1;
+    }
+    fill_pattern(rgb_input);
+
+    printf("%-10s %14s %16s\n", "RGB", "planar (ms)", "interleaved (ms)");
+    for (size_t k = 0; k < 2; k++) {
+        double best[2] = {1e30, 1e30};
+        for (int run = 0; run < runs; run++) {
+            double t0 = bench_now_ms();
+            convolve_planar(rgb_input, rgb_output, kernels[k]);
+            double t1 = bench_now_ms();
+            apply_convolution(rgb_input, rgb_output, kernels[k], 1);
+            double t2 = bench_now_ms();
+            if (t1 - t0 < best[0]) best[0] = t1 - t0;
+            if (t2 - t1 < best[1]) best[1] = t2 - t1;
+        }
+        printf("%-10s %14.3f %16.3f\n", names[k], best[0], best[1]);
+    }
+    printf("\n");
+    image_free(rgb_input);
+    image_free(rgb_output);
+
+    printf("%-10s %8s %12s %9s\n", "kernel", "threads", "time (ms)", "speedup");
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        apply_convolution(input, reference, kernels[k], 1);
+
+        double single = 0.0;
+        for (uint32_t threads = 1; threads <= max_threads; threads++) {
+            double best = 1e30;
+            for (int run = 0; run < runs; run++) {
+                double t0 = bench_now_ms();
+                apply_convolution(input, output, kernels[k], threads);
+                double t1 = bench_now_ms();
+                if (t1 - t0 < best) best = t1 - t0;
+            }
+            if (threads == 1) {
+                single = best;
+            }
+
+            bool same = bench_images_equal(reference, output);
+            printf("%-10s %8u %12.3f %8.2fx%s\n", names[k], threads, best, single / best,
+                   same ? "" : "  MISMATCH");
+            if (!same) {
+                status = 1;
+            }
+        }
+    }
+
+    image_free(input);
+    image_free(reference);
+    image_free(output);
+    if (status) {
+        fprintf(stderr, "ERROR: Threaded convolution differs from the single-threaded result\n");
+    }
+    return status;
+}
@@ -0,0 +1,87 @@
+/**
+ * Compares `steps` iterations of the 3x3 Gaussian/box blur with the fused
+ * running-sum approximation: time for both, and the mean and largest
+ * difference away from the edges, where the fixed border of the iterated
+ * version and the clamped edges of the fused one disagree by design.
+ *
+ * Usage: png_bench fused [width] [height] [steps] [runs]
+ */
+#include "bench.h"
+#include "../include/box_blur.h"
+
+// Apply the kernel `steps` times, ping-ponging between output and temp
+static void iterate(const image_t *input, image_t *output, image_t *temp, kernel_type type, uint32_t steps) {
+    const image_t *source = input;
+    for (uint32_t i = 0; i < steps; i++) {
+        image_t *target = ((steps - 1 - i) % 2 == 0) ? output : temp;
+        apply_convolution(source, target, type, 1);
+        source = target;
+    }
+}
+
+int bench_fused(int argc, char **argv) {
+    uint32_t width = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 10) : 3840;
+    uint32_t height = (argc > 2) ? (uint32_t)strtoul(argv[2], NULL, 10) : 2160;
+    uint32_t max_steps = (argc > 3) ? (uint32_t)strtoul(argv[3], NULL, 10) : 200;
+    int runs = (argc > 4) ? atoi(argv[4]) : 3;
+
+    printf("Fused blur benchmark: %u x %u RGB, single thread, %d runs (best time)\n", width, height, runs);
+
+    image_t *input = image_create(width, height, 3);
+    image_t *iterated = image_create(width, height, 3);
+    image_t *fused = image_create(width, height, 3);
+    image_t *temp = image_create(width, height, 3);
+    if (!input || !iterated || !fused || !temp) {
+        return 1;
+    }
+    bench_fill_scene(input, 61, 15, 2463534242u);
+
+    static const kernel_type kernels[] = {KERNEL_BLUR, KERNEL_GAUSSIAN};
+    static const char *names[] = {"blur", "gaussian"};
+    uint32_t step_counts[] = {1, 4, 16, max_steps};
+
+    printf("%-10s %6s %8s %14s %12s %10s %9s\n",
+           "kernel", "steps", "sigma", "iterated (ms)", "fused (ms)", "mean diff", "max diff");
+    for (size_t k = 0; k < 2; k++) {
+        for (size_t s = 0; s < sizeof(step_counts) / sizeof(step_counts[0]); s++) {
+            uint32_t steps = step_counts[s];
+            double best[2] = {1e30, 1e30};
+            for (int run = 0; run < runs; run++) {
+                double t0 = bench_now_ms();
+                iterate(input, iterated, temp, kernels[k], steps);
+                double t1 = bench_now_ms();
+                if (!box_blur_fused(input, fused, kernels[k], steps, 1)) {
+                    return 1;
+                }
+                double t2 = bench_now_ms();
+                if (t1 - t0 < best[0]) best[0] = t1 - t0;
+                if (t2 - t1 < best[1]) best[1] = t2 - t1;
+            }
+
+            // Skip the band the fixed border reaches into, about 3 sigma
+            uint32_t margin = (uint32_t)(3.0f * fused_blur_sigma(kernels[k], steps)) + 2;
+            uint64_t total = 0, count = 0;
+            int max_diff = 0;
+            for (uint32_t y = margin; y + margin < height; y++) {
+                const uint8_t *a = image_row(iterated, y);
+                const uint8_t *b = image_row(fused, y);
+                for (size_t x = (size_t)margin * 3; x + (size_t)margin * 3 < image_row_bytes(input); x++) {
+                    int diff = abs(a[x] - b[x]);
+                    total += diff;
+                    count++;
+                    if (diff > max_diff) max_diff = diff;
+                }
+            }
+
+            printf("%-10s %6u %8.2f %14.3f %12.3f %10.3f %9d\n", names[k], steps,
+                   fused_blur_sigma(kernels[k], steps), best[0], best[1],
+                   count ? (double)total / count : 0.0, max_diff);
+        }
+    }
+
+    image_free(input);
+    image_free(iterated);
+    image_free(fused);
+    image_free(temp);
+    return 0;
+}
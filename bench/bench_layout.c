@@ -0,0 +1,135 @@
+/**
+ * Compares the contiguous image_t layout against the old row-pointer matrix
+ * (one malloc per row) for allocation and a 3x3 Gaussian convolution.
+ *
+ * Usage: png_bench layout [width] [height] [runs]
+ */
+#include "bench.h"
+#include "../include/processor.h"
+
+// Row-pointer layout as it was before image_t became contiguous
+static uint8_t **legacy_allocate(uint32_t height, uint32_t width) {
+    uint8_t **matrix = malloc(height * sizeof(uint8_t *));
+    if (!matrix) {
+        exit(1);
+    }
+    for (uint32_t i = 0; i < height; i++) {
+        matrix[i] = malloc(width);
+        if (!matrix[i]) {
+            exit(1);
+        }
+    }
+    return matrix;
+}
+
+static void legacy_free(uint8_t **matrix, uint32_t height) {
+    for (uint32_t i = 0; i < height; i++) {
+        free(matrix[i]);
+    }
+    free(matrix);
+}
+
+// apply_convolution() as it was on the row-pointer layout
+static void legacy_convolution(uint8_t **input, uint8_t **output, uint32_t height, uint32_t width, kernel_type type) {
+    for (uint32_t y = 0; y < height; y++) {
+        memcpy(output[y], input[y], width);
+    }
+
+    float kernels[7][3][3] = {
+        [KERNEL_SOBEL_X]        = {{-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1}},
+        [KERNEL_SOBEL_Y]        = {{-1, -2, -1}, {0, 0, 0}, {1, 2, 1}},
+        [KERNEL_SOBEL_COMBINED] = {{0}},
+        [KERNEL_GAUSSIAN]       = {{1/16.f, 2/16.f, 1/16.f}, {2/16.f, 4/16.f, 2/16.f}, {1/16.f, 2/16.f, 1/16.f}},
+        [KERNEL_BLUR]           = {{1/9.f, 1/9.f, 1/9.f}, {1/9.f, 1/9.f, 1/9.f}, {1/9.f, 1/9.f, 1/9.f}},
+        [KERNEL_LAPLACIAN]      = {{0, -1, 0}, {-1, 4, -1}, {0, -1, 0}},
+        [KERNEL_SHARPEN]        = {{0, -1, 0}, {-1, 5, -1}, {0, -1, 0}}
+    };
+
+    for (uint32_t y = 1; y < height - 1; y++) {
+        for (uint32_t x = 1; x < width - 1; x++) {
+            float sum = 0.0f;
+            for (int ky = -1; ky <= 1; ky++) {
+                for (int kx = -1; kx <= 1; kx++) {
+                    sum += input[y + ky][x + kx] * kernels[type][ky + 1][kx + 1];
+                }
+            }
+            if (type == KERNEL_SOBEL_X || type == KERNEL_SOBEL_Y) {
+                sum = fabsf(sum);
+            }
+            if (sum < 0.0f) sum = 0.0f;
+            if (sum > 255.0f) sum = 255.0f;
+            output[y][x] = (uint8_t)sum;
+        }
+    }
+}
+
+int bench_layout(int argc, char **argv) {
+    uint32_t width = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 10) : 4096;
+    uint32_t height = (argc > 2) ? (uint32_t)strtoul(argv[2], NULL, 10) : 10000;
+    int runs = (argc > 3) ? atoi(argv[3]) : 5;
+
+    printf("Image layout benchmark: %u x %u, %d runs (best time)\n", width, height, runs);
+
+    double best[4] = {1e30, 1e30, 1e30, 1e30};
+    uint64_t checksum[2] = {0, 0};
+
+    for (int run = 0; run < runs; run++) {
+        // Row-pointer matrix
+        double t0 = bench_now_ms();
+        uint8_t **in_rows = legacy_allocate(height, width);
+        uint8_t **out_rows = legacy_allocate(height, width);
+        double t1 = bench_now_ms();
+        for (uint32_t y = 0; y < height; y++) {
+            for (uint32_t x = 0; x < width; x++) {
+                in_rows[y][x] = (uint8_t)(x * 7 + y * 13);
+            }
+        }
+        double t2 = bench_now_ms();
+        legacy_convolution(in_rows, out_rows, height, width, KERNEL_GAUSSIAN);
+        double t3 = bench_now_ms();
+        checksum[0] = 0;
+        for (uint32_t y = 0; y < height; y++) {
+            checksum[0] += out_rows[y][y % width];
+        }
+        legacy_free(in_rows, height);
+        legacy_free(out_rows, height);
+
+        // Contiguous image
+        double t4 = bench_now_ms();
+        image_t *in = image_create(width, height, 1);
+        image_t *out = image_create(width, height, 1);
+        double t5 = bench_now_ms();
+        if (!in || !out) {
+            return 1;
+        }
+        for (uint32_t y = 0; y < height; y++) {
+            uint8_t *row = image_row(in, y);
+            for (uint32_t x = 0; x < width; x++) {
+                row[x] = (uint8_t)(x * 7 + y * 13);
+            }
+        }
+        double t6 = bench_now_ms();
+        apply_convolution(in, out, KERNEL_GAUSSIAN, 1);
+        double t7 = bench_now_ms();
+        checksum[1] = 0;
+        for (uint32_t y = 0; y < height; y++) {
+            checksum[1] += image_row(out, y)[y % width];
+        }
+        image_free(in);
+        image_free(out);
+
+        if (t1 - t0 < best[0]) best[0] = t1 - t0;
+        if (t3 - t2 < best[1]) best[1] = t3 - t2;
+        if (t5 - t4 < best[2]) best[2] = t5 - t4;
+        if (t7 - t6 < best[3]) best[3] = t7 - t6;
+    }
+
+    printf("%-12s %12s %12s\n", "layout", "alloc (ms)", "gauss (ms)");
+    printf("%-12s %12.3f %12.3f\n", "row-pointer", best[0], best[1]);
+    printf("%-12s %12.3f %12.3f\n", "contiguous", best[2], best[3]);
+    if (checksum[0] != checksum[1]) {
+        fprintf(stderr, "ERROR: Layouts produced different results\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,278 @@
+/**
+ * Grayscale followed by one convolution, as two separate passes through a
+ * full-size gray image and as the fused read that converts rows band by
+ * band. Both must match bit for bit, for RGBA too. Then a whole
+ * multi-stage pipeline against the same chain run as separate allocating
+ * steps, and decoding straight to gray against decoding in colour and
+ * converting afterwards, for RGB, RGBA (kept as gray+alpha) and 16-bit
+ * RGBA files, serial and in strips.
+ *
+ * Usage: png_bench pipeline [width] [height] [runs]
+ */
+#include <unistd.h>
+#include "bench.h"
+#include "../include/pipeline.h"
+#include "../include/processor.h"
+
+static void fill_noise(image_t *image) {
+    uint32_t state = 12345;
+    for (uint32_t y = 0; y < image->height; y++) {
+        uint8_t *row = image_row(image, y);
+        for (size_t x = 0; x < image_row_bytes(image); x++) {
+            state = state * 1103515245u + 12345u;
+            row[x] = (uint8_t)((x / 3 + y) / 2 + (state >> 28));
+        }
+    }
+}
+
+// gray,gaussian:2,sobel done the way separate runs would: a fresh image per pass
+static image_t *chain_separately(image_t *input) {
+    image_t *gray = rgb_to_grayscale(input);
+    image_t *a = image_create(input->width, input->height, 1);
+    image_t *b = image_create(input->width, input->height, 1);
+    image_t *c = image_create(input->width, input->height, 1);
+    apply_convolution(gray, a, KERNEL_GAUSSIAN, 1);
+    apply_convolution(a, b, KERNEL_GAUSSIAN, 1);
+    apply_convolution(b, c, KERNEL_SOBEL_COMBINED, 1);
+    image_free(gray);
+    image_free(a);
+    image_free(b);
+    return c;
+}
+
+// image_gray_row() and image_gray_alpha_row() against the formula, at
+// every length up to past the vector width so each tail is covered
+static bool verify_gray_row(void) {
+    uint8_t src[64 * 4];
+    uint8_t dst[64 * 2];
+    uint32_t state = 99;
+    for (size_t i = 0; i < sizeof(src); i++) {
+        state = state * 1103515245u + 12345u;
+        src[i] = (uint8_t)(state >> 24);
+    }
+    for (uint32_t channels = 3; channels <= 4; channels++) {
+        for (uint32_t width = 0; width <= 64; width++) {
+            image_gray_row(src, dst, width, channels);
+            for (uint32_t x = 0; x < width; x++) {
+                const uint8_t *p = src + x * channels;
+                if (dst[x] != (uint8_t)((GRAY_WEIGHT_R * p[0] + GRAY_WEIGHT_G * p[1] + GRAY_WEIGHT_B * p[2]) >> 8)) {
+                    return false;
+                }
+            }
+        }
+    }
+    for (uint32_t width = 0; width <= 64; width++) {
+        image_gray_alpha_row(src, dst, width, 4, 8);
+        for (uint32_t x = 0; x < width; x++) {
+            const uint8_t *p = src + x * 4;
+            if (dst[x * 2] != (uint8_t)((GRAY_WEIGHT_R * p[0] + GRAY_WEIGHT_G * p[1] + GRAY_WEIGHT_B * p[2]) >> 8) ||
+                dst[x * 2 + 1] != p[3]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// The folded gray + convolution of an RGBA image against the two steps,
+// both giving gray+alpha with the alpha untouched
+static bool verify_gray_alpha_fold(image_t *rgba) {
+    static const kernel_type kernels[] = {KERNEL_GAUSSIAN, KERNEL_SOBEL_COMBINED};
+    bool exact = true;
+    for (size_t k = 0; k < 2; k++) {
+        image_t *gray = rgb_to_grayscale(rgba);
+        image_t *separate = image_create(rgba->width, rgba->height, 2);
+        image_t *fused = image_create(rgba->width, rgba->height, 2);
+        if (!gray || !separate || !fused) {
+            exit(1);
+        }
+        apply_convolution(gray, separate, kernels[k], 1);
+        exact = exact && apply_convolution_gray(rgba, fused, kernels[k], 1) && bench_images_equal(separate, fused);
+        image_free(gray);
+        image_free(separate);
+        image_free(fused);
+    }
+    return exact;
+}
+
+static image_t *decode_file(const char *path, bool gray, bool keep_16bit, uint32_t threads) {
+    png_reader_t reader;
+    if (!png_reader_open(path, &reader)) {
+        return NULL;
+    }
+    image_t *image = gray ? decode_png_gray(&reader, keep_16bit, threads)
+                          : decode_png_image(&reader, keep_16bit, threads);
+    png_reader_close(&reader);
+    return image;
+}
+
+// Decode `path` and convert, then decode straight to gray, and compare
+static bool bench_decode_gray(const char *path, const char *name, bool keep_16bit, uint32_t threads, int runs) {
+    double best[2] = {1e30, 1e30};
+    bool exact = true;
+    for (int run = 0; run < runs && exact; run++) {
+        double t0 = bench_now_ms();
+        image_t *decoded = decode_file(path, false, keep_16bit, threads);
+        image_t *separate = decoded ? rgb_to_grayscale(decoded) : NULL;
+        double t1 = bench_now_ms();
+        image_t *fused = decode_file(path, true, keep_16bit, threads);
+        double t2 = bench_now_ms();
+
+        exact = separate && fused && fused->channels == separate->channels &&
+                fused->bit_depth == separate->bit_depth && bench_images_equal(separate, fused);
+        image_free(decoded);
+        image_free(separate);
+        image_free(fused);
+        if (t1 - t0 < best[0]) best[0] = t1 - t0;
+        if (t2 - t1 < best[1]) best[1] = t2 - t1;
+    }
+    printf("%-22s %12.3f %12.3f %8s\n", name, best[0], best[1], exact ? "yes" : "NO");
+    return exact;
+}
+
+int bench_pipeline(int argc, char **argv) {
+    uint32_t width = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 10) : 3840;
+    uint32_t height = (argc > 2) ? (uint32_t)strtoul(argv[2], NULL, 10) : 2160;
+    int runs = (argc > 3) ? atoi(argv[3]) : 5;
+
+    printf("Pipeline benchmark: %u x %u RGB, single thread, %d runs (best time)\n", width, height, runs);
+
+    image_t *input = image_create(width, height, 3);
+    image_t *fused = image_create(width, height, 1);
+    if (!input || !fused) {
+        return 1;
+    }
+    fill_noise(input);
+
+    static const kernel_type kernels[] = {KERNEL_GAUSSIAN, KERNEL_SOBEL_COMBINED};
+    static const char *names[] = {"gaussian", "sobel"};
+
+    printf("%-10s %16s %12s %8s\n", "gray +", "separate (ms)", "fused (ms)", "exact");
+    bool all_exact = true;
+    for (size_t k = 0; k < 2; k++) {
+        double best[2] = {1e30, 1e30};
+        bool exact = true;
+        for (int run = 0; run < runs; run++) {
+            double t0 = bench_now_ms();
+            image_t *gray = rgb_to_grayscale(input);
+            image_t *separate = image_create(width, height, 1);
+            if (!gray || !separate) {
+                return 1;
+            }
+            apply_convolution(gray, separate, kernels[k], 1);
+            double t1 = bench_now_ms();
+            if (!apply_convolution_gray(input, fused, kernels[k], 1)) {
+                return 1;
+            }
+            double t2 = bench_now_ms();
+
+            exact = exact && bench_images_equal(separate, fused);
+            image_free(gray);
+            image_free(separate);
+            if (t1 - t0 < best[0]) best[0] = t1 - t0;
+            if (t2 - t1 < best[1]) best[1] = t2 - t1;
+        }
+        all_exact = all_exact && exact;
+        printf("%-10s %16.3f %12.3f %8s\n", names[k], best[0], best[1], exact ? "yes" : "NO");
+    }
+
+    pipeline_t pipeline;
+    if (!pipeline_parse("gray,gaussian:2,sobel", &pipeline)) {
+        return 1;
+    }
+    double best[2] = {1e30, 1e30};
+    bool exact = true;
+    for (int run = 0; run < runs; run++) {
+        double t0 = bench_now_ms();
+        image_t *separate = chain_separately(input);
+        double t1 = bench_now_ms();
+
+        image_t *copy = image_create(width, height, 3);
+        if (!separate || !copy) {
+            return 1;
+        }
+        image_copy(copy, input);
+        double t2 = bench_now_ms();
+        image_t *result = pipeline_run(&pipeline, copy, 1, false, RESAMPLE_BILINEAR, false);
+        double t3 = bench_now_ms();
+        if (!result) {
+            return 1;
+        }
+
+        exact = exact && bench_images_equal(separate, result);
+        image_free(separate);
+        image_free(result);
+        if (t1 - t0 < best[0]) best[0] = t1 - t0;
+        if (t3 - t2 < best[1]) best[1] = t3 - t2;
+    }
+    all_exact = all_exact && exact;
+    printf("\n%-22s %12s %12s %8s\n", "chain", "steps (ms)", "pipeline (ms)", "exact");
+    printf("%-22s %12.3f %12.3f %8s\n", "gray,gaussian:2,sobel", best[0], best[1], exact ? "yes" : "NO");
+
+    if (!verify_gray_row()) {
+        fprintf(stderr, "ERROR: image_gray_row differs from the luma formula\n");
+        all_exact = false;
+    }
+
+    char path[] = "/tmp/png_bench_pipeline_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Could not create a temporary file\n");
+        return 1;
+    }
+    close(fd);
+
+    // 16-bit samples from the same noise, spread over the full range
+    image_t *rgba = image_create(width, height, 4);
+    image_t *deep = image_create_depth(width, height, 4, 16);
+    if (!rgba || !deep) {
+        return 1;
+    }
+    fill_noise(rgba);
+    if (!verify_gray_alpha_fold(rgba)) {
+        fprintf(stderr, "ERROR: Folded gray + convolution differs from the two steps on RGBA\n");
+        all_exact = false;
+    }
+    for (uint32_t y = 0; y < height; y++) {
+        uint16_t *row = (uint16_t *)image_row(deep, y);
+        const uint8_t *src = image_row(rgba, y);
+        for (size_t x = 0; x < (size_t)width * 4; x++) {
+            row[x] = (uint16_t)(src[x] * 257 + (x & 0xFF));
+        }
+    }
+
+    static const struct {
+        const char *name;
+        uint32_t write_threads;
+        uint32_t read_threads;
+        bool keep_16bit;
+    } cases[] = {
+        {"rgb", 1, 1, false},
+        {"rgb, strips", 4, 4, false},
+        {"rgba", 1, 1, false},
+        {"rgba, strips", 4, 4, false},
+        {"rgba16 -> 8", 1, 1, false},
+        {"rgba16, strips", 4, 4, true},
+    };
+    printf("\n%-22s %12s %12s %8s\n", "decode + gray", "steps (ms)", "fused (ms)", "exact");
+    const image_t *sources[] = {input, input, rgba, rgba, deep, deep};
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        const image_t *source = sources[i];
+        png_write_options_t options;
+        png_write_options_default(&options);
+        options.threads = cases[i].write_threads;
+        if (!save_png(path, source, png_color_type_of(source), &options)) {
+            unlink(path);
+            return 1;
+        }
+        all_exact = bench_decode_gray(path, cases[i].name, cases[i].keep_16bit, cases[i].read_threads, runs) &&
+                    all_exact;
+    }
+    unlink(path);
+
+    image_free(rgba);
+    image_free(deep);
+    image_free(input);
+    image_free(fused);
+    return all_exact ? 0 : 1;
+}
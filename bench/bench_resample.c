@@ -0,0 +1,228 @@
+/**
+ * Times the fixed-point resampler for every filter on an upscale and a
+ * downscale, against the per-pixel float bilinear upscaler it replaced, and
+ * checks each result against a double precision evaluation of the same
+ * filter: the fixed-point weights may be off by one level, never more.
+ *
+ * Usage: png_bench resample [width] [height] [runs]
+ */
+#include "bench.h"
+#include "../include/resample.h"
+#include <math.h>
+
+// The previous bilinear_upscale(): float coordinates and floor per pixel,
+// integer factors only, kept here as the baseline
+static image_t *float_bilinear_upscale(const image_t *input, uint32_t factor) {
+    image_t *output = image_create(input->width * factor, input->height * factor, input->channels);
+    if (!output) {
+        return NULL;
+    }
+    uint32_t channels = input->channels;
+    for (uint32_t y = 0; y < output->height; y++) {
+        float y_orig = (y + 0.5f) / factor - 0.5f;
+        int y1 = (int)floor(y_orig);
+        if (y1 < 0) y1 = 0;
+        if ((uint32_t)y1 >= input->height - 1) y1 = input->height - 2;
+        float y_frac = y_orig - y1;
+        const uint8_t *top = image_row(input, y1);
+        const uint8_t *bottom = image_row(input, y1 + 1);
+        uint8_t *out = image_row(output, y);
+
+        for (uint32_t x = 0; x < output->width; x++) {
+            float x_orig = (x + 0.5f) / factor - 0.5f;
+            int x1 = (int)floor(x_orig);
+            if (x1 < 0) x1 = 0;
+            if ((uint32_t)x1 >= input->width - 1) x1 = input->width - 2;
+            float x_frac = x_orig - x1;
+            size_t left = (size_t)x1 * channels;
+            for (uint32_t c = 0; c < channels; c++) {
+                float r1 = top[left + c] * (1.0f - x_frac) + top[left + channels + c] * x_frac;
+                float r2 = bottom[left + c] * (1.0f - x_frac) + bottom[left + channels + c] * x_frac;
+                float value = r1 * (1.0f - y_frac) + r2 * y_frac;
+                out[(size_t)x * channels + c] = (uint8_t)(value < 0.0f ? 0.0f : value > 255.0f ? 255.0f : value);
+            }
+        }
+    }
+    return output;
+}
+
+static double reference_filter(resample_filter_t filter, double x) {
+    double ax = fabs(x);
+    switch (filter) {
+        case RESAMPLE_BOX: return (x > -0.5 && x <= 0.5) ? 1.0 : 0.0;
+        case RESAMPLE_BILINEAR: return (ax < 1.0) ? 1.0 - ax : 0.0;
+        case RESAMPLE_BICUBIC:
+            if (ax < 1.0) return (1.5 * ax - 2.5) * ax * ax + 1.0;
+            if (ax < 2.0) return (((ax - 5.0) * ax + 8.0) * ax - 4.0) * -0.5;
+            return 0.0;
+        case RESAMPLE_LANCZOS3:
+            if (ax == 0.0) return 1.0;
+            if (ax >= 3.0) return 0.0;
+            return 3.0 * sin(M_PI * x) * sin(M_PI * x / 3.0) / (M_PI * M_PI * x * x);
+    }
+    return 0.0;
+}
+
+// Normalised weights of output sample `i`, written into `w` starting at `*begin`
+static uint32_t reference_weights(uint32_t in_size, uint32_t out_size, resample_filter_t filter,
+                                  uint32_t i, double *w, int64_t *begin) {
+    static const double support[] = {0.5, 1.0, 2.0, 3.0};
+    double scale = (double)in_size / out_size;
+    double filter_scale = scale > 1.0 ? scale : 1.0;
+    double radius = support[filter] * filter_scale;
+    double center = (i + 0.5) * scale;
+    int64_t b = (int64_t)(center - radius + 0.5), e = (int64_t)(center + radius + 0.5);
+    if (b < 0) b = 0;
+    if (e > in_size) e = in_size;
+    double total = 0.0;
+    for (int64_t k = b; k < e; k++) {
+        w[k - b] = reference_filter(filter, (k - center + 0.5) / filter_scale);
+        total += w[k - b];
+    }
+    for (int64_t k = b; k < e; k++) {
+        w[k - b] /= total;
+    }
+    *begin = b;
+    return (uint32_t)(e - b);
+}
+
+// Intermediate results within this of a half may round either way: the
+// 14-bit weights move a weighted sum of 8-bit samples by up to about that
+#define REFERENCE_TIE_SLACK 0.05
+
+// Double precision two-pass resample of one sample, horizontal results
+// rounded to 8 bits like the real thing. `bias` pushes those intermediates
+// that sit near a half down (-1) or up (+1)
+static double reference_sample(const image_t *input, const image_t *result, uint32_t x, uint32_t y,
+                               uint32_t c, const double *wx, uint32_t nx, int64_t bx,
+                               const double *wy, uint32_t ny, int64_t by, int bias) {
+    uint32_t channels = input->channels;
+    if (input->height == result->height) {
+        double value = 0.0;
+        const uint8_t *row = image_row(input, y);
+        for (uint32_t i = 0; i < nx; i++) {
+            value += row[(size_t)(bx + i) * channels + c] * wx[i];
+        }
+        return value;
+    }
+    double value = 0.0;
+    for (uint32_t j = 0; j < ny; j++) {
+        const uint8_t *row = image_row(input, (uint32_t)(by + j));
+        double h = 0.0;
+        for (uint32_t i = 0; i < nx; i++) {
+            h += row[(size_t)(bx + i) * channels + c] * wx[i];
+        }
+        h = (input->width == result->width) ? row[(size_t)x * channels + c]
+                                             : floor(h + 0.5 + bias * REFERENCE_TIE_SLACK);
+        value += (h < 0 ? 0 : h > 255 ? 255 : h) * wy[j];
+    }
+    return value;
+}
+
+static int clamp_round(double value) {
+    value = floor(value + 0.5);
+    return (int)(value < 0 ? 0 : value > 255 ? 255 : value);
+}
+
+// Largest difference of `result` from a double precision two-pass resample
+// on a sample of output pixels. A result counts as off by the distance to
+// the nearest value the reference takes over both tie roundings
+static int max_reference_diff(const image_t *input, const image_t *result, resample_filter_t filter) {
+    uint32_t channels = input->channels;
+    double *wx = malloc(sizeof(double) * (input->width + 8));
+    double *wy = malloc(sizeof(double) * (input->height + 8));
+    int worst = 0;
+    for (uint32_t y = 0; y < result->height; y += 7) {
+        int64_t by;
+        uint32_t ny = reference_weights(input->height, result->height, filter, y, wy, &by);
+        for (uint32_t x = 0; x < result->width; x += 5) {
+            int64_t bx;
+            uint32_t nx = reference_weights(input->width, result->width, filter, x, wx, &bx);
+            for (uint32_t c = 0; c < channels; c++) {
+                int low = clamp_round(reference_sample(input, result, x, y, c, wx, nx, bx, wy, ny, by, -1));
+                int high = clamp_round(reference_sample(input, result, x, y, c, wx, nx, bx, wy, ny, by, 1));
+                if (low > high) {
+                    int swap = low;
+                    low = high;
+                    high = swap;
+                }
+                int actual = image_row(result, y)[(size_t)x * channels + c];
+                int diff = (actual < low) ? low - actual : (actual > high) ? actual - high : 0;
+                if (diff > worst) worst = diff;
+            }
+        }
+    }
+    free(wx);
+    free(wy);
+    return worst;
+}
+
+int bench_resample(int argc, char **argv) {
+    uint32_t width = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 10) : 1920;
+    uint32_t height = (argc > 2) ? (uint32_t)strtoul(argv[2], NULL, 10) : 1080;
+    int runs = (argc > 3) ? atoi(argv[3]) : 3;
+
+    printf("Resample benchmark: %u x %u, single thread, %d runs (best time)\n", width, height, runs);
+
+    static const uint32_t channel_counts[] = {1, 3, 4};
+    static const resample_filter_t filter_list[] = {
+        RESAMPLE_BOX, RESAMPLE_BILINEAR, RESAMPLE_BICUBIC, RESAMPLE_LANCZOS3
+    };
+    bool ok = true;
+
+    printf("%-4s %-14s %-10s %12s %10s\n", "ch", "resize", "filter", "time (ms)", "max diff");
+    for (size_t ci = 0; ci < sizeof(channel_counts) / sizeof(channel_counts[0]); ci++) {
+        image_t *input = image_create(width, height, channel_counts[ci]);
+        if (!input) {
+            return 1;
+        }
+        bench_fill_scene(input, 23, 31, 2463534242u);
+
+        double best = 1e30;
+        for (int run = 0; run < runs; run++) {
+            double t0 = bench_now_ms();
+            image_t *old = float_bilinear_upscale(input, 2);
+            double t1 = bench_now_ms();
+            if (!old) {
+                return 1;
+            }
+            image_free(old);
+            if (t1 - t0 < best) best = t1 - t0;
+        }
+        printf("%-4u %-14s %-10s %12.3f %10s\n", channel_counts[ci], "x2 (old)", "float", best, "-");
+
+        // Up by 2, up by a fraction, down by 4 with a different factor per axis
+        uint32_t sizes[][2] = {
+            {width * 2, height * 2},
+            {width * 3 / 2, height * 3 / 2},
+            {width / 4, height / 3},
+        };
+        for (size_t si = 0; si < 3; si++) {
+            for (size_t fi = 0; fi < 4; fi++) {
+                image_t *result = NULL;
+                best = 1e30;
+                for (int run = 0; run < runs; run++) {
+                    image_free(result);
+                    double t0 = bench_now_ms();
+                    result = resample_image(input, sizes[si][0], sizes[si][1], filter_list[fi], 1);
+                    double t1 = bench_now_ms();
+                    if (!result) {
+                        return 1;
+                    }
+                    if (t1 - t0 < best) best = t1 - t0;
+                }
+                int diff = max_reference_diff(input, result, filter_list[fi]);
+                ok = ok && diff <= 1;
+                char label[32];
+                snprintf(label, sizeof(label), "%ux%u", sizes[si][0], sizes[si][1]);
+                printf("%-4u %-14s %-10s %12.3f %10d\n", channel_counts[ci], label,
+                       resample_filter_name(filter_list[fi]), best, diff);
+                image_free(result);
+            }
+        }
+        image_free(input);
+    }
+
+    printf("\n%s\n", ok ? "All results within 1 of the double precision reference" : "MISMATCH");
+    return ok ? 0 : 1;
+}
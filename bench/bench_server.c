@@ -0,0 +1,154 @@
+/**
+ * Request round trips against --serve, run in-process on a temporary Unix
+ * socket. Replies are checked first: a good request, one whose output is
+ * /dev/full, which must fail with its own error while the server keeps
+ * running, and a good one after it. Then the latency of small requests on
+ * one connection is measured.
+ *
+ * Usage: png_bench server [requests] [runs]
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "bench.h"
+#include "../include/server.h"
+
+static void *server_thread(void *arg) {
+    run_server(arg);
+    return NULL;
+}
+
+// Connect to the socket, waiting for the server to come up
+static int connect_server(const char *path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+
+    for (int attempt = 0; attempt < 200; attempt++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0) {
+            return fd;
+        }
+        close(fd);
+        usleep(10000);
+    }
+    return -1;
+}
+
+// Send one request line and read its reply line into `reply`
+static bool round_trip(int fd, const char *line, char *reply, size_t size) {
+    size_t length = strlen(line);
+    if (write(fd, line, length) != (ssize_t)length) {
+        return false;
+    }
+    size_t n = 0;
+    while (n + 1 < size) {
+        ssize_t got = read(fd, reply + n, 1);
+        if (got <= 0) {
+            break;
+        }
+        if (reply[n++] == '\n') {
+            break;
+        }
+    }
+    reply[n] = '\0';
+    return n > 0;
+}
+
+// One request on a fresh connection, true if its reply starts with `expected`
+static bool check_request(const char *socket_path, const char *line, const char *expected) {
+    char reply[256];
+    int fd = connect_server(socket_path);
+    bool ok = fd >= 0 && round_trip(fd, line, reply, sizeof(reply)) &&
+              strncmp(reply, expected, strlen(expected)) == 0;
+    if (!ok) {
+        fprintf(stderr, "ERROR: Request '%.*s' got '%s', expected '%s'\n",
+                (int)strcspn(line, "\n"), line, fd >= 0 ? reply : "no connection", expected);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ok;
+}
+
+int bench_server(int argc, char **argv) {
+    int requests = (argc > 1) ? atoi(argv[1]) : 20;
+    int runs = (argc > 2) ? atoi(argv[2]) : 3;
+
+    char dir[] = "/tmp/png_bench_server_XXXXXX";
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "ERROR: Could not create a temporary directory\n");
+        return 1;
+    }
+    char socket_path[64], input[64], output[64];
+    snprintf(socket_path, sizeof(socket_path), "%s/s.sock", dir);
+    snprintf(input, sizeof(input), "%s/in.png", dir);
+    snprintf(output, sizeof(output), "%s/out.png", dir);
+
+    // Large enough that IDAT writes fail on /dev/full before the file is closed
+    image_t *image = image_create(1024, 512, 3);
+    if (!image) {
+        return 1;
+    }
+    bench_fill_scene(image, 0, 7, 2463534242u);
+    bool saved = save_png(input, image, 2, NULL);
+    image_free(image);
+    if (!saved) {
+        rmdir(dir);
+        return 1;
+    }
+
+    server_config_t config = {socket_path, 2};
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, server_thread, &config) != 0) {
+        unlink(input);
+        rmdir(dir);
+        return 1;
+    }
+
+    char good[256], full[256];
+    snprintf(good, sizeof(good), "%s %s -g\n", input, output);
+    snprintf(full, sizeof(full), "%s /dev/full -g\n", input);
+    bool ok = check_request(socket_path, good, "OK ") &&
+              check_request(socket_path, full, "ERR writing output failed") &&
+              check_request(socket_path, good, "OK ");
+    printf("Reply check: %s\n", ok ? "ok" : "FAILED");
+
+    if (ok) {
+        printf("Server benchmark: %d requests on one connection, %d runs (best)\n", requests, runs);
+        int fd = connect_server(socket_path);
+        double best = 1e30;
+        char reply[256];
+        for (int run = 0; ok && fd >= 0 && run < runs; run++) {
+            double t0 = bench_now_ms();
+            for (int i = 0; ok && i < requests; i++) {
+                ok = round_trip(fd, good, reply, sizeof(reply)) && strncmp(reply, "OK ", 3) == 0;
+            }
+            double elapsed = bench_now_ms() - t0;
+            if (elapsed < best) best = elapsed;
+        }
+        ok = ok && fd >= 0;
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (ok) {
+            printf("%-10s %10.3f ms per request\n", "gray", best / requests);
+        }
+    }
+
+    // The server stops on SIGTERM and removes its socket
+    raise(SIGTERM);
+    pthread_join(thread, NULL);
+    unlink(output);
+    unlink(input);
+    rmdir(dir);
+    return ok ? 0 : 1;
+}
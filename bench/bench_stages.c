@@ -0,0 +1,483 @@
+/**
+ * Times every stage of the tool on its own over a synthetic corpus: sizes
+ * from thumbnail to 1080p, gray, RGB and RGBA, each as a smooth gradient,
+ * a photo-like gradient with mild noise and pure noise. Images are
+ * generated from fixed seeds, so every run sees the same bytes.
+ *
+ * Stages, all on one thread:
+ *   read       load the file and index its chunks (page cache, not disk)
+ *   inflate    zlib over the IDAT run, filter bytes included
+ *   unfilter   reverse the scanline filters of the inflated data
+ *   decode     read + inflate + unfilter as the tool does it
+ *   grayscale  colour to luminance (colour images only)
+ *   <kernel>   apply_convolution() with each 3x3 kernel
+ *   upscale    2x bilinear resample
+ *   filter     pick a filter per row by smallest sum of residuals
+ *   deflate    compress the filtered rows at the default level
+ *   encode     save_png() to a file, filter + deflate + chunking + write
+ *   write      write the finished file's bytes out
+ *
+ * Throughput is raw image bytes (width x height x channels) per second for
+ * every stage, so stages of one case compare directly; ns/pixel is per
+ * input pixel. Each stage reports the min, median, p90 and max of its runs.
+ * With --json the report is a single JSON object on stdout, for CI.
+ *
+ * Usage: png_bench stages [runs] [--json] [--quick]
+ */
+#include <unistd.h>
+#include <sys/stat.h>
+#include "bench.h"
+#include "../include/processor.h"
+#include "../include/resample.h"
+
+#define MAX_RUNS 1000
+
+typedef enum {
+    ENTROPY_FLAT = 0,
+    ENTROPY_PHOTO = 1,
+    ENTROPY_NOISE = 2
+} entropy_t;
+
+static const char *const entropy_names[] = {"flat", "photo", "noise"};
+
+static const struct {
+    uint32_t width;
+    uint32_t height;
+} sizes[] = {
+    {64, 64},
+    {640, 480},
+    {1920, 1080},
+};
+
+static const struct {
+    uint32_t channels;
+    uint8_t color_type;
+    const char *name;
+} formats[] = {
+    {1, 0, "gray"},
+    {3, 2, "rgb"},
+    {4, 6, "rgba"},
+};
+
+static const struct {
+    kernel_type type;
+    const char *name;
+} kernels[] = {
+    {KERNEL_SOBEL_X, "sobel-x"},
+    {KERNEL_SOBEL_Y, "sobel-y"},
+    {KERNEL_SOBEL_COMBINED, "sobel"},
+    {KERNEL_GAUSSIAN, "gaussian"},
+    {KERNEL_BLUR, "blur"},
+    {KERNEL_LAPLACIAN, "laplacian"},
+    {KERNEL_SHARPEN, "sharpen"},
+};
+
+#define KERNEL_STAGES (sizeof(kernels) / sizeof(kernels[0]))
+
+// Everything one case needs, built before any timing starts
+typedef struct {
+    image_t *image;
+    uint8_t color_type;
+    char path[32];
+    uint8_t *file;          // the encoded PNG
+    size_t file_size;
+    uint8_t *raw;           // inflated IDAT data, filter bytes included
+    uint8_t *work;          // scratch copy of raw for unfiltering
+    size_t raw_size;
+    uint8_t *filtered;      // filter + deflate stage buffers
+    uint8_t *compressed;
+    size_t compressed_capacity;
+    size_t compressed_size;
+    uint8_t *candidates;
+} stage_case_t;
+
+static void fill_image(image_t *image, entropy_t entropy, uint32_t seed) {
+    uint32_t state = 2463534242u ^ seed;
+    for (uint32_t y = 0; y < image->height; y++) {
+        uint8_t *row = image_row(image, y);
+        for (uint32_t x = 0; x < image->width; x++) {
+            for (uint32_t c = 0; c < image->channels; c++) {
+                bench_xorshift32(&state);
+                uint32_t smooth = (c == 3) ? 255 - y * 64 / image->height
+                                           : (x * 255 / image->width + y * 127 / image->height + c * 40);
+                uint32_t value = smooth;
+                if (entropy == ENTROPY_PHOTO) {
+                    value = smooth + (state & 7);
+                } else if (entropy == ENTROPY_NOISE) {
+                    value = state >> 24;
+                }
+                row[x * image->channels + c] = (uint8_t)value;
+            }
+        }
+    }
+}
+
+static uint8_t *read_file(const char *path, size_t *size) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+    struct stat st;
+    uint8_t *data = NULL;
+    if (fstat(fileno(file), &st) == 0 && st.st_size > 0) {
+        data = malloc((size_t)st.st_size);
+        if (data && fread(data, 1, (size_t)st.st_size, file) != (size_t)st.st_size) {
+            free(data);
+            data = NULL;
+        }
+        *size = (size_t)st.st_size;
+    }
+    fclose(file);
+    return data;
+}
+
+static bool inflate_idat(stage_case_t *sc) {
+    png_reader_t reader;
+    if (!png_reader_open_memory(sc->file, sc->file_size, sc->path, &reader)) {
+        return false;
+    }
+    z_stream stream = {0};
+    bool ok = inflateInit(&stream) == Z_OK;
+    stream.next_out = sc->raw;
+    stream.avail_out = (uInt)sc->raw_size;
+    int status = Z_OK;
+    const uint8_t *data;
+    size_t length;
+    while (ok && status != Z_STREAM_END && (length = png_reader_next_idat(&reader, &data)) > 0) {
+        stream.next_in = (Bytef *)data;
+        stream.avail_in = (uInt)length;
+        status = inflate(&stream, Z_NO_FLUSH);
+        ok = status == Z_OK || status == Z_STREAM_END;
+    }
+    ok = ok && status == Z_STREAM_END && stream.total_out == sc->raw_size;
+    inflateEnd(&stream);
+    png_reader_close(&reader);
+    return ok;
+}
+
+static bool stage_read(stage_case_t *sc) {
+    size_t size = 0;
+    uint8_t *data = read_file(sc->path, &size);
+    png_reader_t reader;
+    bool ok = data && png_reader_open_memory(data, size, sc->path, &reader);
+    if (ok) {
+        png_reader_close(&reader);
+    }
+    free(data);
+    return ok;
+}
+
+static bool stage_inflate(stage_case_t *sc) {
+    return inflate_idat(sc);
+}
+
+static bool stage_unfilter(stage_case_t *sc) {
+    size_t row_bytes = image_row_bytes(sc->image);
+    const uint8_t *previous = NULL;
+    for (uint32_t y = 0; y < sc->image->height; y++) {
+        uint8_t *line = sc->work + (size_t)y * (row_bytes + 1);
+        unfilter_scanline(line + 1, previous, (uint32_t)row_bytes, sc->image->channels, line[0]);
+        previous = line + 1;
+    }
+    return true;
+}
+
+static bool stage_decode(stage_case_t *sc) {
+    png_reader_t reader;
+    if (!png_reader_open_memory(sc->file, sc->file_size, sc->path, &reader)) {
+        return false;
+    }
+    image_t *decoded = decode_png_image(&reader, false, 1);
+    png_reader_close(&reader);
+    bool ok = decoded != NULL;
+    image_free(decoded);
+    return ok;
+}
+
+static bool stage_grayscale(stage_case_t *sc) {
+    image_t *gray = rgb_to_grayscale(sc->image);
+    bool ok = gray != NULL;
+    if (gray != sc->image) {
+        image_free(gray);
+    }
+    return ok;
+}
+
+static bool run_kernel(stage_case_t *sc, kernel_type type) {
+    image_t *output = image_create(sc->image->width, sc->image->height, sc->image->channels);
+    if (!output) {
+        return false;
+    }
+    apply_convolution(sc->image, output, type, 1);
+    image_free(output);
+    return true;
+}
+
+static bool stage_upscale(stage_case_t *sc) {
+    image_t *output = resample_image(sc->image, sc->image->width * 2, sc->image->height * 2,
+                                     RESAMPLE_BILINEAR, 1);
+    bool ok = output != NULL;
+    image_free(output);
+    return ok;
+}
+
+// The writer's default heuristic, row by row into one buffer
+static bool stage_filter(stage_case_t *sc) {
+    uint32_t row_bytes = (uint32_t)image_row_bytes(sc->image);
+    for (uint32_t y = 0; y < sc->image->height; y++) {
+        const uint8_t *current = image_row(sc->image, y);
+        const uint8_t *previous = y ? image_row(sc->image, y - 1) : sc->candidates + FILTER_COUNT * row_bytes;
+        uint8_t best = 0;
+        uint64_t best_cost = UINT64_MAX;
+        for (uint8_t type = 0; type < FILTER_COUNT; type++) {
+            uint8_t *out = sc->candidates + (size_t)type * row_bytes;
+            filter_scanline(out, current, previous, row_bytes, sc->image->channels, type);
+            uint64_t cost = filter_cost_sad(out, row_bytes);
+            if (cost < best_cost) {
+                best_cost = cost;
+                best = type;
+            }
+        }
+        uint8_t *line = sc->filtered + (size_t)y * (row_bytes + 1);
+        line[0] = best;
+        memcpy(line + 1, sc->candidates + (size_t)best * row_bytes, row_bytes);
+    }
+    return true;
+}
+
+static bool stage_deflate(stage_case_t *sc) {
+    uLongf size = (uLongf)sc->compressed_capacity;
+    bool ok = compress2(sc->compressed, &size, sc->filtered, (uLong)sc->raw_size, Z_DEFAULT_COMPRESSION) == Z_OK;
+    sc->compressed_size = size;
+    return ok;
+}
+
+static bool stage_encode(stage_case_t *sc) {
+    png_write_options_t options;
+    png_write_options_default(&options);
+    return save_png(sc->path, sc->image, sc->color_type, &options);
+}
+
+static bool stage_write(stage_case_t *sc) {
+    FILE *file = fopen(sc->path, "wb");
+    if (!file) {
+        return false;
+    }
+    bool ok = fwrite(sc->file, 1, sc->file_size, file) == sc->file_size;
+    return (fclose(file) == 0) && ok;
+}
+
+typedef bool (*stage_fn)(stage_case_t *sc);
+
+static const struct {
+    const char *name;
+    stage_fn run;
+} stages[] = {
+    {"read", stage_read},
+    {"inflate", stage_inflate},
+    {"unfilter", stage_unfilter},
+    {"decode", stage_decode},
+    {"grayscale", stage_grayscale},
+    {NULL, NULL},                   // the kernels go here
+    {"upscale", stage_upscale},
+    {"filter", stage_filter},
+    {"deflate", stage_deflate},
+    {"encode", stage_encode},
+    {"write", stage_write},
+};
+
+#define STAGE_COUNT (sizeof(stages) / sizeof(stages[0]))
+
+static void stage_case_free(stage_case_t *sc) {
+    if (sc->path[0]) {
+        unlink(sc->path);
+    }
+    image_free(sc->image);
+    free(sc->file);
+    free(sc->raw);
+    free(sc->work);
+    free(sc->filtered);
+    free(sc->compressed);
+    free(sc->candidates);
+}
+
+static bool stage_case_init(stage_case_t *sc, uint32_t width, uint32_t height, uint32_t format,
+                            entropy_t entropy) {
+    memset(sc, 0, sizeof(*sc));
+    sc->image = image_create(width, height, formats[format].channels);
+    sc->color_type = formats[format].color_type;
+    if (!sc->image) {
+        return false;
+    }
+    fill_image(sc->image, entropy, width * 31 + height * 7 + format * 3 + entropy);
+
+    strcpy(sc->path, "/tmp/png_bench_stages_XXXXXX");
+    int fd = mkstemp(sc->path);
+    if (fd < 0) {
+        sc->path[0] = '\0';
+        fprintf(stderr, "ERROR: Could not create a temporary file\n");
+        return false;
+    }
+    close(fd);
+    if (!stage_encode(sc) || !(sc->file = read_file(sc->path, &sc->file_size))) {
+        return false;
+    }
+
+    size_t row_bytes = image_row_bytes(sc->image);
+    sc->raw_size = (row_bytes + 1) * height;
+    sc->compressed_capacity = compressBound((uLong)sc->raw_size);
+    sc->raw = malloc(sc->raw_size);
+    sc->work = malloc(sc->raw_size);
+    sc->filtered = malloc(sc->raw_size);
+    sc->compressed = malloc(sc->compressed_capacity);
+    sc->candidates = calloc(FILTER_COUNT + 1, row_bytes);
+    if (!sc->raw || !sc->work || !sc->filtered || !sc->compressed || !sc->candidates) {
+        fprintf(stderr, "ERROR: Could not allocate benchmark buffers\n");
+        return false;
+    }
+    if (!inflate_idat(sc)) {
+        fprintf(stderr, "ERROR: Could not inflate the generated file\n");
+        return false;
+    }
+    return true;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted times
+static double percentile(const double *sorted, int count, double q) {
+    int rank = (int)(q * count + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return sorted[rank - 1];
+}
+
+typedef struct {
+    bool json;
+    bool first_stage;
+    double megabytes;
+    double pixels;
+} report_t;
+
+// Runs one stage `runs` times and prints its line (or JSON object)
+static bool report_stage(report_t *report, const char *name, stage_case_t *sc, stage_fn fn,
+                         kernel_type kernel, int runs) {
+    double times[MAX_RUNS];
+    for (int run = 0; run < runs; run++) {
+        if (fn == stage_unfilter) {
+            memcpy(sc->work, sc->raw, sc->raw_size);
+        }
+        double t0 = bench_now_ms();
+        bool ok = fn ? fn(sc) : run_kernel(sc, kernel);
+        times[run] = bench_now_ms() - t0;
+        if (!ok) {
+            fprintf(stderr, "ERROR: Stage %s failed\n", name);
+            return false;
+        }
+    }
+    qsort(times, (size_t)runs, sizeof(double), compare_doubles);
+    double median = percentile(times, runs, 0.5);
+    double p90 = percentile(times, runs, 0.9);
+    double rate = report->megabytes / (median / 1e3);
+    double ns_per_pixel = median * 1e6 / report->pixels;
+
+    if (report->json) {
+        printf("%s\n        {\"stage\": \"%s\", \"min_ms\": %.4f, \"p50_ms\": %.4f, \"p90_ms\": %.4f, "
+               "\"max_ms\": %.4f, \"mb_per_s\": %.2f, \"ns_per_pixel\": %.3f}",
+               report->first_stage ? "" : ",", name, times[0], median, p90, times[runs - 1], rate,
+               ns_per_pixel);
+    } else {
+        printf("  %-10s %10.3f %10.3f %10.3f %10.3f %10.1f %10.2f\n", name, times[0], median, p90,
+               times[runs - 1], rate, ns_per_pixel);
+    }
+    report->first_stage = false;
+    return true;
+}
+
+int bench_stages(int argc, char **argv) {
+    int runs = 9;
+    bool json = false;
+    bool quick = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--json")) {
+            json = true;
+        } else if (!strcmp(argv[i], "--quick")) {
+            quick = true;
+        } else {
+            runs = atoi(argv[i]);
+        }
+    }
+    if (runs < 1 || runs > MAX_RUNS) {
+        fprintf(stderr, "ERROR: Runs must be between 1 and %d\n", MAX_RUNS);
+        return 1;
+    }
+
+    // --quick drops the largest size, for CI
+    size_t size_count = sizeof(sizes) / sizeof(sizes[0]) - (quick ? 1 : 0);
+    if (json) {
+        printf("{\n  \"benchmark\": \"stages\",\n  \"runs\": %d,\n  \"cores\": %u,\n  \"cases\": [", runs, cpu_count());
+    } else {
+        printf("Stage benchmark: %d runs per stage, one thread; times in ms, MB/s of raw image bytes\n", runs);
+    }
+
+    bool first_case = true;
+    for (size_t s = 0; s < size_count; s++) {
+        for (uint32_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+            for (int e = ENTROPY_FLAT; e <= ENTROPY_NOISE; e++) {
+                stage_case_t sc;
+                if (!stage_case_init(&sc, sizes[s].width, sizes[s].height, f, (entropy_t)e)) {
+                    stage_case_free(&sc);
+                    return 1;
+                }
+                report_t report = {
+                    .json = json,
+                    .first_stage = true,
+                    .megabytes = (double)image_row_bytes(sc.image) * sc.image->height / 1e6,
+                    .pixels = (double)sc.image->width * sc.image->height,
+                };
+
+                if (json) {
+                    printf("%s\n    {\"name\": \"%s-%ux%u-%s\", \"width\": %u, \"height\": %u, "
+                           "\"color_type\": %u, \"entropy\": \"%s\", \"raw_bytes\": %zu, "
+                           "\"png_bytes\": %zu,\n      \"stages\": [",
+                           first_case ? "" : ",", formats[f].name, sizes[s].width, sizes[s].height,
+                           entropy_names[e], sizes[s].width, sizes[s].height, formats[f].color_type,
+                           entropy_names[e], image_row_bytes(sc.image) * sc.image->height, sc.file_size);
+                } else {
+                    printf("\n%s %ux%u %s, %zu byte PNG\n", formats[f].name, sizes[s].width,
+                           sizes[s].height, entropy_names[e], sc.file_size);
+                    printf("  %-10s %10s %10s %10s %10s %10s %10s\n", "stage", "min", "p50", "p90",
+                           "max", "MB/s", "ns/px");
+                }
+                first_case = false;
+
+                bool ok = true;
+                for (size_t i = 0; i < STAGE_COUNT && ok; i++) {
+                    if (!stages[i].run) {
+                        for (size_t k = 0; k < KERNEL_STAGES && ok; k++) {
+                            ok = report_stage(&report, kernels[k].name, &sc, NULL, kernels[k].type, runs);
+                        }
+                    } else if (stages[i].run != stage_grayscale || sc.image->channels >= 3) {
+                        ok = report_stage(&report, stages[i].name, &sc, stages[i].run, KERNEL_NONE, runs);
+                    }
+                }
+                stage_case_free(&sc);
+                if (!ok) {
+                    return 1;
+                }
+                if (json) {
+                    printf("\n      ]}");
+                }
+                fflush(stdout);
+            }
+        }
+    }
+    if (json) {
+        printf("\n  ]\n}\n");
+    }
+    return 0;
+}
@@ -0,0 +1,123 @@
+/**
+ * Checks unfilter_scanline() against the byte-at-a-time reference on random
+ * scanlines for every filter type and pixel size 1-4, then times both.
+ *
+ * Usage: png_bench unfilter [width] [rows] [runs]
+ */
+#include <stdbool.h>
+#include <string.h>
+#include "bench.h"
+#include "../include/filters.h"
+
+static uint32_t rng_state = 0x12345678u;
+
+static uint8_t next_byte(void) {
+    return (uint8_t)bench_xorshift32(&rng_state);
+}
+
+static void fill_random(uint8_t *buffer, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        buffer[i] = next_byte();
+    }
+}
+
+// Run both implementations on the same random rows, lengths include odd tails.
+// Every row is an allocation of exactly its length, so a read past the end
+// shows up under a sanitizer
+static int verify(void) {
+    static const uint32_t lengths[] = {1, 2, 3, 4, 5, 7, 12, 15, 16, 17, 31, 33, 64, 100, 255, 1024, 3001};
+    int failures = 0;
+
+    for (uint32_t bpp = 1; bpp <= 4; bpp++) {
+        for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+            // Whole pixels only, as in a real scanline
+            uint32_t length = lengths[l] - lengths[l] % bpp;
+            if (length == 0) {
+                continue;
+            }
+            uint8_t *previous = malloc(length);
+            uint8_t *expected = malloc(length);
+            uint8_t *actual = malloc(length);
+            if (!previous || !expected || !actual) {
+                fprintf(stderr, "ERROR: Could not allocate benchmark buffers\n");
+                exit(1);
+            }
+            for (uint8_t type = 0; type < FILTER_COUNT; type++) {
+                for (int trial = 0; trial < 8; trial++) {
+                    bool first_row = (trial == 0);
+                    fill_random(previous, length);
+                    fill_random(expected, length);
+                    memcpy(actual, expected, length);
+
+                    const uint8_t *prev = first_row ? NULL : previous;
+                    unfilter_scanline_scalar(expected, prev, length, bpp, type);
+                    unfilter_scanline(actual, prev, length, bpp, type);
+
+                    if (memcmp(expected, actual, length) != 0) {
+                        fprintf(stderr, "MISMATCH: filter %u bpp %u length %u%s\n",
+                                type, bpp, length, first_row ? " (first row)" : "");
+                        failures++;
+                    }
+                }
+            }
+            free(previous);
+            free(expected);
+            free(actual);
+        }
+    }
+    return failures;
+}
+
+int bench_unfilter(int argc, char **argv) {
+    uint32_t width = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 10) : 4096;
+    uint32_t rows = (argc > 2) ? (uint32_t)strtoul(argv[2], NULL, 10) : 1024;
+    int runs = (argc > 3) ? atoi(argv[3]) : 5;
+
+    int failures = verify();
+    printf("Bit-exact check against scalar reference: %s\n", failures ? "FAILED" : "ok");
+    if (failures) {
+        return 1;
+    }
+
+    printf("Unfilter benchmark: %u px wide, %u rows, %d runs (best MB/s)\n", width, rows, runs);
+    printf("%-6s %-4s %12s %12s %8s\n", "filter", "bpp", "scalar", "simd", "speedup");
+
+    static const char *names[FILTER_COUNT] = {"none", "sub", "up", "avg", "paeth"};
+    for (uint32_t bpp = 1; bpp <= 4; bpp++) {
+        uint32_t length = width * bpp;
+        uint8_t *source = malloc((size_t)length * rows);
+        uint8_t *work = malloc((size_t)length * rows);
+        if (!source || !work) {
+            fprintf(stderr, "ERROR: Could not allocate benchmark buffers\n");
+            return 1;
+        }
+        fill_random(source, (size_t)length * rows);
+
+        for (uint8_t type = FILTER_SUB; type < FILTER_COUNT; type++) {
+            double best[2] = {1e30, 1e30};
+            for (int impl = 0; impl < 2; impl++) {
+                for (int run = 0; run < runs; run++) {
+                    memcpy(work, source, (size_t)length * rows);
+                    double t0 = bench_now_ms();
+                    for (uint32_t y = 0; y < rows; y++) {
+                        uint8_t *row = work + (size_t)y * length;
+                        const uint8_t *prev = y ? row - length : NULL;
+                        if (impl == 0) {
+                            unfilter_scanline_scalar(row, prev, length, bpp, type);
+                        } else {
+                            unfilter_scanline(row, prev, length, bpp, type);
+                        }
+                    }
+                    double elapsed = bench_now_ms() - t0;
+                    if (elapsed < best[impl]) best[impl] = elapsed;
+                }
+            }
+            double mb = (double)length * rows / (1024.0 * 1024.0);
+            printf("%-6s %-4u %12.1f %12.1f %7.2fx\n", names[type], bpp,
+                   mb / (best[0] / 1e3), mb / (best[1] / 1e3), best[0] / best[1]);
+        }
+        free(source);
+        free(work);
+    }
+    return 0;
+}
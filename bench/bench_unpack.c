@@ -0,0 +1,204 @@
+/**
+ * Checks the bit depth kernels against their sample-at-a-time references:
+ * every 16-bit value through the rounding down-conversion, every byte
+ * through the sub-byte tables at odd lengths, the 16-bit and sub-byte pack
+ * round trips and palette expansion to RGB and RGBA. Then times each
+ * against its reference.
+ *
+ * Usage: png_bench unpack [samples] [runs]
+ */
+#include <stdbool.h>
+#include <string.h>
+#include "bench.h"
+#include "../include/unpack.h"
+
+static uint8_t palette[256][4];
+
+static int verify(void) {
+    int failures = 0;
+
+    // All 16-bit values, at a length with a scalar tail
+    size_t count = 65536 + 7;
+    uint8_t *wide = malloc(count * 2);
+    uint8_t *expected = malloc(count * 8);
+    uint8_t *actual = malloc(count * 8);
+    uint16_t *native = malloc(count * sizeof(uint16_t));
+    uint8_t *packed = malloc(count * 2);
+    if (!wide || !expected || !actual || !native || !packed) {
+        fprintf(stderr, "ERROR: Could not allocate benchmark buffers\n");
+        return 1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        wide[i * 2] = (uint8_t)((i & 0xFFFF) >> 8);
+        wide[i * 2 + 1] = (uint8_t)i;
+    }
+    unpack_16_to_8_scalar(wide, expected, count);
+    unpack_16_to_8(wide, actual, count);
+    if (memcmp(expected, actual, count) != 0) {
+        fprintf(stderr, "MISMATCH: 16 to 8 bit\n");
+        failures++;
+    }
+
+    unpack_16(wide, native, count);
+    pack_16(native, packed, count);
+    for (size_t i = 0; i < count; i++) {
+        if (native[i] != (uint16_t)i) {
+            fprintf(stderr, "MISMATCH: 16-bit swap at %zu\n", i);
+            failures++;
+            break;
+        }
+    }
+    if (memcmp(wide, packed, count * 2) != 0) {
+        fprintf(stderr, "MISMATCH: 16-bit swap round trip\n");
+        failures++;
+    }
+
+    // Every byte value, with lengths that end mid-byte
+    uint8_t bytes[256];
+    for (uint32_t i = 0; i < 256; i++) {
+        bytes[i] = (uint8_t)(i * 37 + 11);
+    }
+    static const uint32_t depths[] = {1, 2, 4};
+    for (size_t d = 0; d < 3; d++) {
+        for (int scale = 0; scale < 2; scale++) {
+            for (size_t length = 1; length <= 256 * 8 / depths[d]; length += 1 + length / 3) {
+                unpack_sub_byte_scalar(bytes, expected, length, depths[d], scale);
+                unpack_sub_byte(bytes, actual, length, depths[d], scale);
+                if (memcmp(expected, actual, length) != 0) {
+                    fprintf(stderr, "MISMATCH: %u-bit%s, %zu samples\n", depths[d], scale ? " scaled" : "", length);
+                    failures++;
+                }
+            }
+        }
+    }
+
+    // Packing indices undoes the unscaled unpack
+    for (size_t d = 0; d < 3; d++) {
+        size_t length = 256 * 8 / depths[d] - 3;
+        unpack_sub_byte_scalar(bytes, expected, length, depths[d], false);
+        memset(packed, 0, 256);
+        pack_sub_byte(expected, packed, length, depths[d]);
+        unpack_sub_byte_scalar(packed, actual, length, depths[d], false);
+        if (memcmp(expected, actual, length) != 0) {
+            fprintf(stderr, "MISMATCH: %u-bit pack round trip\n", depths[d]);
+            failures++;
+        }
+    }
+
+    // Every index, RGB and RGBA, with lengths around the 4-pixel unroll
+    for (uint32_t i = 0; i < 256; i++) {
+        for (uint32_t c = 0; c < 4; c++) {
+            palette[i][c] = (uint8_t)(i * 13 + c * 71 + 5);
+        }
+    }
+    for (uint32_t channels = 3; channels <= 4; channels++) {
+        for (size_t length = 1; length <= 256; length += (length < 12) ? 1 : 37) {
+            memset(expected, 0xAA, length * 4 + 4);
+            memset(actual, 0xAA, length * 4 + 4);
+            unpack_palette_scalar(bytes, expected, length, palette, channels);
+            unpack_palette(bytes, actual, length, palette, channels);
+            // Nothing may be written past the last pixel
+            if (memcmp(expected, actual, length * 4 + 4) != 0) {
+                fprintf(stderr, "MISMATCH: palette to %u channels, %zu pixels\n", channels, length);
+                failures++;
+            }
+        }
+    }
+
+    free(wide);
+    free(expected);
+    free(actual);
+    free(native);
+    free(packed);
+    return failures;
+}
+
+typedef void (*unpack_fn)(const uint8_t *src, uint8_t *dst, size_t count, uint32_t bit_depth);
+
+static void sub_byte_fast(const uint8_t *src, uint8_t *dst, size_t count, uint32_t bit_depth) {
+    unpack_sub_byte(src, dst, count, bit_depth, true);
+}
+
+static void sub_byte_reference(const uint8_t *src, uint8_t *dst, size_t count, uint32_t bit_depth) {
+    unpack_sub_byte_scalar(src, dst, count, bit_depth, true);
+}
+
+static void wide_fast(const uint8_t *src, uint8_t *dst, size_t count, uint32_t bit_depth) {
+    (void)bit_depth;
+    unpack_16_to_8(src, dst, count);
+}
+
+static void wide_reference(const uint8_t *src, uint8_t *dst, size_t count, uint32_t bit_depth) {
+    (void)bit_depth;
+    unpack_16_to_8_scalar(src, dst, count);
+}
+
+// bit_depth carries the channel count for palette expansion
+static void palette_fast(const uint8_t *src, uint8_t *dst, size_t count, uint32_t channels) {
+    unpack_palette(src, dst, count, palette, channels);
+}
+
+static void palette_reference(const uint8_t *src, uint8_t *dst, size_t count, uint32_t channels) {
+    unpack_palette_scalar(src, dst, count, palette, channels);
+}
+
+static double best_time(unpack_fn fn, const uint8_t *src, uint8_t *dst, size_t count,
+                        uint32_t bit_depth, int runs) {
+    double best = 1e30;
+    for (int run = 0; run < runs; run++) {
+        double t0 = bench_now_ms();
+        fn(src, dst, count, bit_depth);
+        double elapsed = bench_now_ms() - t0;
+        if (elapsed < best) best = elapsed;
+    }
+    return best;
+}
+
+int bench_unpack(int argc, char **argv) {
+    size_t samples = (argc > 1) ? (size_t)strtoull(argv[1], NULL, 10) : 16u << 20;
+    int runs = (argc > 2) ? atoi(argv[2]) : 5;
+
+    int failures = verify();
+    printf("Exact check against scalar references: %s\n", failures ? "FAILED" : "ok");
+    if (failures) {
+        return 1;
+    }
+
+    uint8_t *src = malloc(samples * 2);
+    uint8_t *dst = malloc(samples * 4);
+    if (!src || !dst) {
+        fprintf(stderr, "ERROR: Could not allocate benchmark buffers\n");
+        return 1;
+    }
+    uint32_t state = 0x9E3779B9u;
+    for (size_t i = 0; i < samples * 2; i++) {
+        state = state * 1103515245u + 12345u;
+        src[i] = (uint8_t)(state >> 24);
+    }
+
+    printf("Unpack benchmark: %zu output samples or pixels, %d runs (best M/s)\n", samples, runs);
+    printf("%-10s %12s %12s %8s\n", "depth", "scalar", "fast", "speedup");
+    static const struct {
+        const char *label;
+        unpack_fn reference;
+        unpack_fn fast;
+        uint32_t param;
+    } cases[] = {
+        {"1-bit", sub_byte_reference, sub_byte_fast, 1},
+        {"2-bit", sub_byte_reference, sub_byte_fast, 2},
+        {"4-bit", sub_byte_reference, sub_byte_fast, 4},
+        {"16 -> 8", wide_reference, wide_fast, 16},
+        {"PLTE RGB", palette_reference, palette_fast, 3},
+        {"PLTE RGBA", palette_reference, palette_fast, 4},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        double reference = best_time(cases[i].reference, src, dst, samples, cases[i].param, runs);
+        double fast = best_time(cases[i].fast, src, dst, samples, cases[i].param, runs);
+        printf("%-10s %12.1f %12.1f %7.2fx\n", cases[i].label, samples / (reference * 1e3),
+               samples / (fast * 1e3), reference / fast);
+    }
+
+    free(src);
+    free(dst);
+    return 0;
+}
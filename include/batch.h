@@ -0,0 +1,33 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "image_processor.h"
+#include "thread_pool.h"
+
+// Longest input or output path batch mode handles
+#define BATCH_PATH_MAX 4096
+
+typedef struct {
+    // A directory (every *.png in it), a glob pattern, or a manifest file
+    // listing one input path per line (blank lines and # comments skipped)
+    const char *source;
+    // Output path with "{name}" standing for the input's base name without
+    // .png, or an existing directory to write <name>.png into
+    const char *output_pattern;
+    // Worker threads; each holds one image at a time, so this is also the
+    // cap on images in memory. 0 = one per core
+    uint32_t jobs;
+    process_options_t process;
+} batch_config_t;
+
+// Run decode -> filter -> encode for every input of the source on a fixed
+// pool of threads and print a throughput and error summary at the end.
+// Inputs are pulled lazily, manifests and directories are never loaded
+// whole. Returns 0 if every file succeeded, 1 otherwise
+int run_batch(const batch_config_t *config);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef BOX_BLUR_H
+#define BOX_BLUR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "image.h"
+#include "convolution.h"
+#include "thread_pool.h"
+
+// Number of boxes per axis; three get within a few percent of a Gaussian
+#define BOX_BLUR_PASSES 3
+
+// Per-axis standard deviation of `steps` passes of the 3x3 Gaussian
+// (variance 1/2 per pass) or box blur (variance 2/3 per pass)
+float fused_blur_sigma(kernel_type type, uint32_t steps);
+
+// Odd box widths whose combined variance is closest to sigma^2
+void box_blur_widths(float sigma, uint32_t widths[BOX_BLUR_PASSES]);
+
+// Approximate `steps` iterations of KERNEL_GAUSSIAN or KERNEL_BLUR in one go:
+// three running-sum box passes per axis, so the cost does not depend on the
+// radius. Colour channels only, alpha and the 1-pixel border are copied like
+// apply_convolution() does. `output` may be `input`: every source row is
+// read before any is written. Returns false for other kernels, 16-bit images
+// or on allocation failure, leaving output unspecified
+bool box_blur_fused(const image_t *input, image_t *output, kernel_type type,
+                    uint32_t steps, uint32_t threads);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef BUFFER_CACHE_H
+#define BUFFER_CACHE_H
+
+#include <stddef.h>
+
+// Every thread keeps up to BUFFER_CACHE_SLOTS freed image buffers for the
+// next images it creates, so the full-size buffers of a run (decoded image,
+// gray copy, kernel output and temporaries) are recycled across stages, and
+// across files in batch and server mode, instead of going back to malloc.
+// Sizes are rounded up to classes a quarter power of two apart, so images
+// of similar size share blocks. A thread caches at most
+// BUFFER_CACHE_MAX_BYTES, dropping the blocks released longest ago first.
+// Cached blocks are freed by buffer_cache_trim or when their thread exits
+#define BUFFER_CACHE_SLOTS 4
+#define BUFFER_CACHE_MAX_BYTES ((size_t)64 << 20)
+
+// A 64-byte aligned block of at least `size` bytes, its real size in
+// *capacity. NULL on failure
+void *buffer_cache_acquire(size_t size, size_t *capacity);
+
+// Hand a block from buffer_cache_acquire back to this thread's cache, or
+// free it if it alone exceeds the byte cap
+void buffer_cache_release(void *data, size_t capacity);
+
+// Free this thread's cached blocks that were not released since the last
+// trim. Called after each file or request, so a block left over from one
+// large image lives through at most one more unit of work
+void buffer_cache_trim(void);
+
+#endif
@@ -6,21 +6,23 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
-#include "processor.h"
+#include "image_processor.h"
+#include "stats.h"
 
 typedef struct {
     char *input_file;
     char *output_file;
-    bool force_grayscale;
-    bool do_upscale;
     bool draw;
     bool draw_color;
-    kernel_type kernel;
-    uint8_t steps;
-    float scale_factor;
     bool show_info;
     bool steg_mode;
     char *steg_operation;  // "find", "inject", or "delete"
+    char *batch_source;    // directory, glob or manifest for --batch, NULL otherwise
+    uint32_t jobs;         // files processed at once in batch mode, 0 = one per core
+    char *serve_socket;    // Unix socket path for --serve, NULL otherwise
+    bool stats;            // print per-stage time and memory to stderr when done
+    stats_format_t stats_format;
+    process_options_t process;  // kernel, output format and encoder settings
 } cli_config_t;
 
 // Parse command-line arguments into config structure
@@ -0,0 +1,61 @@
+#ifndef CONVOLUTION_H
+#define CONVOLUTION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "image.h"
+#include "thread_pool.h"
+
+typedef enum {
+    KERNEL_SOBEL_X = 0,
+    KERNEL_SOBEL_Y = 1,
+    KERNEL_SOBEL_COMBINED = 2,
+    KERNEL_GAUSSIAN = 3,
+    KERNEL_BLUR = 4,
+    KERNEL_LAPLACIAN = 5,
+    KERNEL_SHARPEN = 6,
+    KERNEL_NONE = 7
+} kernel_type;
+
+// Apply a 3x3 kernel to every colour channel of an interleaved image, with
+// neighbours one pixel (`channels` bytes) apart. Alpha and the 1-pixel
+// border are copied unchanged, as is all of an image narrower or shorter
+// than 3 pixels. Rows are split into bands that run on the shared worker
+// pool; `threads` caps the parallelism (0 = one per core, 1 = caller only)
+// and is itself capped by the core count. The result does not depend on it
+//
+// Gaussian and box blur are separable with integer weights and take a
+// fixed-point path (two 1-D passes, rounded to nearest); the other kernels
+// use floats, as do all kernels on 16-bit images. Both images must have the
+// same bit depth. Returns false on invalid arguments or allocation failure
+bool apply_convolution(const image_t *input, image_t *output, kernel_type type, uint32_t threads);
+
+// apply_convolution() with `image` as both input and output, bit for bit.
+// Each band keeps the two source rows above the one it writes in a small
+// ring and reads the row below from the image, so the working memory is the
+// image plus a few rows per thread. Returns false on allocation failure,
+// with `image` unchanged
+bool apply_convolution_in_place(image_t *image, kernel_type type, uint32_t threads);
+
+// rgb_to_grayscale() followed by apply_convolution(), bit for bit, without
+// the full-size gray intermediate: each band converts the input rows it
+// reads on the fly. `output` is the size of `input`, with the channels
+// rgb_to_grayscale() gives it (gray+alpha for input with alpha), both 8-bit.
+// Returns false on invalid arguments or allocation failure
+bool apply_convolution_gray(const image_t *input, image_t *output, kernel_type type, uint32_t threads);
+
+// The single-threaded float path for every kernel, kept as the reference the
+// integer path is checked against. Float results are truncated, so Gaussian
+// and box blur may differ from apply_convolution() by 1
+void apply_convolution_reference(const image_t *input, image_t *output, kernel_type type);
+
+// True if `type` takes the fixed-point separable path
+bool convolution_is_separable(kernel_type type);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC-32 as used by PNG chunks (and zlib/gzip). The state runs from
+// CRC32_INIT through any number of crc32_update() calls, crc32_final()
+// turns it into the checksum
+#define CRC32_INIT 0xffffffffu
+
+static inline uint32_t crc32_final(uint32_t state) {
+    return state ^ 0xffffffffu;
+}
+
+// Feed `length` bytes. Picks PCLMULQDQ folding at runtime where the CPU
+// has it and slice-by-8 tables otherwise
+uint32_t crc32_update(uint32_t state, const void *data, size_t length);
+
+// Portable slice-by-8 path, the fallback of crc32_update()
+uint32_t crc32_update_slice8(uint32_t state, const void *data, size_t length);
+
+// One table lookup per byte, the reference the fast paths must match
+uint32_t crc32_update_bytewise(uint32_t state, const void *data, size_t length);
+
+// Checksum of a whole buffer
+static inline uint32_t crc(const uint8_t *buffer, size_t length) {
+    return crc32_final(crc32_update(CRC32_INIT, buffer, length));
+}
+
+#endif
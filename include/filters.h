@@ -0,0 +1,41 @@
+#ifndef FILTERS_H
+#define FILTERS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    FILTER_NONE = 0,
+    FILTER_SUB = 1,
+    FILTER_UP = 2,
+    FILTER_AVG = 3,
+    FILTER_PAETH = 4
+};
+
+#define FILTER_COUNT 5
+
+// How the encoder picks the filter type of each scanline
+typedef enum {
+    FILTER_STRATEGY_FIXED = 0,   // the same filter type for every row
+    FILTER_STRATEGY_MINSAD = 1,  // smallest sum of absolute (signed) residuals
+    FILTER_STRATEGY_BRUTE = 2    // trial-compress every filter, keep the smallest
+} filter_strategy_t;
+
+// Forward filter of one scanline into `out` (without the filter type byte).
+// `previous` is the unfiltered row above, all zeros for the first row
+void filter_scanline(uint8_t *out, const uint8_t *current, const uint8_t *previous,
+                     uint32_t length, uint32_t bpp, uint8_t filter_type);
+
+// Sum of |(int8_t)residual| over a filtered row, the classic libpng heuristic
+uint64_t filter_cost_sad(const uint8_t *filtered, uint32_t length);
+
+// Reverse the filter of one scanline in place. `previous` is the unfiltered
+// row above or NULL for the first row. Uses SIMD kernels specialized for
+// 1-4 byte pixels where the CPU has them
+void unfilter_scanline(uint8_t *current, const uint8_t *previous, uint32_t length, uint32_t bpp, uint8_t filter_type);
+
+// Byte-at-a-time reference implementation, the SIMD paths must match it exactly
+void unfilter_scanline_scalar(uint8_t *current, const uint8_t *previous, uint32_t length, uint32_t bpp, uint8_t filter_type);
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Rows start on cache line boundaries and the stride is padded to match
+#define IMAGE_ALIGNMENT 64
+
+// Colours of an indexed image as RGBA, alpha 255 past the entries the
+// file gave an alpha for (tRNS)
+typedef struct {
+    uint8_t entries[256][4];
+    uint32_t count;
+    uint32_t alpha_count;
+} image_palette_t;
+
+// Interleaved image stored in one contiguous block. Samples are bytes, or
+// native-endian uint16_t when bit_depth is 16.
+// Row y starts at data + y * stride, stride >= image_row_bytes()
+typedef struct {
+    uint8_t *data;
+    size_t stride;
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+    uint32_t bit_depth;     // 8 or 16
+    size_t capacity;        // bytes behind data, which comes from the buffer cache
+    image_palette_t *palette;   // owned; set for indexed images, 1 channel of palette indices
+} image_t;
+
+// Allocate an 8-bit image with a single aligned allocation, recycled
+// through the thread's buffer cache (see buffer_cache.h). Returns NULL on failure
+image_t *image_create(uint32_t width, uint32_t height, uint32_t channels);
+
+// Same with 8 or 16 bits per sample
+image_t *image_create_depth(uint32_t width, uint32_t height, uint32_t channels, uint32_t bit_depth);
+void image_free(image_t *image);
+
+// Copy the pixels of src into dst, both must have the same dimensions
+void image_copy(image_t *dst, const image_t *src);
+
+// Fixed-point luma weights, out of 256: about 0.299 R + 0.587 G + 0.114 B
+#define GRAY_WEIGHT_R 77
+#define GRAY_WEIGHT_G 150
+#define GRAY_WEIGHT_B 29
+
+// Luminance of one row of `width` interleaved pixels. Colour input is
+// (77 R + 150 G + 29 B) >> 8, gray+alpha keeps the gray byte
+void image_gray_row(const uint8_t *src, uint8_t *dst, uint32_t width, uint32_t channels);
+
+// The same for 16-bit samples
+void image_gray_row16(const uint16_t *src, uint16_t *dst, uint32_t width, uint32_t channels);
+
+// Gray of one row with alpha kept: gray+alpha pairs for gray+alpha (2) and
+// RGBA (4) input, with the alpha samples untouched, and image_gray_row()
+// otherwise. `bit_depth` is 8 or 16
+void image_gray_alpha_row(const uint8_t *src, uint8_t *dst, uint32_t width, uint32_t channels,
+                          uint32_t bit_depth);
+
+// Channels of the gray version of a `channels` image: 2 if it has alpha
+static inline uint32_t image_gray_channels(uint32_t channels) {
+    return (channels == 2 || channels == 4) ? 2 : 1;
+}
+
+static inline uint8_t *image_row(const image_t *image, uint32_t y) {
+    return image->data + (size_t)y * image->stride;
+}
+
+// Bytes of pixel data in one row, excluding stride padding
+static inline size_t image_row_bytes(const image_t *image) {
+    return (size_t)image->width * image->channels * (image->bit_depth / 8);
+}
+
+// Channels that carry colour: everything but a trailing alpha channel in
+// gray+alpha (2) and RGBA (4) images
+static inline uint32_t image_color_channels(const image_t *image) {
+    return (image->channels == 2 || image->channels == 4) ? image->channels - 1 : image->channels;
+}
+
+#endif
@@ -6,24 +6,62 @@
 #include <stdio.h>
 #include <string.h>
 #include "processor.h"
+#include "box_blur.h"
+#include "pipeline.h"
 #include "png_io.h"
 #include "utils.h"
 
-// Main processing function that orchestrates the entire workflow
-int process_png_image(png_data_t *png, const char *output_file, 
-                      bool force_grayscale, bool do_upscale, 
-                      kernel_type kernel, uint8_t steps, float scale_factor);
+// Everything that shapes one decode -> filter -> encode run
+typedef struct {
+    bool force_grayscale;
+    bool do_resize;
+    kernel_type kernel;
+    uint8_t steps;
+    resample_size_t resize;     // output size for -u, --resize and --thumbnail
+    resample_filter_t filter;   // resampling filter for resizes
+    uint32_t threads;   // worker threads for filters, 0 = one per core
+    bool fuse;          // multi-step Gaussian/box blur as one approximate fused pass
+    bool keep_16bit;    // 16-bit inputs stay 16-bit through processing and output
+    bool verbose;       // progress messages on stdout
+    png_write_options_t write_options;  // encoder filter strategy and zlib level
+    pipeline_t pipeline;    // stages run instead of kernel/upscale, empty = not used
+} process_options_t;
 
-// Process grayscale image with optional filter
-void process_grayscale_image(image_t *image, const char *output_file,
-                             kernel_type kernel, uint8_t steps);
+// Outcome of a run, so callers can tell a bad input from an output that
+// could not be written
+typedef enum {
+    PROCESS_OK = 0,
+    PROCESS_FAILED = 1,         // decoding or filtering failed
+    PROCESS_WRITE_FAILED = 2    // the output file could not be written
+} process_status_t;
 
-// Process RGB/RGBA image with optional filter
-void process_rgb_image(image_t *image, const char *output_file,
-                       kernel_type kernel, uint8_t steps);
+// No kernel, colour output, default encoder settings, verbose
+void process_options_default(process_options_t *options);
 
-// Process image upscaling
-void process_upscale_image(image_t *image, const char *output_file,
-                          bool force_grayscale, float scale_factor);
+// Main processing function that orchestrates the entire workflow.
+// Image data is streamed from the reader while decoding.
+// Returns a process_status_t
+int process_png_image(png_reader_t *png, const char *output_file,
+                      const process_options_t *options);
+
+// Process grayscale image with optional filter. Alpha is kept, so input
+// with alpha is saved as gray+alpha. A gray or gray+alpha `image` is
+// filtered in place
+process_status_t process_grayscale_image(image_t *image, const char *output_file,
+                                         const process_options_t *options);
+
+// Process RGB/RGBA (or gray+alpha) image with optional filter, applied to
+// `image` in place
+process_status_t process_rgb_image(image_t *image, const char *output_file,
+                                   const process_options_t *options);
+
+// Run options->pipeline over the image and save the result. Consumes
+// `image`, which is freed whatever the outcome
+process_status_t process_pipeline_image(image_t *image, const char *output_file,
+                                        const process_options_t *options);
+
+// Resample the image to options->resize
+process_status_t process_resize_image(image_t *image, const char *output_file,
+                                      const process_options_t *options);
 
 #endif
@@ -0,0 +1,51 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "image.h"
+#include "convolution.h"
+#include "resample.h"
+
+#define PIPELINE_MAX_STAGES 16
+
+typedef enum {
+    STAGE_GRAYSCALE = 0,
+    STAGE_CONVOLVE = 1,
+    STAGE_RESIZE = 2
+} stage_kind_t;
+
+typedef struct {
+    stage_kind_t kind;
+    kernel_type kernel;     // STAGE_CONVOLVE
+    uint8_t steps;          // STAGE_CONVOLVE, passes of the kernel
+    resample_size_t size;   // STAGE_RESIZE
+} pipeline_stage_t;
+
+// Fixed size so it is copied along with the options that carry it
+typedef struct {
+    pipeline_stage_t stages[PIPELINE_MAX_STAGES];
+    uint32_t count;
+} pipeline_t;
+
+// Parse a comma separated stage list such as "gray,gaussian:3,sobel,upscale:2".
+// Stages: gray, gaussian[:steps], blur[:steps], sobel-x, sobel-y, sobel,
+// laplacian, sharpen, upscale[:factor] (default 2), resize:<W>x<H> (a side
+// left out keeps the aspect ratio) and thumbnail:<N> (fit in N x N, never
+// enlarged). Returns false with a message on stderr for anything else
+bool pipeline_parse(const char *description, pipeline_t *pipeline);
+
+// Run every stage over `image` in memory. Convolutions filter the current
+// image in place, while grayscale and resize stages build a new image that
+// replaces it. A grayscale stage directly before a convolution is folded
+// into the convolution's reads; with `fuse`, multi-step blurs run as one fused pass like --fuse.
+// Resize stages resample with `filter`. Consumes `image`: the result is
+// returned and everything else freed. Returns NULL on failure
+image_t *pipeline_run(const pipeline_t *pipeline, image_t *image, uint32_t threads,
+                      bool fuse, resample_filter_t filter, bool verbose);
+
+#endif
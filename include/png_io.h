@@ -10,6 +10,9 @@
 #include <zlib.h>
 
 #include "utils.h"
+#include "crc32.h"
+#include "image.h"
+#include "filters.h"
 
 #define PNG_SIG_SIZE 8
 extern const uint8_t png_sig[PNG_SIG_SIZE];
@@ -18,9 +21,10 @@ typedef struct {
     uint8_t r, g, b;
 } rgb_t;
 
+// Entries and alphas point into the mapped file, see png_map_t
 typedef struct {
-    rgb_t *entries;
-    uint8_t *alphas;
+    const rgb_t *entries;
+    const uint8_t *alphas;
     uint32_t entry_count;
     uint32_t alpha_count;
 } palette_t;
@@ -36,35 +40,181 @@ typedef struct {
 } ihdr_t;
 
 void read_bytes(FILE *file, void *buffer, size_t size);
-void write_bytes(FILE *file, const void *buffer, size_t size);
+// Writers print the error and return false when the file cannot be written
+bool write_bytes(FILE *file, const void *buffer, size_t size);
 
 uint32_t read_chunk_size(FILE *file);
-void write_chunk_size(FILE *file, uint32_t size);
+bool write_chunk_size(FILE *file, uint32_t size);
 
 void read_chunk_type(FILE *file, uint8_t type[]);
-void write_chunk_type(FILE *file, const char type[]);
+bool write_chunk_type(FILE *file, const char type[]);
 
 uint32_t read_chunk_crc(FILE *file);
-void write_chunk_crc(FILE *file, uint32_t crc);
+bool write_chunk_crc(FILE *file, uint32_t crc);
 
-void write_chunk(FILE *file, const char type[], uint8_t *data, uint32_t length_le);
+bool write_chunk(FILE *file, const char type[], const uint8_t *data, uint32_t length_le);
 
-void save_png(const char *filename, uint8_t **pixels, uint32_t width, uint32_t height, uint8_t color_type, uint32_t channels);
-void print_info(FILE *file, char *filename);
+#define PNG_IDAT_CHUNK_SIZE (64 * 1024)
+
+// Multithreaded saves cut the image into strips of about this many raw
+// bytes and deflate each on its own. Strips end on a sync flush, so their
+// outputs concatenate into one valid zlib stream (pigz style), and the
+// first row of every strip after the first is filtered with None or Sub
+// only, so it does not depend on the strip above. The strip size does not
+// depend on the thread count: any count above one writes the same file
+#define PNG_STRIP_BYTES (256 * 1024)
+
+// Private ancillary chunk, written before the IDATs of a stripped file, that
+// lets readers inflate the strips in parallel: a version byte (1), then for
+// every strip its first row (u32) and the offset of its first deflate byte
+// in the zlib stream (u64), both big-endian. Strip 0 starts at offset 2,
+// right after the zlib header
+#define PNG_STRIP_CHUNK "stRP"
+#define PNG_STRIP_VERSION 1
+#define PNG_STRIP_ENTRY_SIZE 12
+
+typedef struct {
+    size_t idat_chunk_size;            // payload bytes per IDAT chunk, 0 = PNG_IDAT_CHUNK_SIZE
+    int level;                         // zlib compression level, Z_DEFAULT_COMPRESSION if unsure
+    filter_strategy_t filter_strategy; // how each row's filter type is chosen
+    uint8_t filter_type;               // filter used by FILTER_STRATEGY_FIXED
+    uint32_t threads;                  // above 1, save_png writes strips compressed on this many threads
+} png_write_options_t;
+
+// Defaults used when NULL options are passed to the writer
+void png_write_options_default(png_write_options_t *options);
+
+// Compressed output of one strip, collected in memory
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    uint32_t first_row;
+    uint32_t rows;
+    uLong adler;          // Adler-32 of the strip's raw (filtered) bytes
+    bool failed;
+} png_strip_t;
+
+// Streaming writer: rows are deflated as they arrive and IDAT chunks are
+// written out whenever a chunk worth of compressed data is ready
+typedef struct {
+    FILE *file;
+    z_stream *stream;     // borrowed from the thread's zstream cache
+    int level;
+    uint32_t width;
+    uint32_t height;
+    uint32_t rows_written;
+    size_t row_bytes;
+    uint32_t bpp;
+    uint8_t bit_depth;    // 8, 16 for rows of native uint16_t samples, below 8 for packed indices
+    uint8_t *idat_buffer;
+    size_t idat_chunk_size;
+    filter_strategy_t filter_strategy;
+    uint8_t filter_type;
+    uint8_t *previous;    // previous unfiltered row, zeros before the first one
+    uint8_t *candidates;  // FILTER_COUNT rows of filter byte + filtered data
+    uint8_t *trial_buffer;
+    uint8_t *packed;      // the current row as stored: big-endian at 16 bits, packed below 8
+    png_strip_t *strip;   // set while compressing one strip into memory
+    bool restart;         // next row starts a strip, filter it without the row above
+} png_writer_t;
+
+// Create the file and write the signature and IHDR. `bit_depth` is 8 or 16,
+// or 1, 2, 4 or 8 for colour type 3, whose rows still hold one index byte
+// per pixel and are packed on the way. Indexed output is not filtered
+// unless a fixed filter or brute force is asked for
+bool png_writer_open(png_writer_t *writer, const char *filename,
+                     uint32_t width, uint32_t height, uint8_t color_type, uint8_t bit_depth,
+                     const png_write_options_t *options);
+
+// Write PLTE, and tRNS if any entry has an alpha, between open and the first row
+bool png_writer_write_palette(png_writer_t *writer, const image_palette_t *palette);
+
+// Append `count` rows, consecutive rows are `stride` bytes apart
+bool png_writer_write_rows(png_writer_t *writer, const uint8_t *rows, uint32_t count, size_t stride);
+
+// Flush the deflate stream, write the last IDAT and IEND, close the file
+bool png_writer_finish(png_writer_t *writer);
+
+// Release the writer without completing the file (error paths)
+void png_writer_abort(png_writer_t *writer);
+
+// Colour type that stores `image` as it is: 3 for indexed images, otherwise
+// 0, 4, 2 or 6 for 1 to 4 channels
+uint8_t png_color_type_of(const image_t *image);
+
+// Write a whole image at its own bit depth, options may be NULL for the defaults.
+// Indexed images are written as colour type 3 at the smallest index depth
+// that holds their palette.
+// With more than one thread the image is compressed in strips, see
+// PNG_STRIP_BYTES. Returns false, after reporting the error, if the file
+// could not be written
+bool save_png(const char *filename, const image_t *image, uint8_t color_type,
+              const png_write_options_t *options);
+// Boxed summary of every chunk, false if the file cannot be mapped
+bool print_info(const char *filename);
 void draw_ascii(const char *filename, bool color);
 
-// Structure to hold PNG data read from file
+// One entry of the chunk index. `offset` is where the payload starts in the
+// mapping, the type is 4 bytes before it and the CRC right after it
+typedef struct {
+    size_t offset;
+    uint32_t length;
+    char type[4];
+    bool crc_ok;
+} png_chunk_t;
+
+// Read-only mapping of a whole PNG plus the index of its chunks, built in one
+// pass that checks the signature, chunk bounds and CRCs
 typedef struct {
+    const uint8_t *data;
+    size_t size;
+    png_chunk_t *chunks;
+    uint32_t chunk_count;
+    bool complete;           // the walk reached IEND, otherwise the tail is truncated
+    bool mapped;             // data is our mapping rather than a caller buffer
+} png_map_t;
+
+// Map `filename` and index its chunks
+bool png_map_open(const char *filename, png_map_t *map);
+
+// Index a PNG already in memory; `data` must outlive the map. `name` is
+// only used in messages
+bool png_map_open_memory(const uint8_t *data, size_t size, const char *name, png_map_t *map);
+
+// Index of the first chunk of `type` at or after `start`, chunk_count if none
+uint32_t png_map_find(const png_map_t *map, const char type[4], uint32_t start);
+
+// Payload of an indexed chunk
+static inline const uint8_t *png_chunk_data(const png_map_t *map, const png_chunk_t *chunk) {
+    return map->data + chunk->offset;
+}
+
+void png_map_close(png_map_t *map);
+
+// Decoding reader on top of the mapping: header chunks are parsed up front
+// and IDAT payloads are handed out straight from the mapping, one chunk at a
+// time, so compressed data is never copied
+typedef struct {
+    png_map_t map;
     ihdr_t ihdr;
     palette_t palette;
-    uint8_t *idat_data;
-    uint64_t idat_size;
-} png_data_t;
+    uint32_t next_chunk;      // index of the next chunk to hand out
+    bool idat_done;
+    const uint8_t *strip_index;   // payload of a PNG_STRIP_CHUNK, NULL if the file has none
+    uint32_t strip_index_length;
+} png_reader_t;
+
+// Open and index a PNG and parse IHDR, PLTE, tRNS and the strip index
+bool png_reader_open(const char *filename, png_reader_t *reader);
+
+// Same for a PNG in memory, nothing is copied; `data` must outlive the reader
+bool png_reader_open_memory(const uint8_t *data, size_t size, const char *name, png_reader_t *reader);
 
-// Read and parse PNG file
-bool read_png_file(const char *filename, png_data_t *png_data);
+// Point *data at the payload of the next IDAT chunk.
+// Returns its length, 0 once the IDAT run ends
+size_t png_reader_next_idat(png_reader_t *reader, const uint8_t **data);
 
-// Free PNG data resources
-void free_png_data(png_data_t *png_data);
+void png_reader_close(png_reader_t *reader);
 
 #endif
@@ -2,6 +2,7 @@
 #define PROCESSOR_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -9,40 +10,55 @@
 #include <math.h>
 
 #include "utils.h"
+#include "image.h"
+#include "filters.h"
+#include "convolution.h"
 #include "png_io.h"
 
-typedef struct {
-    uint8_t **pixels;
-    uint32_t width;
-    uint32_t height;
-    uint32_t channels;
-} image_t;
-
-typedef enum {
-    KERNEL_SOBEL_X = 0,
-    KERNEL_SOBEL_Y = 1,
-    KERNEL_SOBEL_COMBINED = 2,
-    KERNEL_GAUSSIAN = 3,
-    KERNEL_BLUR = 4,
-    KERNEL_LAPLACIAN = 5,
-    KERNEL_SHARPEN = 6,
-    KERNEL_NONE = 7
-} kernel_type;
-
-enum {
-    FILTER_NONE = 0,
-    FILTER_SUB = 1,
-    FILTER_UP = 2,
-    FILTER_AVG = 3,
-    FILTER_PAETH = 4
-};
+// Hands out the next run of compressed IDAT bytes, returns 0 at the end of the data
+typedef size_t (*idat_source_fn)(void *ctx, const uint8_t **data);
+
+// Receives one unfiltered scanline (filter byte stripped). Return false to abort
+typedef bool (*scanline_fn)(void *user, uint32_t y, const uint8_t *scanline, uint32_t length);
+
+// Samples per pixel and packed bits per pixel of the file, false with a
+// message for colour type / bit depth combinations PNG does not allow
+bool png_sample_layout(const ihdr_t *ihdr, uint32_t *samples, uint32_t *bits_per_pixel);
 
 uint8_t paeth_predictor(uint8_t left, uint8_t up, uint8_t up_left);
-void unfilter_scanline(uint8_t *current, const uint8_t *previous, uint32_t length, uint32_t byte_ppx, uint8_t filter_type);
+
+// Scanlines come out packed at the file's bit depth, in row order, also for
+// Adam7 files, whose passes are gathered into a full packed image first
+bool decode_scanlines(const ihdr_t *ihdr, idat_source_fn source, void *source_ctx, scanline_fn emit, void *user);
 image_t *process_idat_chunks(ihdr_t *ihdr, palette_t *palette, uint8_t *idat_data, uint64_t idat_size);
-uint8_t **rgb_to_grayscale(image_t *image);
-void apply_convolution(uint8_t **input, uint8_t **output, uint32_t height, uint32_t width, kernel_type type);
-uint8_t **upscale(uint8_t **input, uint32_t height, uint32_t width);
-uint8_t **bilinear_upscale(uint8_t **input, uint32_t height, uint32_t width, float scale_factor);
+
+// Every bit depth decodes to 8-bit samples, 1/2/4-bit gray stretched to
+// 0-255 and 16-bit rounded; with `keep_16bit`, 16-bit files give a 16-bit image.
+// Files written in strips are decoded on up to `threads` threads (0 = one per core)
+image_t *decode_png_image(png_reader_t *reader, bool keep_16bit, uint32_t threads);
+
+// decode_png_image() followed by rgb_to_grayscale(), bit for bit, without
+// the colour image: every scanline is converted to gray as it is unfiltered.
+// Gray and gray+alpha files decode as usual, alpha is kept
+image_t *decode_png_gray(png_reader_t *reader, bool keep_16bit, uint32_t threads);
+
+// Decode an indexed (colour type 3) file without expanding it: one index
+// byte per pixel plus the palette, whatever the file's index depth
+image_t *decode_png_indexed(png_reader_t *reader, uint32_t threads);
+
+// Decode into a width x height area average of the image without ever
+// holding it at full size, for thumbnails. Only reduces: each side is
+// clamped to the input's
+image_t *decode_png_reduced(png_reader_t *reader, uint32_t width, uint32_t height, bool keep_16bit);
+
+// Gray version of `image`: single channel for RGB, gray+alpha with the
+// alpha untouched for RGBA. Gray and gray+alpha images are returned as
+// they are, anything else is a new image
+image_t *rgb_to_grayscale(image_t *image);
+
+// Turn the palette of an indexed image gray in place, with the weights of
+// rgb_to_grayscale; indices and alpha are untouched
+void palette_to_grayscale(image_t *image);
+image_t *upscale(const image_t *input);
 
 #endif
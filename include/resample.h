@@ -0,0 +1,51 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "image.h"
+#include "thread_pool.h"
+
+typedef enum {
+    RESAMPLE_BOX = 0,       // area average, the cheapest good downscaler
+    RESAMPLE_BILINEAR = 1,  // triangle, radius 1
+    RESAMPLE_BICUBIC = 2,   // Catmull-Rom (a = -0.5), radius 2
+    RESAMPLE_LANCZOS3 = 3   // windowed sinc, radius 3, sharpest
+} resample_filter_t;
+
+// How big the output should be
+typedef struct {
+    float scale;            // > 0: both axes times this factor
+    uint32_t width;         // otherwise the target size; a 0 side keeps the
+    uint32_t height;        // aspect ratio of the input
+    bool fit;               // width x height is a box to fit into, never enlarged
+} resample_size_t;
+
+// Filter by name: box, bilinear, bicubic, lanczos3. False if unknown
+bool resample_parse_filter(const char *name, resample_filter_t *filter);
+const char *resample_filter_name(resample_filter_t filter);
+
+// Parse "WxH", "Wx" or "xH" into a size request. False if malformed
+bool resample_parse_size(const char *text, resample_size_t *size);
+
+// Output dimensions for `request` applied to a width x height input, at least 1 x 1
+void resample_target_size(uint32_t width, uint32_t height, const resample_size_t *request,
+                          uint32_t *out_width, uint32_t *out_height);
+
+// Resize an interleaved 1-4 channel image to width x height, up or down,
+// with each axis scaled independently. Every channel, alpha included, is
+// filtered. Per-column and per-row weights are computed once per call in
+// 14-bit fixed point; the image is filtered horizontally and then
+// vertically, with SSE2 inner loops where available (16-bit images take a
+// scalar path and stay 16-bit). Rows are split across
+// the shared pool like apply_convolution(), `threads` caps it (0 = one per
+// core). Returns NULL on failure
+image_t *resample_image(const image_t *input, uint32_t width, uint32_t height,
+                        resample_filter_t filter, uint32_t threads);
+
+#endif
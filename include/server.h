@@ -0,0 +1,40 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "image_processor.h"
+#include "thread_pool.h"
+
+// Longest request line, and the largest inline PNG a request may carry
+#define SERVER_LINE_MAX 8192
+#define SERVER_INLINE_MAX ((size_t)256 << 20)
+
+// Connections accepted but not yet picked up by a worker
+#define SERVER_QUEUE_SIZE 64
+
+// Protocol, any number of requests per connection, each one line:
+//
+//   <input> <output> [options]\n
+//
+// <input> is a path, or @<n> followed by n bytes of PNG data right after the
+// newline. Options are the command line flags (-g, --blur 3, -z 9, ...).
+// Tokens are separated by spaces or tabs, there is no quoting. Every
+// request gets one reply line:
+//
+//   OK total_ms=<t> read_ms=<t> process_ms=<t>\n
+//   ERR <message>\n
+//
+// Details of an error are logged on the server's stderr
+typedef struct {
+    const char *socket_path;
+    uint32_t jobs;              // connection workers, 0 = one per core
+} server_config_t;
+
+// Serve requests until SIGINT or SIGTERM. Each worker keeps its buffers and
+// zlib streams between requests. Returns 0 on a clean shutdown
+int run_server(const server_config_t *config);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Stages timed by --stats. Convolution and resampling are timed around the
+// whole parallel call; per-row and per-strip work (inflate, unfilter,
+// convert, filter, deflate) is summed over the threads doing it
+typedef enum {
+    STATS_PARSE = 0,    // mapping the file, chunk index and CRCs, header chunks
+    STATS_INFLATE,      // bytes: decompressed
+    STATS_UNFILTER,
+    STATS_CONVERT,      // bit depth and palette unpacking, grayscale conversion
+    STATS_CONVOLVE,     // one call per kernel pass (or per fused blur)
+    STATS_RESAMPLE,     // resizes, including reduction while decoding
+    STATS_FILTER,       // encoder filter selection, bytes: raw rows
+    STATS_DEFLATE,      // bytes: filtered rows in
+    STATS_WRITE,        // bytes: file bytes out
+    STATS_STAGE_COUNT
+} stats_stage_t;
+
+typedef enum {
+    STATS_FORMAT_TEXT = 0,
+    STATS_FORMAT_JSON = 1
+} stats_format_t;
+
+// Off by default: every hook below is then a single predictable branch
+extern bool stats_enabled;
+
+void stats_enable(void);
+
+uint64_t stats_now_ns(void);
+void stats_record(stats_stage_t stage, uint64_t start, uint64_t bytes);
+void stats_track(int64_t delta);
+
+// Start of a timed section, 0 when stats are off
+static inline uint64_t stats_begin(void) {
+    return stats_enabled ? stats_now_ns() : 0;
+}
+
+// Add the time since `start` and `bytes` to `stage`
+static inline void stats_end(stats_stage_t stage, uint64_t start, uint64_t bytes) {
+    if (stats_enabled) {
+        stats_record(stage, start, bytes);
+    }
+}
+
+// Count a large buffer (image, Adam7 or strip buffer) towards the peak
+static inline void stats_alloc(size_t bytes) {
+    if (stats_enabled) {
+        stats_track((int64_t)bytes);
+    }
+}
+
+static inline void stats_free(size_t bytes) {
+    if (stats_enabled) {
+        stats_track(-(int64_t)bytes);
+    }
+}
+
+// Print the per-stage totals, the peak of tracked buffers and the peak RSS
+void stats_print(FILE *out, stats_format_t format, double total_ms);
+
+#endif
@@ -5,7 +5,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 
-bool detect(FILE *file);
+bool detect(const char *filename);
 void inject_chunk(FILE *file, char type[], char message[]);
 void delete_chunk(FILE *file, char type[]);
 
@@ -0,0 +1,36 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+// Body of a parallel loop, called once for every index in [0, count)
+typedef void (*pool_task_fn)(void *arg, uint32_t index);
+
+typedef struct thread_pool thread_pool_t;
+
+// Number of online CPUs, at least 1
+uint32_t cpu_count(void);
+
+// Start `threads` persistent workers. Returns NULL on failure
+thread_pool_t *thread_pool_create(uint32_t threads);
+void thread_pool_destroy(thread_pool_t *pool);
+
+// Worker count, not counting the calling thread
+uint32_t thread_pool_size(const thread_pool_t *pool);
+
+// Run fn(arg, i) for every i < count and wait for all of them. The calling
+// thread takes tasks too, so a pool of 0 workers degrades to a plain loop.
+// Only one parallel loop runs on a pool at a time; concurrent callers wait
+void thread_pool_run(thread_pool_t *pool, uint32_t count, pool_task_fn fn, void *arg);
+
+// Process-wide pool sized to the core count, created on first use and
+// kept for the lifetime of the process
+thread_pool_t *thread_pool_shared(void);
+
+// Resolve a user thread count, 0 meaning one per core
+uint32_t thread_count_resolve(uint32_t threads);
+
+#endif
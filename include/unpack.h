@@ -0,0 +1,41 @@
+#ifndef UNPACK_H
+#define UNPACK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Conversions from the sample layouts PNG stores to the ones image_t holds.
+// Sub-byte samples are packed most significant bits first and 16-bit
+// samples are big-endian
+
+// 1, 2 or 4-bit samples to one byte each. With `scale` gray levels are
+// stretched to 0-255 (x255, x85, x17), without it the raw values are kept,
+// as palette indices need. Table driven, one lookup per input byte
+void unpack_sub_byte(const uint8_t *src, uint8_t *dst, size_t count, uint32_t bit_depth, bool scale);
+
+// Big-endian 16-bit samples to 8 bits, rounded to nearest: round(v / 257)
+void unpack_16_to_8(const uint8_t *src, uint8_t *dst, size_t count);
+
+// Big-endian 16-bit samples to native uint16_t
+void unpack_16(const uint8_t *src, uint16_t *dst, size_t count);
+
+// Native uint16_t samples back to big-endian, for the encoder
+void pack_16(const uint16_t *src, uint8_t *dst, size_t count);
+
+// One byte per sample back to 1, 2 or 4-bit samples, for indexed output.
+// Values must fit the depth
+void pack_sub_byte(const uint8_t *src, uint8_t *dst, size_t count, uint32_t bit_depth);
+
+// Palette indices to RGB (channels 3) or RGBA (4) pixels through the RGBA
+// `entries`, every index must be a valid entry. One 4-byte copy per pixel
+void unpack_palette(const uint8_t *indices, uint8_t *dst, size_t count,
+                    const uint8_t entries[256][4], uint32_t channels);
+
+// Sample at a time reference implementations, the fast paths must match them
+void unpack_sub_byte_scalar(const uint8_t *src, uint8_t *dst, size_t count, uint32_t bit_depth, bool scale);
+void unpack_16_to_8_scalar(const uint8_t *src, uint8_t *dst, size_t count);
+void unpack_palette_scalar(const uint8_t *indices, uint8_t *dst, size_t count,
+                           const uint8_t entries[256][4], uint32_t channels);
+
+#endif
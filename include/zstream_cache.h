@@ -0,0 +1,25 @@
+#ifndef ZSTREAM_CACHE_H
+#define ZSTREAM_CACHE_H
+
+#include <stdbool.h>
+#include <zlib.h>
+
+// Every thread keeps one inflate and one deflate stream alive between
+// images. A reset only clears the stream state, while Init/End allocate
+// and free the window and hash tables (about 270 KB for deflate), which
+// dominates the cost of small images. Cached streams are freed when their
+// thread exits
+
+// An inflate stream ready for a new zlib stream, NULL on failure
+z_stream *zstream_inflate_acquire(void);
+
+// A deflate stream at compression `level`, NULL on failure
+z_stream *zstream_deflate_acquire(int level);
+
+// Hand a stream back: it is reset and cached for the next acquire, or
+// ended if this thread already caches one. Deflate streams are returned
+// with the level they were acquired at
+void zstream_inflate_release(z_stream *stream);
+void zstream_deflate_release(z_stream *stream, int level);
+
+#endif
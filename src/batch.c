@@ -0,0 +1,316 @@
+#include "../include/batch.h"
+#include "../include/buffer_cache.h"
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <glob.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define BATCH_NAME_TOKEN "{name}"
+
+typedef enum {
+    SOURCE_DIRECTORY,
+    SOURCE_GLOB,
+    SOURCE_MANIFEST
+} source_kind_t;
+
+// Lazily enumerated inputs; only the glob result is held in memory whole
+typedef struct {
+    source_kind_t kind;
+    const char *path;
+    DIR *dir;
+    glob_t glob;
+    size_t glob_next;
+    FILE *manifest;
+    char *line;
+    size_t line_capacity;
+} batch_source_t;
+
+typedef enum {
+    SOURCE_END = 0,
+    SOURCE_ITEM = 1,
+    SOURCE_SKIPPED = -1     // an entry that cannot be processed, counts as failed
+} source_status_t;
+
+typedef struct {
+    const batch_config_t *config;
+    bool output_is_directory;
+
+    pthread_mutex_t lock;   // guards the source and the counters below
+    batch_source_t source;
+    uint64_t succeeded;
+    uint64_t failed;
+    uint64_t bytes_in;
+    uint64_t pixels;
+} batch_t;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool has_png_suffix(const char *name) {
+    size_t length = strlen(name);
+    return length > 4 && strcasecmp(name + length - 4, ".png") == 0;
+}
+
+static bool source_open(batch_source_t *source, const char *path) {
+    memset(source, 0, sizeof(batch_source_t));
+    source->path = path;
+
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        source->kind = SOURCE_DIRECTORY;
+        source->dir = opendir(path);
+        if (!source->dir) {
+            fprintf(stderr, "ERROR: Could not open directory %s: %s\n", path, strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    if (strpbrk(path, "*?[")) {
+        source->kind = SOURCE_GLOB;
+        int status = glob(path, 0, NULL, &source->glob);
+        if (status == GLOB_NOMATCH) {
+            fprintf(stderr, "WARNING: No files match %s\n", path);
+        } else if (status != 0) {
+            fprintf(stderr, "ERROR: Could not expand %s\n", path);
+            return false;
+        }
+        return true;
+    }
+
+    source->kind = SOURCE_MANIFEST;
+    source->manifest = fopen(path, "r");
+    if (!source->manifest) {
+        fprintf(stderr, "ERROR: Could not open manifest %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Copy `name` into `path` or report it as too long
+static source_status_t source_emit(const char *name, char *path, size_t size) {
+    if (strlen(name) >= size) {
+        fprintf(stderr, "ERROR: Path too long: %.64s...\n", name);
+        return SOURCE_SKIPPED;
+    }
+    strcpy(path, name);
+    return SOURCE_ITEM;
+}
+
+// Next input path. Not thread-safe, callers hold the batch lock
+static source_status_t source_next(batch_source_t *source, char *path, size_t size) {
+    switch (source->kind) {
+        case SOURCE_DIRECTORY: {
+            struct dirent *entry;
+            while ((entry = readdir(source->dir)) != NULL) {
+                if (entry->d_type == DT_DIR || !has_png_suffix(entry->d_name)) {
+                    continue;
+                }
+                size_t dir_length = strlen(source->path);
+                const char *separator = (dir_length > 0 && source->path[dir_length - 1] == '/') ? "" : "/";
+                int n = snprintf(path, size, "%s%s%s", source->path, separator, entry->d_name);
+                if (n < 0 || (size_t)n >= size) {
+                    fprintf(stderr, "ERROR: Path too long: %s\n", entry->d_name);
+                    return SOURCE_SKIPPED;
+                }
+                return SOURCE_ITEM;
+            }
+            return SOURCE_END;
+        }
+
+        case SOURCE_GLOB:
+            if (source->glob_next >= source->glob.gl_pathc) {
+                return SOURCE_END;
+            }
+            return source_emit(source->glob.gl_pathv[source->glob_next++], path, size);
+
+        case SOURCE_MANIFEST:
+            while (getline(&source->line, &source->line_capacity, source->manifest) > 0) {
+                char *line = source->line;
+                line[strcspn(line, "\r\n")] = '\0';
+                while (*line == ' ' || *line == '\t') {
+                    line++;
+                }
+                if (*line == '\0' || *line == '#') {
+                    continue;
+                }
+                return source_emit(line, path, size);
+            }
+            return SOURCE_END;
+    }
+    return SOURCE_END;
+}
+
+static void source_close(batch_source_t *source) {
+    if (source->dir) {
+        closedir(source->dir);
+    }
+    if (source->kind == SOURCE_GLOB) {
+        globfree(&source->glob);
+    }
+    if (source->manifest) {
+        fclose(source->manifest);
+    }
+    free(source->line);
+    memset(source, 0, sizeof(batch_source_t));
+}
+
+// Expand the output pattern for one input: {name} is the input's base
+// name without .png, a directory pattern gets <name>.png appended
+static bool make_output_path(const batch_t *batch, const char *input, char *output, size_t size) {
+    const char *base = strrchr(input, '/');
+    base = base ? base + 1 : input;
+    size_t name_length = strlen(base);
+    if (has_png_suffix(base)) {
+        name_length -= 4;
+    }
+
+    const char *pattern = batch->config->output_pattern;
+    size_t used = 0;
+    int n;
+
+    if (batch->output_is_directory) {
+        size_t dir_length = strlen(pattern);
+        const char *separator = (dir_length > 0 && pattern[dir_length - 1] == '/') ? "" : "/";
+        n = snprintf(output, size, "%s%s%.*s.png", pattern, separator, (int)name_length, base);
+        used = (n < 0) ? size : (size_t)n;
+    } else {
+        output[0] = '\0';
+        const char *token;
+        while ((token = strstr(pattern, BATCH_NAME_TOKEN)) != NULL && used < size) {
+            n = snprintf(output + used, size - used, "%.*s%.*s",
+                         (int)(token - pattern), pattern, (int)name_length, base);
+            used = (n < 0) ? size : used + (size_t)n;
+            pattern = token + strlen(BATCH_NAME_TOKEN);
+        }
+        if (used < size) {
+            n = snprintf(output + used, size - used, "%s", pattern);
+            used = (n < 0) ? size : used + (size_t)n;
+        }
+    }
+
+    if (used >= size) {
+        fprintf(stderr, "ERROR: Output path for %s is too long\n", input);
+        return false;
+    }
+    return true;
+}
+
+// Decode, filter and encode one file, adding its size and pixel count
+static bool process_file(const char *input, const char *output, const process_options_t *options,
+                         uint64_t *bytes, uint64_t *pixels) {
+    png_reader_t png;
+    if (!png_reader_open(input, &png)) {
+        return false;
+    }
+    *bytes = png.map.size;
+    *pixels = (uint64_t)png.ihdr.width * png.ihdr.height;
+
+    int result = process_png_image(&png, output, options);
+    png_reader_close(&png);
+    return result == PROCESS_OK;
+}
+
+// Every worker pulls inputs from the shared source until it runs dry, so
+// no more than one image per worker is ever in flight
+static void batch_worker(void *arg, uint32_t index) {
+    (void)index;
+    batch_t *batch = arg;
+    char input[BATCH_PATH_MAX];
+    char output[BATCH_PATH_MAX];
+
+    // Files are the unit of parallelism, each one is filtered on its own thread
+    process_options_t options = batch->config->process;
+    options.threads = 1;
+    options.verbose = false;
+
+    while (true) {
+        pthread_mutex_lock(&batch->lock);
+        source_status_t status = source_next(&batch->source, input, sizeof(input));
+        pthread_mutex_unlock(&batch->lock);
+        if (status == SOURCE_END) {
+            break;
+        }
+
+        uint64_t bytes = 0;
+        uint64_t pixels = 0;
+        bool ok = status == SOURCE_ITEM &&
+                  make_output_path(batch, input, output, sizeof(output)) &&
+                  process_file(input, output, &options, &bytes, &pixels);
+        if (!ok && status == SOURCE_ITEM) {
+            fprintf(stderr, "FAILED: %s\n", input);
+        }
+        buffer_cache_trim();
+
+        pthread_mutex_lock(&batch->lock);
+        if (ok) {
+            batch->succeeded++;
+            batch->bytes_in += bytes;
+            batch->pixels += pixels;
+        } else {
+            batch->failed++;
+        }
+        pthread_mutex_unlock(&batch->lock);
+    }
+}
+
+static void print_summary(const batch_t *batch, uint32_t jobs, double seconds) {
+    uint64_t files = batch->succeeded + batch->failed;
+    double rate = (seconds > 0.0) ? 1.0 / seconds : 0.0;
+
+    printf("\nBatch summary\n");
+    printf("  Files      : %llu ok, %llu failed\n",
+           (unsigned long long)batch->succeeded, (unsigned long long)batch->failed);
+    printf("  Input      : %.1f MB, %.1f Mpixels\n",
+           batch->bytes_in / (1024.0 * 1024.0), batch->pixels / 1e6);
+    printf("  Time       : %.2f s on %u jobs\n", seconds, jobs);
+    printf("  Throughput : %.1f files/s, %.1f MB/s, %.1f Mpixels/s\n",
+           files * rate, batch->bytes_in / (1024.0 * 1024.0) * rate, batch->pixels / 1e6 * rate);
+}
+
+int run_batch(const batch_config_t *config) {
+    batch_t batch;
+    memset(&batch, 0, sizeof(batch_t));
+    batch.config = config;
+
+    struct stat st;
+    batch.output_is_directory = strstr(config->output_pattern, BATCH_NAME_TOKEN) == NULL &&
+                                stat(config->output_pattern, &st) == 0 && S_ISDIR(st.st_mode);
+    if (!batch.output_is_directory && !strstr(config->output_pattern, BATCH_NAME_TOKEN)) {
+        fprintf(stderr, "ERROR: Output pattern %s must contain %s or be an existing directory\n",
+                config->output_pattern, BATCH_NAME_TOKEN);
+        return 1;
+    }
+
+    if (!source_open(&batch.source, config->source)) {
+        return 1;
+    }
+
+    uint32_t jobs = thread_count_resolve(config->jobs);
+    // The calling thread is the last worker
+    thread_pool_t *pool = thread_pool_create(jobs - 1);
+    if (!pool) {
+        source_close(&batch.source);
+        return 1;
+    }
+    pthread_mutex_init(&batch.lock, NULL);
+
+    printf("Batch: %s -> %s, %u jobs\n", config->source, config->output_pattern, jobs);
+    fflush(stdout);
+    double start = now_seconds();
+    thread_pool_run(pool, jobs, batch_worker, &batch);
+    double elapsed = now_seconds() - start;
+
+    thread_pool_destroy(pool);
+    pthread_mutex_destroy(&batch.lock);
+    source_close(&batch.source);
+
+    print_summary(&batch, jobs, elapsed);
+    return batch.failed ? 1 : 0;
+}
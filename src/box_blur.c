@@ -0,0 +1,429 @@
+#include "../include/box_blur.h"
+#include "../include/stats.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Samples between passes carry up to this many fractional bits, as many as
+// let the widest window sum still fit 16 bits (see box_blur_fused)
+#define BOX_MAX_FRACTION_BITS 7
+
+// Window sums stay below 2^16, so running sums can wrap in 16-bit lanes
+#define BOX_MAX_SUM_WIDTH 256
+
+// Columns one vertical task carries through all passes at once; 32 samples
+// are one 64-byte line of the intermediate image. Must divide
+// IMAGE_ALIGNMENT so a stripe never reads past the input stride
+#define BOX_STRIPE 32
+
+// Rows the horizontal passes handle together, one per 16-bit SIMD lane
+#define BOX_LANES 8
+
+// Division by the width is a multiply-high: (sum + half) * recip >> 16
+typedef struct {
+    uint32_t radius;
+    uint16_t recip;
+    uint16_t half;
+} box_t;
+
+typedef struct {
+    const image_t *input;
+    image_t *output;
+    uint16_t *rows;         // horizontally blurred image, `pitch` samples per row
+    size_t pitch;
+    void *scratch;          // per task, sized for the larger of the two phases
+    size_t scratch_size;    // bytes per task
+    size_t row_bytes;
+    uint32_t fraction_bits;
+    uint32_t row_groups;    // groups of BOX_LANES rows
+    uint32_t row_tasks;
+    uint32_t stripes;
+    uint32_t stripe_tasks;
+    box_t boxes[BOX_BLUR_PASSES];
+} box_job_t;
+
+float fused_blur_sigma(kernel_type type, uint32_t steps) {
+    float variance = (type == KERNEL_GAUSSIAN) ? 0.5f : 2.0f / 3.0f;
+    return sqrtf(steps * variance);
+}
+
+void box_blur_widths(float sigma, uint32_t widths[BOX_BLUR_PASSES]) {
+    // A box of width w has variance (w^2 - 1) / 12. Take the odd width just
+    // below the ideal one and widen `BOX_BLUR_PASSES - m` of the boxes by 2
+    float n = BOX_BLUR_PASSES;
+    float target = 12.0f * sigma * sigma;
+    int lower = (int)floorf(sqrtf(target / n + 1.0f));
+    if (lower % 2 == 0) {
+        lower--;
+    }
+    if (lower < 1) {
+        lower = 1;
+    }
+
+    float ideal = (target - n * lower * lower - 4.0f * n * lower - 3.0f * n) / (-4.0f * lower - 4.0f);
+    int m = (int)roundf(ideal);
+    if (m < 0) m = 0;
+    if (m > BOX_BLUR_PASSES) m = BOX_BLUR_PASSES;
+
+    for (int i = 0; i < BOX_BLUR_PASSES; i++) {
+        widths[i] = (uint32_t)((i < m) ? lower : lower + 2);
+    }
+}
+
+// Edge-clamped sample indices entering and leaving the window after
+// position x
+static inline uint32_t box_enter(uint32_t x, uint32_t radius, uint32_t last) {
+    return (x + radius + 1 < last) ? x + radius + 1 : last;
+}
+
+static inline uint32_t box_leave(uint32_t x, uint32_t radius) {
+    return (x >= radius) ? x - radius : 0;
+}
+
+static inline uint16_t box_average(uint32_t sum, const box_t *box) {
+    return (uint16_t)(((sum + box->half) * box->recip) >> 16);
+}
+
+static inline uint8_t box_to_byte(uint32_t sample, uint32_t fraction_bits) {
+    uint32_t value = (sample + ((1u << fraction_bits) >> 1)) >> fraction_bits;
+    return (value > 255) ? 255 : (uint8_t)value;
+}
+
+#ifdef __SSE2__
+// In-place transpose of an 8x8 block of 16-bit samples
+static inline void transpose_8x8_epi16(__m128i v[8]) {
+    __m128i t[8], u[8];
+    for (int i = 0; i < 4; i++) {
+        t[2 * i] = _mm_unpacklo_epi16(v[2 * i], v[2 * i + 1]);
+        t[2 * i + 1] = _mm_unpackhi_epi16(v[2 * i], v[2 * i + 1]);
+    }
+    for (int i = 0; i < 2; i++) {
+        u[4 * i + 0] = _mm_unpacklo_epi32(t[4 * i + 0], t[4 * i + 2]);
+        u[4 * i + 1] = _mm_unpackhi_epi32(t[4 * i + 0], t[4 * i + 2]);
+        u[4 * i + 2] = _mm_unpacklo_epi32(t[4 * i + 1], t[4 * i + 3]);
+        u[4 * i + 3] = _mm_unpackhi_epi32(t[4 * i + 1], t[4 * i + 3]);
+    }
+    for (int i = 0; i < 4; i++) {
+        v[2 * i] = _mm_unpacklo_epi64(u[i], u[i + 4]);
+        v[2 * i + 1] = _mm_unpackhi_epi64(u[i], u[i + 4]);
+    }
+}
+
+// Eight window sums divided by the box width
+static inline __m128i box_average_epi16(__m128i sum, const box_t *box) {
+    return _mm_mulhi_epu16(_mm_add_epi16(sum, _mm_set1_epi16((short)box->half)),
+                           _mm_set1_epi16((short)box->recip));
+}
+
+// One box along a chain of vectors `stride` apart, each lane its own row.
+// Sums wrap in 16 bits but every window sum fits, so they come out exact
+static void box_pass_lanes(const __m128i *src, __m128i *dst, size_t stride,
+                           uint32_t count, const box_t *box) {
+    uint32_t radius = box->radius;
+    uint32_t last = count - 1;
+
+    if (radius == 0) {
+        for (uint32_t x = 0; x < count; x++) {
+            dst[(size_t)x * stride] = src[(size_t)x * stride];
+        }
+        return;
+    }
+
+    // Window around x = 0, the left edge repeated radius times
+    __m128i sum = _mm_setzero_si128();
+    for (uint32_t i = 0; i <= 2 * radius; i++) {
+        uint32_t index = (i <= radius) ? 0 : i - radius;
+        sum = _mm_add_epi16(sum, src[(size_t)(index < last ? index : last) * stride]);
+    }
+
+    for (uint32_t x = 0; x < count; x++) {
+        dst[(size_t)x * stride] = box_average_epi16(sum, box);
+        sum = _mm_add_epi16(sum, src[(size_t)box_enter(x, radius, last) * stride]);
+        sum = _mm_sub_epi16(sum, src[(size_t)box_leave(x, radius) * stride]);
+    }
+}
+
+// The same box down a stripe of BOX_STRIPE columns, one row at a time
+static void box_pass_stripe(const uint16_t *src, size_t src_pitch, uint16_t *dst,
+                            uint32_t height, const box_t *box) {
+    enum { VECTORS = BOX_STRIPE / 8 };
+    uint32_t radius = box->radius;
+    uint32_t last = height - 1;
+    __m128i sum[VECTORS];
+
+    for (int v = 0; v < VECTORS; v++) {
+        sum[v] = _mm_setzero_si128();
+    }
+    for (uint32_t i = 0; i <= 2 * radius; i++) {
+        uint32_t index = (i <= radius) ? 0 : i - radius;
+        const __m128i *row = (const __m128i *)(src + (size_t)(index < last ? index : last) * src_pitch);
+        for (int v = 0; v < VECTORS; v++) {
+            sum[v] = _mm_add_epi16(sum[v], _mm_load_si128(row + v));
+        }
+    }
+
+    for (uint32_t y = 0; y < height; y++) {
+        __m128i *out = (__m128i *)(dst + (size_t)y * BOX_STRIPE);
+        const __m128i *in = (const __m128i *)(src + (size_t)box_enter(y, radius, last) * src_pitch);
+        const __m128i *gone = (const __m128i *)(src + (size_t)box_leave(y, radius) * src_pitch);
+        for (int v = 0; v < VECTORS; v++) {
+            _mm_store_si128(out + v, (radius == 0) ? sum[v] : box_average_epi16(sum[v], box));
+            sum[v] = _mm_add_epi16(sum[v], _mm_load_si128(in + v));
+            sum[v] = _mm_sub_epi16(sum[v], _mm_load_si128(gone + v));
+        }
+    }
+}
+#else
+// One box over `count` samples, `src_stride` and `dst_stride` apart
+static void box_pass(const uint16_t *src, size_t src_stride, uint16_t *dst, size_t dst_stride,
+                     uint32_t count, const box_t *box) {
+    uint32_t radius = box->radius;
+    uint32_t last = count - 1;
+
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i <= 2 * radius; i++) {
+        uint32_t index = (i <= radius) ? 0 : i - radius;
+        sum += src[(size_t)(index < last ? index : last) * src_stride];
+    }
+
+    for (uint32_t x = 0; x < count; x++) {
+        dst[(size_t)x * dst_stride] = (radius == 0) ? (uint16_t)sum : box_average(sum, box);
+        sum += src[(size_t)box_enter(x, radius, last) * src_stride];
+        sum -= src[(size_t)box_leave(x, radius) * src_stride];
+    }
+}
+#endif
+
+// Horizontal passes over groups of BOX_LANES rows into job->rows. The rows
+// of a group are transposed so each pass runs on whole vectors
+static void box_rows_task(void *arg, uint32_t index) {
+    box_job_t *job = arg;
+    const image_t *input = job->input;
+    uint32_t height = input->height;
+    uint32_t channels = input->channels;
+    uint32_t colors = image_color_channels(input);
+
+    uint32_t per_task = (job->row_groups + job->row_tasks - 1) / job->row_tasks;
+    uint32_t g_begin = index * per_task;
+    uint32_t g_end = (g_begin + per_task < job->row_groups) ? g_begin + per_task : job->row_groups;
+
+#ifdef __SSE2__
+    __m128i *a = (__m128i *)((uint8_t *)job->scratch + index * job->scratch_size);
+    __m128i *b = a + job->pitch;
+    __m128i shift = _mm_cvtsi32_si128((int)job->fraction_bits);
+
+    for (uint32_t g = g_begin; g < g_end; g++) {
+        uint32_t y0 = g * BOX_LANES;
+
+        // Lane i of a[x] is sample x of row y0 + i; rows past the bottom
+        // repeat the last one and are not stored
+        for (size_t x = 0; x < job->pitch; x += 8) {
+            __m128i v[8];
+            for (int i = 0; i < 8; i++) {
+                uint32_t y = (y0 + i < height) ? y0 + i : height - 1;
+                __m128i bytes = _mm_loadl_epi64((const __m128i *)(image_row(input, y) + x));
+                v[i] = _mm_sll_epi16(_mm_unpacklo_epi8(bytes, _mm_setzero_si128()), shift);
+            }
+            transpose_8x8_epi16(v);
+            for (int i = 0; i < 8; i++) {
+                a[x + i] = v[i];
+            }
+        }
+
+        for (uint32_t c = 0; c < colors; c++) {
+            box_pass_lanes(a + c, b + c, channels, input->width, &job->boxes[0]);
+            box_pass_lanes(b + c, a + c, channels, input->width, &job->boxes[1]);
+            box_pass_lanes(a + c, b + c, channels, input->width, &job->boxes[2]);
+        }
+
+        for (size_t x = 0; x < job->pitch; x += 8) {
+            __m128i v[8];
+            for (int i = 0; i < 8; i++) {
+                v[i] = b[x + i];
+            }
+            transpose_8x8_epi16(v);
+            for (uint32_t i = 0; i < 8 && y0 + i < height; i++) {
+                _mm_store_si128((__m128i *)(job->rows + (size_t)(y0 + i) * job->pitch + x), v[i]);
+            }
+        }
+    }
+#else
+    uint16_t *a = (uint16_t *)((uint8_t *)job->scratch + index * job->scratch_size);
+    uint16_t *b = a + job->pitch;
+
+    for (uint32_t y = g_begin * BOX_LANES; y < g_end * BOX_LANES && y < height; y++) {
+        const uint8_t *src = image_row(input, y);
+        uint16_t *out = job->rows + (size_t)y * job->pitch;
+
+        for (size_t i = 0; i < job->row_bytes; i++) {
+            a[i] = (uint16_t)(src[i] << job->fraction_bits);
+        }
+        for (uint32_t c = 0; c < colors; c++) {
+            box_pass(a + c, channels, b + c, channels, input->width, &job->boxes[0]);
+            box_pass(b + c, channels, a + c, channels, input->width, &job->boxes[1]);
+            box_pass(a + c, channels, out + c, channels, input->width, &job->boxes[2]);
+        }
+    }
+#endif
+}
+
+// Vertical passes over a group of column stripes, then the interior colour
+// samples are rounded back to 8 bits
+static void box_columns_task(void *arg, uint32_t index) {
+    box_job_t *job = arg;
+    const image_t *input = job->input;
+    uint32_t height = input->height;
+    uint32_t channels = input->channels;
+    uint32_t colors = image_color_channels(input);
+    size_t border = (size_t)(input->width - 1) * channels;
+
+    uint32_t per_task = (job->stripes + job->stripe_tasks - 1) / job->stripe_tasks;
+    uint32_t s_begin = index * per_task;
+    uint32_t s_end = (s_begin + per_task < job->stripes) ? s_begin + per_task : job->stripes;
+
+    uint16_t *a = (uint16_t *)((uint8_t *)job->scratch + index * job->scratch_size);
+    uint16_t *b = a + (size_t)BOX_STRIPE * height;
+    uint8_t keep[BOX_STRIPE];  // 1 where the output byte is left alone
+
+    for (uint32_t s = s_begin; s < s_end; s++) {
+        size_t x0 = (size_t)s * BOX_STRIPE;
+        const uint16_t *src = job->rows + x0;
+
+#ifdef __SSE2__
+        box_pass_stripe(src, job->pitch, a, height, &job->boxes[0]);
+        box_pass_stripe(a, BOX_STRIPE, b, height, &job->boxes[1]);
+        box_pass_stripe(b, BOX_STRIPE, a, height, &job->boxes[2]);
+#else
+        for (size_t c = 0; c < BOX_STRIPE; c++) {
+            box_pass(src + c, job->pitch, a + c, BOX_STRIPE, height, &job->boxes[0]);
+            box_pass(a + c, BOX_STRIPE, b + c, BOX_STRIPE, height, &job->boxes[1]);
+            box_pass(b + c, BOX_STRIPE, a + c, BOX_STRIPE, height, &job->boxes[2]);
+        }
+#endif
+
+        // Border pixels, alpha and the padding past the row keep what is there
+        for (size_t c = 0; c < BOX_STRIPE; c++) {
+            size_t x = x0 + c;
+            keep[c] = x < channels || x >= border || x % channels == colors;
+        }
+#ifdef __SSE2__
+        __m128i keep_mask[BOX_STRIPE / 16];
+        for (int v = 0; v < BOX_STRIPE / 16; v++) {
+            keep_mask[v] = _mm_sub_epi8(_mm_setzero_si128(), _mm_loadu_si128((const __m128i *)(keep + v * 16)));
+        }
+        __m128i shift = _mm_cvtsi32_si128((int)job->fraction_bits);
+        __m128i half = _mm_set1_epi16((short)((1u << job->fraction_bits) >> 1));
+#endif
+        for (uint32_t y = 1; y + 1 < height; y++) {
+            uint8_t *out = image_row(job->output, y) + x0;
+            const uint16_t *row = a + (size_t)y * BOX_STRIPE;
+#ifdef __SSE2__
+            for (int v = 0; v < BOX_STRIPE / 16; v++) {
+                __m128i lo = _mm_srl_epi16(_mm_add_epi16(_mm_load_si128((const __m128i *)row + 2 * v), half), shift);
+                __m128i hi = _mm_srl_epi16(_mm_add_epi16(_mm_load_si128((const __m128i *)row + 2 * v + 1), half), shift);
+                __m128i bytes = _mm_packus_epi16(lo, hi);
+                __m128i old = _mm_loadu_si128((const __m128i *)(out + v * 16));
+                bytes = _mm_or_si128(_mm_and_si128(keep_mask[v], old), _mm_andnot_si128(keep_mask[v], bytes));
+                _mm_storeu_si128((__m128i *)(out + v * 16), bytes);
+            }
+#else
+            for (size_t c = 0; c < BOX_STRIPE; c++) {
+                if (!keep[c]) {
+                    out[c] = box_to_byte(row[c], job->fraction_bits);
+                }
+            }
+#endif
+        }
+    }
+}
+
+static void run_tasks(uint32_t threads, uint32_t count, pool_task_fn fn, void *arg) {
+    if (threads == 1) {
+        for (uint32_t i = 0; i < count; i++) {
+            fn(arg, i);
+        }
+        return;
+    }
+    thread_pool_run(thread_pool_shared(), count, fn, arg);
+}
+
+static bool blur_fused(const image_t *input, image_t *output, kernel_type type,
+                       uint32_t steps, uint32_t threads) {
+    if (!input || !output || (type != KERNEL_GAUSSIAN && type != KERNEL_BLUR) ||
+        input->bit_depth != 8 || output->bit_depth != 8) {
+        return false;
+    }
+
+    image_copy(output, input);
+    if (steps == 0 || input->width < 3 || input->height < 3) {
+        return true;
+    }
+
+    // Stripes may run past the row into the stride padding, which image_t
+    // keeps to a multiple of 64 bytes
+    box_job_t job = {
+        .input = input,
+        .output = output,
+        .row_bytes = image_row_bytes(input),
+    };
+    job.pitch = (job.row_bytes + BOX_STRIPE - 1) / BOX_STRIPE * BOX_STRIPE;
+
+    // As many fractional bits as keep the widest window sum of
+    // (255 << bits) samples within 16 bits. Wider boxes than that (over a
+    // thousand steps) are left to the caller
+    uint32_t widths[BOX_BLUR_PASSES];
+    box_blur_widths(fused_blur_sigma(type, steps), widths);
+    job.fraction_bits = BOX_MAX_FRACTION_BITS;
+    for (int i = 0; i < BOX_BLUR_PASSES; i++) {
+        if (widths[i] > BOX_MAX_SUM_WIDTH) {
+            return false;
+        }
+        while ((widths[i] << job.fraction_bits) > BOX_MAX_SUM_WIDTH) {
+            job.fraction_bits--;
+        }
+        job.boxes[i].radius = widths[i] / 2;
+        job.boxes[i].recip = (uint16_t)((65536 + widths[i] - 1) / widths[i]);
+        job.boxes[i].half = (uint16_t)(widths[i] / 2);
+    }
+
+    threads = thread_count_resolve(threads);
+    job.row_groups = (input->height + BOX_LANES - 1) / BOX_LANES;
+    job.stripes = (uint32_t)(job.pitch / BOX_STRIPE);
+    job.row_tasks = (threads < job.row_groups) ? threads : job.row_groups;
+    job.stripe_tasks = (threads < job.stripes) ? threads : job.stripes;
+
+    // Two transposed row groups per horizontal task, two stripes per
+    // vertical task
+    size_t row_scratch = 2 * job.pitch * BOX_LANES * sizeof(uint16_t);
+    size_t column_scratch = 2 * (size_t)BOX_STRIPE * input->height * sizeof(uint16_t);
+    job.scratch_size = (row_scratch > column_scratch) ? row_scratch : column_scratch;
+    uint32_t tasks = (job.row_tasks > job.stripe_tasks) ? job.row_tasks : job.stripe_tasks;
+
+    job.rows = aligned_alloc(IMAGE_ALIGNMENT, job.pitch * input->height * sizeof(uint16_t));
+    job.scratch = aligned_alloc(IMAGE_ALIGNMENT, tasks * job.scratch_size);
+    if (!job.rows || !job.scratch) {
+        fprintf(stderr, "ERROR: Could not allocate memory for fused blur\n");
+        free(job.rows);
+        free(job.scratch);
+        return false;
+    }
+    // Samples past the row are never written by a pass; zero them once so
+    // the padding columns carried through the vertical passes are defined
+    memset(job.scratch, 0, tasks * job.scratch_size);
+
+    run_tasks(threads, job.row_tasks, box_rows_task, &job);
+    run_tasks(threads, job.stripe_tasks, box_columns_task, &job);
+
+    free(job.rows);
+    free(job.scratch);
+    return true;
+}
+
+bool box_blur_fused(const image_t *input, image_t *output, kernel_type type,
+                    uint32_t steps, uint32_t threads) {
+    uint64_t start = stats_begin();
+    bool ok = blur_fused(input, output, type, steps, threads);
+    stats_end(STATS_CONVOLVE, start, ok ? image_row_bytes(input) * input->height : 0);
+    return ok;
+}
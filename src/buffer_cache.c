@@ -0,0 +1,139 @@
+#include "../include/buffer_cache.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+// Alignment of every block, matches IMAGE_ALIGNMENT
+#define BLOCK_ALIGNMENT 64
+#define MIN_BLOCK_SIZE 4096
+
+typedef struct {
+    void *data;
+    size_t capacity;
+    bool used;              // released since the last buffer_cache_trim
+} cached_block_t;
+
+// Blocks in release order, oldest first
+typedef struct {
+    cached_block_t blocks[BUFFER_CACHE_SLOTS];
+    uint32_t count;
+    size_t bytes;
+} buffer_slots_t;
+
+static pthread_key_t slots_key;
+static pthread_once_t slots_key_once = PTHREAD_ONCE_INIT;
+
+static void free_slots(void *data) {
+    buffer_slots_t *slots = data;
+    for (uint32_t i = 0; i < slots->count; i++) {
+        free(slots->blocks[i].data);
+    }
+    free(slots);
+}
+
+static void make_slots_key(void) {
+    pthread_key_create(&slots_key, free_slots);
+}
+
+// This thread's slots, created on first use. NULL if that fails, callers
+// then simply do not cache
+static buffer_slots_t *thread_slots(void) {
+    pthread_once(&slots_key_once, make_slots_key);
+    buffer_slots_t *slots = pthread_getspecific(slots_key);
+    if (!slots) {
+        slots = calloc(1, sizeof(buffer_slots_t));
+        if (slots && pthread_setspecific(slots_key, slots) != 0) {
+            free(slots);
+            slots = NULL;
+        }
+    }
+    return slots;
+}
+
+// `size` rounded up to a multiple of a quarter of the power of two below it
+static size_t size_class(size_t size) {
+    if (size <= MIN_BLOCK_SIZE) {
+        return MIN_BLOCK_SIZE;
+    }
+    size_t top = (size_t)1 << (sizeof(size_t) * 8 - 1 - (size_t)__builtin_clzl(size));
+    size_t step = top / 4;
+    if (size > SIZE_MAX - step) {
+        return size;
+    }
+    return (size + step - 1) / step * step;
+}
+
+// Free the cached block at `index`, keeping the others in order
+static void drop_block(buffer_slots_t *slots, uint32_t index, bool free_data) {
+    if (free_data) {
+        free(slots->blocks[index].data);
+    }
+    slots->bytes -= slots->blocks[index].capacity;
+    slots->count--;
+    memmove(&slots->blocks[index], &slots->blocks[index + 1],
+            (slots->count - index) * sizeof(cached_block_t));
+}
+
+void *buffer_cache_acquire(size_t size, size_t *capacity) {
+    size_t wanted = size_class(size);
+    buffer_slots_t *slots = thread_slots();
+    if (slots) {
+        // The smallest cached block that fits, unless it would waste more
+        // than the request itself
+        int best = -1;
+        for (uint32_t i = 0; i < slots->count; i++) {
+            size_t have = slots->blocks[i].capacity;
+            if (have >= wanted && have / 2 <= wanted &&
+                (best < 0 || have < slots->blocks[best].capacity)) {
+                best = (int)i;
+            }
+        }
+        if (best >= 0) {
+            cached_block_t block = slots->blocks[best];
+            drop_block(slots, (uint32_t)best, false);
+            *capacity = block.capacity;
+            return block.data;
+        }
+    }
+
+    void *data = aligned_alloc(BLOCK_ALIGNMENT, (wanted + BLOCK_ALIGNMENT - 1) & ~(size_t)(BLOCK_ALIGNMENT - 1));
+    *capacity = data ? wanted : 0;
+    return data;
+}
+
+void buffer_cache_release(void *data, size_t capacity) {
+    if (!data) {
+        return;
+    }
+    buffer_slots_t *slots = thread_slots();
+    if (!slots || capacity > BUFFER_CACHE_MAX_BYTES) {
+        free(data);
+        return;
+    }
+
+    // Make room by dropping the blocks released longest ago
+    while (slots->count == BUFFER_CACHE_SLOTS || slots->bytes + capacity > BUFFER_CACHE_MAX_BYTES) {
+        drop_block(slots, 0, true);
+    }
+    slots->blocks[slots->count++] = (cached_block_t){data, capacity, true};
+    slots->bytes += capacity;
+}
+
+void buffer_cache_trim(void) {
+    pthread_once(&slots_key_once, make_slots_key);
+    buffer_slots_t *slots = pthread_getspecific(slots_key);
+    if (!slots) {
+        return;
+    }
+    uint32_t i = 0;
+    while (i < slots->count) {
+        if (slots->blocks[i].used) {
+            slots->blocks[i++].used = false;
+        } else {
+            drop_block(slots, i, true);
+        }
+    }
+}
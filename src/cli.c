@@ -7,7 +7,7 @@ void usage(char *exec_name) {
     printf("\nOptions: \n");
     printf("  -o,  --output <file>        Output filename (default=out.png)\n");
     printf("  -i,  --info <file>          Show information about PNG file\n");
-    printf("  -g,  --grayscale            Convert to grayscale\n");
+    printf("  -g,  --grayscale            Convert to grayscale (alpha is kept, as gray + alpha)\n");
     printf("  -c,  --color                Keep RGB format (default)\n");
     printf("  -x,  --sobel-x              Apply Sobel X edge detection\n");
     printf("  -y,  --sobel-y              Apply Sobel Y edge detection\n");
@@ -16,33 +16,85 @@ void usage(char *exec_name) {
     printf("  -b,  --blur [steps]         Apply box blur (optional: number of iterations, default=1)\n");
     printf("  -l,  --laplacian            Apply Laplacian edge detection\n");
     printf("  -sh, --sharpen              Apply sharpening filter\n");
-    printf("  -u,  --upscale              Upscale the image\n");
+    printf("  -u,  --upscale [factor]     Scale the image by a factor (default=2, may be fractional)\n");
+    printf("  --resize <W>x<H>            Resize to W x H; with Wx or xH the other side keeps the aspect\n");
+    printf("  --thumbnail <N>             Shrink to fit in N x N, keeping the aspect ratio\n");
+    printf("  --filter <name>             Resampling filter: box, bilinear (default), bicubic, lanczos3\n");
     printf("  -d,  --draw [color]         Draw the input image in ASCII characters (default: color=true)\n");
+    printf("  --pipeline <stages>         Chain stages in memory, e.g. \"gray,gaussian:3,sobel,upscale:2\";\n");
+    printf("                              stages: gray, gaussian[:n], blur[:n], sobel-x, sobel-y,\n");
+    printf("                              sobel, laplacian, sharpen, upscale[:factor], resize:<W>x<H>,\n");
+    printf("                              thumbnail:<N>\n");
+    printf("  --fuse                      Run multi-step Gaussian/box blur as one approximate pass\n");
+    printf("  --keep-16                   Keep 16-bit inputs at 16 bits through filters and output\n");
+    printf("                              (default: every input is reduced to 8 bits when decoded)\n");
+    printf("  -t,  --threads <n>          Worker threads for filters, encoding and decoding\n");
+    printf("                              (default=0, one per core; the output is written in\n");
+    printf("                              parallel strips only when n is above 1)\n");
+    printf("  --batch <dir|glob|list>     Process every PNG in a directory, matching a quoted glob,\n");
+    printf("                              or listed one per line in a manifest file; -o is then\n");
+    printf("                              an output pattern with {name} or an output directory\n");
+    printf("  -j,  --jobs <n>             Files processed at once in batch mode, which also caps\n");
+    printf("                              the images held in memory (default=0, one per core)\n");
+    printf("  --serve <socket>            Stay resident and process requests sent over a Unix\n");
+    printf("                              socket, -j sets the number of connection workers\n");
+    printf("  --stats [text|json]         Print time per stage (parse, inflate, unfilter, convert,\n");
+    printf("                              convolve, resample, filter, deflate, write) and peak\n");
+    printf("                              memory to stderr when done (default: text)\n");
+    printf("  -z,  --zlevel <0-9>         Output compression level, 0=fastest 9=smallest (default=6)\n");
+    printf("  --png-filter <mode>         Output row filter: none, sub, up, avg, paeth, minsad (default),\n");
+    printf("                              or brute (smallest output, slowest)\n");
     printf("  --none                      No filter (default)\n");
     printf("  -h, --help                  Show this HELP message\n");
     printf("\nExamples:\n");
     printf("  %s input.png -o edges.png --sobel --grayscale\n", exec_name);
     printf("  %s photo.png -o blurred.png --gaussian\n", exec_name);
     printf("  %s photo.png -o blurred.png --draw false\n", exec_name);
+    printf("  %s photo.png -o edges.png --pipeline gray,gaussian:2,sobel\n", exec_name);
+    printf("  %s --batch photos/ -o thumbs/{name}_gray.png -g -j 8\n", exec_name);
+    printf("  %s --serve /tmp/png.sock -j 4\n", exec_name);
 
     printf("\n\n");
     printf("Author: YerdosNar github.com/YerdosNar/PNG.git\n");
 }
 
+// Map a --png-filter name onto the encoder options
+static bool parse_filter_mode(const char *name, png_write_options_t *options) {
+    static const char *fixed[FILTER_COUNT] = {"none", "sub", "up", "avg", "paeth"};
+
+    for (uint8_t type = 0; type < FILTER_COUNT; type++) {
+        if (!strcmp(name, fixed[type])) {
+            options->filter_strategy = FILTER_STRATEGY_FIXED;
+            options->filter_type = type;
+            return true;
+        }
+    }
+    if (!strcmp(name, "minsad")) {
+        options->filter_strategy = FILTER_STRATEGY_MINSAD;
+        return true;
+    }
+    if (!strcmp(name, "brute")) {
+        options->filter_strategy = FILTER_STRATEGY_BRUTE;
+        return true;
+    }
+    return false;
+}
+
 bool parse_arguments(int argc, char **argv, cli_config_t *config) {
     // Initialize config with defaults
     config->input_file = NULL;
     config->output_file = NULL;
-    config->force_grayscale = false;
-    config->do_upscale = false;
     config->draw = false;
     config->draw_color = false;
-    config->kernel = KERNEL_NONE;
-    config->steps = 0;
-    config->scale_factor = 0.0f;
     config->show_info = false;
     config->steg_mode = false;
     config->steg_operation = NULL;
+    config->batch_source = NULL;
+    config->jobs = 0;
+    config->serve_socket = NULL;
+    config->stats = false;
+    config->stats_format = STATS_FORMAT_TEXT;
+    process_options_default(&config->process);
 
     if (argc < 2) {
         usage(argv[0]);
@@ -127,7 +179,7 @@ bool parse_arguments(int argc, char **argv, cli_config_t *config) {
             }
         } else if ((!strcmp(argv[i], "-g") || !strcmp(argv[i], "--grayscale"))) {
             if (!conflict) {
-                config->force_grayscale = true;
+                config->process.force_grayscale = true;
                 conflict = true;
             } else {
                 fprintf(stderr, "ERROR: RGB and Grayscale both cannot be set\n");
@@ -135,7 +187,7 @@ bool parse_arguments(int argc, char **argv, cli_config_t *config) {
             }
         } else if (!strcmp(argv[i], "--rgb")) {
             if (!conflict) {
-                config->force_grayscale = false;
+                config->process.force_grayscale = false;
                 conflict = true;
             } else {
                 fprintf(stderr, "ERROR: RGB and Grayscale both cannot be set\n");
@@ -144,7 +196,7 @@ bool parse_arguments(int argc, char **argv, cli_config_t *config) {
         } else if (!strcmp(argv[i], "-x") || !strcmp(argv[i], "--sobel-x")) {
             if (!conflict_kernel) {
                 conflict_kernel = true;
-                config->kernel = KERNEL_SOBEL_X;
+                config->process.kernel = KERNEL_SOBEL_X;
             } else {
                 fprintf(stderr, "ERROR: Two or more kernels chosen\n");
                 return false;
@@ -152,7 +204,7 @@ bool parse_arguments(int argc, char **argv, cli_config_t *config) {
         } else if (!strcmp(argv[i], "-y") || !strcmp(argv[i], "--sobel-y")) {
             if (!conflict_kernel) {
                 conflict_kernel = true;
-                config->kernel = KERNEL_SOBEL_Y;
+                config->process.kernel = KERNEL_SOBEL_Y;
             } else {
                 fprintf(stderr, "ERROR: Two or more kernels chosen\n");
                 return false;
@@ -160,7 +212,7 @@ bool parse_arguments(int argc, char **argv, cli_config_t *config) {
         } else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--sobel")) {
             if (!conflict_kernel) {
                 conflict_kernel = true;
-                config->kernel = KERNEL_SOBEL_COMBINED;
+                config->process.kernel = KERNEL_SOBEL_COMBINED;
             } else {
                 fprintf(stderr, "ERROR: Two or more kernels chosen\n");
                 return false;
@@ -168,9 +220,9 @@ bool parse_arguments(int argc, char **argv, cli_config_t *config) {
         } else if (!strcmp(argv[i], "--gaussian")) {
             if (!conflict_kernel) {
                 conflict_kernel = true;
-                config->kernel = KERNEL_GAUSSIAN;
+                config->process.kernel = KERNEL_GAUSSIAN;
                 if (i + 1 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9') {
-                    config->steps = (uint8_t)(strtol(argv[++i], NULL, 10));
+                    config->process.steps = (uint8_t)(strtol(argv[++i], NULL, 10));
                 }
             } else {
                 fprintf(stderr, "ERROR: Two or more kernels chosen\n");
@@ -179,9 +231,9 @@ bool parse_arguments(int argc, char **argv, cli_config_t *config) {
         } else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--blur")) {
             if (!conflict_kernel) {
                 conflict_kernel = true;
-                config->kernel = KERNEL_BLUR;
+                config->process.kernel = KERNEL_BLUR;
                 if (i + 1 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9') {
-                    config->steps = (uint8_t)(strtol(argv[++i], NULL, 10));
+                    config->process.steps = (uint8_t)(strtol(argv[++i], NULL, 10));
                 }
             } else {
                 fprintf(stderr, "ERROR: Two or more kernels chosen\n");
@@ -190,7 +242,7 @@ bool parse_arguments(int argc, char **argv, cli_config_t *config) {
         } else if (!strcmp(argv[i], "-l") || !strcmp(argv[i], "--laplacian")) {
             if (!conflict_kernel) {
                 conflict_kernel = true;
-                config->kernel = KERNEL_LAPLACIAN;
+                config->process.kernel = KERNEL_LAPLACIAN;
             } else {
                 fprintf(stderr, "ERROR: Two or more kernels chosen\n");
                 return false;
@@ -198,7 +250,7 @@ bool parse_arguments(int argc, char **argv, cli_config_t *config) {
         } else if (!strcmp(argv[i], "-sh") || !strcmp(argv[i], "--sharpen")) {
             if (!conflict_kernel) {
                 conflict_kernel = true;
-                config->kernel = KERNEL_SHARPEN;
+                config->process.kernel = KERNEL_SHARPEN;
             } else {
                 fprintf(stderr, "ERROR: Two or more kernels chosen\n");
                 return false;
@@ -206,7 +258,7 @@ bool parse_arguments(int argc, char **argv, cli_config_t *config) {
         } else if (!strcmp(argv[i], "--none")) {
             if (!conflict_kernel) {
                 conflict_kernel = true;
-                config->kernel = KERNEL_NONE;
+                config->process.kernel = KERNEL_NONE;
             } else {
                 fprintf(stderr, "ERROR: Two or more kernels chosen\n");
                 return false;
@@ -214,12 +266,13 @@ bool parse_arguments(int argc, char **argv, cli_config_t *config) {
         } else if (!strcmp(argv[i], "-u") || !strcmp(argv[i], "--upscale")) {
             if (!conflict_kernel) {
                 conflict_kernel = true;
-                config->do_upscale = true;
-                config->kernel = KERNEL_NONE;
+                config->process.do_resize = true;
+                config->process.kernel = KERNEL_NONE;
+                config->process.resize.scale = 2.0f;
                 if (i + 1 < argc && (argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9')) {
-                    config->scale_factor = strtof(argv[++i], NULL);
-                    if (config->scale_factor <= 0.0f || config->scale_factor > 15.0f) {
-                        fprintf(stderr, "ERROR: Invalid scale_factor...Must between [1.0 ~ 15.0]\n");
+                    config->process.resize.scale = strtof(argv[++i], NULL);
+                    if (config->process.resize.scale <= 0.0f || config->process.resize.scale > 15.0f) {
+                        fprintf(stderr, "ERROR: Invalid scale_factor...Must between (0 ~ 15.0]\n");
                         return false;
                     }
                 }
@@ -227,13 +280,121 @@ bool parse_arguments(int argc, char **argv, cli_config_t *config) {
                 fprintf(stderr, "ERROR: Upscale cannot be combined with other kernel.\n");
                 return false;
             }
+        } else if (!strcmp(argv[i], "--resize") || !strcmp(argv[i], "--thumbnail")) {
+            bool thumbnail = !strcmp(argv[i], "--thumbnail");
+            if (conflict_kernel) {
+                fprintf(stderr, "ERROR: %s cannot be combined with other kernel.\n", argv[i]);
+                return false;
+            }
+            conflict_kernel = true;
+            config->process.do_resize = true;
+            config->process.kernel = KERNEL_NONE;
+            if (i + 1 >= argc) {
+                fprintf(stderr, "ERROR: %s requires a size\n", argv[i]);
+                return false;
+            }
+            i++;
+            if (thumbnail) {
+                unsigned long box = strtoul(argv[i], NULL, 10);
+                if (box == 0 || box > UINT32_MAX) {
+                    fprintf(stderr, "ERROR: --thumbnail requires a box size in pixels\n");
+                    return false;
+                }
+                config->process.resize.width = config->process.resize.height = (uint32_t)box;
+                config->process.resize.fit = true;
+            } else if (!resample_parse_size(argv[i], &config->process.resize)) {
+                fprintf(stderr, "ERROR: --resize requires <W>x<H>, <W>x or x<H>\n");
+                return false;
+            }
+        } else if (!strcmp(argv[i], "--filter")) {
+            if (i + 1 >= argc || !resample_parse_filter(argv[++i], &config->process.filter)) {
+                fprintf(stderr, "ERROR: --filter requires one of box, bilinear, bicubic, lanczos3\n");
+                return false;
+            }
+        } else if (!strcmp(argv[i], "--pipeline")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "ERROR: --pipeline requires a stage list\n");
+                return false;
+            }
+            if (!pipeline_parse(argv[++i], &config->process.pipeline)) {
+                return false;
+            }
+        } else if (!strcmp(argv[i], "--fuse")) {
+            config->process.fuse = true;
+        } else if (!strcmp(argv[i], "--keep-16")) {
+            config->process.keep_16bit = true;
+        } else if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--threads")) {
+            if (i + 1 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9') {
+                config->process.threads = (uint32_t)strtoul(argv[++i], NULL, 10);
+                config->process.write_options.threads = config->process.threads;
+            } else {
+                fprintf(stderr, "ERROR: %s requires a thread count\n", argv[i]);
+                return false;
+            }
+        } else if (!strcmp(argv[i], "-z") || !strcmp(argv[i], "--zlevel")) {
+            if (i + 1 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9' && argv[i + 1][1] == '\0') {
+                config->process.write_options.level = argv[++i][0] - '0';
+            } else {
+                fprintf(stderr, "ERROR: %s requires a level between 0 and 9\n", argv[i]);
+                return false;
+            }
+        } else if (!strcmp(argv[i], "--png-filter")) {
+            if (i + 1 >= argc || !parse_filter_mode(argv[++i], &config->process.write_options)) {
+                fprintf(stderr, "ERROR: --png-filter requires one of none, sub, up, avg, paeth, minsad, brute\n");
+                return false;
+            }
+        } else if (!strcmp(argv[i], "--stats")) {
+            config->stats = true;
+            config->stats_format = STATS_FORMAT_TEXT;
+            if (i + 1 < argc && !strcmp(argv[i + 1], "json")) {
+                config->stats_format = STATS_FORMAT_JSON;
+                i++;
+            } else if (i + 1 < argc && !strcmp(argv[i + 1], "text")) {
+                i++;
+            }
+        } else if (!strcmp(argv[i], "--batch")) {
+            if (i + 1 < argc) {
+                config->batch_source = argv[++i];
+            } else {
+                fprintf(stderr, "ERROR: --batch requires a directory, glob or manifest file\n");
+                return false;
+            }
+        } else if (!strcmp(argv[i], "--serve")) {
+            if (i + 1 < argc) {
+                config->serve_socket = argv[++i];
+            } else {
+                fprintf(stderr, "ERROR: --serve requires a socket path\n");
+                return false;
+            }
+        } else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) {
+            if (i + 1 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9') {
+                config->jobs = (uint32_t)strtoul(argv[++i], NULL, 10);
+            } else {
+                fprintf(stderr, "ERROR: %s requires a job count\n", argv[i]);
+                return false;
+            }
         } else if (strstr(argv[i], ".png") != NULL && config->input_file == NULL) {
             config->input_file = argv[i];
         }
     }
 
-    // Validate input file
-    if (!config->input_file) {
+    // A pipeline spells out every stage itself
+    if (config->process.pipeline.count > 0 && (conflict || conflict_kernel)) {
+        fprintf(stderr, "ERROR: --pipeline cannot be combined with kernel, grayscale or upscale flags\n");
+        return false;
+    }
+
+    // Validate input file, batch mode names its outputs from a pattern instead
+    // and server mode takes both from every request
+    if (config->serve_socket) {
+        return true;
+    }
+    if (config->batch_source) {
+        if (!config->output_file) {
+            fprintf(stderr, "ERROR: --batch requires an output pattern (-o)\n");
+            return false;
+        }
+    } else if (!config->input_file) {
         fprintf(stderr, "ERROR: No input file specified\n");
         usage(argv[0]);
         return false;
@@ -247,30 +408,15 @@ bool parse_arguments(int argc, char **argv, cli_config_t *config) {
     }
 
     // Default steps to 1 if kernel is specified but steps is 0
-    if (config->steps == 0 && config->kernel != KERNEL_NONE) {
-        config->steps = 1;
-    }
-
-    // Suggest grayscale for edge detection
-    if ((config->kernel == KERNEL_SOBEL_X || config->kernel == KERNEL_SOBEL_Y ||
-         config->kernel == KERNEL_SOBEL_COMBINED || config->kernel == KERNEL_LAPLACIAN) &&
-        !config->force_grayscale) {
-        printf("Note: Edge detection typically works better on grayscale images.\n");
-        printf("Consider adding --grayscale flag.\n\n");
+    if (config->process.steps == 0 && config->process.kernel != KERNEL_NONE) {
+        config->process.steps = 1;
     }
 
     return true;
 }
 
 int handle_info_command(const char *filename) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        fprintf(stderr, "ERROR: Could not open file %s\n", filename);
-        return 1;
-    }
-    print_info(file, (char *)filename);
-    fclose(file);
-    return 0;
+    return print_info(filename) ? 0 : 1;
 }
 
 int handle_draw_command(const char *filename, bool color) {
@@ -298,13 +444,7 @@ int handle_steg_command(int argc, char **argv) {
             fprintf(stderr, "ERROR: Filename is not provided!\n");
             return 1;
         }
-        FILE *file = fopen(argv[3], "rb");
-        if (!file) {
-            fprintf(stderr, "ERROR: Could not open file %s\n", argv[3]);
-            return 1;
-        }
-        detect(file);
-        fclose(file);
+        detect(argv[3]);
         return 0;
     }
 
@@ -0,0 +1,632 @@
+#include "../include/convolution.h"
+#include "../include/stats.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Built once instead of on every call
+static const float kernels[7][3][3] = {
+    [KERNEL_SOBEL_X]        = {{-1, 0, 1},
+                               {-2, 0, 2},
+                               {-1, 0, 1}},
+
+    [KERNEL_SOBEL_Y]        = {{-1, -2, -1},
+                               {0, 0, 0},
+                               {1, 2, 1}},
+
+    [KERNEL_SOBEL_COMBINED] = {{0}}, // Handled as a special case
+
+    [KERNEL_GAUSSIAN]       = {{1/16.f, 2/16.f, 1/16.f},
+                               {2/16.f, 4/16.f, 2/16.f},
+                               {1/16.f, 2/16.f, 1/16.f}},
+
+    [KERNEL_BLUR]           = {{1/9.f, 1/9.f, 1/9.f},
+                               {1/9.f, 1/9.f, 1/9.f},
+                               {1/9.f, 1/9.f, 1/9.f}},
+
+    [KERNEL_LAPLACIAN]      = {{0, -1, 0},
+                               {-1, 4, -1},
+                               {0, -1, 0}},
+
+    [KERNEL_SHARPEN]        = {{0, -1, 0},
+                               {-1, 5, -1},
+                               {0, -1, 0}}
+};
+
+// Rows per band handed to one task; small enough to balance, large enough
+// that the halo rows read twice stay negligible
+#define CONVOLUTION_BAND_ROWS 64
+
+// Images narrower or shorter than this are all border and pass through
+// unchanged
+#define CONVOLUTION_MIN_SIZE 3
+
+// Border pixels and alpha pass through unchanged: copy them from the
+// source row, so every output row is written in full
+static void copy_untouched(const uint8_t *middle, uint8_t *out, uint32_t width, uint32_t channels,
+                           uint32_t colors, size_t sample_bytes) {
+    size_t pixel = channels * sample_bytes;
+    memcpy(out, middle, pixel);
+    memcpy(out + (size_t)(width - 1) * pixel, middle + (size_t)(width - 1) * pixel, pixel);
+    if (colors == channels) {
+        return;
+    }
+    size_t alpha = colors * sample_bytes;
+    for (uint32_t x = 1; x + 1 < width; x++) {
+        memcpy(out + x * pixel + alpha, middle + x * pixel + alpha, sample_bytes);
+    }
+}
+
+// One output row from the rows above, at and below it (`rows`), float path
+static void convolve_row(const uint8_t *const rows[3], uint8_t *out, uint32_t width,
+                         uint32_t channels, kernel_type type) {
+    uint32_t colors = (channels == 2 || channels == 4) ? channels - 1 : channels;
+    ptrdiff_t step = channels;
+
+    for (uint32_t x = 1; x < width - 1; x++) {
+        for (uint32_t c = 0; c < colors; c++) {
+            size_t i = (size_t)x * channels + c;
+            float gx = 0.0f, gy = 0.0f;
+
+            if (type == KERNEL_SOBEL_COMBINED) {
+                 for (int ky = -1; ky <= 1; ky++) {
+                    for (int kx = -1; kx <= 1; kx++) {
+                        uint8_t pixel = rows[ky + 1][i + kx * step];
+                        gx += pixel * kernels[KERNEL_SOBEL_X][ky + 1][kx + 1];
+                        gy += pixel * kernels[KERNEL_SOBEL_Y][ky + 1][kx + 1];
+                    }
+                }
+                float magnitude = sqrtf(gx * gx + gy * gy);
+                out[i] = (magnitude > 255.0f) ? 255 : (uint8_t)magnitude;
+            } else {
+                float sum = 0.0f;
+                for (int ky = -1; ky <= 1; ky++) {
+                    for (int kx = -1; kx <= 1; kx++) {
+                        sum += rows[ky + 1][i + kx * step] * kernels[type][ky + 1][kx + 1];
+                    }
+                }
+
+                // FIX: For Sobel X/Y, take the absolute value to see all edges.
+                if (type == KERNEL_SOBEL_X || type == KERNEL_SOBEL_Y) {
+                    sum = fabsf(sum);
+                }
+
+                // Clamp the result to the valid 0-255 range
+                if (sum < 0.0f) sum = 0.0f;
+                if (sum > 255.0f) sum = 255.0f;
+                out[i] = (uint8_t)sum;
+            }
+        }
+    }
+    copy_untouched(rows[1], out, width, channels, colors, 1);
+}
+
+// convolve_row() for 16-bit samples, clamped to 0-65535
+static void convolve_row16(const uint8_t *const row_bytes[3], uint8_t *out_bytes, uint32_t width,
+                           uint32_t channels, kernel_type type) {
+    uint32_t colors = (channels == 2 || channels == 4) ? channels - 1 : channels;
+    ptrdiff_t step = channels;
+    const uint16_t *rows[3] = {
+        (const uint16_t *)row_bytes[0],
+        (const uint16_t *)row_bytes[1],
+        (const uint16_t *)row_bytes[2]
+    };
+    uint16_t *out = (uint16_t *)out_bytes;
+
+    for (uint32_t x = 1; x < width - 1; x++) {
+        for (uint32_t c = 0; c < colors; c++) {
+            size_t i = (size_t)x * channels + c;
+            float sum = 0.0f;
+
+            if (type == KERNEL_SOBEL_COMBINED) {
+                float gx = 0.0f, gy = 0.0f;
+                for (int ky = -1; ky <= 1; ky++) {
+                    for (int kx = -1; kx <= 1; kx++) {
+                        uint16_t pixel = rows[ky + 1][i + kx * step];
+                        gx += pixel * kernels[KERNEL_SOBEL_X][ky + 1][kx + 1];
+                        gy += pixel * kernels[KERNEL_SOBEL_Y][ky + 1][kx + 1];
+                    }
+                }
+                sum = sqrtf(gx * gx + gy * gy);
+            } else {
+                for (int ky = -1; ky <= 1; ky++) {
+                    for (int kx = -1; kx <= 1; kx++) {
+                        sum += rows[ky + 1][i + kx * step] * kernels[type][ky + 1][kx + 1];
+                    }
+                }
+                if (type == KERNEL_SOBEL_X || type == KERNEL_SOBEL_Y) {
+                    sum = fabsf(sum);
+                }
+            }
+
+            if (sum < 0.0f) sum = 0.0f;
+            if (sum > 65535.0f) sum = 65535.0f;
+            out[i] = (uint16_t)sum;
+        }
+    }
+    copy_untouched(row_bytes[1], out_bytes, width, channels, colors, 2);
+}
+
+bool convolution_is_separable(kernel_type type) {
+    return type == KERNEL_GAUSSIAN || type == KERNEL_BLUR;
+}
+
+// Both separable kernels are [1 c 1] x [1 c 1]: c = 2 for the Gaussian (sum
+// / 16), c = 1 for the box blur (sum / 9). The 2-D sum peaks at 16 * 255 and
+// 9 * 255, so 16-bit lanes hold every intermediate
+#define BOX_DIVIDE_MAGIC 7282 // (s + 4) * 7282 >> 16 == round(s / 9) for s <= 9 * 255
+
+static inline uint8_t separable_round(uint32_t sum, kernel_type type) {
+    return (type == KERNEL_GAUSSIAN) ? (uint8_t)((sum + 8) >> 4) : (uint8_t)((sum + 4) / 9);
+}
+
+#ifdef __SSE2__
+static inline __m128i separable_round_epi16(__m128i sum, kernel_type type) {
+    if (type == KERNEL_GAUSSIAN) {
+        return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(8)), 4);
+    }
+    return _mm_mulhi_epu16(_mm_add_epi16(sum, _mm_set1_epi16(4)), _mm_set1_epi16(BOX_DIVIDE_MAGIC));
+}
+#endif
+
+// Vertical pass into `column`, then horizontal pass with rounding into the
+// output row. `column` holds one row of 16-bit vertical sums for all bytes,
+// alpha included; alpha results are discarded and the source byte kept
+static void convolve_separable_row(const uint8_t *const rows[3], uint8_t *out, uint32_t width,
+                                   uint32_t channels, kernel_type type, uint16_t *column) {
+    size_t row_bytes = (size_t)width * channels;
+    size_t colors = (channels == 2 || channels == 4) ? channels - 1 : channels;
+    int shift = (type == KERNEL_GAUSSIAN) ? 1 : 0;
+    const uint8_t *above = rows[0];
+    const uint8_t *middle = rows[1];
+    const uint8_t *below = rows[2];
+    size_t x = 0;
+
+#ifdef __SSE2__
+    // Alpha byte positions, vectors start on a pixel boundary
+    __m128i alpha = _mm_setzero_si128();
+    if (channels == 2) {
+        alpha = _mm_set1_epi16((short)0xFF00);
+    } else if (channels == 4) {
+        alpha = _mm_set1_epi32((int)0xFF000000);
+    }
+
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 16 <= row_bytes; x += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(above + x));
+        __m128i b = _mm_loadu_si128((const __m128i *)(middle + x));
+        __m128i c = _mm_loadu_si128((const __m128i *)(below + x));
+        __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(c, zero));
+        __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(c, zero));
+        lo = _mm_add_epi16(lo, _mm_slli_epi16(_mm_unpacklo_epi8(b, zero), shift));
+        hi = _mm_add_epi16(hi, _mm_slli_epi16(_mm_unpackhi_epi8(b, zero), shift));
+        _mm_storeu_si128((__m128i *)(column + x), lo);
+        _mm_storeu_si128((__m128i *)(column + x + 8), hi);
+    }
+#endif
+    for (; x < row_bytes; x++) {
+        column[x] = (uint16_t)(above[x] + (middle[x] << shift) + below[x]);
+    }
+
+    // Horizontal neighbours are one pixel apart
+    x = channels;
+#ifdef __SSE2__
+    for (; x + 16 + channels <= row_bytes; x += 16) {
+        __m128i sum[2];
+        for (int half = 0; half < 2; half++) {
+            const uint16_t *v = column + x + half * 8;
+            __m128i left = _mm_loadu_si128((const __m128i *)(v - channels));
+            __m128i center = _mm_loadu_si128((const __m128i *)v);
+            __m128i right = _mm_loadu_si128((const __m128i *)(v + channels));
+            sum[half] = _mm_add_epi16(_mm_add_epi16(left, right), _mm_slli_epi16(center, shift));
+            sum[half] = separable_round_epi16(sum[half], type);
+        }
+        __m128i result = _mm_packus_epi16(sum[0], sum[1]);
+        if (colors != channels) {
+            __m128i original = _mm_loadu_si128((const __m128i *)(middle + x));
+            result = _mm_or_si128(_mm_andnot_si128(alpha, result), _mm_and_si128(alpha, original));
+        }
+        _mm_storeu_si128((__m128i *)(out + x), result);
+    }
+#endif
+    for (; x < row_bytes - channels; x++) {
+        if (x % channels == colors) {
+            out[x] = middle[x]; // alpha
+            continue;
+        }
+        uint32_t sum = column[x - channels] + (column[x] << shift) + column[x + channels];
+        out[x] = separable_round(sum, type);
+    }
+    memcpy(out, middle, channels);
+    memcpy(out + row_bytes - channels, middle + row_bytes - channels, channels);
+}
+
+// How one band computes its rows: the kernel, and the scratch the
+// separable path and in-place filtering need
+typedef struct {
+    kernel_type type;
+    uint32_t width;
+    uint32_t channels;
+    uint32_t bit_depth;
+    uint16_t *column;       // separable sums, NULL to take the float path
+    uint8_t *ring;          // in place: two saved source rows, NULL otherwise
+} row_context_t;
+
+static void convolve_any_row(const row_context_t *ctx, const uint8_t *const rows[3], uint8_t *out) {
+    if (ctx->bit_depth == 16) {
+        convolve_row16(rows, out, ctx->width, ctx->channels, ctx->type);
+    } else if (ctx->column) {
+        convolve_separable_row(rows, out, ctx->width, ctx->channels, ctx->type, ctx->column);
+    } else {
+        convolve_row(rows, out, ctx->width, ctx->channels, ctx->type);
+    }
+}
+
+/**
+ * Convolves rows [y_begin, y_end) of the interior from `input` into `output`.
+ * `top` and `bottom` are the source rows just above and below the band.
+ *
+ * In place (`ctx->ring` set, input == output) each row is saved to the ring
+ * before it is overwritten, so the rows above and at the current one are
+ * read from the ring and the one below is still untouched in the image.
+ * Only the band's last row reads `bottom`, which the band below may already
+ * have overwritten, so the caller passes a saved copy.
+ */
+static void convolve_band(const row_context_t *ctx, const image_t *input, image_t *output,
+                          uint32_t y_begin, uint32_t y_end, const uint8_t *top, const uint8_t *bottom) {
+    size_t row_bytes = image_row_bytes(input);
+    const uint8_t *above = top;
+    for (uint32_t y = y_begin; y < y_end; y++) {
+        const uint8_t *middle = image_row(input, y);
+        if (ctx->ring) {
+            uint8_t *saved = ctx->ring + (y & 1) * row_bytes;
+            memcpy(saved, middle, row_bytes);
+            middle = saved;
+        }
+        const uint8_t *rows[3] = {above, middle, (y + 1 == y_end) ? bottom : image_row(input, y + 1)};
+        convolve_any_row(ctx, rows, image_row(output, y));
+        above = middle;
+    }
+}
+
+// True if `image` filtered with `type` takes the integer path, which needs
+// a row of sums
+static bool uses_column_sums(const image_t *image, kernel_type type) {
+    return image->bit_depth == 8 && convolution_is_separable(type);
+}
+
+// Bytes of a row of 16-bit sums, rounded up to keep per-band rows aligned
+static size_t column_sums_size(const image_t *image) {
+    size_t row_bytes = (image_row_bytes(image) + IMAGE_ALIGNMENT - 1) & ~(size_t)(IMAGE_ALIGNMENT - 1);
+    return 2 * row_bytes;
+}
+
+// Out of place over rows [y_begin, y_end), reading straight from `input`.
+// `column` is a row of sums for the integer path, NULL for the float path
+static void convolve_rows(const image_t *input, image_t *output, kernel_type type,
+                          uint32_t y_begin, uint32_t y_end, uint16_t *column) {
+    row_context_t ctx = {type, input->width, input->channels, input->bit_depth, column, NULL};
+    convolve_band(&ctx, input, output, y_begin, y_end, image_row(input, y_begin - 1), image_row(input, y_end));
+}
+
+typedef struct {
+    const image_t *input;
+    image_t *output;
+    kernel_type type;
+    uint32_t band_rows;
+    uint8_t *scratch;       // per band: in place, the saved rows above and below it, the ring and sums;
+                            // out of place, the sums only (NULL on the float path)
+    size_t scratch_size;
+} convolution_job_t;
+
+// Bytes of in-place scratch per band: two saved halo rows, the two ring
+// rows and a row of 16-bit sums
+static size_t in_place_scratch_size(const image_t *image) {
+    return 3 * column_sums_size(image);
+}
+
+static void convolution_band(void *arg, uint32_t index) {
+    convolution_job_t *job = arg;
+    uint32_t last = job->input->height - 1;
+
+    uint32_t y_begin = 1 + index * job->band_rows;
+    uint32_t y_end = y_begin + job->band_rows;
+    if (y_end > last) {
+        y_end = last;
+    }
+    if (job->input != job->output) {
+        uint16_t *column = job->scratch ? (uint16_t *)(job->scratch + index * job->scratch_size) : NULL;
+        convolve_rows(job->input, job->output, job->type, y_begin, y_end, column);
+        return;
+    }
+
+    const image_t *image = job->input;
+    size_t row_bytes = job->scratch_size / 6;
+    uint8_t *scratch = job->scratch + index * job->scratch_size;
+    row_context_t ctx = {
+        .type = job->type,
+        .width = image->width,
+        .channels = image->channels,
+        .bit_depth = image->bit_depth,
+        .column = uses_column_sums(image, job->type) ? (uint16_t *)(scratch + 4 * row_bytes) : NULL,
+        .ring = scratch + 2 * row_bytes,
+    };
+    convolve_band(&ctx, image, job->output, y_begin, y_end, scratch, scratch + row_bytes);
+}
+
+// Bands for `rows` interior rows on up to `threads` threads. The shared
+// pool never runs more than one task per core at once. Below that, exactly
+// `threads` bands cap the parallelism; otherwise fixed-size bands keep the
+// cores balanced
+static uint32_t band_rows_for(uint32_t rows, uint32_t threads) {
+    uint32_t band_rows = CONVOLUTION_BAND_ROWS;
+    if (threads < thread_pool_size(thread_pool_shared()) + 1 || rows / band_rows < threads) {
+        band_rows = (rows + threads - 1) / threads;
+    }
+    return band_rows;
+}
+
+static bool convolve_image(const image_t *input, image_t *output, kernel_type type, uint32_t threads) {
+    if (!input || !output || input == output || input->bit_depth != output->bit_depth ||
+        input->width != output->width || input->height != output->height ||
+        input->channels != output->channels) {
+        fprintf(stderr, "ERROR: Invalid parameters for convolution\n");
+        return false;
+    }
+    if (type == KERNEL_NONE || input->width < CONVOLUTION_MIN_SIZE || input->height < CONVOLUTION_MIN_SIZE) {
+        image_copy(output, input);
+        return true;
+    }
+
+    uint32_t interior = input->height - 2;
+    threads = thread_count_resolve(threads);
+    uint32_t band_rows = (threads == 1) ? interior : band_rows_for(interior, threads);
+    uint32_t bands = (interior + band_rows - 1) / band_rows;
+    convolution_job_t job = {
+        .input = input,
+        .output = output,
+        .type = type,
+        .band_rows = band_rows,
+    };
+
+    // Every band's sums are allocated before any row is written, so the
+    // whole image takes the same path whatever the thread count
+    if (uses_column_sums(input, type)) {
+        job.scratch_size = column_sums_size(input);
+        job.scratch = aligned_alloc(IMAGE_ALIGNMENT, bands * job.scratch_size);
+        if (!job.scratch) {
+            fprintf(stderr, "ERROR: Could not allocate memory for convolution\n");
+            return false;
+        }
+    }
+
+    // Only the top and bottom rows are copied here, the row kernels copy
+    // the left and right pixels and alpha themselves
+    size_t row_bytes = image_row_bytes(input);
+    memcpy(image_row(output, 0), image_row(input, 0), row_bytes);
+    memcpy(image_row(output, input->height - 1), image_row(input, input->height - 1), row_bytes);
+
+    if (bands == 1) {
+        convolution_band(&job, 0);
+    } else {
+        thread_pool_run(thread_pool_shared(), bands, convolution_band, &job);
+    }
+    free(job.scratch);
+    return true;
+}
+
+static bool convolve_in_place(image_t *image, kernel_type type, uint32_t threads) {
+    if (!image) {
+        fprintf(stderr, "ERROR: Invalid parameters for convolution\n");
+        return false;
+    }
+    if (type == KERNEL_NONE || image->width < CONVOLUTION_MIN_SIZE || image->height < CONVOLUTION_MIN_SIZE) {
+        return true;
+    }
+
+    // One band per thread, so the scratch stays a few rows per thread
+    uint32_t interior = image->height - 2;
+    threads = thread_count_resolve(threads);
+    if (threads > interior) {
+        threads = interior;
+    }
+    uint32_t band_rows = (interior + threads - 1) / threads;
+    uint32_t bands = (interior + band_rows - 1) / band_rows;
+
+    convolution_job_t job = {
+        .input = image,
+        .output = image,
+        .type = type,
+        .band_rows = band_rows,
+        .scratch_size = in_place_scratch_size(image),
+    };
+    job.scratch = aligned_alloc(IMAGE_ALIGNMENT, bands * job.scratch_size);
+    if (!job.scratch) {
+        fprintf(stderr, "ERROR: Could not allocate memory for convolution\n");
+        return false;
+    }
+
+    // Every band's outside rows are saved before any band overwrites them
+    size_t row_bytes = image_row_bytes(image);
+    for (uint32_t i = 0; i < bands; i++) {
+        uint32_t y_begin = 1 + i * band_rows;
+        uint32_t y_end = (y_begin + band_rows < image->height - 1) ? y_begin + band_rows : image->height - 1;
+        uint8_t *scratch = job.scratch + i * job.scratch_size;
+        memcpy(scratch, image_row(image, y_begin - 1), row_bytes);
+        memcpy(scratch + job.scratch_size / 6, image_row(image, y_end), row_bytes);
+    }
+
+    if (bands == 1) {
+        convolution_band(&job, 0);
+    } else {
+        thread_pool_run(thread_pool_shared(), bands, convolution_band, &job);
+    }
+    free(job.scratch);
+    return true;
+}
+
+typedef struct {
+    const image_t *input;
+    image_t *output;
+    kernel_type type;
+    uint32_t band_rows;
+    bool *failed;           // one flag per band, set when its scratch allocation fails
+} gray_convolution_job_t;
+
+// Gray rows [first, end) of `input` into `gray`, then output rows
+// [y_begin, y_end) from them. `gray` covers the chunk plus its halo rows
+static void convolve_gray_chunk(const image_t *input, image_t *output, image_t *gray, kernel_type type,
+                                uint16_t *column, uint32_t y_begin, uint32_t y_end) {
+    uint32_t height = input->height;
+    uint32_t first = (y_begin > 0) ? y_begin - 1 : 0;
+    uint32_t end = (y_end < height) ? y_end + 1 : height;
+
+    // Views of the chunk's rows of both images, starting at `first`, so the
+    // convolution indexes them alike
+    image_t local = *gray;
+    local.height = end - first;
+    image_t window = {
+        .data = image_row(output, first),
+        .stride = output->stride,
+        .width = output->width,
+        .height = end - first,
+        .channels = output->channels,
+        .bit_depth = 8,
+    };
+
+    for (uint32_t y = first; y < end; y++) {
+        image_gray_alpha_row(image_row(input, y), image_row(&local, y - first), input->width,
+                             input->channels, 8);
+    }
+
+    uint32_t interior_begin = (y_begin > 1) ? y_begin : 1;
+    uint32_t interior_end = (y_end < height - 1) ? y_end : height - 1;
+    bool convolve = type != KERNEL_NONE && input->width >= CONVOLUTION_MIN_SIZE;
+
+    // The kernel writes whole interior rows, only the border rows are copied
+    for (uint32_t y = y_begin; y < y_end; y++) {
+        if (!convolve || y < interior_begin || y >= interior_end) {
+            memcpy(image_row(&window, y - first), image_row(&local, y - first), image_row_bytes(&local));
+        }
+    }
+
+    if (convolve && interior_begin < interior_end) {
+        convolve_rows(&local, &window, type, interior_begin - first, interior_end - first, column);
+    }
+}
+
+// Output rows [y_begin, y_end) of a grayscale-then-convolve, worked through
+// in chunks whose gray rows, halo included, fit a small scratch image that
+// stays in cache, so the full-size gray intermediate never exists
+static bool convolve_gray_band(const image_t *input, image_t *output, kernel_type type,
+                               uint32_t y_begin, uint32_t y_end) {
+    uint32_t chunk = (y_end - y_begin < CONVOLUTION_BAND_ROWS) ? y_end - y_begin : CONVOLUTION_BAND_ROWS;
+    image_t *gray = image_create(input->width, chunk + 2, output->channels);
+    uint16_t *column = uses_column_sums(output, type) ? malloc(column_sums_size(output)) : NULL;
+    if (!gray || (!column && uses_column_sums(output, type))) {
+        image_free(gray);
+        return false;
+    }
+    for (uint32_t y = y_begin; y < y_end; y += chunk) {
+        uint32_t chunk_end = (y_end - y < chunk) ? y_end : y + chunk;
+        convolve_gray_chunk(input, output, gray, type, column, y, chunk_end);
+    }
+    free(column);
+    image_free(gray);
+    return true;
+}
+
+static void gray_convolution_band(void *arg, uint32_t index) {
+    gray_convolution_job_t *job = arg;
+    uint32_t y_begin = index * job->band_rows;
+    uint32_t y_end = y_begin + job->band_rows;
+    if (y_end > job->input->height) {
+        y_end = job->input->height;
+    }
+    if (!convolve_gray_band(job->input, job->output, job->type, y_begin, y_end)) {
+        job->failed[index] = true;
+    }
+}
+
+static bool convolve_gray_image(const image_t *input, image_t *output, kernel_type type, uint32_t threads) {
+    if (!input || !output || output->channels != image_gray_channels(input->channels) ||
+        output->width != input->width || output->height != input->height ||
+        input->bit_depth != 8 || output->bit_depth != 8) {
+        fprintf(stderr, "ERROR: Invalid parameters for convolution\n");
+        return false;
+    }
+
+    // Bands as in apply_convolution(), here over all rows since the border
+    // rows need their gray conversion too
+    uint32_t height = input->height;
+    threads = thread_count_resolve(threads);
+    thread_pool_t *pool = (threads > 1) ? thread_pool_shared() : NULL;
+    uint32_t band_rows = CONVOLUTION_BAND_ROWS;
+    if (!pool || threads < thread_pool_size(pool) + 1 || height / band_rows < threads) {
+        band_rows = (height + threads - 1) / threads;
+    }
+    uint32_t bands = (height + band_rows - 1) / band_rows;
+
+    bool *failed = calloc(bands, sizeof(bool));
+    if (!failed) {
+        fprintf(stderr, "ERROR: Could not allocate memory for convolution\n");
+        return false;
+    }
+    gray_convolution_job_t job = {
+        .input = input,
+        .output = output,
+        .type = type,
+        .band_rows = band_rows,
+        .failed = failed,
+    };
+
+    if (pool) {
+        thread_pool_run(pool, bands, gray_convolution_band, &job);
+    } else {
+        gray_convolution_band(&job, 0);
+    }
+
+    bool ok = true;
+    for (uint32_t i = 0; i < bands; i++) {
+        ok = ok && !failed[i];
+    }
+    free(failed);
+    if (!ok) {
+        fprintf(stderr, "ERROR: Could not allocate memory for convolution\n");
+    }
+    return ok;
+}
+
+bool apply_convolution(const image_t *input, image_t *output, kernel_type type, uint32_t threads) {
+    uint64_t start = stats_begin();
+    bool ok = convolve_image(input, output, type, threads);
+    stats_end(STATS_CONVOLVE, start, ok ? image_row_bytes(output) * output->height : 0);
+    return ok;
+}
+
+bool apply_convolution_gray(const image_t *input, image_t *output, kernel_type type, uint32_t threads) {
+    uint64_t start = stats_begin();
+    bool ok = convolve_gray_image(input, output, type, threads);
+    stats_end(STATS_CONVOLVE, start, ok ? image_row_bytes(input) * input->height : 0);
+    return ok;
+}
+
+bool apply_convolution_in_place(image_t *image, kernel_type type, uint32_t threads) {
+    uint64_t start = stats_begin();
+    bool ok = convolve_in_place(image, type, threads);
+    stats_end(STATS_CONVOLVE, start, ok ? image_row_bytes(image) * image->height : 0);
+    return ok;
+}
+
+void apply_convolution_reference(const image_t *input, image_t *output, kernel_type type) {
+    if (!input || !output || input->height < 3 || input->width < 3) {
+        fprintf(stderr, "ERROR: Invalid parameters for convolution\n");
+        return;
+    }
+
+    image_copy(output, input);
+    if (type != KERNEL_NONE) {
+        convolve_rows(input, output, type, 1, input->height - 1, NULL);
+    }
+}
@@ -0,0 +1,151 @@
+#include "../include/crc32.h"
+
+#include <string.h>
+#include <pthread.h>
+
+// Folding kernel is compiled in regardless of -march and picked at runtime
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+// Reflected polynomial of CRC-32
+#define CRC32_POLY 0xedb88320u
+
+// crc_tables[0] is the classic table from the PNG spec appendix
+// (https://www.libpng.org/pub/png/spec/1.2/PNG-CRCAppendix.html),
+// crc_tables[k] advances a byte through k further zero bytes
+static uint32_t crc_tables[8][256];
+static pthread_once_t crc_tables_once = PTHREAD_ONCE_INIT;
+
+static void make_crc_tables(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? CRC32_POLY ^ (c >> 1) : c >> 1;
+        }
+        crc_tables[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t c = crc_tables[k - 1][n];
+            crc_tables[k][n] = (c >> 8) ^ crc_tables[0][c & 0xff];
+        }
+    }
+}
+
+uint32_t crc32_update_bytewise(uint32_t state, const void *data, size_t length) {
+    pthread_once(&crc_tables_once, make_crc_tables);
+
+    const uint8_t *p = data;
+    for (size_t i = 0; i < length; i++) {
+        state = crc_tables[0][(state ^ p[i]) & 0xff] ^ (state >> 8);
+    }
+    return state;
+}
+
+uint32_t crc32_update_slice8(uint32_t state, const void *data, size_t length) {
+    pthread_once(&crc_tables_once, make_crc_tables);
+
+    const uint8_t *p = data;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Eight bytes per step: the low word absorbs the state, every byte
+    // then goes through the table matching its distance from the end
+    for (; length >= 8; p += 8, length -= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= state;
+        state = crc_tables[7][lo & 0xff] ^ crc_tables[6][(lo >> 8) & 0xff] ^
+                crc_tables[5][(lo >> 16) & 0xff] ^ crc_tables[4][lo >> 24] ^
+                crc_tables[3][hi & 0xff] ^ crc_tables[2][(hi >> 8) & 0xff] ^
+                crc_tables[1][(hi >> 16) & 0xff] ^ crc_tables[0][hi >> 24];
+    }
+#endif
+    for (; length > 0; p++, length--) {
+        state = crc_tables[0][(state ^ *p) & 0xff] ^ (state >> 8);
+    }
+    return state;
+}
+
+#ifdef CRC32_X86_DISPATCH
+// Below this the setup and the final reduction cost more than the tables
+#define CRC32_FOLD_MIN 64
+
+// Carry-less multiply folding after Gopal et al., "Fast CRC Computation for
+// Generic Polynomials Using PCLMULQDQ Instruction" (Intel, 2009). Four
+// 128-bit lanes are folded 64 bytes at a time, merged into one, then
+// reduced to 32 bits with a Barrett step. Consumes a multiple of 16 bytes,
+// at least CRC32_FOLD_MIN; the caller finishes the tail.
+// Constants are x^k mod P in the bit-reflected domain
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_fold_pclmul(uint32_t state, const uint8_t *p, size_t length) {
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)state));
+    p += 64;
+    length -= 64;
+
+    for (; length >= 64; p += 64, length -= 64) {
+        __m128i l1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i l2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i l3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i l4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, l1), _mm_loadu_si128((const __m128i *)(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, l2), _mm_loadu_si128((const __m128i *)(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, l3), _mm_loadu_si128((const __m128i *)(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, l4), _mm_loadu_si128((const __m128i *)(p + 0x30)));
+    }
+
+    // Fold the four lanes into one, then any remaining 16-byte blocks
+    __m128i next[3] = {x2, x3, x4};
+    for (int i = 0; i < 3; i++) {
+        __m128i lo = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, lo), next[i]);
+    }
+    for (; length >= 16; p += 16, length -= 16) {
+        __m128i lo = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, lo), _mm_loadu_si128((const __m128i *)p));
+    }
+
+    // 128 -> 64 bits
+    __m128i t = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), t);
+    t = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, low32), k5, 0x00);
+    x1 = _mm_xor_si128(x1, t);
+
+    // Barrett reduction to 32 bits
+    t = _mm_clmulepi64_si128(_mm_and_si128(x1, low32), poly, 0x10);
+    t = _mm_clmulepi64_si128(_mm_and_si128(t, low32), poly, 0x00);
+    x1 = _mm_xor_si128(x1, t);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+#endif
+
+uint32_t crc32_update(uint32_t state, const void *data, size_t length) {
+#ifdef CRC32_X86_DISPATCH
+    // Runtime check, the binary itself only assumes SSE2
+    if (length >= CRC32_FOLD_MIN && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        size_t folded = length & ~(size_t)15;
+        state = crc32_fold_pclmul(state, data, folded);
+        data = (const uint8_t *)data + folded;
+        length -= folded;
+    }
+#endif
+    return crc32_update_slice8(state, data, length);
+}
@@ -0,0 +1,466 @@
+#include "../include/filters.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// AVX2 kernels are compiled in regardless of -march and picked at runtime
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FILTERS_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+// source: https://www.libpng.org/pub/png/spec/1.2/PNG-Filters.html
+static inline uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+    int p = (int)a + (int)b - (int)c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+
+    if (pa <= pb && pa <= pc) {
+        return a;
+    } else if (pb <= pc) {
+        return b;
+    }
+    return c;
+}
+
+#ifdef __SSE2__
+static inline __m128i abs_epi16(__m128i x) {
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+// Select mask ? x : y
+static inline __m128i select_si128(__m128i mask, __m128i x, __m128i y) {
+    return _mm_or_si128(_mm_and_si128(mask, x), _mm_andnot_si128(mask, y));
+}
+
+// Paeth predictor for eight 16-bit lanes
+static inline __m128i paeth_epi16(__m128i a, __m128i b, __m128i c) {
+    __m128i pa = abs_epi16(_mm_sub_epi16(b, c));                            // |p - a|
+    __m128i pb = abs_epi16(_mm_sub_epi16(a, c));                            // |p - b|
+    __m128i pc = abs_epi16(_mm_add_epi16(_mm_sub_epi16(a, c),
+                                         _mm_sub_epi16(b, c)));             // |p - c|
+
+    __m128i not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+    __m128i not_b = _mm_cmpgt_epi16(pb, pc);
+    return select_si128(not_a, select_si128(not_b, c, b), a);
+}
+
+// Paeth predictor for 16 bytes
+static inline __m128i paeth_epi8(__m128i a, __m128i b, __m128i c) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = paeth_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+    __m128i hi = paeth_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+    return _mm_packus_epi16(lo, hi);
+}
+
+// floor((a + b) / 2) per byte; _mm_avg_epu8 rounds up so take the carry back off
+static inline __m128i avg_floor_epu8(__m128i a, __m128i b) {
+    __m128i odd = _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1));
+    return _mm_sub_epi8(_mm_avg_epu8(a, b), odd);
+}
+#endif
+
+void filter_scanline(uint8_t *out, const uint8_t *current, const uint8_t *previous,
+                     uint32_t length, uint32_t bpp, uint8_t filter_type) {
+    uint32_t head = (bpp < length) ? bpp : length;
+    uint32_t i = 0;
+
+    switch (filter_type) {
+        case FILTER_NONE:
+            memcpy(out, current, length);
+            return;
+
+        case FILTER_SUB:
+            // Filt(x) = Orig(x) - Orig(a)
+            memcpy(out, current, head);
+            i = head;
+#ifdef __SSE2__
+            for (; i + 16 <= length; i += 16) {
+                __m128i x = _mm_loadu_si128((const __m128i *)(current + i));
+                __m128i a = _mm_loadu_si128((const __m128i *)(current + i - bpp));
+                _mm_storeu_si128((__m128i *)(out + i), _mm_sub_epi8(x, a));
+            }
+#endif
+            for (; i < length; i++) {
+                out[i] = current[i] - current[i - bpp];
+            }
+            return;
+
+        case FILTER_UP:
+            // Filt(x) = Orig(x) - Orig(b)
+#ifdef __SSE2__
+            for (; i + 16 <= length; i += 16) {
+                __m128i x = _mm_loadu_si128((const __m128i *)(current + i));
+                __m128i b = _mm_loadu_si128((const __m128i *)(previous + i));
+                _mm_storeu_si128((__m128i *)(out + i), _mm_sub_epi8(x, b));
+            }
+#endif
+            for (; i < length; i++) {
+                out[i] = current[i] - previous[i];
+            }
+            return;
+
+        case FILTER_AVG:
+            // Filt(x) = Orig(x) - floor((Orig(a) + Orig(b)) / 2)
+            for (; i < head; i++) {
+                out[i] = current[i] - (previous[i] >> 1);
+            }
+#ifdef __SSE2__
+            for (; i + 16 <= length; i += 16) {
+                __m128i x = _mm_loadu_si128((const __m128i *)(current + i));
+                __m128i a = _mm_loadu_si128((const __m128i *)(current + i - bpp));
+                __m128i b = _mm_loadu_si128((const __m128i *)(previous + i));
+                _mm_storeu_si128((__m128i *)(out + i), _mm_sub_epi8(x, avg_floor_epu8(a, b)));
+            }
+#endif
+            for (; i < length; i++) {
+                out[i] = current[i] - ((current[i - bpp] + previous[i]) >> 1);
+            }
+            return;
+
+        case FILTER_PAETH:
+            // Filt(x) = Orig(x) - PaethPredictor(Orig(a), Orig(b), Orig(c))
+            for (; i < head; i++) {
+                out[i] = current[i] - previous[i]; // a = c = 0 picks b
+            }
+#ifdef __SSE2__
+            for (; i + 16 <= length; i += 16) {
+                __m128i x = _mm_loadu_si128((const __m128i *)(current + i));
+                __m128i a = _mm_loadu_si128((const __m128i *)(current + i - bpp));
+                __m128i b = _mm_loadu_si128((const __m128i *)(previous + i));
+                __m128i c = _mm_loadu_si128((const __m128i *)(previous + i - bpp));
+                _mm_storeu_si128((__m128i *)(out + i), _mm_sub_epi8(x, paeth_epi8(a, b, c)));
+            }
+#endif
+            for (; i < length; i++) {
+                out[i] = current[i] - paeth(current[i - bpp], previous[i], previous[i - bpp]);
+            }
+            return;
+    }
+}
+
+uint64_t filter_cost_sad(const uint8_t *filtered, uint32_t length) {
+    uint64_t sum = 0;
+    uint32_t i = 0;
+
+#ifdef __SSE2__
+    // |(int8_t)x| is min(x, -x) when both are read as unsigned
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (; i + 16 <= length; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(filtered + i));
+        __m128i mag = _mm_min_epu8(x, _mm_sub_epi8(zero, x));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(mag, zero));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    sum = lanes[0] + lanes[1];
+#endif
+
+    for (; i < length; i++) {
+        int8_t v = (int8_t)filtered[i];
+        sum += (v < 0) ? -v : v;
+    }
+    return sum;
+}
+
+/* ---------------------------------------------------------------------------
+ * Unfiltering (decode side)
+ * ------------------------------------------------------------------------- */
+
+void unfilter_scanline_scalar(uint8_t *current, const uint8_t *previous, uint32_t length, uint32_t bpp, uint8_t filter_type) {
+    // NOTE: bpp is bytes per pixel, not bits.
+    // It's the offset to the corresponding pixel on the left.
+    switch (filter_type) {
+        case FILTER_NONE:
+            break;
+
+        case FILTER_SUB:
+            for (uint32_t i = bpp; i < length; i++) {
+                // Recon(x) = Filt(x) + Recon(a)
+                current[i] += current[i - bpp];
+            }
+            break;
+
+        case FILTER_UP:
+            if (previous) {
+                for (uint32_t i = 0; i < length; i++) {
+                    // Recon(x) = Filt(x) + Recon(b)
+                    current[i] += previous[i];
+                }
+            }
+            break;
+
+        case FILTER_AVG:
+            for (uint32_t i = 0; i < length; i++) {
+                uint8_t left = (i >= bpp) ? current[i - bpp] : 0;
+                uint8_t up = previous ? previous[i] : 0;
+                // Recon(x) = Filt(x) + floor((Recon(a) + Recon(b)) / 2)
+                current[i] += (left + up) / 2;
+            }
+            break;
+
+        case FILTER_PAETH:
+            for (uint32_t i = 0; i < length; i++) {
+                uint8_t left = (i >= bpp) ? current[i - bpp] : 0;
+                uint8_t up = previous ? previous[i] : 0;
+                uint8_t up_left = (previous && i >= bpp) ? previous[i - bpp] : 0;
+                // Recon(x) = Filt(x) + PaethPredictor(Recon(a), Recon(b), Recon(c))
+                current[i] += paeth(left, up, up_left);
+            }
+            break;
+    }
+}
+
+// Branch-free Paeth for the scalar small-bpp paths
+static inline uint8_t paeth_branchless(int a, int b, int c) {
+    int pa = abs(b - c);
+    int pb = abs(a - c);
+    int pc = abs(a + b - 2 * c);
+    int use_b = (pb < pa) & (pb <= pc);
+    int use_c = (pc < pa) & (pc < pb);
+    return (uint8_t)(use_c ? c : (use_b ? b : a));
+}
+
+// The bpp argument is a compile-time constant at every call site, so these
+// inline into one tight loop per pixel size
+static inline __attribute__((always_inline)) void unfilter_avg_small(uint8_t *current, const uint8_t *previous, uint32_t length, uint32_t bpp) {
+    for (uint32_t i = 0; i < bpp; i++) {
+        current[i] += previous[i] >> 1;
+    }
+    for (uint32_t i = bpp; i < length; i++) {
+        current[i] += (current[i - bpp] + previous[i]) >> 1;
+    }
+}
+
+static inline __attribute__((always_inline)) void unfilter_paeth_small(uint8_t *current, const uint8_t *previous, uint32_t length, uint32_t bpp) {
+    for (uint32_t i = 0; i < bpp; i++) {
+        current[i] += previous[i];
+    }
+    for (uint32_t i = bpp; i < length; i++) {
+        current[i] += paeth_branchless(current[i - bpp], previous[i], previous[i - bpp]);
+    }
+}
+
+static inline __attribute__((always_inline)) void unfilter_sub_small(uint8_t *current, uint32_t length, uint32_t bpp) {
+    for (uint32_t i = bpp; i < length; i++) {
+        current[i] += current[i - bpp];
+    }
+}
+
+static void unfilter_up_generic(uint8_t *current, const uint8_t *previous, uint32_t length) {
+    uint32_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= length; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(current + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(previous + i));
+        _mm_storeu_si128((__m128i *)(current + i), _mm_add_epi8(x, b));
+    }
+#endif
+    for (; i < length; i++) {
+        current[i] += previous[i];
+    }
+}
+
+#ifdef FILTERS_X86_DISPATCH
+__attribute__((target("avx2")))
+static void unfilter_up_avx2(uint8_t *current, const uint8_t *previous, uint32_t length) {
+    uint32_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(current + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(previous + i));
+        _mm256_storeu_si256((__m256i *)(current + i), _mm256_add_epi8(x, b));
+    }
+    for (; i < length; i++) {
+        current[i] += previous[i];
+    }
+}
+#endif
+
+#ifdef __SSE2__
+// Pixels of 3 or 4 bytes are moved through the low lane of an XMM register.
+// Loads always read 4 bytes (callers stop a pixel early for bpp 3 so that
+// never runs past the row, even a one-pixel row), stores write exactly bpp
+// bytes. Everything
+// taking bpp is force-inlined so the size is a constant in the loops
+static inline __attribute__((always_inline)) __m128i load_pixel(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return _mm_cvtsi32_si128((int)v);
+}
+
+static inline __attribute__((always_inline)) void store_pixel(uint8_t *p, __m128i x, uint32_t bpp) {
+    uint32_t v = (uint32_t)_mm_cvtsi128_si32(x);
+    memcpy(p, &v, bpp);
+}
+
+// Bytes the pixel loops may cover with 4-byte loads
+static inline __attribute__((always_inline)) uint32_t pixel_loop_end(uint32_t length, uint32_t bpp) {
+    return (bpp == 4 || length == 0) ? length : length - 1;
+}
+
+// Sub for 1, 2 and 4 byte pixels as a log-step prefix sum over 16 bytes,
+// seeded with the last reconstructed pixel of the previous block
+#define DEFINE_UNFILTER_SUB_PREFIX(BPP)                                              \
+static void unfilter_sub_sse2_##BPP(uint8_t *current, uint32_t length) {             \
+    uint32_t i = BPP;                                                                 \
+    for (; i + 16 <= length; i += 16) {                                               \
+        __m128i x = _mm_loadu_si128((const __m128i *)(current + i));                  \
+        x = _mm_add_epi8(x, _mm_slli_si128(x, BPP));                                  \
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 2 * BPP));                              \
+        if (4 * BPP < 16) x = _mm_add_epi8(x, _mm_slli_si128(x, (4 * BPP) & 15));     \
+        if (8 * BPP < 16) x = _mm_add_epi8(x, _mm_slli_si128(x, (8 * BPP) & 15));     \
+        uint32_t left = 0;                                                            \
+        memcpy(&left, current + i - BPP, BPP);                                        \
+        __m128i carry = (BPP == 1) ? _mm_set1_epi8((char)left)                        \
+                      : (BPP == 2) ? _mm_set1_epi16((short)left)                      \
+                      : _mm_set1_epi32((int)left);                                    \
+        _mm_storeu_si128((__m128i *)(current + i), _mm_add_epi8(x, carry));           \
+    }                                                                                 \
+    for (; i < length; i++) {                                                         \
+        current[i] += current[i - BPP];                                               \
+    }                                                                                 \
+}
+
+DEFINE_UNFILTER_SUB_PREFIX(1)
+DEFINE_UNFILTER_SUB_PREFIX(2)
+DEFINE_UNFILTER_SUB_PREFIX(4)
+
+// Sub, Avg and Paeth for 3 and 4 byte pixels carry a dependency from one
+// pixel to the next, so they walk the row one pixel per iteration with all
+// channels of the pixel handled at once
+static inline __attribute__((always_inline)) void unfilter_sub_sse2_pixel(uint8_t *current, uint32_t length, uint32_t bpp) {
+    uint32_t end = pixel_loop_end(length, bpp);
+    uint32_t i = bpp;
+    if (bpp + 4 <= length) {
+        __m128i a = load_pixel(current);
+        for (; i + bpp <= end; i += bpp) {
+            a = _mm_add_epi8(load_pixel(current + i), a);
+            store_pixel(current + i, a, bpp);
+        }
+    }
+    for (; i < length; i++) {
+        current[i] += current[i - bpp];
+    }
+}
+
+static inline __attribute__((always_inline)) void unfilter_avg_sse2(uint8_t *current, const uint8_t *previous, uint32_t length, uint32_t bpp) {
+    uint32_t end = pixel_loop_end(length, bpp);
+    __m128i a = _mm_setzero_si128();
+    uint32_t i = 0;
+    for (; i + bpp <= end; i += bpp) {
+        __m128i b = load_pixel(previous + i);
+        a = _mm_add_epi8(load_pixel(current + i), avg_floor_epu8(a, b));
+        store_pixel(current + i, a, bpp);
+    }
+    for (; i < length; i++) {
+        uint8_t left = (i >= bpp) ? current[i - bpp] : 0;
+        current[i] += (left + previous[i]) >> 1;
+    }
+}
+
+static inline __attribute__((always_inline)) void unfilter_paeth_sse2(uint8_t *current, const uint8_t *previous, uint32_t length, uint32_t bpp) {
+    uint32_t end = pixel_loop_end(length, bpp);
+    __m128i zero = _mm_setzero_si128();
+    __m128i a = zero;
+    __m128i c = zero;
+    uint32_t i = 0;
+    for (; i + bpp <= end; i += bpp) {
+        __m128i b = _mm_unpacklo_epi8(load_pixel(previous + i), zero);
+        __m128i predicted = _mm_packus_epi16(paeth_epi16(a, b, c), zero);
+        __m128i x = _mm_add_epi8(load_pixel(current + i), predicted);
+        store_pixel(current + i, x, bpp);
+        a = _mm_unpacklo_epi8(x, zero);
+        c = b;
+    }
+    for (; i < length; i++) {
+        uint8_t left = (i >= bpp) ? current[i - bpp] : 0;
+        uint8_t up_left = (i >= bpp) ? previous[i - bpp] : 0;
+        current[i] += paeth(left, previous[i], up_left);
+    }
+}
+#endif
+
+static void unfilter_up(uint8_t *current, const uint8_t *previous, uint32_t length) {
+#ifdef FILTERS_X86_DISPATCH
+    // Runtime check, the binary itself only assumes SSE2
+    if (__builtin_cpu_supports("avx2")) {
+        unfilter_up_avx2(current, previous, length);
+        return;
+    }
+#endif
+    unfilter_up_generic(current, previous, length);
+}
+
+void unfilter_scanline(uint8_t *current, const uint8_t *previous, uint32_t length, uint32_t bpp, uint8_t filter_type) {
+    // The first row has no predecessor; only Avg still needs the generic code
+    if (!previous) {
+        if (filter_type == FILTER_UP) {
+            return;
+        }
+        if (filter_type == FILTER_PAETH) {
+            filter_type = FILTER_SUB; // b = c = 0 always picks a
+        } else if (filter_type == FILTER_AVG) {
+            unfilter_scanline_scalar(current, previous, length, bpp, filter_type);
+            return;
+        }
+    }
+
+    switch (filter_type) {
+        case FILTER_NONE:
+            return;
+
+        case FILTER_UP:
+            unfilter_up(current, previous, length);
+            return;
+
+        case FILTER_SUB:
+            switch (bpp) {
+#ifdef __SSE2__
+                case 1: unfilter_sub_sse2_1(current, length); return;
+                case 2: unfilter_sub_sse2_2(current, length); return;
+                case 3: unfilter_sub_sse2_pixel(current, length, 3); return;
+                case 4: unfilter_sub_sse2_4(current, length); return;
+#else
+                case 1: unfilter_sub_small(current, length, 1); return;
+                case 2: unfilter_sub_small(current, length, 2); return;
+                case 3: unfilter_sub_small(current, length, 3); return;
+                case 4: unfilter_sub_small(current, length, 4); return;
+#endif
+            }
+            break;
+
+        case FILTER_AVG:
+            switch (bpp) {
+                case 1: unfilter_avg_small(current, previous, length, 1); return;
+                case 2: unfilter_avg_small(current, previous, length, 2); return;
+#ifdef __SSE2__
+                case 3: unfilter_avg_sse2(current, previous, length, 3); return;
+                case 4: unfilter_avg_sse2(current, previous, length, 4); return;
+#else
+                case 3: unfilter_avg_small(current, previous, length, 3); return;
+                case 4: unfilter_avg_small(current, previous, length, 4); return;
+#endif
+            }
+            break;
+
+        case FILTER_PAETH:
+            switch (bpp) {
+                case 1: unfilter_paeth_small(current, previous, length, 1); return;
+                case 2: unfilter_paeth_small(current, previous, length, 2); return;
+#ifdef __SSE2__
+                case 3: unfilter_paeth_sse2(current, previous, length, 3); return;
+                case 4: unfilter_paeth_sse2(current, previous, length, 4); return;
+#else
+                case 3: unfilter_paeth_small(current, previous, length, 3); return;
+                case 4: unfilter_paeth_small(current, previous, length, 4); return;
+#endif
+            }
+            break;
+    }
+
+    // Wider pixels (16-bit samples) take the reference path
+    unfilter_scanline_scalar(current, previous, length, bpp, filter_type);
+}
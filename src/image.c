@@ -0,0 +1,193 @@
+#include "../include/image.h"
+#include "../include/stats.h"
+#include "../include/buffer_cache.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+image_t *image_create(uint32_t width, uint32_t height, uint32_t channels) {
+    return image_create_depth(width, height, channels, 8);
+}
+
+image_t *image_create_depth(uint32_t width, uint32_t height, uint32_t channels, uint32_t bit_depth) {
+    if (width == 0 || height == 0 || channels == 0 || (bit_depth != 8 && bit_depth != 16)) {
+        fprintf(stderr, "ERROR: Invalid image dimensions %u x %u x %u (%u-bit)\n", width, height, channels, bit_depth);
+        return NULL;
+    }
+
+    image_t *image = malloc(sizeof(image_t));
+    if (!image) {
+        fprintf(stderr, "ERROR: Could not allocate memory for image structure\n");
+        return NULL;
+    }
+
+    // Pad every row to a multiple of the alignment so each row starts aligned
+    size_t row_bytes = (size_t)width * channels * (bit_depth / 8);
+    image->stride = (row_bytes + IMAGE_ALIGNMENT - 1) & ~(size_t)(IMAGE_ALIGNMENT - 1);
+    image->width = width;
+    image->height = height;
+    image->channels = channels;
+    image->bit_depth = bit_depth;
+    image->palette = NULL;
+
+    image->data = buffer_cache_acquire(image->stride * height, &image->capacity);
+    if (!image->data) {
+        fprintf(stderr, "ERROR: Could not allocate memory for %u x %u image\n", width, height);
+        free(image);
+        return NULL;
+    }
+    stats_alloc(image->capacity);
+
+    return image;
+}
+
+void image_free(image_t *image) {
+    if (!image) {
+        return;
+    }
+    stats_free(image->capacity);
+    buffer_cache_release(image->data, image->capacity);
+    free(image->palette);
+    free(image);
+}
+
+void image_copy(image_t *dst, const image_t *src) {
+    if (dst == src) {
+        return;
+    }
+    if (dst->stride == src->stride) {
+        memcpy(dst->data, src->data, src->stride * src->height);
+        return;
+    }
+    size_t row_bytes = image_row_bytes(src);
+    for (uint32_t y = 0; y < src->height; y++) {
+        memcpy(image_row(dst, y), image_row(src, y), row_bytes);
+    }
+}
+
+#ifdef __SSE2__
+// Gray of four pixels held as four bytes each (R, G, B and a fourth byte
+// with weight 0), in the low four 32-bit lanes of the result
+static inline __m128i gray_quad(__m128i pixels) {
+    const __m128i weights = _mm_setr_epi16(GRAY_WEIGHT_R, GRAY_WEIGHT_G, GRAY_WEIGHT_B, 0,
+                                           GRAY_WEIGHT_R, GRAY_WEIGHT_G, GRAY_WEIGHT_B, 0);
+    const __m128i zero = _mm_setzero_si128();
+    // Per pixel: R and G weighted in one lane, B in the next
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(pixels, zero), weights);
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(pixels, zero), weights);
+    __m128 even = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 odd = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(3, 1, 3, 1));
+    return _mm_srli_epi32(_mm_add_epi32(_mm_castps_si128(even), _mm_castps_si128(odd)), 8);
+}
+
+// Four RGB pixels from the first 12 of 16 loaded bytes, spread to four
+// bytes each
+static inline __m128i rgb_quad(__m128i v) {
+    __m128i p01 = _mm_unpacklo_epi32(v, _mm_srli_si128(v, 3));
+    __m128i p23 = _mm_unpacklo_epi32(_mm_srli_si128(v, 6), _mm_srli_si128(v, 9));
+    return _mm_unpacklo_epi64(p01, p23);
+}
+#endif
+
+void image_gray_row(const uint8_t *src, uint8_t *dst, uint32_t width, uint32_t channels) {
+    if (channels == 1) {
+        memcpy(dst, src, width);
+        return;
+    }
+    uint32_t x = 0;
+    if (channels < 3) { // Grayscale + Alpha, ignore alpha
+        for (; x < width; x++) {
+            dst[x] = src[x * channels];
+        }
+        return;
+    }
+
+#ifdef __SSE2__
+    // Eight pixels at a time; RGB loads read 4 bytes past the eighth pixel
+    uint32_t tail = (channels == 4) ? 8 : 10;
+    for (; x + tail <= width; x += 8) {
+        const uint8_t *p = src + (size_t)x * channels;
+        __m128i a, b;
+        if (channels == 4) {
+            a = _mm_loadu_si128((const __m128i *)p);
+            b = _mm_loadu_si128((const __m128i *)(p + 16));
+        } else {
+            a = rgb_quad(_mm_loadu_si128((const __m128i *)p));
+            b = rgb_quad(_mm_loadu_si128((const __m128i *)(p + 12)));
+        }
+        __m128i gray = _mm_packs_epi32(gray_quad(a), gray_quad(b));
+        _mm_storel_epi64((__m128i *)(dst + x), _mm_packus_epi16(gray, gray));
+    }
+#endif
+    for (; x < width; x++) {
+        const uint8_t *p = src + (size_t)x * channels;
+        dst[x] = (uint8_t)((GRAY_WEIGHT_R * p[0] + GRAY_WEIGHT_G * p[1] + GRAY_WEIGHT_B * p[2]) >> 8);
+    }
+}
+
+void image_gray_row16(const uint16_t *src, uint16_t *dst, uint32_t width, uint32_t channels) {
+    if (channels == 1) {
+        memcpy(dst, src, (size_t)width * sizeof(uint16_t));
+        return;
+    }
+    for (uint32_t x = 0; x < width; x++) {
+        const uint16_t *p = src + (size_t)x * channels;
+        if (channels >= 3) {
+            dst[x] = (uint16_t)((GRAY_WEIGHT_R * p[0] + GRAY_WEIGHT_G * p[1] + GRAY_WEIGHT_B * p[2]) >> 8);
+        } else {
+            dst[x] = p[0];
+        }
+    }
+}
+
+void image_gray_alpha_row(const uint8_t *src, uint8_t *dst, uint32_t width, uint32_t channels,
+                          uint32_t bit_depth) {
+    size_t sample_bytes = bit_depth / 8;
+    if (channels == 2) {
+        memcpy(dst, src, (size_t)width * 2 * sample_bytes);
+        return;
+    }
+    if (channels != 4) {
+        if (bit_depth == 16) {
+            image_gray_row16((const uint16_t *)src, (uint16_t *)dst, width, channels);
+        } else {
+            image_gray_row(src, dst, width, channels);
+        }
+        return;
+    }
+
+    if (bit_depth == 16) {
+        const uint16_t *in = (const uint16_t *)src;
+        uint16_t *out = (uint16_t *)dst;
+        for (uint32_t x = 0; x < width; x++) {
+            const uint16_t *p = in + (size_t)x * 4;
+            out[x * 2] = (uint16_t)((GRAY_WEIGHT_R * p[0] + GRAY_WEIGHT_G * p[1] + GRAY_WEIGHT_B * p[2]) >> 8);
+            out[x * 2 + 1] = p[3];
+        }
+        return;
+    }
+
+    uint32_t x = 0;
+#ifdef __SSE2__
+    // Eight pixels at a time: gray | alpha << 8 in each 32-bit lane, packed
+    // to 16 bits with a bias since SSE2 only packs with signed saturation
+    const __m128i alpha_mask = _mm_set1_epi32(0xFF00);
+    const __m128i bias32 = _mm_set1_epi32(0x8000);
+    const __m128i bias16 = _mm_set1_epi16((short)0x8000);
+    for (; x + 8 <= width; x += 8) {
+        const uint8_t *p = src + (size_t)x * 4;
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+        __m128i lo = _mm_or_si128(gray_quad(a), _mm_and_si128(_mm_srli_epi32(a, 16), alpha_mask));
+        __m128i hi = _mm_or_si128(gray_quad(b), _mm_and_si128(_mm_srli_epi32(b, 16), alpha_mask));
+        __m128i pairs = _mm_packs_epi32(_mm_sub_epi32(lo, bias32), _mm_sub_epi32(hi, bias32));
+        _mm_storeu_si128((__m128i *)(dst + (size_t)x * 2), _mm_add_epi16(pairs, bias16));
+    }
+#endif
+    for (; x < width; x++) {
+        const uint8_t *p = src + (size_t)x * 4;
+        dst[x * 2] = (uint8_t)((GRAY_WEIGHT_R * p[0] + GRAY_WEIGHT_G * p[1] + GRAY_WEIGHT_B * p[2]) >> 8);
+        dst[x * 2 + 1] = p[3];
+    }
+}
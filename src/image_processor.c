@@ -1,263 +1,260 @@
 #include "../include/image_processor.h"
 #include <math.h>
 
-void process_grayscale_image(image_t *image, const char *output_file,
-                             kernel_type kernel, uint8_t steps) {
-    // Convert to grayscale if needed
-    uint8_t **grayscale = rgb_to_grayscale(image);
-    uint8_t **processed = allocate_pixel_matrix(image->height, image->width);
-    uint8_t **temp = NULL;
-
-    // Apply convolution
-    if (kernel != KERNEL_NONE) {
-        printf("Applying filter");
-        if (steps > 1) {
-            printf(" (%d steps)", steps);
-            temp = allocate_pixel_matrix(image->height, image->width);
-        }
-        printf("...\n");
-
-        uint8_t **input = grayscale;
-        uint8_t **output = processed;
+void process_options_default(process_options_t *options) {
+    options->force_grayscale = false;
+    options->do_resize = false;
+    options->kernel = KERNEL_NONE;
+    options->steps = 0;
+    memset(&options->resize, 0, sizeof(resample_size_t));
+    options->filter = RESAMPLE_BILINEAR;
+    options->threads = 0;
+    options->fuse = false;
+    options->keep_16bit = false;
+    options->verbose = true;
+    png_write_options_default(&options->write_options);
+    options->pipeline.count = 0;
+}
 
-        for (uint8_t i = 0; i < steps; i++) {
-            output = ((steps - 1 - i) % 2 == 0) ? processed : temp;
-            apply_convolution(input, output, image->height, image->width, kernel);
-            input = output;
+// Run `steps` passes of `kernel` over `image` in place. With `fuse`,
+// multi-step blurs become a single fused pass whose cost does not grow
+// with steps
+static bool filter_image(image_t *image, kernel_type kernel, uint8_t steps, uint32_t threads, bool fuse) {
+    if (fuse && steps > 1 && box_blur_fused(image, image, kernel, steps, threads)) {
+        return true;
+    }
+    for (uint8_t i = 0; i < steps; i++) {
+        if (!apply_convolution_in_place(image, kernel, threads)) {
+            return false;
         }
+    }
+    return true;
+}
 
-        if (output != processed) {
-            for (uint32_t y = 0; y < image->height; y++) {
-                memcpy(processed[y], output[y], image->width);
-            }
-        }
-    } else {
-        for (uint32_t y = 0; y < image->height; y++) {
-            memcpy(processed[y], grayscale[y], image->width);
+static void print_filter_banner(const process_options_t *options) {
+    if (!options->verbose) {
+        return;
+    }
+    printf("Applying filter");
+    if (options->steps > 1) {
+        printf(" (%d steps", options->steps);
+        if (options->fuse && (options->kernel == KERNEL_GAUSSIAN || options->kernel == KERNEL_BLUR)) {
+            printf(", fused");
         }
+        printf(")");
     }
+    printf("...\n");
+}
 
-    // Save grayscale image
-    save_png(output_file, processed, image->width, image->height, 0, 1);
-
-    // Cleanup
-    if (grayscale != image->pixels) {
-        free_pixel_matrix(grayscale, image->height);
+// Saved in the colour type that matches the image: gray, gray+alpha, RGB,
+// RGBA or indexed
+static process_status_t save_output(const char *output_file, const image_t *image,
+                                    const process_options_t *options) {
+    if (!save_png(output_file, image, png_color_type_of(image), &options->write_options)) {
+        return PROCESS_WRITE_FAILED;
     }
-    free_pixel_matrix(processed, image->height);
-    if (temp) {
-        free_pixel_matrix(temp, image->height);
+    if (options->verbose) {
+        printf("Successfully saved output image to: %s\n", output_file);
     }
+    return PROCESS_OK;
 }
 
-void process_rgb_image(image_t *image, const char *output_file,
-                       kernel_type kernel, uint8_t steps) {
-    if (kernel == KERNEL_NONE) {
-        // No kernel applied - just save original
-        uint8_t color_type = (image->channels == 4) ? 6 : 2;
-        save_png(output_file, image->pixels, image->width, image->height, color_type, image->channels);
-        return;
+// Filter a gray copy of `image`, or `image` itself if it is gray already,
+// and save it as grayscale. Alpha is passed through, so input with alpha
+// gives gray+alpha output
+static process_status_t filter_grayscale(image_t *image, const char *output_file,
+                                         const process_options_t *options) {
+    image_t *grayscale = rgb_to_grayscale(image);
+    if (!grayscale) {
+        return PROCESS_FAILED;
     }
 
-    // Process RGB/RGBA image with kernel
-    if (image->channels >= 3) {
-        uint8_t **processed = allocate_pixel_matrix(image->height, image->width * image->channels);
-
-        // Initialize with original data
-        for (uint32_t y = 0; y < image->height; y++) {
-            memcpy(processed[y], image->pixels[y], image->width * image->channels);
-        }
-
-        printf("Applying filter");
-        if (steps > 1) printf(" (%d steps)", steps);
-        printf("...\n");
-
-        // Apply kernel to each channel
-        for (uint32_t ch = 0; ch < 3; ch++) {
-            uint8_t **channel = allocate_pixel_matrix(image->height, image->width);
-            uint8_t **proc_channel = allocate_pixel_matrix(image->height, image->width);
-            uint8_t **temp_channel = NULL;
-
-            if (steps > 1) {
-                temp_channel = allocate_pixel_matrix(image->height, image->width);
-            }
-
-            // Extract channel
-            for (uint32_t y = 0; y < image->height; y++) {
-                for (uint32_t x = 0; x < image->width; x++) {
-                    channel[y][x] = image->pixels[y][x * image->channels + ch];
-                }
-            }
-
-            // Apply kernel
-            uint8_t **input = channel;
-            uint8_t **output = proc_channel;
-
-            for (uint8_t i = 0; i < steps; i++) {
-                apply_convolution(input, output, image->height, image->width, kernel);
-
-                if (i < steps - 1) {
-                    uint8_t **swap = input;
-                    input = output;
-                    output = (swap == channel && temp_channel) ? temp_channel : channel;
-                }
-            }
-
-            // Copy processed channel back
-            for (uint32_t y = 0; y < image->height; y++) {
-                for (uint32_t x = 0; x < image->width; x++) {
-                    processed[y][x * image->channels + ch] = output[y][x];
-                }
-            }
-
-            free_pixel_matrix(channel, image->height);
-            free_pixel_matrix(proc_channel, image->height);
-            if (temp_channel) {
-                free_pixel_matrix(temp_channel, image->height);
-            }
-        }
-
-        // Copy alpha channel if present
-        if (image->channels == 4) {
-            for (uint32_t y = 0; y < image->height; y++) {
-                for (uint32_t x = 0; x < image->width; x++) {
-                    processed[y][x * image->channels + 3] = image->pixels[y][x * image->channels + 3];
-                }
-            }
-        }
+    // The gray image is filtered in place and saved
+    if (options->kernel != KERNEL_NONE) {
+        print_filter_banner(options);
+    }
+    process_status_t status = filter_image(grayscale, options->kernel, options->steps, options->threads, options->fuse)
+                            ? save_output(output_file, grayscale, options) : PROCESS_FAILED;
 
-        // Save RGB/RGBA image
-        uint8_t color_type = (image->channels == 4) ? 6 : 2;
-        save_png(output_file, processed, image->width, image->height, color_type, image->channels);
-        free_pixel_matrix(processed, image->height);
-    } else {
-        // Grayscale with kernel
-        uint8_t **processed = allocate_pixel_matrix(image->height, image->width);
-        uint8_t **temp = NULL;
+    if (grayscale != image) {
+        image_free(grayscale);
+    }
+    return status;
+}
 
-        // Initialize with original data
-        for (uint32_t y = 0; y < image->height; y++) {
-            memcpy(processed[y], image->pixels[y], image->width);
-        }
+process_status_t process_grayscale_image(image_t *image, const char *output_file,
+                                         const process_options_t *options) {
+    return filter_grayscale(image, output_file, options);
+}
 
-        if (steps > 1) {
-            temp = allocate_pixel_matrix(image->height, image->width);
-        }
+process_status_t process_rgb_image(image_t *image, const char *output_file,
+                                   const process_options_t *options) {
+    if (options->kernel == KERNEL_NONE) {
+        // No kernel applied - just save original
+        return save_output(output_file, image, options);
+    }
 
-        uint8_t **input = processed;
-        uint8_t **output = processed;
+    // Convolve the interleaved pixels directly and in place, alpha is
+    // copied through untouched. Gray+alpha is saved as such
+    print_filter_banner(options);
+    if (!filter_image(image, options->kernel, options->steps, options->threads, options->fuse)) {
+        return PROCESS_FAILED;
+    }
+    return save_output(output_file, image, options);
+}
 
-        for (uint8_t i = 0; i < steps; i++) {
-            if (i > 0) {
-                output = (input == processed) ? temp : processed;
-            }
-            apply_convolution(input, output, image->height, image->width, kernel);
-            input = output;
-        }
+// Resample to width x height and save
+static process_status_t resize_and_save(image_t *image, uint32_t width, uint32_t height,
+                                        const char *output_file, const process_options_t *options) {
+    if (options->verbose) {
+        printf("Resizing %u x %u to %u x %u (%s)...\n", image->width, image->height,
+               width, height, resample_filter_name(options->filter));
+    }
 
-        // Ensure final result is in processed
-        if (output != processed && temp) {
-            for (uint32_t y = 0; y < image->height; y++) {
-                memcpy(processed[y], output[y], image->width);
-            }
-        }
+    image_t *source = options->force_grayscale ? rgb_to_grayscale(image) : image;
+    image_t *resized = NULL;
+    if (source && source->width == width && source->height == height) {
+        resized = source;
+    } else if (source) {
+        resized = resample_image(source, width, height, options->filter, options->threads);
+    }
+    process_status_t status = resized ? save_output(output_file, resized, options) : PROCESS_FAILED;
 
-        save_png(output_file, processed, image->width, image->height, 0, 1);
-        free_pixel_matrix(processed, image->height);
-        if (temp) {
-            free_pixel_matrix(temp, image->height);
-        }
+    if (resized != source) {
+        image_free(resized);
+    }
+    if (source != image) {
+        image_free(source);
     }
+    return status;
 }
 
-void process_upscale_image(image_t *image, const char *output_file,
-                          bool force_grayscale, float scale_factor) {
-    printf("Upscaling image by a factor of %.2f...\n", scale_factor);
-    
-    // Calculate new dimensions using the scale_factor, rounding for accuracy
-    uint32_t new_width = (uint32_t)roundf(image->width * scale_factor);
-    uint32_t new_height = (uint32_t)roundf(image->height * scale_factor);
-
-    if (force_grayscale || image->channels == 1) {
-        uint8_t **grayscale = rgb_to_grayscale(image);
-        uint8_t **upscaled_pixels = bilinear_upscale(grayscale, image->height, image->width, scale_factor);
+process_status_t process_resize_image(image_t *image, const char *output_file,
+                                      const process_options_t *options) {
+    uint32_t width, height;
+    resample_target_size(image->width, image->height, &options->resize, &width, &height);
+    return resize_and_save(image, width, height, output_file, options);
+}
 
-        save_png(output_file, upscaled_pixels, new_width, new_height, 0, 1);
+// Decode for a resize. A shrink is reduced while decoding, so the full
+// image is never held: a box filter gets the final size straight from the
+// decoder, the others an area average of twice the target size that they
+// then resample. Shrinks by less than that decode in full
+static process_status_t process_resize_png(png_reader_t *png, const char *output_file,
+                                           const process_options_t *options) {
+    uint32_t in_width = png->ihdr.width;
+    uint32_t in_height = png->ihdr.height;
+    uint32_t width, height;
+    resample_target_size(in_width, in_height, &options->resize, &width, &height);
+
+    uint32_t reduced_width = in_width;
+    uint32_t reduced_height = in_height;
+    if (width <= in_width && height <= in_height) {
+        uint32_t factor = (options->filter == RESAMPLE_BOX) ? 1 : 2;
+        if ((uint64_t)width * factor < in_width) reduced_width = width * factor;
+        if ((uint64_t)height * factor < in_height) reduced_height = height * factor;
+    }
 
-        if (grayscale != image->pixels) {
-            free_pixel_matrix(grayscale, image->height);
+    image_t *image;
+    if (reduced_width != in_width || reduced_height != in_height) {
+        if (options->verbose) {
+            printf("Reducing to %u x %u while decoding...\n", reduced_width, reduced_height);
         }
-        free_pixel_matrix(upscaled_pixels, new_height);
+        image = decode_png_reduced(png, reduced_width, reduced_height, options->keep_16bit);
+    } else if (options->force_grayscale) {
+        // Gray comes before the resize anyway, so it can come with the decode
+        image = decode_png_gray(png, options->keep_16bit, options->threads);
     } else {
-        // Handle color images
-        uint8_t **processed = allocate_pixel_matrix(new_height, new_width * image->channels);
+        image = decode_png_image(png, options->keep_16bit, options->threads);
+    }
+    if (!image) {
+        fprintf(stderr, "ERROR: Failed to process image data\n");
+        return PROCESS_FAILED;
+    }
 
-        // Upscale each color channel (R, G, B) separately
-        for (uint32_t ch = 0; ch < 3; ch++) {
-            uint8_t **channel = allocate_pixel_matrix(image->height, image->width);
-            for (uint32_t y = 0; y < image->height; y++) {
-                for (uint32_t x = 0; x < image->width; x++) {
-                    channel[y][x] = image->pixels[y][x * image->channels + ch];
-                }
-            }
+    process_status_t status = resize_and_save(image, width, height, output_file, options);
+    image_free(image);
+    return status;
+}
 
-            uint8_t **upscaled_channel = bilinear_upscale(channel, image->height, image->width, scale_factor);
+process_status_t process_pipeline_image(image_t *image, const char *output_file,
+                                        const process_options_t *options) {
+    if (options->verbose) {
+        printf("Running %u stage pipeline...\n", options->pipeline.count);
+    }
 
-            // Recombine the upscaled channel into the final image
-            for (uint32_t y = 0; y < new_height; y++) {
-                for (uint32_t x = 0; x < new_width; x++) {
-                    processed[y][x * image->channels + ch] = upscaled_channel[y][x];
-                }
-            }
-            free_pixel_matrix(channel, image->height);
-            free_pixel_matrix(upscaled_channel, new_height);
-        }
+    image_t *result = pipeline_run(&options->pipeline, image, options->threads,
+                                   options->fuse, options->filter, options->verbose);
+    if (!result) {
+        return PROCESS_FAILED;
+    }
 
-        // Copy alpha channel if it exists (using nearest-neighbor for simplicity)
-        if (image->channels == 4) {
-            for (uint32_t y = 0; y < new_height; y++) {
-                for (uint32_t x = 0; x < new_width; x++) {
-                    uint32_t orig_y = (uint32_t)fmin(roundf(y / scale_factor), image->height - 1);
-                    uint32_t orig_x = (uint32_t)fmin(roundf(x / scale_factor), image->width - 1);
-                    processed[y][x * 4 + 3] = image->pixels[orig_y][orig_x * 4 + 3];
-                }
-            }
-        }
+    process_status_t status = save_output(output_file, result, options);
+    image_free(result);
+    return status;
+}
 
-        uint8_t color_type = (image->channels == 4) ? 6 : 2;
-        save_png(output_file, processed, new_width, new_height, color_type, image->channels);
-        free_pixel_matrix(processed, new_height);
+// Re-encoding an indexed file, or turning it gray, only needs the palette:
+// the indices are never expanded and the output is colour type 3 again
+static process_status_t process_indexed_png(png_reader_t *png, const char *output_file,
+                                            const process_options_t *options) {
+    image_t *image = decode_png_indexed(png, options->threads);
+    if (!image) {
+        fprintf(stderr, "ERROR: Failed to process image data\n");
+        return PROCESS_FAILED;
+    }
+    if (options->verbose) {
+        printf("Keeping the %u entry palette%s...\n", image->palette->count,
+               options->force_grayscale ? ", converted to grayscale" : "");
     }
+    if (options->force_grayscale) {
+        palette_to_grayscale(image);
+    }
+
+    process_status_t status = save_output(output_file, image, options);
+    image_free(image);
+    return status;
 }
 
-int process_png_image(png_data_t *png, const char *output_file,
-                      bool force_grayscale, bool do_upscale,
-                      kernel_type kernel, uint8_t steps, float scale_factor) {
-    if (!png->idat_data || png->idat_size == 0) {
-        fprintf(stderr, "ERROR: No IDAT chunks found or empty image data\n");
-        return 1;
+int process_png_image(png_reader_t *png, const char *output_file,
+                      const process_options_t *options) {
+    if (options->verbose) {
+        printf("\nProcessing image data...\n");
+    }
+    if (options->do_resize && options->pipeline.count == 0) {
+        return process_resize_png(png, output_file, options);
+    }
+    if (png->ihdr.color_type == 3 && options->pipeline.count == 0 && options->kernel == KERNEL_NONE) {
+        return process_indexed_png(png, output_file, options);
     }
 
-    printf("\nProcessing image data...\n");
-    image_t *image = process_idat_chunks(&png->ihdr, &png->palette, png->idat_data, png->idat_size);
+    // Grayscale output, or a pipeline that starts with it, is converted row
+    // by row while decoding and the colour image never exists
+    const pipeline_t *pipeline = &options->pipeline;
+    bool decode_gray = (pipeline->count > 0) ? pipeline->stages[0].kind == STAGE_GRAYSCALE
+                                             : options->force_grayscale;
+    image_t *image = decode_gray ? decode_png_gray(png, options->keep_16bit, options->threads)
+                                 : decode_png_image(png, options->keep_16bit, options->threads);
 
     if (!image) {
         fprintf(stderr, "ERROR: Failed to process image data\n");
-        return 1;
+        return PROCESS_FAILED;
     }
 
     // Process based on mode
-    if (do_upscale) {
-        process_upscale_image(image, output_file, force_grayscale, scale_factor);
-    } else if (force_grayscale || image->channels == 1) {
-        process_grayscale_image(image, output_file, kernel, steps);
+    process_status_t status;
+    if (options->pipeline.count > 0) {
+        // The pipeline works in place of the decoded image and frees it
+        status = process_pipeline_image(image, output_file, options);
+        image = NULL;
+    } else if (options->force_grayscale || image->channels == 1) {
+        status = process_grayscale_image(image, output_file, options);
     } else {
-        process_rgb_image(image, output_file, kernel, steps);
+        status = process_rgb_image(image, output_file, options);
     }
 
     // Cleanup
-    free_pixel_matrix(image->pixels, image->height);
-    free(image);
+    image_free(image);
 
-    return 0;
+    return status;
 }
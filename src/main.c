@@ -1,6 +1,33 @@
 #include <stdio.h>
 #include "../include/image_processor.h"
 #include "../include/cli.h"
+#include "../include/batch.h"
+#include "../include/server.h"
+
+static void print_settings(const process_options_t *options) {
+    if (options->pipeline.count > 0) {
+        printf("Pipeline: %u stages\n\n", options->pipeline.count);
+        return;
+    }
+
+    printf("Kernel: ");
+    switch (options->kernel) {
+        case KERNEL_SOBEL_X: printf("Sobel X\n"); break;
+        case KERNEL_SOBEL_Y: printf("Sobel Y\n"); break;
+        case KERNEL_SOBEL_COMBINED: printf("Sobel Combined\n"); break;
+        case KERNEL_GAUSSIAN: printf("Gaussian\n"); break;
+        case KERNEL_BLUR:
+            printf("Blur");
+            if (options->steps > 1) printf(" (%d steps)", options->steps);
+            printf("\n");
+            break;
+        case KERNEL_LAPLACIAN: printf("Laplacian\n"); break;
+        case KERNEL_SHARPEN: printf("Sharpen\n"); break;
+        case KERNEL_NONE: printf("None\n"); break;
+    }
+    printf("Output format: %s%s\n\n", options->force_grayscale ? "Grayscale" : "RGB",
+           options->keep_16bit ? ", 16-bit inputs kept at 16 bits" : "");
+}
 
 int main(int argc, char **argv) {
     // Parse command-line arguments
@@ -24,41 +51,69 @@ int main(int argc, char **argv) {
         return handle_draw_command(config.input_file, config.draw_color);
     }
 
-    // Print processing information
-    printf("Kernel: ");
-    switch (config.kernel) {
-        case KERNEL_SOBEL_X: printf("Sobel X\n"); break;
-        case KERNEL_SOBEL_Y: printf("Sobel Y\n"); break;
-        case KERNEL_SOBEL_COMBINED: printf("Sobel Combined\n"); break;
-        case KERNEL_GAUSSIAN: printf("Gaussian\n"); break;
-        case KERNEL_BLUR:
-            printf("Blur");
-            if (config.steps > 1) printf(" (%d steps)", config.steps);
-            printf("\n");
-            break;
-        case KERNEL_LAPLACIAN: printf("Laplacian\n"); break;
-        case KERNEL_SHARPEN: printf("Sharpen\n"); break;
-        case KERNEL_NONE: printf("None\n"); break;
+    // Handle server mode
+    if (config.serve_socket) {
+        server_config_t server = {
+            .socket_path = config.serve_socket,
+            .jobs = config.jobs,
+        };
+        return run_server(&server);
     }
-    printf("Output format: %s\n\n", config.force_grayscale ? "Grayscale" : "RGB");
 
-    // Read PNG file
-    png_data_t png;
-    if (!read_png_file(config.input_file, &png)) {
+    // Stats cover the batch or the single file below
+    uint64_t start = 0;
+    if (config.stats) {
+        stats_enable();
+        start = stats_now_ns();
+    }
+
+    // Handle batch mode
+    if (config.batch_source) {
+        batch_config_t batch = {
+            .source = config.batch_source,
+            .output_pattern = config.output_file,
+            .jobs = config.jobs,
+            .process = config.process,
+        };
+        int result = run_batch(&batch);
+        if (config.stats) {
+            stats_print(stderr, config.stats_format, (stats_now_ns() - start) / 1e6);
+        }
+        return result;
+    }
+
+    // Suggest grayscale for edge detection
+    if ((config.process.kernel == KERNEL_SOBEL_X || config.process.kernel == KERNEL_SOBEL_Y ||
+         config.process.kernel == KERNEL_SOBEL_COMBINED || config.process.kernel == KERNEL_LAPLACIAN) &&
+        !config.process.force_grayscale) {
+        printf("Note: Edge detection typically works better on grayscale images.\n");
+        printf("Consider adding --grayscale flag.\n\n");
+    }
+
+    // Print processing information
+    print_settings(&config.process);
+
+    // Open PNG file, image data is streamed while decoding
+    png_reader_t png;
+    if (!png_reader_open(config.input_file, &png)) {
         return 1;
     }
+    printf("Processing: %s\n", config.input_file);
+    printf("Image dimensions: %u x %u\n", png.ihdr.width, png.ihdr.height);
+    printf("Bit depth: %u, Color type: %u\n", png.ihdr.bit_depth, png.ihdr.color_type);
 
     // Process the image
-    int result = process_png_image(&png, config.output_file,
-                                   config.force_grayscale, config.do_upscale,
-                                   config.kernel, config.steps, config.scale_factor);
+    int result = process_png_image(&png, config.output_file, &config.process);
 
     // Cleanup
-    free_png_data(&png);
+    png_reader_close(&png);
+    if (config.stats) {
+        stats_print(stderr, config.stats_format, (stats_now_ns() - start) / 1e6);
+    }
 
-    if (result == 0) {
+    if (result == PROCESS_OK) {
         printf("\nDone!\n");
     }
 
-    return result;
+    return result == PROCESS_OK ? 0 : 1;
 }
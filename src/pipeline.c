@@ -0,0 +1,248 @@
+#include "../include/pipeline.h"
+#include "../include/processor.h"
+#include "../include/box_blur.h"
+
+typedef struct {
+    const char *name;
+    stage_kind_t kind;
+    kernel_type kernel;
+} stage_name_t;
+
+static const stage_name_t stage_names[] = {
+    {"gray",      STAGE_GRAYSCALE, KERNEL_NONE},
+    {"grayscale", STAGE_GRAYSCALE, KERNEL_NONE},
+    {"gaussian",  STAGE_CONVOLVE,  KERNEL_GAUSSIAN},
+    {"blur",      STAGE_CONVOLVE,  KERNEL_BLUR},
+    {"sobel-x",   STAGE_CONVOLVE,  KERNEL_SOBEL_X},
+    {"sobel-y",   STAGE_CONVOLVE,  KERNEL_SOBEL_Y},
+    {"sobel",     STAGE_CONVOLVE,  KERNEL_SOBEL_COMBINED},
+    {"laplacian", STAGE_CONVOLVE,  KERNEL_LAPLACIAN},
+    {"sharpen",   STAGE_CONVOLVE,  KERNEL_SHARPEN},
+    {"upscale",   STAGE_RESIZE,    KERNEL_NONE},
+    {"resize",    STAGE_RESIZE,    KERNEL_NONE},
+    {"thumbnail", STAGE_RESIZE,    KERNEL_NONE},
+};
+
+#define STAGE_NAME_COUNT (sizeof(stage_names) / sizeof(stage_names[0]))
+
+static const char *stage_name(const pipeline_stage_t *stage) {
+    if (stage->kind == STAGE_RESIZE) {
+        return (stage->size.scale > 0.0f) ? "upscale" : stage->size.fit ? "thumbnail" : "resize";
+    }
+    for (size_t i = 0; i < STAGE_NAME_COUNT; i++) {
+        if (stage_names[i].kind == stage->kind && stage_names[i].kernel == stage->kernel) {
+            return stage_names[i].name;
+        }
+    }
+    return "?";
+}
+
+// One "name[:argument]" token of length `length`
+static bool parse_stage(const char *token, size_t length, pipeline_stage_t *stage) {
+    const char *colon = memchr(token, ':', length);
+    size_t name_length = colon ? (size_t)(colon - token) : length;
+    char argument[32] = "";
+    if (colon) {
+        size_t argument_length = length - name_length - 1;
+        if (argument_length == 0 || argument_length >= sizeof(argument)) {
+            fprintf(stderr, "ERROR: Bad argument in pipeline stage '%.*s'\n", (int)length, token);
+            return false;
+        }
+        memcpy(argument, colon + 1, argument_length);
+        argument[argument_length] = '\0';
+    }
+
+    const stage_name_t *match = NULL;
+    for (size_t i = 0; i < STAGE_NAME_COUNT; i++) {
+        if (strlen(stage_names[i].name) == name_length && !strncmp(stage_names[i].name, token, name_length)) {
+            match = &stage_names[i];
+            break;
+        }
+    }
+    if (!match) {
+        fprintf(stderr, "ERROR: Unknown pipeline stage '%.*s'\n", (int)name_length, token);
+        return false;
+    }
+
+    stage->kind = match->kind;
+    stage->kernel = match->kernel;
+    stage->steps = 1;
+    memset(&stage->size, 0, sizeof(resample_size_t));
+
+    char *end = NULL;
+    bool takes_steps = match->kernel == KERNEL_GAUSSIAN || match->kernel == KERNEL_BLUR;
+    if (!strcmp(match->name, "upscale")) {
+        stage->size.scale = colon ? strtof(argument, &end) : 2.0f;
+        if (colon && (*end != '\0' || !(stage->size.scale > 0.0f && stage->size.scale <= 15.0f))) {
+            fprintf(stderr, "ERROR: upscale factor must be between 0 and 15\n");
+            return false;
+        }
+    } else if (!strcmp(match->name, "resize")) {
+        if (!colon || !resample_parse_size(argument, &stage->size)) {
+            fprintf(stderr, "ERROR: resize takes a size, resize:<W>x<H>, <W>x or x<H>\n");
+            return false;
+        }
+    } else if (!strcmp(match->name, "thumbnail")) {
+        unsigned long box = colon ? strtoul(argument, &end, 10) : 0;
+        if (!colon || *end != '\0' || box == 0 || box > UINT32_MAX) {
+            fprintf(stderr, "ERROR: thumbnail takes a box size, thumbnail:<N>\n");
+            return false;
+        }
+        stage->size.width = stage->size.height = (uint32_t)box;
+        stage->size.fit = true;
+    } else if (colon && takes_steps) {
+        long steps = strtol(argument, &end, 10);
+        if (*end != '\0' || steps < 1 || steps > 255) {
+            fprintf(stderr, "ERROR: %s steps must be between 1 and 255\n", match->name);
+            return false;
+        }
+        stage->steps = (uint8_t)steps;
+    } else if (colon) {
+        fprintf(stderr, "ERROR: Pipeline stage '%s' takes no argument\n", match->name);
+        return false;
+    }
+    return true;
+}
+
+bool pipeline_parse(const char *description, pipeline_t *pipeline) {
+    pipeline->count = 0;
+
+    const char *token = description;
+    while (true) {
+        size_t length = strcspn(token, ",");
+        if (length == 0) {
+            fprintf(stderr, "ERROR: Empty stage in pipeline '%s'\n", description);
+            return false;
+        }
+        if (pipeline->count == PIPELINE_MAX_STAGES) {
+            fprintf(stderr, "ERROR: Pipeline has more than %d stages\n", PIPELINE_MAX_STAGES);
+            return false;
+        }
+        if (!parse_stage(token, length, &pipeline->stages[pipeline->count])) {
+            return false;
+        }
+        pipeline->count++;
+
+        if (token[length] == '\0') {
+            return true;
+        }
+        token += length + 1;
+    }
+}
+
+// Stages work on `*image`. Convolutions filter it in place; grayscale and
+// resizes replace it with a new image and free the old one
+static void replace_image(image_t **image, image_t *replacement) {
+    image_free(*image);
+    *image = replacement;
+}
+
+// Alpha is kept, gray and gray+alpha images are left as they are
+static bool run_grayscale(image_t **image) {
+    image_t *gray = rgb_to_grayscale(*image);
+    if (!gray) {
+        return false;
+    }
+    if (gray != *image) {
+        replace_image(image, gray);
+    }
+    return true;
+}
+
+// Passes of one convolution stage. With `to_gray` the first pass also
+// converts the input to grayscale
+static bool run_convolve(image_t **image, const pipeline_stage_t *stage, bool to_gray,
+                         uint32_t threads, bool fuse) {
+    uint8_t steps = stage->steps;
+    if (to_gray) {
+        image_t *gray = image_create((*image)->width, (*image)->height, image_gray_channels((*image)->channels));
+        if (!gray || !apply_convolution_gray(*image, gray, stage->kernel, threads)) {
+            image_free(gray);
+            return false;
+        }
+        replace_image(image, gray);
+        steps--;
+    }
+
+    // The remaining passes filter the image in place
+    if (fuse && steps > 1 && box_blur_fused(*image, *image, stage->kernel, steps, threads)) {
+        return true;
+    }
+    for (uint8_t i = 0; i < steps; i++) {
+        if (!apply_convolution_in_place(*image, stage->kernel, threads)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool run_resize(image_t **image, const pipeline_stage_t *stage, resample_filter_t filter,
+                       uint32_t threads) {
+    uint32_t width, height;
+    resample_target_size((*image)->width, (*image)->height, &stage->size, &width, &height);
+    if (width == (*image)->width && height == (*image)->height) {
+        return true;
+    }
+
+    image_t *resized = resample_image(*image, width, height, filter, threads);
+    if (!resized) {
+        return false;
+    }
+    replace_image(image, resized);
+    return true;
+}
+
+image_t *pipeline_run(const pipeline_t *pipeline, image_t *image, uint32_t threads,
+                      bool fuse, resample_filter_t filter, bool verbose) {
+    bool ok = true;
+
+    for (uint32_t i = 0; ok && i < pipeline->count; i++) {
+        const pipeline_stage_t *stage = &pipeline->stages[i];
+        const pipeline_stage_t *next = (i + 1 < pipeline->count) ? &pipeline->stages[i + 1] : NULL;
+
+        // Fold grayscale into the next convolution, unless that one is a
+        // multi-step blur about to take the fused path. The folded reads
+        // are 8-bit only
+        bool fold_gray = stage->kind == STAGE_GRAYSCALE && image->channels > 2 &&
+                         image->bit_depth == 8 &&
+                         next && next->kind == STAGE_CONVOLVE &&
+                         !(fuse && next->steps > 1 && convolution_is_separable(next->kernel));
+
+        if (fold_gray) {
+            if (verbose) {
+                printf("Stage %u-%u: gray + %s", i + 1, i + 2, stage_name(next));
+                if (next->steps > 1) {
+                    printf(" (%u steps)", next->steps);
+                }
+                printf(", fused\n");
+            }
+            ok = run_convolve(&image, next, true, threads, fuse);
+            i++;
+            continue;
+        }
+
+        if (verbose) {
+            printf("Stage %u: %s", i + 1, stage_name(stage));
+            if (stage->kind == STAGE_CONVOLVE && stage->steps > 1) {
+                printf(" (%u steps)", stage->steps);
+            } else if (stage->kind == STAGE_RESIZE && stage->size.scale > 0.0f) {
+                printf(" x%g (%s)", stage->size.scale, resample_filter_name(filter));
+            } else if (stage->kind == STAGE_RESIZE) {
+                printf(" %ux%u (%s)", stage->size.width, stage->size.height, resample_filter_name(filter));
+            }
+            printf("\n");
+        }
+
+        switch (stage->kind) {
+            case STAGE_GRAYSCALE: ok = run_grayscale(&image); break;
+            case STAGE_CONVOLVE:  ok = run_convolve(&image, stage, false, threads, fuse); break;
+            case STAGE_RESIZE:    ok = run_resize(&image, stage, filter, threads); break;
+        }
+    }
+
+    if (!ok) {
+        image_free(image);
+        return NULL;
+    }
+    return image;
+}
@@ -1,10 +1,18 @@
 #include "../include/png_io.h"
 #include "../include/processor.h"
+#include "../include/zstream_cache.h"
+#include "../include/unpack.h"
+#include "../include/thread_pool.h"
+#include "../include/stats.h"
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 const uint8_t png_sig[PNG_SIG_SIZE] = {137, 80, 78, 71, 13, 10, 26, 10};
 
-void print_bytes(uint8_t *buffer, size_t buffer_size) {
+void print_bytes(const uint8_t *buffer, size_t buffer_size) {
     for(size_t i = 0; i < buffer_size-1; i++) {
         printf("%u ", buffer[i]);
     }
@@ -24,12 +32,13 @@ void read_bytes(FILE *file, void *buffer, size_t size) {
     }
 }
 
-void write_bytes(FILE *file, const void *buffer, size_t size) {
+bool write_bytes(FILE *file, const void *buffer, size_t size) {
     size_t n = fwrite(buffer, size, 1, file);
     if(1 != n) {
         fprintf(stderr, "ERROR: Could not write %zu bytes to file: %s\n", size, strerror(errno));
-        exit(1);
+        return false;
     }
+    return true;
 }
 
 uint32_t read_chunk_size(FILE *file) {
@@ -39,16 +48,16 @@ uint32_t read_chunk_size(FILE *file) {
     return size;
 }
 
-void write_chunk_size(FILE *file, uint32_t size) {
-    write_bytes(file, &size, sizeof(size));
+bool write_chunk_size(FILE *file, uint32_t size) {
+    return write_bytes(file, &size, sizeof(size));
 }
 
 void read_chunk_type(FILE *file, uint8_t *type) {
     read_bytes(file, type, 4);
 }
 
-void write_chunk_type(FILE *file, const char type[]) {
-    write_bytes(file, type, 4);  // Fixed: removed & operator
+bool write_chunk_type(FILE *file, const char type[]) {
+    return write_bytes(file, type, 4);  // Fixed: removed & operator
 }
 
 uint32_t read_chunk_crc(FILE *file) {
@@ -58,55 +67,289 @@ uint32_t read_chunk_crc(FILE *file) {
     return crc;
 }
 
-void write_chunk_crc(FILE *file, uint32_t crc) {
-    write_bytes(file, &crc, sizeof(crc));
+bool write_chunk_crc(FILE *file, uint32_t crc) {
+    return write_bytes(file, &crc, sizeof(crc));
 }
 
-void write_chunk(FILE *file, const char type[], uint8_t *data, uint32_t length_le) {
+bool write_chunk(FILE *file, const char type[], const uint8_t *data, uint32_t length_le) {
+    uint64_t start = stats_begin();
+
     // Convert length to big endian for writing
     uint32_t length_be = length_le;
     reverse(&length_be, sizeof(length_be));
-    write_bytes(file, &length_be, sizeof(length_be));
-
-    // Write chunk type
-    write_bytes(file, type, 4);  // Fixed: removed & operator
+    if(!write_bytes(file, &length_be, sizeof(length_be)) ||
+       !write_bytes(file, type, 4)) {  // Fixed: removed & operator
+        return false;
+    }
 
     // Write data if it exists
+    if(length_le > 0 && data != NULL && !write_bytes(file, data, length_le)) {
+        return false;
+    }
+
+    // The CRC covers type and data, fed one after the other
+    uint32_t state = crc32_update(CRC32_INIT, type, 4);
     if(length_le > 0 && data != NULL) {
-        write_bytes(file, data, length_le);
+        state = crc32_update(state, data, length_le);
     }
+    uint32_t crc_val = crc32_final(state);
+    reverse(&crc_val, sizeof(crc_val));
+    bool ok = write_bytes(file, &crc_val, sizeof(crc_val));
+    stats_end(STATS_WRITE, start, 12 + (uint64_t)length_le);
+    return ok;
+}
+
+#define PNG_TRIAL_BUFFER_SIZE (16 * 1024)
 
-    // Calculate and write CRC
-    uint8_t *crc_buf = malloc(4 + length_le);
-    if(!crc_buf) {
-        fprintf(stderr, "ERROR: Could not allocate memory for CRC calculation\n");
-        exit(1);
+void png_write_options_default(png_write_options_t *options) {
+    options->idat_chunk_size = PNG_IDAT_CHUNK_SIZE;
+    options->level = Z_DEFAULT_COMPRESSION;
+    options->filter_strategy = FILTER_STRATEGY_MINSAD;
+    options->filter_type = FILTER_NONE;
+    options->threads = 1;
+}
+
+static void free_row_buffers(png_writer_t *writer) {
+    free(writer->previous);
+    free(writer->candidates);
+    free(writer->trial_buffer);
+    free(writer->packed);
+    writer->previous = NULL;
+    writer->candidates = NULL;
+    writer->trial_buffer = NULL;
+    writer->packed = NULL;
+}
+
+// Write out whatever compressed data the IDAT buffer holds as one chunk.
+// A strip writer keeps everything instead and grows its buffer
+static bool flush_idat(png_writer_t *writer) {
+    png_strip_t *strip = writer->strip;
+    if (strip) {
+        strip->size = (size_t)(writer->stream->next_out - strip->data);
+        if (writer->stream->avail_out == 0) {
+            uint8_t *grown = realloc(strip->data, strip->capacity * 2);
+            if (!grown) {
+                fprintf(stderr, "ERROR: Could not allocate memory for compressed strip\n");
+                return false;
+            }
+            stats_alloc(strip->capacity);
+            strip->data = grown;
+            strip->capacity *= 2;
+        }
+        writer->stream->next_out = strip->data + strip->size;
+        writer->stream->avail_out = (uInt)(strip->capacity - strip->size);
+        return true;
     }
 
-    memcpy(crc_buf, type, 4);
-    if(length_le > 0 && data != NULL) {
-        memcpy(crc_buf + 4, data, length_le);
+    size_t pending = writer->idat_chunk_size - writer->stream->avail_out;
+    if (pending > 0 && !write_chunk(writer->file, "IDAT", writer->idat_buffer, (uint32_t)pending)) {
+        return false;
     }
+    writer->stream->next_out = writer->idat_buffer;
+    writer->stream->avail_out = (uInt)writer->idat_chunk_size;
+    return true;
+}
 
-    uint32_t crc_val = crc(crc_buf, 4 + length_le);
-    reverse(&crc_val, sizeof(crc_val));
-    write_bytes(file, &crc_val, sizeof(crc_val));
+// Copy already compressed bytes into the IDAT stream; the deflate stream's
+// output window doubles as the write cursor
+static bool append_idat(png_writer_t *writer, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        size_t take = size < writer->stream->avail_out ? size : writer->stream->avail_out;
+        memcpy(writer->stream->next_out, data, take);
+        writer->stream->next_out += take;
+        writer->stream->avail_out -= (uInt)take;
+        data += take;
+        size -= take;
+        if (writer->stream->avail_out == 0 && !flush_idat(writer)) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    free(crc_buf);
+// Deflate `size` bytes, emitting an IDAT chunk every time the buffer fills up
+static bool deflate_bytes(png_writer_t *writer, const uint8_t *data, size_t size, int flush) {
+    writer->stream->next_in = (Bytef *)data;
+    writer->stream->avail_in = (uInt)size;
+
+    while (true) {
+        uint64_t start = stats_begin();
+        uInt before = writer->stream->avail_in;
+        int result = deflate(writer->stream, flush);
+        stats_end(STATS_DEFLATE, start, before - writer->stream->avail_in);
+        if (result == Z_STREAM_ERROR) {
+            fprintf(stderr, "ERROR: Failed to compress image data (error: %d)\n", result);
+            return false;
+        }
+        if (writer->stream->avail_out == 0) {
+            if (!flush_idat(writer)) {
+                return false;
+            }
+            continue;
+        }
+        if (flush == Z_FINISH ? result == Z_STREAM_END : writer->stream->avail_in == 0) {
+            return true;
+        }
+    }
+}
+
+// Bytes the row would add to the stream so far, measured on a copy of the deflate state
+static uint64_t trial_compress(png_writer_t *writer, const uint8_t *data, size_t size) {
+    z_stream trial;
+    if (deflateCopy(&trial, writer->stream) != Z_OK) {
+        return UINT64_MAX;
+    }
+
+    trial.next_in = (Bytef *)data;
+    trial.avail_in = (uInt)size;
+
+    // A sync flush forces the row out so the candidates can be compared
+    uint64_t produced = 0;
+    do {
+        trial.next_out = writer->trial_buffer;
+        trial.avail_out = PNG_TRIAL_BUFFER_SIZE;
+        if (deflate(&trial, Z_SYNC_FLUSH) == Z_STREAM_ERROR) {
+            produced = UINT64_MAX;
+            break;
+        }
+        produced += PNG_TRIAL_BUFFER_SIZE - trial.avail_out;
+    } while (trial.avail_out == 0);
+
+    deflateEnd(&trial);
+    return produced;
+}
+
+// Filter `row` with the writer's strategy, returns filter byte + filtered data
+static const uint8_t *choose_filter(png_writer_t *writer, const uint8_t *row) {
+    size_t candidate_size = 1 + writer->row_bytes;
+    uint32_t length = (uint32_t)writer->row_bytes;
+
+    if (writer->filter_strategy == FILTER_STRATEGY_FIXED) {
+        uint8_t type = writer->filter_type;
+        if (writer->restart && type > FILTER_SUB) {
+            // Against a zero row above Up is None and Paeth is Sub
+            type = (type == FILTER_UP) ? FILTER_NONE : FILTER_SUB;
+        }
+        uint8_t *out = writer->candidates;
+        out[0] = type;
+        filter_scanline(out + 1, row, writer->previous, length, writer->bpp, type);
+        return out;
+    }
+
+    uint8_t best = FILTER_NONE;
+    uint64_t best_cost = UINT64_MAX;
+    uint8_t type_count = writer->restart ? FILTER_SUB + 1 : FILTER_COUNT;
+    for (uint8_t type = FILTER_NONE; type < type_count; type++) {
+        uint8_t *out = writer->candidates + type * candidate_size;
+        out[0] = type;
+        filter_scanline(out + 1, row, writer->previous, length, writer->bpp, type);
+
+        uint64_t cost = (writer->filter_strategy == FILTER_STRATEGY_BRUTE)
+                      ? trial_compress(writer, out, candidate_size)
+                      : filter_cost_sad(out + 1, length);
+        if (cost < best_cost) {
+            best_cost = cost;
+            best = type;
+        }
+    }
+    return writer->candidates + best * candidate_size;
+}
+
+// Scratch rows for filtering, sized from the writer's settings
+static bool alloc_row_buffers(png_writer_t *writer) {
+    size_t candidate_rows = (writer->filter_strategy == FILTER_STRATEGY_FIXED) ? 1 : FILTER_COUNT;
+    writer->previous = calloc(writer->row_bytes, 1);
+    writer->candidates = malloc(candidate_rows * (1 + writer->row_bytes));
+    if (writer->filter_strategy == FILTER_STRATEGY_BRUTE) {
+        writer->trial_buffer = malloc(PNG_TRIAL_BUFFER_SIZE);
+    }
+    if (writer->bit_depth != 8) {
+        writer->packed = malloc(writer->row_bytes);
+    }
+    if (!writer->previous || !writer->candidates ||
+        (writer->filter_strategy == FILTER_STRATEGY_BRUTE && !writer->trial_buffer) ||
+        (writer->bit_depth != 8 && !writer->packed)) {
+        free_row_buffers(writer);
+        return false;
+    }
+    return true;
 }
 
-void save_png(const char *filename, uint8_t **pixels,
-              uint32_t width, uint32_t height,
-              uint8_t color_type, uint32_t channels) {
-    FILE *file = fopen(filename, "wb");
-    if(!file) {
+bool png_writer_open(png_writer_t *writer, const char *filename,
+                     uint32_t width, uint32_t height, uint8_t color_type, uint8_t bit_depth,
+                     const png_write_options_t *options) {
+    memset(writer, 0, sizeof(png_writer_t));
+
+    png_write_options_t defaults;
+    if (!options) {
+        png_write_options_default(&defaults);
+        options = &defaults;
+    }
+
+    uint32_t channels;
+    switch (color_type) {
+        case 0: channels = 1; break;
+        case 2: channels = 3; break;
+        case 3: channels = 1; break;
+        case 4: channels = 2; break;
+        case 6: channels = 4; break;
+        default:
+            fprintf(stderr, "ERROR: Unsupported output color type: %u\n", color_type);
+            return false;
+    }
+    bool indexed_depth = (bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8);
+    if (color_type == 3 ? !indexed_depth : (bit_depth != 8 && bit_depth != 16)) {
+        fprintf(stderr, "ERROR: Unsupported output bit depth: %u\n", bit_depth);
+        return false;
+    }
+
+    if (options->filter_strategy == FILTER_STRATEGY_FIXED && options->filter_type > FILTER_PAETH) {
+        fprintf(stderr, "ERROR: Invalid filter type: %u\n", options->filter_type);
+        return false;
+    }
+
+    writer->width = width;
+    writer->height = height;
+    writer->row_bytes = ((size_t)width * channels * bit_depth + 7) / 8;
+    writer->bpp = (channels * bit_depth >= 8) ? channels * bit_depth / 8 : 1;
+    writer->bit_depth = bit_depth;
+    writer->idat_chunk_size = options->idat_chunk_size ? options->idat_chunk_size : PNG_IDAT_CHUNK_SIZE;
+    writer->filter_strategy = options->filter_strategy;
+    writer->filter_type = options->filter_type;
+    if (color_type == 3 && writer->filter_strategy == FILTER_STRATEGY_MINSAD) {
+        // Differences of palette indices mean nothing, the PNG spec
+        // recommends no filter for indexed images
+        writer->filter_strategy = FILTER_STRATEGY_FIXED;
+        writer->filter_type = FILTER_NONE;
+    }
+
+    writer->idat_buffer = malloc(writer->idat_chunk_size);
+    if (!writer->idat_buffer || !alloc_row_buffers(writer)) {
+        fprintf(stderr, "ERROR: Could not allocate memory for PNG writer\n");
+        free(writer->idat_buffer);
+        writer->idat_buffer = NULL;
+        return false;
+    }
+
+    writer->level = options->level;
+    writer->stream = zstream_deflate_acquire(options->level);
+    if (!writer->stream) {
+        free(writer->idat_buffer);
+        free_row_buffers(writer);
+        writer->idat_buffer = NULL;
+        return false;
+    }
+    writer->stream->next_out = writer->idat_buffer;
+    writer->stream->avail_out = (uInt)writer->idat_chunk_size;
+
+    writer->file = fopen(filename, "wb");
+    if (!writer->file) {
         fprintf(stderr, "ERROR: Could not create output file %s\n", filename);
-        exit(1);
+        png_writer_abort(writer);
+        return false;
     }
 
     // Write PNG signature
-    write_bytes(file, png_sig, PNG_SIG_SIZE);
-
     // Create IHDR chunk
     uint8_t ihdr_data[13];
     uint32_t width_be = width;
@@ -116,224 +359,613 @@ void save_png(const char *filename, uint8_t **pixels,
 
     memcpy(ihdr_data, &width_be, sizeof(width_be));
     memcpy(ihdr_data + 4, &height_be, sizeof(height_be));
-    ihdr_data[8] = 8;          // bit depth
+    ihdr_data[8] = bit_depth;  // bit depth
     ihdr_data[9] = color_type; // color type
     ihdr_data[10] = 0;         // compression method
     ihdr_data[11] = 0;         // filter method
     ihdr_data[12] = 0;         // interlace method
 
-    write_chunk(file, "IHDR", ihdr_data, sizeof(ihdr_data));
+    if (!write_bytes(writer->file, png_sig, PNG_SIG_SIZE) ||
+        !write_chunk(writer->file, "IHDR", ihdr_data, sizeof(ihdr_data))) {
+        png_writer_abort(writer);
+        return false;
+    }
+    return true;
+}
 
-    // Prepare image data with filter bytes
-    uint32_t bytes_per_pixel = (color_type == 0) ? 1 : channels;
-    uint64_t raw_size = height * (1 + width * bytes_per_pixel);
-    uint8_t *raw_data = malloc(raw_size);
-    if(!raw_data) {
-        fprintf(stderr, "ERROR: Could not allocate memory for raw data\n");
-        fclose(file);
-        exit(1);
+bool png_writer_write_palette(png_writer_t *writer, const image_palette_t *palette) {
+    if (writer->rows_written > 0 || palette->count == 0 || palette->count > (1u << writer->bit_depth)) {
+        fprintf(stderr, "ERROR: Palette of %u entries does not fit the output\n", palette->count);
+        return false;
     }
 
-    // Copy pixel data with filter bytes
-    for(uint32_t y = 0; y < height; y++) {
-        uint64_t row_offset = y * (1 + width * bytes_per_pixel);
-        raw_data[row_offset] = 0; // filter type: None
-        memcpy(raw_data + row_offset + 1, pixels[y], width * bytes_per_pixel);
+    uint8_t plte[256 * 3];
+    uint8_t trns[256];
+    for (uint32_t i = 0; i < palette->count; i++) {
+        memcpy(plte + i * 3, palette->entries[i], 3);
+        trns[i] = palette->entries[i][3];
     }
+    return write_chunk(writer->file, "PLTE", plte, palette->count * 3) &&
+           (palette->alpha_count == 0 || write_chunk(writer->file, "tRNS", trns, palette->alpha_count));
+}
 
-    // Compress data
-    uLongf compressed_size = compressBound(raw_size);
-    uint8_t *compressed_data = malloc(compressed_size);
-    if(!compressed_data) {
-        fprintf(stderr, "ERROR: Could not allocate memory for compressed data\n");
-        free(raw_data);
-        fclose(file);
-        exit(1);
+bool png_writer_write_rows(png_writer_t *writer, const uint8_t *rows, uint32_t count, size_t stride) {
+    if (writer->rows_written + count > writer->height) {
+        fprintf(stderr, "ERROR: Too many rows written (%u of %u)\n", writer->rows_written + count, writer->height);
+        return false;
     }
 
-    int result = compress2(compressed_data, &compressed_size, raw_data, raw_size, Z_DEFAULT_COMPRESSION);
-    if(result != Z_OK) {
-        fprintf(stderr, "ERROR: Failed to compress image data (error: %d)\n", result);
-        free(raw_data);
-        free(compressed_data);
-        fclose(file);
-        exit(1);
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t *row = rows + (size_t)i * stride;
+        if (writer->bit_depth == 16) {
+            // PNG stores 16-bit samples big-endian
+            pack_16((const uint16_t *)row, writer->packed, writer->row_bytes / 2);
+            row = writer->packed;
+        } else if (writer->bit_depth < 8) {
+            pack_sub_byte(row, writer->packed, writer->width, writer->bit_depth);
+            row = writer->packed;
+        }
+        uint64_t start = stats_begin();
+        const uint8_t *filtered = choose_filter(writer, row);
+        stats_end(STATS_FILTER, start, writer->row_bytes);
+        if (!deflate_bytes(writer, filtered, 1 + writer->row_bytes, Z_NO_FLUSH)) {
+            return false;
+        }
+        // Rows may live in a caller buffer that gets reused, keep our own copy
+        memcpy(writer->previous, row, writer->row_bytes);
+        writer->restart = false;
     }
+    writer->rows_written += count;
+    return true;
+}
 
-    // Write IDAT chunk
-    write_chunk(file, "IDAT", compressed_data, (uint32_t)compressed_size);
+// Write the last IDAT and IEND, close the file and release the writer
+static bool finish_file(png_writer_t *writer) {
+    // Write the last IDAT and the IEND chunk
+    if (!flush_idat(writer) || !write_chunk(writer->file, "IEND", NULL, 0)) {
+        png_writer_abort(writer);
+        return false;
+    }
+
+    uint64_t start = stats_begin();
+    bool ok = (fclose(writer->file) == 0);
+    stats_end(STATS_WRITE, start, 0);
+    writer->file = NULL;
+    if (!ok) {
+        fprintf(stderr, "ERROR: Could not finish writing output file: %s\n", strerror(errno));
+    }
+    png_writer_abort(writer);
+    return ok;
+}
+
+bool png_writer_finish(png_writer_t *writer) {
+    if (writer->rows_written != writer->height) {
+        fprintf(stderr, "ERROR: Only %u of %u rows were written\n", writer->rows_written, writer->height);
+        png_writer_abort(writer);
+        return false;
+    }
+
+    if (!deflate_bytes(writer, NULL, 0, Z_FINISH)) {
+        png_writer_abort(writer);
+        return false;
+    }
+    return finish_file(writer);
+}
+
+void png_writer_abort(png_writer_t *writer) {
+    if (writer->idat_buffer) {
+        zstream_deflate_release(writer->stream, writer->level);
+        writer->stream = NULL;
+        free(writer->idat_buffer);
+        free_row_buffers(writer);
+        writer->idat_buffer = NULL;
+    }
+    if (writer->file) {
+        fclose(writer->file);
+        writer->file = NULL;
+    }
+}
 
-    // Write IEND chunk
-    write_chunk(file, "IEND", NULL, 0);
+static void store_be32(uint8_t *p, uint32_t value) {
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
 
-    free(raw_data);
-    free(compressed_data);
-    fclose(file);
+static void store_be64(uint8_t *p, uint64_t value) {
+    store_be32(p, (uint32_t)(value >> 32));
+    store_be32(p + 4, (uint32_t)value);
+}
 
-    printf("Successfully saved output image to: %s\n", filename);
+// Deflate one strip of `image` into memory with a writer of its own, on
+// whichever thread runs it. The stream ends on a sync flush, or is finished
+// for the last strip
+static bool compress_strip(const png_writer_t *base, const image_t *image, png_strip_t *strip, bool last) {
+    png_writer_t writer = *base;
+    writer.file = NULL;
+    writer.idat_buffer = NULL;
+    writer.previous = NULL;
+    writer.candidates = NULL;
+    writer.trial_buffer = NULL;
+    writer.packed = NULL;
+    writer.height = strip->rows;
+    writer.rows_written = 0;
+    writer.strip = strip;
+    writer.restart = strip->first_row > 0;
+
+    size_t raw_size = (size_t)strip->rows * (1 + writer.row_bytes);
+    strip->capacity = raw_size / 4 + 1024;
+    strip->data = malloc(strip->capacity);
+    stats_alloc(strip->capacity);
+    if (!strip->data || !alloc_row_buffers(&writer)) {
+        fprintf(stderr, "ERROR: Could not allocate memory for PNG writer\n");
+        return false;
+    }
+    writer.stream = zstream_deflate_acquire(writer.level);
+    if (!writer.stream) {
+        free_row_buffers(&writer);
+        return false;
+    }
+    writer.stream->next_out = strip->data;
+    writer.stream->avail_out = (uInt)strip->capacity;
+
+    bool ok = png_writer_write_rows(&writer, image->data + (size_t)strip->first_row * image->stride,
+                                    strip->rows, image->stride) &&
+              deflate_bytes(&writer, NULL, 0, last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (ok) {
+        strip->size = (size_t)(writer.stream->next_out - strip->data);
+        strip->adler = writer.stream->adler;
+    }
+    zstream_deflate_release(writer.stream, writer.level);
+    free_row_buffers(&writer);
+    return ok;
 }
 
-bool read_png_file(const char *filename, png_data_t *png_data) {
-    // Initialize png_data structure
-    memset(png_data, 0, sizeof(png_data_t));
+typedef struct {
+    const png_writer_t *writer;
+    const image_t *image;
+    png_strip_t *strips;
+    uint32_t strip_count;
+    uint32_t task_count;
+} strip_job_t;
+
+// Task `index` takes every task_count-th strip
+static void compress_strips_task(void *arg, uint32_t index) {
+    strip_job_t *job = arg;
+    for (uint32_t i = index; i < job->strip_count; i += job->task_count) {
+        job->strips[i].failed = !compress_strip(job->writer, job->image, &job->strips[i],
+                                                i + 1 == job->strip_count);
+    }
+}
 
-    FILE *input_fp = fopen(filename, "rb");
-    if (!input_fp) {
-        fprintf(stderr, "ERROR: Could not open input file %s\n", filename);
+// Compress the strips in parallel, then write the strip index and stitch
+// the strips into one zlib stream: every strip after the first loses its
+// zlib header, the last one its Adler-32, and the combined checksum of all
+// of them closes the stream
+static bool write_strips(png_writer_t *writer, const image_t *image, uint32_t rows_per_strip, uint32_t threads) {
+    uint32_t strip_count = (image->height + rows_per_strip - 1) / rows_per_strip;
+    png_strip_t *strips = calloc(strip_count, sizeof(png_strip_t));
+    uint8_t *index = malloc(1 + (size_t)strip_count * PNG_STRIP_ENTRY_SIZE);
+    if (!strips || !index) {
+        fprintf(stderr, "ERROR: Could not allocate memory for PNG strips\n");
+        free(strips);
+        free(index);
+        png_writer_abort(writer);
         return false;
     }
+    for (uint32_t i = 0; i < strip_count; i++) {
+        strips[i].first_row = i * rows_per_strip;
+        strips[i].rows = (i + 1 < strip_count) ? rows_per_strip : image->height - strips[i].first_row;
+    }
 
-    // Check PNG signature
-    uint8_t signature[PNG_SIG_SIZE];
-    read_bytes(input_fp, signature, PNG_SIG_SIZE);
-    if (memcmp(signature, png_sig, PNG_SIG_SIZE) != 0) {
-        fprintf(stderr, "ERROR: %s is not a PNG file\n", filename);
-        fclose(input_fp);
+    strip_job_t job = {writer, image, strips, strip_count, threads < strip_count ? threads : strip_count};
+    thread_pool_run(thread_pool_shared(), job.task_count, compress_strips_task, &job);
+
+    bool ok = true;
+    for (uint32_t i = 0; i < strip_count; i++) {
+        ok = ok && !strips[i].failed;
+    }
+
+    if (ok) {
+        index[0] = PNG_STRIP_VERSION;
+        uint64_t position = 0;
+        for (uint32_t i = 0; i < strip_count; i++) {
+            uint8_t *entry = index + 1 + (size_t)i * PNG_STRIP_ENTRY_SIZE;
+            size_t start = (i == 0) ? 0 : 2;
+            size_t end = strips[i].size - ((i + 1 == strip_count) ? 4 : 0);
+            // Only the first strip keeps its zlib header in front of the deflate data
+            store_be32(entry, strips[i].first_row);
+            store_be64(entry + 4, position + 2 - start);
+            position += end - start;
+        }
+        ok = write_chunk(writer->file, PNG_STRIP_CHUNK, index, (uint32_t)(1 + (size_t)strip_count * PNG_STRIP_ENTRY_SIZE));
+
+        uLong adler = strips[0].adler;
+        for (uint32_t i = 0; ok && i < strip_count; i++) {
+            size_t start = (i == 0) ? 0 : 2;
+            size_t end = strips[i].size - ((i + 1 == strip_count) ? 4 : 0);
+            ok = append_idat(writer, strips[i].data + start, end - start);
+            if (i > 0) {
+                adler = adler32_combine(adler, strips[i].adler,
+                                        (z_off_t)((size_t)strips[i].rows * (1 + writer->row_bytes)));
+            }
+        }
+        uint8_t trailer[4];
+        store_be32(trailer, (uint32_t)adler);
+        ok = ok && append_idat(writer, trailer, sizeof(trailer));
+    }
+
+    for (uint32_t i = 0; i < strip_count; i++) {
+        free(strips[i].data);
+        stats_free(strips[i].capacity);
+    }
+    free(strips);
+    free(index);
+
+    if (!ok) {
+        png_writer_abort(writer);
         return false;
     }
+    writer->rows_written = writer->height;
+    return finish_file(writer);
+}
 
-    printf("Processing: %s\n", filename);
+// Smallest index depth that holds `count` palette entries
+static uint8_t palette_bit_depth(uint32_t count) {
+    return (count <= 2) ? 1 : (count <= 4) ? 2 : (count <= 16) ? 4 : 8;
+}
 
-    uint64_t idat_capacity = 0;
-    bool quit = false;
+uint8_t png_color_type_of(const image_t *image) {
+    static const uint8_t by_channels[5] = {0, 0, 4, 2, 6};
+    return image->palette ? 3 : by_channels[image->channels <= 4 ? image->channels : 0];
+}
 
-    while (!quit) {
-        uint32_t chunk_size = read_chunk_size(input_fp);
-        uint8_t chunk_type[4];
-        read_chunk_type(input_fp, chunk_type);
+bool save_png(const char *filename, const image_t *image, uint8_t color_type,
+              const png_write_options_t *options) {
+    if ((color_type == 3) != (image->palette != NULL)) {
+        fprintf(stderr, "ERROR: Colour type 3 needs an indexed image and indexed images need it\n");
+        return false;
+    }
+    if (image->channels > 4 || png_color_type_of(image) != color_type) {
+        fprintf(stderr, "ERROR: Colour type %u does not match a %u channel image\n", color_type, image->channels);
+        return false;
+    }
+    uint8_t bit_depth = image->palette ? palette_bit_depth(image->palette->count) : (uint8_t)image->bit_depth;
 
-        if (memcmp(chunk_type, "IHDR", 4) == 0) {
-            read_bytes(input_fp, &png_data->ihdr.width, 4);
-            read_bytes(input_fp, &png_data->ihdr.height, 4);
-            read_bytes(input_fp, &png_data->ihdr.bit_depth, 1);
-            read_bytes(input_fp, &png_data->ihdr.color_type, 1);
-            read_bytes(input_fp, &png_data->ihdr.compression, 1);
-            read_bytes(input_fp, &png_data->ihdr.filter, 1);
-            read_bytes(input_fp, &png_data->ihdr.interlace, 1);
+    png_writer_t writer;
+    if (!png_writer_open(&writer, filename, image->width, image->height, color_type, bit_depth, options)) {
+        return false;
+    }
+    if (image->palette && !png_writer_write_palette(&writer, image->palette)) {
+        png_writer_abort(&writer);
+        return false;
+    }
+
+    // Only an explicit thread count picks the strip layout, so the bytes
+    // written never depend on the host's core count
+    uint32_t threads = options ? options->threads : 1;
+    uint32_t rows_per_strip = (uint32_t)(PNG_STRIP_BYTES / (1 + writer.row_bytes));
+    if (rows_per_strip == 0) {
+        rows_per_strip = 1;
+    }
+    if (threads > 1 && image->height > rows_per_strip) {
+        return write_strips(&writer, image, rows_per_strip, threads);
+    }
 
-            reverse(&png_data->ihdr.width, sizeof(png_data->ihdr.width));
-            reverse(&png_data->ihdr.height, sizeof(png_data->ihdr.height));
+    // Rows go straight from the image into deflate, no intermediate copy
+    if (!png_writer_write_rows(&writer, image->data, image->height, image->stride) ||
+        !png_writer_finish(&writer)) {
+        png_writer_abort(&writer);
+        return false;
+    }
+    return true;
+}
 
-            printf("Image dimensions: %u x %u\n", png_data->ihdr.width, png_data->ihdr.height);
-            printf("Bit depth: %u, Color type: %u\n", png_data->ihdr.bit_depth, png_data->ihdr.color_type);
-        } else if (memcmp(chunk_type, "PLTE", 4) == 0) {
-            png_data->palette.entry_count = chunk_size / 3;
-            png_data->palette.entries = malloc(chunk_size);
-            if (!png_data->palette.entries) {
-                fprintf(stderr, "ERROR: Could not allocate memory for PLTE\n");
-                fclose(input_fp);
-                return false;
-            }
-            read_bytes(input_fp, png_data->palette.entries, chunk_size);
-        } else if (memcmp(chunk_type, "tRNS", 4) == 0) {
-            png_data->palette.alpha_count = chunk_size;
-            png_data->palette.alphas = malloc(chunk_size);
-            if (!png_data->palette.alphas) {
-                fprintf(stderr, "ERROR: Could not allocate memory for tRNS\n");
-                fclose(input_fp);
+static uint32_t load_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Walks the chunk list once, recording every chunk that fits in the file
+static bool index_chunks(png_map_t *map, const char *filename) {
+    uint32_t capacity = 16;
+    map->chunks = malloc(capacity * sizeof(png_chunk_t));
+    if (!map->chunks) {
+        fprintf(stderr, "ERROR: Could not allocate memory for chunk index\n");
+        return false;
+    }
+
+    size_t pos = PNG_SIG_SIZE;
+    while (!map->complete) {
+        // length + type + CRC
+        if (map->size - pos < 12) {
+            break;
+        }
+        uint32_t length = load_be32(map->data + pos);
+        if (length > 0x7fffffffu || map->size - pos - 12 < length) {
+            break;
+        }
+
+        if (map->chunk_count == capacity) {
+            capacity *= 2;
+            png_chunk_t *chunks = realloc(map->chunks, capacity * sizeof(png_chunk_t));
+            if (!chunks) {
+                fprintf(stderr, "ERROR: Could not allocate memory for chunk index\n");
                 return false;
             }
-            read_bytes(input_fp, png_data->palette.alphas, chunk_size);
-        } else if (memcmp(chunk_type, "IDAT", 4) == 0) {
-            if (idat_capacity < png_data->idat_size + chunk_size) {
-                idat_capacity = (png_data->idat_size + chunk_size) * 2;
-                uint8_t *new_idat_data = realloc(png_data->idat_data, idat_capacity);
-                if (!new_idat_data) {
-                    fprintf(stderr, "ERROR: Could not reallocate memory for IDAT\n");
-                    free(png_data->idat_data);
-                    fclose(input_fp);
-                    return false;
-                }
-                png_data->idat_data = new_idat_data;
-            }
-            read_bytes(input_fp, png_data->idat_data + png_data->idat_size, chunk_size);
-            png_data->idat_size += chunk_size;
-        } else if (memcmp(chunk_type, "IEND", 4) == 0) {
-            quit = true;
-        } else {
-            fseek(input_fp, chunk_size, SEEK_CUR);
+            map->chunks = chunks;
+        }
+
+        // The CRC covers the type and the payload, which are adjacent in the file
+        png_chunk_t *chunk = &map->chunks[map->chunk_count++];
+        chunk->offset = pos + 8;
+        chunk->length = length;
+        memcpy(chunk->type, map->data + pos + 4, 4);
+        chunk->crc_ok = crc(map->data + pos + 4, (size_t)length + 4) == load_be32(map->data + chunk->offset + length);
+
+        pos = chunk->offset + length + 4;
+        if (memcmp(chunk->type, "IEND", 4) == 0) {
+            map->complete = true;
+        }
+    }
+
+    if (!map->complete) {
+        fprintf(stderr, "WARNING: %s is truncated after %u chunks\n", filename, map->chunk_count);
+    }
+    return true;
+}
+
+// Signature check and chunk index shared by both ways of opening a map
+static bool check_and_index(png_map_t *map, const char *name) {
+    if (memcmp(map->data, png_sig, PNG_SIG_SIZE) != 0) {
+        fprintf(stderr, "ERROR: %s is not a PNG file\n", name);
+        png_map_close(map);
+        return false;
+    }
+
+    if (!index_chunks(map, name)) {
+        png_map_close(map);
+        return false;
+    }
+    return true;
+}
+
+bool png_map_open(const char *filename, png_map_t *map) {
+    memset(map, 0, sizeof(png_map_t));
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Could not open input file %s: %s\n", filename, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "ERROR: Could not stat %s: %s\n", filename, strerror(errno));
+        close(fd);
+        return false;
+    }
+    if (st.st_size < PNG_SIG_SIZE) {
+        fprintf(stderr, "ERROR: %s is not a PNG file\n", filename);
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps its own reference to the file
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Could not map %s: %s\n", filename, strerror(errno));
+        return false;
+    }
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+    map->data = data;
+    map->size = (size_t)st.st_size;
+    map->mapped = true;
+
+    return check_and_index(map, filename);
+}
+
+bool png_map_open_memory(const uint8_t *data, size_t size, const char *name, png_map_t *map) {
+    memset(map, 0, sizeof(png_map_t));
+    if (size < PNG_SIG_SIZE) {
+        fprintf(stderr, "ERROR: %s is not a PNG file\n", name);
+        return false;
+    }
+    map->data = data;
+    map->size = size;
+    return check_and_index(map, name);
+}
+
+uint32_t png_map_find(const png_map_t *map, const char type[4], uint32_t start) {
+    for (uint32_t i = start; i < map->chunk_count; i++) {
+        if (memcmp(map->chunks[i].type, type, 4) == 0) {
+            return i;
         }
+    }
+    return map->chunk_count;
+}
+
+void png_map_close(png_map_t *map) {
+    if (map->mapped) {
+        munmap((void *)map->data, map->size);
+        map->mapped = false;
+    }
+    map->data = NULL;
+    free(map->chunks);
+    map->chunks = NULL;
+    map->chunk_count = 0;
+}
 
-        read_chunk_crc(input_fp);
+// Parse IHDR, PLTE, tRNS and the strip index of an indexed map and find the first IDAT
+static bool parse_header_chunks(png_reader_t *reader, const char *filename) {
+    png_map_t *map = &reader->map;
+
+    if (map->chunk_count == 0 || memcmp(map->chunks[0].type, "IHDR", 4) != 0 ||
+        map->chunks[0].length < 13) {
+        fprintf(stderr, "ERROR: IHDR chunk missing in %s\n", filename);
+        png_reader_close(reader);
+        return false;
     }
 
-    fclose(input_fp);
+    // PLTE and tRNS must precede the first IDAT, so everything needed for
+    // decoding is known once we get there
+    uint32_t i = 0;
+    for (; i < map->chunk_count; i++) {
+        const png_chunk_t *chunk = &map->chunks[i];
+        const uint8_t *data = png_chunk_data(map, chunk);
+
+        // A damaged critical chunk makes the image unreliable, ancillary ones
+        // are not needed for decoding
+        if (!chunk->crc_ok && !(chunk->type[0] & 0x20)) {
+            fprintf(stderr, "ERROR: CRC mismatch in %.4s chunk of %s\n", chunk->type, filename);
+            png_reader_close(reader);
+            return false;
+        }
+
+        if (memcmp(chunk->type, "IHDR", 4) == 0) {
+            reader->ihdr.width = load_be32(data);
+            reader->ihdr.height = load_be32(data + 4);
+            reader->ihdr.bit_depth = data[8];
+            reader->ihdr.color_type = data[9];
+            reader->ihdr.compression = data[10];
+            reader->ihdr.filter = data[11];
+            reader->ihdr.interlace = data[12];
+        } else if (memcmp(chunk->type, "PLTE", 4) == 0) {
+            reader->palette.entry_count = chunk->length / 3;
+            reader->palette.entries = (const rgb_t *)data;
+        } else if (memcmp(chunk->type, "tRNS", 4) == 0) {
+            reader->palette.alpha_count = chunk->length;
+            reader->palette.alphas = data;
+        } else if (memcmp(chunk->type, PNG_STRIP_CHUNK, 4) == 0 && chunk->crc_ok) {
+            reader->strip_index = data;
+            reader->strip_index_length = chunk->length;
+        } else if (memcmp(chunk->type, "IDAT", 4) == 0) {
+            break;
+        }
+    }
+
+    if (i == map->chunk_count) {
+        fprintf(stderr, "ERROR: No IDAT chunks found in %s\n", filename);
+        png_reader_close(reader);
+        return false;
+    }
+    reader->next_chunk = i;
+
     return true;
 }
 
-void free_png_data(png_data_t *png_data) {
-    if (png_data->palette.entries) {
-        free(png_data->palette.entries);
-        png_data->palette.entries = NULL;
+bool png_reader_open(const char *filename, png_reader_t *reader) {
+    uint64_t start = stats_begin();
+    memset(reader, 0, sizeof(png_reader_t));
+    if (!png_map_open(filename, &reader->map)) {
+        return false;
     }
-    if (png_data->palette.alphas) {
-        free(png_data->palette.alphas);
-        png_data->palette.alphas = NULL;
+    bool ok = parse_header_chunks(reader, filename);
+    stats_end(STATS_PARSE, start, reader->map.size);
+    return ok;
+}
+
+bool png_reader_open_memory(const uint8_t *data, size_t size, const char *name, png_reader_t *reader) {
+    uint64_t start = stats_begin();
+    memset(reader, 0, sizeof(png_reader_t));
+    if (!png_map_open_memory(data, size, name, &reader->map)) {
+        return false;
     }
-    if (png_data->idat_data) {
-        free(png_data->idat_data);
-        png_data->idat_data = NULL;
+    bool ok = parse_header_chunks(reader, name);
+    stats_end(STATS_PARSE, start, size);
+    return ok;
+}
+
+size_t png_reader_next_idat(png_reader_t *reader, const uint8_t **data) {
+    const png_map_t *map = &reader->map;
+
+    // Step over empty IDATs, IDAT chunks are consecutive so anything else
+    // ends the image data
+    while (!reader->idat_done) {
+        if (reader->next_chunk >= map->chunk_count) {
+            reader->idat_done = true;
+            break;
+        }
+
+        const png_chunk_t *chunk = &map->chunks[reader->next_chunk];
+        if (memcmp(chunk->type, "IDAT", 4) != 0) {
+            reader->idat_done = true;
+            break;
+        }
+        if (!chunk->crc_ok) {
+            fprintf(stderr, "ERROR: CRC mismatch in IDAT chunk %u\n", reader->next_chunk);
+            reader->idat_done = true;
+            break;
+        }
+
+        reader->next_chunk++;
+        if (chunk->length > 0) {
+            *data = png_chunk_data(map, chunk);
+            return chunk->length;
+        }
     }
+    return 0;
 }
 
-void print_info(FILE *file, char *filename) {
-    rewind(file);
-    fseek(file, 0, SEEK_END);
-    uint32_t total_size = ftell(file);
-    rewind(file);
-    uint8_t signature[PNG_SIG_SIZE];
-    read_bytes(file, signature, PNG_SIG_SIZE);
-    if(memcmp(signature, png_sig, PNG_SIG_SIZE) != 0) {
-        fprintf(stderr, "ERROR: is not a PNG file\n");
-        fclose(file);
-        exit(1);
+void png_reader_close(png_reader_t *reader) {
+    png_map_close(&reader->map);
+    memset(&reader->palette, 0, sizeof(reader->palette));
+    reader->strip_index = NULL;
+    reader->strip_index_length = 0;
+}
+
+bool print_info(const char *filename) {
+    png_map_t map;
+    if(!png_map_open(filename, &map)) {
+        return false;
     }
+    size_t total_size = map.size;
 
     printf("PNG File Name : \033[32m%s\033[0m\n", filename);
     printf("PNG Signature : \033[32m");
-    print_bytes(signature, PNG_SIG_SIZE);
+    print_bytes(map.data, PNG_SIG_SIZE);
     printf("\033[0m");
     if(total_size > 1024*1024) {
-        printf("PNG Total Size: \033[32m%.2f KB\n", (float)(total_size)/(1024*1024));
+        printf("PNG Total Size: \033[32m%.2f MB\n", (float)(total_size)/(1024*1024));
     } else if(total_size > 1024) {
         printf("PNG Total Size: \033[32m%.2f KB\n", (float)(total_size)/1024);
     } else {
-        printf("PNG Total Size: \033[32m%u B\n", total_size);
+        printf("PNG Total Size: \033[32m%zu B\n", total_size);
     }
     printf("\033[0m                 +======+\n");
     printf(" +================ INFO =================+\n");
     printf("||               +======+                ||\n");
     printf("||                                       ||\n");
 
-    bool quit = false;
-    bool no_print = false;
-    while(!quit) {
-        uint32_t chunk_size = read_chunk_size(file);
-        uint8_t chunk_type[4];
-        read_chunk_type(file, chunk_type);
+    for(uint32_t i = 0; i < map.chunk_count; i++) {
+        const png_chunk_t *chunk = &map.chunks[i];
+        const uint8_t *data = png_chunk_data(&map, chunk);
+        uint32_t chunk_size = chunk->length;
+        bool no_print = false;
 
         if(chunk_size > 1024*1024) {
             float chunk_size_MB = (float)chunk_size / (1024 * 1024);
-            printf("||  Chunk: \033[32m%.*s\033[0m (size: %-3.2f MB)%-9s||\n", (int)sizeof(chunk_type), chunk_type, chunk_size_MB, "");
+            printf("||  Chunk: \033[32m%.4s\033[0m (size: %-3.2f MB)%-9s||\n", chunk->type, chunk_size_MB, "");
         } else if(chunk_size > 1024) {
             float chunk_size_KB = (float)chunk_size / 1024;
-            printf("||  Chunk: \033[32m%.*s\033[0m (size: %-3.2f KB)%-10s||\n", (int)sizeof(chunk_type), chunk_type, chunk_size_KB, "");
+            printf("||  Chunk: \033[32m%.4s\033[0m (size: %-3.2f KB)%-10s||\n", chunk->type, chunk_size_KB, "");
         } else {
-            printf("||  Chunk: \033[32m%.*s\033[0m (size: %-3u B)%-12s||\n", (int)sizeof(chunk_type), chunk_type, chunk_size, "");
+            printf("||  Chunk: \033[32m%.4s\033[0m (size: %-3u B)%-12s||\n", chunk->type, chunk_size, "");
+        }
+        if(!chunk->crc_ok) {
+            printf("||    \033[31m%-35s\033[0m||\n", "CRC mismatch");
         }
 
-        if(memcmp(chunk_type, "IHDR", 4) == 0) {
+        if(memcmp(chunk->type, "IHDR", 4) == 0 && chunk_size >= 13) {
             ihdr_t ihdr;
-            read_bytes(file, &ihdr.width, 4);
-            read_bytes(file, &ihdr.height, 4);
-            read_bytes(file, &ihdr.bit_depth, 1);
-            read_bytes(file, &ihdr.color_type, 1);
-            read_bytes(file, &ihdr.compression, 1);
-            read_bytes(file, &ihdr.filter, 1);
-            read_bytes(file, &ihdr.interlace, 1);
-
-            reverse(&ihdr.width, sizeof(ihdr.width));
-            reverse(&ihdr.height, sizeof(ihdr.height));
+            ihdr.width = load_be32(data);
+            ihdr.height = load_be32(data + 4);
+            ihdr.bit_depth = data[8];
+            ihdr.color_type = data[9];
+            ihdr.compression = data[10];
+            ihdr.filter = data[11];
+            ihdr.interlace = data[12];
 
             printf("||                                       ||\n");
             printf("||    %-12s : %-4u x %-4u pixels%-2s||\n", "Dimensions", ihdr.width, ihdr.height, "");
@@ -352,26 +984,29 @@ void print_info(FILE *file, char *filename) {
             printf("||    %-12s : %u%-19s||\n", "Filter", ihdr.filter, "");
             printf("||    %-12s : %u%-19s||\n", "Interlace", ihdr.interlace, "");
         }
-        else if((memcmp(chunk_type, "PLTE", 4) == 0) ||
-                (memcmp(chunk_type, "tRNS", 4) == 0) ||
-                (memcmp(chunk_type, "pHYs", 4) == 0) ||
-                (memcmp(chunk_type, "IDAT", 4) == 0)) {
-            fseek(file, chunk_size, SEEK_CUR);
+        else if(memcmp(chunk->type, "PLTE", 4) == 0) {
+            printf("||                                       ||\n");
+            printf("||    %-12s : %-3u entries%-9s||\n", "Palette", chunk_size / 3, "");
+        }
+        else if((memcmp(chunk->type, "IHDR", 4) == 0) ||
+                (memcmp(chunk->type, "tRNS", 4) == 0) ||
+                (memcmp(chunk->type, PNG_STRIP_CHUNK, 4) == 0) ||
+                (memcmp(chunk->type, "pHYs", 4) == 0) ||
+                (memcmp(chunk->type, "IDAT", 4) == 0)) {
+            // Binary payload, nothing readable to show
         }
-        else if(memcmp(chunk_type, "IEND", 4) == 0) {
+        else if(memcmp(chunk->type, "IEND", 4) == 0) {
             no_print = true;
-            quit = true;
         }
         else {
-            char buffer[chunk_size];
-            read_bytes(file, &buffer, sizeof(buffer));
-            buffer[chunk_size-1] = '\0';
+            // Text chunks start with a NUL-terminated keyword
+            int text_length = (int)strnlen((const char *)data, chunk_size);
             printf("||                                       ||\n");
-            if(strlen(buffer) > 25) {
-                printf("||   Text: \033[33m%-27.27s\033[0m...||\n", buffer);
+            if(text_length > 25) {
+                printf("||   Text: \033[33m%-27.*s\033[0m...||\n", text_length < 27 ? text_length : 27, (const char *)data);
             }
             else {
-                printf("||   Text: \033[33m%-30s\033[0m||\n", buffer);
+                printf("||   Text: \033[33m%-30.*s\033[0m||\n", text_length, (const char *)data);
             }
         }
         printf("||                                       ||\n");
@@ -379,9 +1014,10 @@ void print_info(FILE *file, char *filename) {
         if(!no_print) {
             printf("||                                       ||\n");
         }
-
-        read_chunk_crc(file);
     }
+
+    png_map_close(&map);
+    return true;
 }
 
 void draw_ascii(const char *filename, bool color) {
@@ -397,17 +1033,17 @@ void draw_ascii(const char *filename, bool color) {
     }
 
     // Read PNG using our own infrastructure
-    png_data_t png;
-    if (!read_png_file(filename, &png)) {
+    png_reader_t png;
+    if (!png_reader_open(filename, &png)) {
         fprintf(stderr, "ERROR: Could NOT load image: %s\n", filename);
         return;
     }
 
     // Process the image data
-    image_t *image = process_idat_chunks(&png.ihdr, &png.palette, png.idat_data, png.idat_size);
+    image_t *image = decode_png_image(&png, false, 0);
     if (!image) {
         fprintf(stderr, "ERROR: Failed to process image data\n");
-        free_png_data(&png);
+        png_reader_close(&png);
         return;
     }
 
@@ -435,26 +1071,27 @@ void draw_ascii(const char *filename, bool color) {
             if(src_y >= (int)height) src_y = height - 1;
 
             uint8_t r = 0, g = 0, b = 0, a = 0xff;
+            const uint8_t *row = image_row(image, src_y);
 
             // Extract pixel values based on channel count
             if (channels == 1) {
                 // Grayscale
-                r = g = b = image->pixels[src_y][src_x];
+                r = g = b = row[src_x];
             } else if (channels == 2) {
                 // Grayscale + Alpha
-                r = g = b = image->pixels[src_y][src_x * 2];
-                a = image->pixels[src_y][src_x * 2 + 1];
+                r = g = b = row[src_x * 2];
+                a = row[src_x * 2 + 1];
             } else if (channels == 3) {
                 // RGB
-                r = image->pixels[src_y][src_x * 3];
-                g = image->pixels[src_y][src_x * 3 + 1];
-                b = image->pixels[src_y][src_x * 3 + 2];
+                r = row[src_x * 3];
+                g = row[src_x * 3 + 1];
+                b = row[src_x * 3 + 2];
             } else if (channels == 4) {
                 // RGBA
-                r = image->pixels[src_y][src_x * 4];
-                g = image->pixels[src_y][src_x * 4 + 1];
-                b = image->pixels[src_y][src_x * 4 + 2];
-                a = image->pixels[src_y][src_x * 4 + 3];
+                r = row[src_x * 4];
+                g = row[src_x * 4 + 1];
+                b = row[src_x * 4 + 2];
+                a = row[src_x * 4 + 3];
             }
 
             // Handle transparency
@@ -482,7 +1119,6 @@ void draw_ascii(const char *filename, bool color) {
     }
 
     // Cleanup
-    free_pixel_matrix(image->pixels, image->height);
-    free(image);
-    free_png_data(&png);
+    image_free(image);
+    png_reader_close(&png);
 }
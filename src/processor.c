@@ -1,4 +1,8 @@
 #include "../include/processor.h"
+#include "../include/zstream_cache.h"
+#include "../include/unpack.h"
+#include "../include/thread_pool.h"
+#include "../include/stats.h"
 #include <math.h> // Required for sqrtf and fabsf
 
 // source: https://www.libpng.org/pub/png/spec/1.2/PNG-Filters.html
@@ -18,380 +22,1059 @@ uint8_t paeth_predictor(uint8_t left, uint8_t up, uint8_t up_left) {
     }
 }
 
-void unfilter_scanline(uint8_t *current, const uint8_t *previous, uint32_t length, uint32_t bpp, uint8_t filter_type) {
-    // NOTE: bpp is bytes per pixel, not bits.
-    // It's the offset to the corresponding pixel on the left.
-    switch (filter_type) {
-        case FILTER_NONE:
-            break;
+bool png_sample_layout(const ihdr_t *ihdr, uint32_t *samples, uint32_t *bits_per_pixel) {
+    uint32_t count;
+    bool depth_ok;
+    uint8_t depth = ihdr->bit_depth;
+    switch (ihdr->color_type) {
+        case 0: count = 1; depth_ok = depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16; break;
+        case 3: count = 1; depth_ok = depth == 1 || depth == 2 || depth == 4 || depth == 8; break;
+        case 2: count = 3; depth_ok = depth == 8 || depth == 16; break;
+        case 4: count = 2; depth_ok = depth == 8 || depth == 16; break;
+        case 6: count = 4; depth_ok = depth == 8 || depth == 16; break;
+        default:
+            fprintf(stderr, "ERROR: Unknown color type: %u\n", ihdr->color_type);
+            return false;
+    }
+    if (!depth_ok) {
+        fprintf(stderr, "ERROR: Bit depth %u is not allowed for color type %u\n", depth, ihdr->color_type);
+        return false;
+    }
+    if (ihdr->interlace > 1) {
+        fprintf(stderr, "ERROR: Unknown interlace method: %u\n", ihdr->interlace);
+        return false;
+    }
+    *samples = count;
+    *bits_per_pixel = count * depth;
+    return true;
+}
 
-        case FILTER_SUB:
-            for (uint32_t i = bpp; i < length; i++) {
-                // Recon(x) = Filt(x) + Recon(a)
-                current[i] += current[i - bpp];
+// Bytes of one packed scanline of `width` pixels, filter byte excluded
+static inline size_t packed_row_bytes(uint32_t width, uint32_t bits_per_pixel) {
+    return ((size_t)width * bits_per_pixel + 7) / 8;
+}
+
+// zlib stream plus the compressed data source feeding it
+typedef struct {
+    z_stream *stream;
+    idat_source_fn source;
+    void *source_ctx;
+    bool stream_end;
+    bool failed;        // zlib reported an error, already printed
+    bool quiet;         // the caller has a fallback, do not report errors
+    bool checksum;      // keep the Adler-32 of everything inflated, for raw streams
+    uLong adler;
+} inflater_t;
+
+// Inflate up to `length` bytes into `out`, pulling compressed data as
+// needed. Returns the bytes produced, short if the data ended or failed
+static size_t inflate_exact(inflater_t *inflater, uint8_t *out, size_t length) {
+    z_stream *stream = inflater->stream;
+    stream->next_out = out;
+    stream->avail_out = (uInt)length;
+
+    while (stream->avail_out > 0 && !inflater->stream_end) {
+        if (stream->avail_in == 0) {
+            const uint8_t *data = NULL;
+            size_t n = inflater->source(inflater->source_ctx, &data);
+            if (n == 0) {
+                break;
             }
-            break;
+            stream->next_in = (Bytef *)data;
+            stream->avail_in = (uInt)n;
+        }
 
-        case FILTER_UP:
-            if (previous) {
-                for (uint32_t i = 0; i < length; i++) {
-                    // Recon(x) = Filt(x) + Recon(b)
-                    current[i] += previous[i];
-                }
+        int result = inflate(stream, Z_NO_FLUSH);
+        if (result == Z_STREAM_END) {
+            inflater->stream_end = true;
+        } else if (result != Z_OK && result != Z_BUF_ERROR) {
+            if (!inflater->quiet) {
+                fprintf(stderr, "ERROR: Failed to inflate IDAT data (zlib error: %d)\n", result);
             }
+            inflater->failed = true;
             break;
+        }
+    }
+
+    size_t produced = length - stream->avail_out;
+    if (inflater->checksum) {
+        inflater->adler = adler32(inflater->adler, out, (uInt)produced);
+    }
+    return produced;
+}
+
+// Inflate and unfilter row `y` of `height` into row + 1, row[0] receiving
+// the filter byte. `previous` is the unfiltered row above, NULL for the first
+static bool next_row(inflater_t *inflater, uint8_t *row, const uint8_t *previous, size_t length,
+                     uint32_t bpp, uint32_t y, uint32_t height) {
+    uint64_t start = stats_begin();
+    size_t produced = inflate_exact(inflater, row, 1 + length);
+    stats_end(STATS_INFLATE, start, produced);
+    if (produced != 1 + length) {
+        if (!inflater->failed && !inflater->quiet) {
+            fprintf(stderr, "ERROR: IDAT data ended early at row %u of %u\n", y, height);
+        }
+        return false;
+    }
+
+    uint8_t filter_type = row[0];
+    if (filter_type > FILTER_PAETH) {
+        if (!inflater->quiet) {
+            fprintf(stderr, "ERROR: Invalid filter type %u at row %u\n", filter_type, y);
+        }
+        return false;
+    }
+    start = stats_begin();
+    unfilter_scanline(row + 1, previous, (uint32_t)length, bpp, filter_type);
+    stats_end(STATS_UNFILTER, start, length);
+    return true;
+}
+
+// Adam7 passes: first pixel and spacing of each reduced image
+static const uint8_t adam7_x0[7] = {0, 4, 0, 2, 0, 1, 0};
+static const uint8_t adam7_y0[7] = {0, 0, 4, 0, 2, 0, 1};
+static const uint8_t adam7_dx[7] = {8, 8, 4, 4, 2, 2, 1};
+static const uint8_t adam7_dy[7] = {8, 8, 8, 4, 4, 2, 2};
+
+static inline uint32_t adam7_size(uint32_t size, uint32_t first, uint32_t step) {
+    return (size > first) ? (size - first + step - 1) / step : 0;
+}
+
+// Copy the pixels of one pass row to their places in the full-size row.
+// `full` was zeroed, so sub-byte pixels can be ORed in
+static void adam7_scatter(const uint8_t *pass_row, uint32_t count, uint8_t *full, uint32_t x0,
+                          uint32_t dx, uint32_t bits_per_pixel) {
+    if (bits_per_pixel >= 8) {
+        size_t bytes = bits_per_pixel / 8;
+        for (uint32_t i = 0; i < count; i++) {
+            memcpy(full + (size_t)(x0 + i * dx) * bytes, pass_row + i * bytes, bytes);
+        }
+        return;
+    }
+    uint32_t mask = (1u << bits_per_pixel) - 1;
+    for (uint32_t i = 0; i < count; i++) {
+        size_t from = (size_t)i * bits_per_pixel;
+        size_t to = (size_t)(x0 + i * dx) * bits_per_pixel;
+        uint32_t value = (pass_row[from / 8] >> (8 - bits_per_pixel - from % 8)) & mask;
+        full[to / 8] |= (uint8_t)(value << (8 - bits_per_pixel - to % 8));
+    }
+}
+
+// The seven passes of an interlaced image, scattered into `pixels` (height
+// rows of `row_bytes`) before any row is emitted, since every row is only
+// complete after the last pass
+static bool decode_adam7(inflater_t *inflater, const ihdr_t *ihdr, uint32_t bits_per_pixel,
+                         uint8_t *pixels, size_t row_bytes, uint8_t *current, uint8_t *previous) {
+    uint32_t bpp = (bits_per_pixel >= 8) ? bits_per_pixel / 8 : 1;
+    for (int pass = 0; pass < 7; pass++) {
+        uint32_t width = adam7_size(ihdr->width, adam7_x0[pass], adam7_dx[pass]);
+        uint32_t height = adam7_size(ihdr->height, adam7_y0[pass], adam7_dy[pass]);
+        if (width == 0 || height == 0) {
+            continue; // empty passes have no rows at all, not even filter bytes
+        }
 
-        case FILTER_AVG:
-            for (uint32_t i = 0; i < length; i++) {
-                // FIX: Use reconstructed values for 'left' and 'up'.
-                uint8_t left = (i >= bpp) ? current[i - bpp] : 0;
-                uint8_t up = previous ? previous[i] : 0;
-                // Recon(x) = Filt(x) + floor((Recon(a) + Recon(b)) / 2)
-                current[i] += (left + up) / 2;
+        size_t length = packed_row_bytes(width, bits_per_pixel);
+        for (uint32_t y = 0; y < height; y++) {
+            if (!next_row(inflater, current, (y > 0) ? previous + 1 : NULL, length, bpp, y, height)) {
+                return false;
             }
-            break;
+            uint8_t *full = pixels + (size_t)(adam7_y0[pass] + y * adam7_dy[pass]) * row_bytes;
+            adam7_scatter(current + 1, width, full, adam7_x0[pass], adam7_dx[pass], bits_per_pixel);
+
+            uint8_t *swap = previous;
+            previous = current;
+            current = swap;
+        }
+    }
+    return true;
+}
+
+/**
+ * Inflates the IDAT stream piece by piece and emits each unfiltered scanline.
+ *
+ * For a non-interlaced image only two scanlines (current and previous) plus
+ * the zlib window are held at any time; compressed input is pulled from
+ * `source` whenever inflate runs dry. An Adam7 image is gathered in full at
+ * its packed size first, then emitted row by row the same way.
+ *
+ * @return true if every row was decoded and emitted.
+ */
+bool decode_scanlines(const ihdr_t *ihdr, idat_source_fn source, void *source_ctx, scanline_fn emit, void *user) {
+    if (!ihdr || !source || !emit || ihdr->width == 0 || ihdr->height == 0) {
+        fprintf(stderr, "ERROR: Invalid input parameters to decode_scanlines\n");
+        return false;
+    }
+
+    uint32_t samples, bits_per_pixel;
+    if (!png_sample_layout(ihdr, &samples, &bits_per_pixel)) {
+        return false;
+    }
+
+    // Filters work on whole bytes: sub-byte pixels use the byte to the left
+    uint32_t bpp = (bits_per_pixel >= 8) ? bits_per_pixel / 8 : 1;
+    size_t scanline_length = packed_row_bytes(ihdr->width, bits_per_pixel);
+    if (scanline_length > UINT32_MAX - 1) {
+        fprintf(stderr, "ERROR: Scanlines of %u pixels are too long\n", ihdr->width);
+        return false;
+    }
+
+    // Each buffer holds the filter byte followed by the scanline
+    uint8_t *current = malloc(1 + scanline_length);
+    uint8_t *previous = malloc(1 + scanline_length);
+    uint8_t *pixels = NULL;
+    if (ihdr->interlace && current && previous) {
+        pixels = calloc(ihdr->height, scanline_length);
+    }
+    if (!current || !previous || (ihdr->interlace && !pixels)) {
+        fprintf(stderr, "ERROR: Could not allocate memory for scanlines.\n");
+        free(current);
+        free(previous);
+        free(pixels);
+        return false;
+    }
+
+    inflater_t inflater = {
+        .stream = zstream_inflate_acquire(),
+        .source = source,
+        .source_ctx = source_ctx,
+    };
+    if (!inflater.stream) {
+        free(current);
+        free(previous);
+        free(pixels);
+        return false;
+    }
+
+    bool ok = true;
+    if (pixels) {
+        stats_alloc((size_t)ihdr->height * scanline_length);
+        ok = decode_adam7(&inflater, ihdr, bits_per_pixel, pixels, scanline_length, current, previous);
+        for (uint32_t y = 0; ok && y < ihdr->height; y++) {
+            ok = emit(user, y, pixels + (size_t)y * scanline_length, (uint32_t)scanline_length);
+        }
+    } else {
+        for (uint32_t y = 0; ok && y < ihdr->height; y++) {
+            ok = next_row(&inflater, current, (y > 0) ? previous + 1 : NULL, scanline_length, bpp, y, ihdr->height) &&
+                 emit(user, y, current + 1, (uint32_t)scanline_length);
+
+            // The unfiltered current row becomes the previous row for the next iteration
+            uint8_t *swap = previous;
+            previous = current;
+            current = swap;
+        }
+    }
+
+    zstream_inflate_release(inflater.stream);
+    free(current);
+    free(previous);
+    if (pixels) {
+        stats_free((size_t)ihdr->height * scanline_length);
+    }
+    free(pixels);
+    return ok;
+}
+
+typedef struct {
+    const uint8_t *data;
+    uint64_t remaining;
+} memory_source_t;
+
+static size_t memory_source(void *ctx, const uint8_t **data) {
+    memory_source_t *src = ctx;
+    // zlib takes at most a uInt at a time
+    size_t n = (src->remaining > UINT32_MAX) ? UINT32_MAX : (size_t)src->remaining;
+    *data = src->data;
+    src->data += n;
+    src->remaining -= n;
+    return n;
+}
 
-        case FILTER_PAETH:
-            for (uint32_t i = 0; i < length; i++) {
-                // FIX: Use reconstructed values for 'left', 'up', and 'up_left'.
-                uint8_t left = (i >= bpp) ? current[i - bpp] : 0;
-                uint8_t up = previous ? previous[i] : 0;
-                uint8_t up_left = (previous && i >= bpp) ? previous[i - bpp] : 0;
-                // Recon(x) = Filt(x) + PaethPredictor(Recon(a), Recon(b), Recon(c))
-                current[i] += paeth_predictor(left, up, up_left);
+static size_t reader_source(void *ctx, const uint8_t **data) {
+    return png_reader_next_idat(ctx, data);
+}
+
+// Turns the packed scanlines of a file into image samples: bytes, or native
+// uint16_t when a 16-bit file is kept at full depth
+typedef struct {
+    uint32_t bit_depth;     // of the file
+    size_t samples;         // per row
+    bool indexed;
+    bool keep_16bit;        // only ever set for 16-bit files
+} unpacker_t;
+
+static bool unpacker_init(unpacker_t *unpacker, const ihdr_t *ihdr, bool keep_16bit) {
+    uint32_t samples, bits_per_pixel;
+    if (!png_sample_layout(ihdr, &samples, &bits_per_pixel)) {
+        return false;
+    }
+    unpacker->bit_depth = ihdr->bit_depth;
+    unpacker->samples = (size_t)ihdr->width * samples;
+    unpacker->indexed = (ihdr->color_type == 3);
+    unpacker->keep_16bit = keep_16bit && ihdr->bit_depth == 16;
+    return true;
+}
+
+// Samples of `scanline`: 8-bit rows are returned as they are, everything
+// else is unpacked into `out`
+static const uint8_t *unpack_row(const unpacker_t *unpacker, const uint8_t *scanline, uint8_t *out) {
+    switch (unpacker->bit_depth) {
+        case 8:
+            return scanline;
+        case 16:
+            if (unpacker->keep_16bit) {
+                unpack_16(scanline, (uint16_t *)out, unpacker->samples);
+            } else {
+                unpack_16_to_8(scanline, out, unpacker->samples);
             }
-            break;
+            return out;
+        default:
+            // Gray levels are stretched to 0-255, palette indices kept
+            unpack_sub_byte(scanline, out, unpacker->samples, unpacker->bit_depth, !unpacker->indexed);
+            return out;
     }
 }
 
-image_t *process_idat_chunks(ihdr_t *ihdr, palette_t *palette, uint8_t *idat_data, uint64_t idat_size) {
-    if (!ihdr || !idat_data || idat_size == 0) {
-        fprintf(stderr, "ERROR: Invalid input parameters to process_idat_chunks\n");
-        return NULL;
+// What the decoded image holds
+typedef enum {
+    DECODE_PIXELS,      // 8-bit (or kept 16-bit) samples, palettes expanded
+    DECODE_INDICES,     // indexed files stay indexed
+    DECODE_GRAY,        // gray, plus alpha if the file has any, converted row by row
+} decode_output_t;
+
+typedef struct {
+    image_t *image;
+    const image_palette_t *colors;  // palette of indexed files
+    unpacker_t unpacker;
+    uint8_t *indices;           // unpacked palette indices of sub-byte rows
+    bool keep_indices;          // indexed files stay indexed instead of being expanded
+    bool to_gray;               // colour rows are converted to gray before they are stored
+    uint32_t channels;          // of the file's pixels, before any conversion to gray
+    uint8_t *pixels;            // unpacked 16-bit colour rows on their way to gray
+    uint8_t gray_palette[256];  // gray of every palette entry, with `to_gray`
+} image_sink_t;
+
+// Copy PLTE and tRNS into RGBA entries; entries past the palette repeat
+// the first colour, which is what invalid indices decode to
+static void load_palette(const palette_t *palette, image_palette_t *colors) {
+    colors->count = (palette->entry_count < 256) ? palette->entry_count : 256;
+    colors->alpha_count = (palette->alpha_count < colors->count) ? palette->alpha_count : colors->count;
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t entry = (i < colors->count) ? i : 0;
+        rgb_t color = palette->entries[entry];
+        colors->entries[i][0] = color.r;
+        colors->entries[i][1] = color.g;
+        colors->entries[i][2] = color.b;
+        colors->entries[i][3] = (entry < colors->alpha_count) ? palette->alphas[entry] : 255;
+    }
+}
+
+// Report indices past the end of the palette, false if there are any
+static bool check_indices(const uint8_t *indices, uint32_t width, uint32_t count, uint32_t y) {
+    if (count == 256) {
+        return true;
+    }
+    uint8_t largest = 0;
+    for (uint32_t x = 0; x < width; x++) {
+        largest = (indices[x] > largest) ? indices[x] : largest;
+    }
+    if (largest < count) {
+        return true;
+    }
+    for (uint32_t x = 0; x < width; x++) {
+        if (indices[x] >= count) {
+            fprintf(stderr, "ERROR: Invalid palette index %u at (%u, %u)\n", indices[x], y, x);
+        }
+    }
+    return false;
+}
+
+// Converts a colour or indexed scanline straight to the gray (or gray+alpha)
+// row, so the colour image never exists: palette entries were converted
+// once, other rows are unpacked if need be and weighted like rgb_to_grayscale()
+static void store_gray_scanline(image_sink_t *sink, uint32_t y, const uint8_t *scanline, uint8_t *row) {
+    uint32_t width = sink->image->width;
+    if (sink->unpacker.indexed) {
+        const uint8_t *indices = unpack_row(&sink->unpacker, scanline, sink->indices);
+        check_indices(indices, width, sink->colors->count, y);
+        if (sink->image->channels == 2) {
+            for (uint32_t x = 0; x < width; x++) {
+                row[x * 2] = sink->gray_palette[indices[x]];
+                row[x * 2 + 1] = sink->colors->entries[indices[x]][3];
+            }
+            return;
+        }
+        for (uint32_t x = 0; x < width; x++) {
+            row[x] = sink->gray_palette[indices[x]];
+        }
+        return;
     }
 
-    uint32_t channels;
+    const uint8_t *samples = unpack_row(&sink->unpacker, scanline, sink->pixels);
+    image_gray_alpha_row(samples, row, width, sink->channels, sink->image->bit_depth);
+}
+
+// Stores a decoded scanline into the image, expanding palette indices on the
+// way unless the image keeps them
+static bool store_scanline(void *user, uint32_t y, const uint8_t *scanline, uint32_t length) {
+    image_sink_t *sink = user;
+    image_t *image = sink->image;
+    uint64_t start = stats_begin();
+
+    uint8_t *row = image_row(image, y);
+    if (sink->to_gray) {
+        store_gray_scanline(sink, y, scanline, row);
+        stats_end(STATS_CONVERT, start, image_row_bytes(image));
+        return true;
+    }
+    if (!sink->unpacker.indexed || sink->keep_indices) {
+        // Unpacked straight into the row
+        if (unpack_row(&sink->unpacker, scanline, row) == scanline) {
+            memcpy(row, scanline, length);
+        }
+        if (sink->unpacker.indexed && !check_indices(row, image->width, sink->colors->count, y)) {
+            // Invalid indices decode to the first colour
+            for (uint32_t x = 0; x < image->width; x++) {
+                row[x] = (row[x] < sink->colors->count) ? row[x] : 0;
+            }
+        }
+        stats_end(STATS_CONVERT, start, image_row_bytes(image));
+        return true;
+    }
+
+    // Entries past the palette hold the first colour, so invalid indices
+    // need no special case once reported
+    const uint8_t *indices = unpack_row(&sink->unpacker, scanline, sink->indices);
+    check_indices(indices, image->width, sink->colors->count, y);
+    unpack_palette(indices, row, image->width, sink->colors->entries, image->channels);
+    stats_end(STATS_CONVERT, start, image_row_bytes(image));
+    return true;
+}
+
+// Channels of the decoded image, 0 if the header or palette is unusable
+static uint32_t decoded_channels(const ihdr_t *ihdr, const palette_t *palette) {
     switch (ihdr->color_type) {
-        case 0: channels = 1; break; // Grayscale
-        case 2: channels = 3; break; // RGB
-        case 4: channels = 2; break; // Grayscale + Alpha
-        case 6: channels = 4; break; // RGB + Alpha
+        case 0: return 1; // Grayscale
+        case 2: return 3; // RGB
+        case 4: return 2; // Grayscale + Alpha
+        case 6: return 4; // RGB + Alpha
         case 3: // Palette
-            if(!palette || !palette->entries) {
+            if(!palette || !palette->entries || palette->entry_count == 0) {
                 fprintf(stderr, "ERROR: Palette (PLTE) chunk missing for color type 3.\n");
-                return NULL;
+                return 0;
             }
-            channels = (palette->alphas) ? 4 : 3;
-            break;
+            return (palette->alphas) ? 4 : 3;
         default:
             fprintf(stderr, "ERROR: Unknown color type: %u\n", ihdr->color_type);
-            return NULL;
+            return 0;
     }
+}
 
-    // Bytes per pixel. Assumes bit depth is 8, which is true for this project.
-    uint32_t bpp = (ihdr->color_type == 3) ? 1 : channels;
+// Create the output image of `ihdr` and the unpacking state that fills it.
+// DECODE_INDICES gives an indexed file an indexed image that owns its palette
+static bool image_sink_init(image_sink_t *sink, const ihdr_t *ihdr, const palette_t *palette,
+                            bool keep_16bit, decode_output_t output) {
+    *sink = (image_sink_t){ .keep_indices = output == DECODE_INDICES && ihdr->color_type == 3 };
+    uint32_t channels = decoded_channels(ihdr, palette);
+    if (channels == 0 || !unpacker_init(&sink->unpacker, ihdr, keep_16bit)) {
+        return false;
+    }
+    sink->channels = channels;
+    sink->to_gray = output == DECODE_GRAY && image_gray_channels(channels) != channels;
+    if (sink->keep_indices) {
+        channels = 1;
+    } else if (sink->to_gray) {
+        channels = image_gray_channels(channels);
+    }
 
-    // Calculate decompressed data size. Each row is preceded by 1 filter-type byte.
-    uLongf decompressed_size = (uLongf)ihdr->height * (1 + (uLongf)ihdr->width * bpp);
-    uint8_t *decompressed = malloc(decompressed_size);
-    if (!decompressed) {
-        fprintf(stderr, "ERROR: Could not allocate memory for decompression.\n");
+    sink->image = image_create_depth(ihdr->width, ihdr->height, channels, sink->unpacker.keep_16bit ? 16 : 8);
+    if (!sink->image) {
+        return false;
+    }
+    if (sink->to_gray && ihdr->bit_depth == 16) {
+        sink->pixels = malloc(sink->unpacker.samples * sizeof(uint16_t));
+        if (!sink->pixels) {
+            fprintf(stderr, "ERROR: Could not allocate memory for scanlines.\n");
+            image_free(sink->image);
+            return false;
+        }
+    }
+    if (sink->unpacker.indexed) {
+        image_palette_t *colors = malloc(sizeof(image_palette_t));
+        sink->indices = (ihdr->bit_depth < 8 && !sink->keep_indices) ? malloc(ihdr->width) : NULL;
+        if (!colors || (ihdr->bit_depth < 8 && !sink->keep_indices && !sink->indices)) {
+            fprintf(stderr, "ERROR: Could not allocate memory for scanlines.\n");
+            free(colors);
+            free(sink->indices);
+            image_free(sink->image);
+            return false;
+        }
+        load_palette(palette, colors);
+        sink->colors = colors;
+        if (sink->keep_indices) {
+            sink->image->palette = colors;
+        }
+        if (sink->to_gray) {
+            // The entries are RGBA pixels, so they convert like a row of them
+            image_gray_row(&colors->entries[0][0], sink->gray_palette, 256, 4);
+        }
+    }
+    return true;
+}
+
+// Free the sink's buffers; the image, and a palette it owns, stay
+static void image_sink_release(image_sink_t *sink) {
+    free(sink->indices);
+    free(sink->pixels);
+    if (sink->colors != sink->image->palette) {
+        free((image_palette_t *)sink->colors);
+    }
+}
+
+static image_t *decode_image(ihdr_t *ihdr, palette_t *palette, idat_source_fn source, void *source_ctx,
+                             bool keep_16bit, decode_output_t output) {
+    image_sink_t sink;
+    if (!image_sink_init(&sink, ihdr, palette, keep_16bit, output)) {
         return NULL;
     }
 
-    int result = uncompress(decompressed, &decompressed_size, idat_data, (uLong)idat_size);
-    if (result != Z_OK) {
-        fprintf(stderr, "ERROR: Failed to uncompress IDAT data (zlib error: %d)\n", result);
-        free(decompressed);
+    bool ok = decode_scanlines(ihdr, source, source_ctx, store_scanline, &sink);
+    image_sink_release(&sink);
+    if (!ok) {
+        image_free(sink.image);
         return NULL;
     }
+    return sink.image;
+}
 
-    image_t *image = malloc(sizeof(image_t));
-    if (!image) {
-        fprintf(stderr, "ERROR: Could not allocate memory for image structure.\n");
-        free(decompressed);
+image_t *process_idat_chunks(ihdr_t *ihdr, palette_t *palette, uint8_t *idat_data, uint64_t idat_size) {
+    if (!ihdr || !idat_data || idat_size == 0) {
+        fprintf(stderr, "ERROR: Invalid input parameters to process_idat_chunks\n");
         return NULL;
     }
-    image->width = ihdr->width;
-    image->height = ihdr->height;
-    image->channels = channels;
-    image->pixels = allocate_pixel_matrix(ihdr->height, ihdr->width * channels);
 
-    uint32_t scanline_length = ihdr->width * bpp;
-    const uint8_t *previous_scanline = NULL;
+    memory_source_t src = { .data = idat_data, .remaining = idat_size };
+    return decode_image(ihdr, palette, memory_source, &src, false, DECODE_PIXELS);
+}
 
-    if(ihdr->color_type == 3) {
-        uint8_t *unfiltered_indices = malloc(ihdr->height * ihdr->width);
-        if(!unfiltered_indices) {
-            fprintf(stderr, "ERROR: Could not allocate for palette indices.\n");
-            free(unfiltered_indices);
-            return NULL;
-        }
+// One IDAT payload and where it sits in the concatenated zlib stream
+typedef struct {
+    const uint8_t *data;
+    uint32_t length;
+    uint64_t start;
+} idat_span_t;
 
-        for(uint32_t y = 0; y < ihdr->height; y++) {
-            uint64_t offset = y * (1 + scanline_length);
-            uint8_t filter_type = decompressed[offset];
-            uint8_t *scanline = &decompressed[offset + 1];
+// Compressed bytes [position, end) of the zlib stream, handed out a chunk at a time
+typedef struct {
+    const idat_span_t *spans;
+    uint32_t span_count;
+    uint32_t span;
+    uint64_t position;
+    uint64_t end;
+} slice_source_t;
 
-            unfilter_scanline(scanline, previous_scanline, scanline_length, bpp, filter_type);
+static size_t slice_source(void *ctx, const uint8_t **data) {
+    slice_source_t *src = ctx;
+    while (src->span < src->span_count &&
+           src->position >= src->spans[src->span].start + src->spans[src->span].length) {
+        src->span++;
+    }
+    if (src->position >= src->end || src->span == src->span_count) {
+        return 0;
+    }
 
-            memcpy(unfiltered_indices + (y * ihdr->width), scanline, scanline_length);
-            previous_scanline = unfiltered_indices + (y * ihdr->width);
-        }
+    const idat_span_t *span = &src->spans[src->span];
+    uint64_t stop = span->start + span->length;
+    if (stop > src->end) {
+        stop = src->end;
+    }
+    *data = span->data + (src->position - span->start);
+    size_t n = (size_t)(stop - src->position);
+    src->position = stop;
+    return n;
+}
 
-        for(uint32_t y = 0; y < ihdr->height; y++) {
-            for(uint32_t x = 0; x < ihdr->width; x++) {
-                uint8_t index = unfiltered_indices[y * ihdr->width + x];
-                if(index >= palette->entry_count) {
-                    fprintf(stderr, "ERROR: Invalid palette index %u at (%u, %u)\n", index, y, x);
-                    index = 0;
-                }
+// Copy `length` bytes of the zlib stream from `position`, false past its end
+static bool stream_bytes(const idat_span_t *spans, uint32_t span_count, uint64_t position,
+                         uint8_t *out, size_t length) {
+    slice_source_t src = { spans, span_count, 0, position, position + length };
+    const uint8_t *data;
+    size_t n;
+    while ((n = slice_source(&src, &data)) > 0) {
+        memcpy(out, data, n);
+        out += n;
+        length -= n;
+    }
+    return length == 0;
+}
 
-                rgb_t color = palette->entries[index];
-                image->pixels[y][x * channels + 0] = color.r;
-                image->pixels[y][x * channels + 1] = color.g;
-                image->pixels[y][x * channels + 2] = color.b;
+static uint64_t load_be64(const uint8_t *p) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
 
-                if(channels == 4) {
-                    image->pixels[y][x * channels + 3] = (index < palette->alpha_count) ? palette->alphas[index] : 255;
-                }
-            }
-        }
-        free(unfiltered_indices);
-    }
-    else {
-        for (uint32_t y = 0; y < ihdr->height; y++) {
-            // Calculate the offset to the start of the current scanline in the decompressed buffer.
-            uint64_t offset = y * (1 + scanline_length);
-            uint8_t filter_type = decompressed[offset];
-            uint8_t *scanline = &decompressed[offset + 1];
-
-            if (filter_type > FILTER_PAETH) {
-                fprintf(stderr, "ERROR: Invalid filter type %u at row %u\n", filter_type, y);
-                free_pixel_matrix(image->pixels, image->height);
-                free(image);
-                free(decompressed);
-                return NULL;
-            }
+// One entry of the strip index, with the end of its compressed data
+typedef struct {
+    uint32_t first_row;
+    uint32_t rows;
+    uint64_t begin;
+    uint64_t end;
+    uLong adler;        // of the strip's raw bytes, once decoded
+    bool ok;
+} strip_range_t;
 
-            unfilter_scanline(scanline, previous_scanline, scanline_length, bpp, filter_type);
+typedef struct {
+    const ihdr_t *ihdr;
+    const image_sink_t *sink;
+    const idat_span_t *spans;
+    uint32_t span_count;
+    strip_range_t *strips;
+    uint32_t strip_count;
+    uint32_t task_count;
+    size_t scanline_length;
+    uint32_t bpp;
+} strip_decode_t;
 
-            memcpy(image->pixels[y], scanline, scanline_length);
+static bool decode_strip(const strip_decode_t *job, strip_range_t *strip, inflater_t *inflater,
+                         image_sink_t *sink, uint8_t *current, uint8_t *previous) {
+    slice_source_t src = { job->spans, job->span_count, 0, strip->begin, strip->end };
+    inflater->source_ctx = &src;
+    inflater->stream_end = false;
+    inflater->failed = false;
+    inflater->adler = adler32(0, NULL, 0);
+    if (inflateReset(inflater->stream) != Z_OK) {
+        return false;
+    }
 
-            // FIX: The *unfiltered* current row becomes the previous row for the next iteration.
-            previous_scanline = image->pixels[y];
+    uint32_t last = strip->first_row + strip->rows;
+    for (uint32_t y = strip->first_row; y < last; y++) {
+        bool first = (y == strip->first_row);
+        if (!next_row(inflater, current, first ? NULL : previous + 1, job->scanline_length, job->bpp,
+                      y, job->ihdr->height)) {
+            return false;
+        }
+        // The first row of a strip must not need the strip above
+        if (first && y > 0 && current[0] > FILTER_SUB) {
+            return false;
         }
+        store_scanline(sink, y, current + 1, (uint32_t)job->scanline_length);
+
+        uint8_t *swap = previous;
+        previous = current;
+        current = swap;
+    }
+    strip->adler = inflater->adler;
+    return true;
+}
+
+// Task `index` decodes every task_count-th strip with its own raw inflate
+// stream, rows, palette index and gray conversion buffers
+static void decode_strips_task(void *arg, uint32_t index) {
+    const strip_decode_t *job = arg;
+    image_sink_t sink = *job->sink;
+    uint8_t *current = malloc(1 + job->scanline_length);
+    uint8_t *previous = malloc(1 + job->scanline_length);
+    sink.indices = job->sink->indices ? malloc(job->ihdr->width) : NULL;
+    sink.pixels = job->sink->pixels ? malloc(sink.unpacker.samples * sizeof(uint16_t)) : NULL;
+    inflater_t inflater = {
+        .stream = zstream_inflate_acquire(),
+        .source = slice_source,
+        .quiet = true,
+        .checksum = true,
+    };
+
+    bool ready = current && previous && (sink.indices || !job->sink->indices) &&
+                 (sink.pixels || !job->sink->pixels) && inflater.stream &&
+                 inflateReset2(inflater.stream, -15) == Z_OK;
+    for (uint32_t i = index; i < job->strip_count; i += job->task_count) {
+        strip_range_t *strip = &job->strips[i];
+        strip->ok = ready && decode_strip(job, strip, &inflater, &sink, current, previous);
     }
 
-    free(decompressed);
-    return image;
+    if (inflater.stream) {
+        // Cached streams are handed out for zlib data again
+        inflateReset2(inflater.stream, 15);
+        zstream_inflate_release(inflater.stream);
+    }
+    free(current);
+    free(previous);
+    free(sink.indices);
+    free(sink.pixels);
 }
 
-uint8_t **rgb_to_grayscale(image_t *image) {
-    if (!image || !image->pixels) {
-        fprintf(stderr, "ERROR: Invalid image for grayscale conversion\n");
-        return NULL;
+// Read the strip index against the IDAT run: strips must start at row 0 and
+// at the first deflate byte, and both rows and offsets must ascend. Returns
+// the strip count, 0 if the index is unusable
+static uint32_t parse_strip_index(const png_reader_t *reader, uint64_t stream_size, strip_range_t **out) {
+    const uint8_t *index = reader->strip_index;
+    uint32_t length = reader->strip_index_length;
+    if (length < 1 + 2 * PNG_STRIP_ENTRY_SIZE || (length - 1) % PNG_STRIP_ENTRY_SIZE != 0 ||
+        index[0] != PNG_STRIP_VERSION || stream_size < 6) {
+        return 0;
     }
 
-    if (image->channels == 1) {
-        // Already grayscale, no conversion needed.
-        return image->pixels;
+    uint32_t count = (length - 1) / PNG_STRIP_ENTRY_SIZE;
+    strip_range_t *strips = calloc(count, sizeof(strip_range_t));
+    if (!strips) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t *entry = index + 1 + (size_t)i * PNG_STRIP_ENTRY_SIZE;
+        strips[i].first_row = ((uint32_t)entry[0] << 24) | ((uint32_t)entry[1] << 16) |
+                              ((uint32_t)entry[2] << 8) | entry[3];
+        strips[i].begin = load_be64(entry + 4);
     }
 
-    uint8_t **gray = allocate_pixel_matrix(image->height, image->width);
-    if (!gray) return NULL;
+    bool valid = strips[0].first_row == 0 && strips[0].begin == 2;
+    for (uint32_t i = 0; valid && i < count; i++) {
+        uint32_t end_row = (i + 1 < count) ? strips[i + 1].first_row : reader->ihdr.height;
+        strips[i].end = (i + 1 < count) ? strips[i + 1].begin : stream_size - 4;
+        valid = end_row > strips[i].first_row && end_row <= reader->ihdr.height &&
+                strips[i].end > strips[i].begin && strips[i].end <= stream_size - 4;
+        strips[i].rows = end_row - strips[i].first_row;
+    }
+    if (!valid) {
+        free(strips);
+        return 0;
+    }
+    *out = strips;
+    return count;
+}
 
-    for (uint32_t y = 0; y < image->height; y++) {
-        for (uint32_t x = 0; x < image->width; x++) {
-            if (image->channels >= 3) { // RGB or RGBA
-                uint8_t r = image->pixels[y][x * image->channels + 0];
-                uint8_t g = image->pixels[y][x * image->channels + 1];
-                uint8_t b = image->pixels[y][x * image->channels + 2];
-                // Luminosity conversion: gray = 0.299*R + 0.587*G + 0.114*B
-                gray[y][x] = (uint8_t)(0.299f * r + 0.587f * g + 0.114f * b);
-            } else if (image->channels == 2) { // Grayscale + Alpha
-                // Just take the grayscale value, ignore alpha.
-                gray[y][x] = image->pixels[y][x * 2];
-            }
+// Decode a file written in strips (see PNG_STRIP_BYTES) on up to `threads`
+// threads. The strip checksums are combined and checked against the zlib
+// trailer. NULL, without a message, if anything does not add up, so the
+// caller can fall back to a serial decode that reports the real error
+static image_t *decode_strips(png_reader_t *reader, bool keep_16bit, decode_output_t output, uint32_t threads) {
+    const png_map_t *map = &reader->map;
+    const ihdr_t *ihdr = &reader->ihdr;
+
+    uint32_t samples, bits_per_pixel;
+    if (!png_sample_layout(ihdr, &samples, &bits_per_pixel) || ihdr->interlace) {
+        return NULL;
+    }
+
+    // The IDAT run, as handed out by png_reader_next_idat
+    uint32_t first = reader->next_chunk;
+    uint32_t span_count = 0;
+    while (first + span_count < map->chunk_count &&
+           memcmp(map->chunks[first + span_count].type, "IDAT", 4) == 0) {
+        if (!map->chunks[first + span_count].crc_ok) {
+            return NULL;
         }
+        span_count++;
+    }
+    idat_span_t *spans = malloc((span_count ? span_count : 1) * sizeof(idat_span_t));
+    if (!spans) {
+        return NULL;
+    }
+    uint64_t stream_size = 0;
+    for (uint32_t i = 0; i < span_count; i++) {
+        const png_chunk_t *chunk = &map->chunks[first + i];
+        spans[i] = (idat_span_t){ png_chunk_data(map, chunk), chunk->length, stream_size };
+        stream_size += chunk->length;
     }
-    return gray;
-}
 
-void apply_convolution(uint8_t **input, uint8_t **output, uint32_t height, uint32_t width, kernel_type type) {
-    if (!input || !output || height < 3 || width < 3) {
-        fprintf(stderr, "ERROR: Invalid parameters for convolution\n");
-        return;
+    strip_range_t *strips = NULL;
+    uint32_t strip_count = parse_strip_index(reader, stream_size, &strips);
+    uint8_t header[2], trailer[4];
+    if (strip_count == 0 || !stream_bytes(spans, span_count, 0, header, 2) ||
+        !stream_bytes(spans, span_count, stream_size - 4, trailer, 4) ||
+        (header[0] & 0x0F) != Z_DEFLATED || (header[0] * 256 + header[1]) % 31 != 0 || (header[1] & 0x20)) {
+        free(spans);
+        free(strips);
+        return NULL;
     }
 
-    // Using a simple "copy border" strategy. More advanced methods like
-    // mirroring or extending exist but are more complex.
-    for(uint32_t y = 0; y < height; y++) {
-        memcpy(output[y], input[y], width);
+    image_sink_t sink;
+    if (!image_sink_init(&sink, ihdr, &reader->palette, keep_16bit, output)) {
+        free(spans);
+        free(strips);
+        return NULL;
+    }
+
+    strip_decode_t job = {
+        .ihdr = ihdr,
+        .sink = &sink,
+        .spans = spans,
+        .span_count = span_count,
+        .strips = strips,
+        .strip_count = strip_count,
+        .task_count = threads < strip_count ? threads : strip_count,
+        .scanline_length = packed_row_bytes(ihdr->width, bits_per_pixel),
+        .bpp = (bits_per_pixel >= 8) ? bits_per_pixel / 8 : 1,
+    };
+    thread_pool_run(thread_pool_shared(), job.task_count, decode_strips_task, &job);
+
+    bool ok = strips[0].ok;
+    uLong adler = strips[0].adler;
+    for (uint32_t i = 1; ok && i < strip_count; i++) {
+        ok = strips[i].ok;
+        adler = adler32_combine(adler, strips[i].adler,
+                                (z_off_t)((uint64_t)strips[i].rows * (1 + job.scanline_length)));
+    }
+    uint32_t expected = ((uint32_t)trailer[0] << 24) | ((uint32_t)trailer[1] << 16) |
+                        ((uint32_t)trailer[2] << 8) | trailer[3];
+    ok = ok && adler == expected;
+
+    free(spans);
+    free(strips);
+    image_sink_release(&sink);
+    if (!ok) {
+        image_free(sink.image);
+        return NULL;
+    }
+    return sink.image;
+}
+
+/**
+ * Decodes the image behind an open reader, feeding IDAT chunks to zlib straight
+ * from the mapped file instead of collecting them first. Files with a strip
+ * index are decoded a strip per task when `threads` allows more than one.
+ */
+static image_t *decode_reader(png_reader_t *reader, bool keep_16bit, decode_output_t output, uint32_t threads) {
+    if (!reader || !reader->map.data) {
+        fprintf(stderr, "ERROR: Invalid reader passed to decode_png_image\n");
+        return NULL;
     }
 
-    if (type == KERNEL_NONE) {
-        return; // Nothing to do if no kernel is selected
+    if (reader->strip_index && thread_count_resolve(threads) > 1) {
+        image_t *image = decode_strips(reader, keep_16bit, output, thread_count_resolve(threads));
+        if (image) {
+            return image;
+        }
     }
+    return decode_image(&reader->ihdr, &reader->palette, reader_source, reader, keep_16bit, output);
+}
 
-    float kernels[7][3][3] = {
-        [KERNEL_SOBEL_X]        = {{-1, 0, 1},
-                                   {-2, 0, 2},
-                                   {-1, 0, 1}},
+image_t *decode_png_image(png_reader_t *reader, bool keep_16bit, uint32_t threads) {
+    return decode_reader(reader, keep_16bit, DECODE_PIXELS, threads);
+}
 
-        [KERNEL_SOBEL_Y]        = {{-1, -2, -1},
-                                   {0, 0, 0},
-                                   {1, 2, 1}},
+image_t *decode_png_indexed(png_reader_t *reader, uint32_t threads) {
+    return decode_reader(reader, false, DECODE_INDICES, threads);
+}
 
-        [KERNEL_SOBEL_COMBINED] = {{0}}, // Handled as a special case
+image_t *decode_png_gray(png_reader_t *reader, bool keep_16bit, uint32_t threads) {
+    return decode_reader(reader, keep_16bit, DECODE_GRAY, threads);
+}
 
-        [KERNEL_GAUSSIAN]       = {{1/16.f, 2/16.f, 1/16.f},
-                                   {2/16.f, 4/16.f, 2/16.f},
-                                   {1/16.f, 2/16.f, 1/16.f}},
+typedef struct {
+    image_t *image;             // the reduced output
+    const palette_t *palette;
+    unpacker_t unpacker;
+    uint8_t *unpacked;          // the current row unpacked, unless it is 8-bit
+    uint32_t in_height;
+    uint32_t *column_begin;     // first input column of every output column, plus the end
+    uint64_t *sums;             // channel sums of the output row being gathered
+    uint32_t out_y;
+} reduce_sink_t;
 
-        [KERNEL_BLUR]           = {{1/9.f, 1/9.f, 1/9.f},
-                                   {1/9.f, 1/9.f, 1/9.f},
-                                   {1/9.f, 1/9.f, 1/9.f}},
+// First input row or column of output cell `i` when `in` maps onto `out`
+static inline uint32_t reduce_begin(uint32_t i, uint32_t in, uint32_t out) {
+    return (uint32_t)((uint64_t)i * in / out);
+}
 
-        [KERNEL_LAPLACIAN]      = {{0, -1, 0},
-                                   {-1, 4, -1},
-                                   {0, -1, 0}},
+// Adds a decoded scanline to the sums of its output row; once the last input
+// row of that output row is in, the averages are written out. Samples of
+// 16-bit files are summed at full depth and only rounded in the average
+static bool reduce_scanline(void *user, uint32_t y, const uint8_t *scanline, uint32_t length) {
+    reduce_sink_t *sink = user;
+    image_t *image = sink->image;
+    uint32_t channels = image->channels;
+    uint64_t *sums = sink->sums;
+    uint64_t start = stats_begin();
+    const uint8_t *samples = unpack_row(&sink->unpacker, scanline, sink->unpacked);
+    bool wide = sink->unpacker.bit_depth == 16;
 
-        [KERNEL_SHARPEN]        = {{0, -1, 0},
-                                   {-1, 5, -1},
-                                   {0, -1, 0}}
-    };
+    for (uint32_t ox = 0; ox < image->width; ox++) {
+        uint64_t *sum = sums + (size_t)ox * channels;
+        uint32_t x_begin = sink->column_begin[ox];
+        uint32_t x_end = sink->column_begin[ox + 1];
 
-    // Iterate over the inner pixels, avoiding the 1-pixel border
-    for (uint32_t y = 1; y < height - 1; y++) {
-        for (uint32_t x = 1; x < width - 1; x++) {
-            float gx = 0.0f, gy = 0.0f;
-
-            if (type == KERNEL_SOBEL_COMBINED) {
-                 for (int ky = -1; ky <= 1; ky++) {
-                    for (int kx = -1; kx <= 1; kx++) {
-                        uint8_t pixel = input[y + ky][x + kx];
-                        gx += pixel * kernels[KERNEL_SOBEL_X][ky + 1][kx + 1];
-                        gy += pixel * kernels[KERNEL_SOBEL_Y][ky + 1][kx + 1];
-                    }
+        if (sink->unpacker.indexed) {
+            const palette_t *palette = sink->palette;
+            for (uint32_t x = x_begin; x < x_end; x++) {
+                uint8_t index = samples[x];
+                if (index >= palette->entry_count) {
+                    fprintf(stderr, "ERROR: Invalid palette index %u at (%u, %u)\n", index, y, x);
+                    index = 0;
                 }
-                float magnitude = sqrtf(gx * gx + gy * gy);
-                output[y][x] = (magnitude > 255.0f) ? 255 : (uint8_t)magnitude;
-            } else {
-                float sum = 0.0f;
-                for (int ky = -1; ky <= 1; ky++) {
-                    for (int kx = -1; kx <= 1; kx++) {
-                        sum += input[y + ky][x + kx] * kernels[type][ky + 1][kx + 1];
-                    }
+                sum[0] += palette->entries[index].r;
+                sum[1] += palette->entries[index].g;
+                sum[2] += palette->entries[index].b;
+                if (channels == 4) {
+                    sum[3] += (index < palette->alpha_count) ? palette->alphas[index] : 255;
                 }
-
-                // FIX: For Sobel X/Y, take the absolute value to see all edges.
-                if (type == KERNEL_SOBEL_X || type == KERNEL_SOBEL_Y) {
-                    sum = fabsf(sum);
+            }
+        } else if (wide) {
+            const uint16_t *pixel = (const uint16_t *)samples + (size_t)x_begin * channels;
+            for (uint32_t x = x_begin; x < x_end; x++, pixel += channels) {
+                for (uint32_t c = 0; c < channels; c++) {
+                    sum[c] += pixel[c];
+                }
+            }
+        } else {
+            const uint8_t *pixel = samples + (size_t)x_begin * channels;
+            for (uint32_t x = x_begin; x < x_end; x++, pixel += channels) {
+                for (uint32_t c = 0; c < channels; c++) {
+                    sum[c] += pixel[c];
                 }
-
-                // Clamp the result to the valid 0-255 range
-                if (sum < 0.0f) sum = 0.0f;
-                if (sum > 255.0f) sum = 255.0f;
-                output[y][x] = (uint8_t)sum;
             }
         }
     }
-}
 
-// Just upscaling. Nothing more
-uint8_t **upscale(uint8_t **input, uint32_t height, uint32_t width) {
-    if(!input) {
-        return NULL;
+    uint32_t row_begin = reduce_begin(sink->out_y, sink->in_height, image->height);
+    uint32_t row_end = reduce_begin(sink->out_y + 1, sink->in_height, image->height);
+    if (y + 1 < row_end) {
+        stats_end(STATS_RESAMPLE, start, length);
+        return true;
     }
 
-    uint32_t new_h = height * 3;
-    uint32_t new_w = width * 3;
-    uint8_t **output = allocate_pixel_matrix(new_h, new_w);
-    if(!output) {
-        fprintf(stderr, "ERROR: Could not allocate memory for output in upscale()\n");
-        return NULL;
-    }
-
-    for(uint32_t y = 0; y < height; y++) {
-        for(uint32_t x = 0; x < width; x++) {
-            uint8_t pixel_value = input[y][x];
-            for(uint8_t ky = 0; ky < 3; ky++) {
-                for(uint8_t kx = 0; kx < 3; kx++) {
-                    output[y * 3 + ky][x * 3 + kx] = pixel_value;
-                }
+    // 16-bit sums averaged into an 8-bit image are also divided by 257
+    uint64_t scale = (wide && image->bit_depth == 8) ? 257 : 1;
+    uint8_t *out = image_row(image, sink->out_y);
+    for (uint32_t ox = 0; ox < image->width; ox++) {
+        uint64_t count = (uint64_t)(sink->column_begin[ox + 1] - sink->column_begin[ox]) * (row_end - row_begin) * scale;
+        for (uint32_t c = 0; c < channels; c++) {
+            size_t i = (size_t)ox * channels + c;
+            uint64_t average = (sums[i] + count / 2) / count;
+            if (image->bit_depth == 16) {
+                ((uint16_t *)out)[i] = (uint16_t)average;
+            } else {
+                out[i] = (uint8_t)average;
             }
+            sums[i] = 0;
         }
     }
-    // apply_convolution(output, output, new_h, new_w, KERNEL_SHARPEN);
-
-    return output;
+    sink->out_y++;
+    stats_end(STATS_RESAMPLE, start, length);
+    return true;
 }
 
 /**
- * Upscales a single-channel image by a factor of 3 using bilinear interpolation.
- *
- * @param input The input pixel matrix (grayscale).
- * @param height The height of the input image.
- * @param width The width of the input image.
- * @return A new, upscaled pixel matrix, or NULL on failure.
+ * Decodes the image behind an open reader straight into a width x height
+ * area average: every input pixel is added to the one output pixel it falls
+ * in as its scanline comes out of the decoder, and each output row is
+ * finished once its last input row has been seen. Besides zlib, only two
+ * input scanlines and one row of sums are ever held, whatever the input size
+ * (interlaced files excepted, see decode_scanlines()).
+ * Sizes larger than the input are clamped to it.
  */
-uint8_t **bilinear_upscale(uint8_t **input, uint32_t height, uint32_t width, float scale_factor) {
-    if (!input) {
+image_t *decode_png_reduced(png_reader_t *reader, uint32_t width, uint32_t height, bool keep_16bit) {
+    if (!reader || !reader->map.data || width == 0 || height == 0) {
+        fprintf(stderr, "ERROR: Invalid parameters to decode_png_reduced\n");
         return NULL;
     }
 
-    uint32_t new_height = height * (int)(scale_factor);
-    uint32_t new_width = width * (int)(scale_factor);
-
-    uint8_t **output = allocate_pixel_matrix(new_height, new_width);
-    if (!output) {
-        fprintf(stderr, "ERROR: Could not allocate memory for bilinear upscale output\n");
+    ihdr_t *ihdr = &reader->ihdr;
+    reduce_sink_t sink = {
+        .palette = &reader->palette,
+        .in_height = ihdr->height,
+    };
+    uint32_t channels = decoded_channels(ihdr, &reader->palette);
+    if (channels == 0 || !unpacker_init(&sink.unpacker, ihdr, keep_16bit)) {
         return NULL;
     }
+    if (width > ihdr->width) width = ihdr->width;
+    if (height > ihdr->height) height = ihdr->height;
+
+    // 16-bit rows always unpack at full depth, for the sums
+    sink.unpacker.keep_16bit = (ihdr->bit_depth == 16);
+    sink.image = image_create_depth(width, height, channels, (keep_16bit && ihdr->bit_depth == 16) ? 16 : 8);
+    sink.column_begin = malloc(((size_t)width + 1) * sizeof(uint32_t));
+    sink.sums = calloc((size_t)width * channels, sizeof(uint64_t));
+    if (ihdr->bit_depth != 8) {
+        sink.unpacked = malloc(sink.unpacker.samples * 2);
+    }
+    bool ok = sink.image && sink.column_begin && sink.sums && (ihdr->bit_depth == 8 || sink.unpacked);
+    if (sink.image && !ok) {
+        fprintf(stderr, "ERROR: Could not allocate memory for reduced decoding\n");
+    }
 
-    for (uint32_t y_new = 0; y_new < new_height; y_new++) {
-        for (uint32_t x_new = 0; x_new < new_width; x_new++) {
-            // Map the new pixel's coordinates back to the original image
-            float x_orig = (x_new + 0.5f) / scale_factor - 0.5f;
-            float y_orig = (y_new + 0.5f) / scale_factor - 0.5f;
+    if (ok) {
+        for (uint32_t ox = 0; ox <= width; ox++) {
+            sink.column_begin[ox] = reduce_begin(ox, ihdr->width, width);
+        }
+        ok = decode_scanlines(ihdr, reader_source, reader, reduce_scanline, &sink);
+    }
 
-            // Get the integer coordinates of the top-left surrounding pixel
-            int x1 = (int)floor(x_orig);
-            int y1 = (int)floor(y_orig);
+    free(sink.column_begin);
+    free(sink.sums);
+    free(sink.unpacked);
+    if (!ok) {
+        image_free(sink.image);
+        return NULL;
+    }
+    return sink.image;
+}
 
-            // Handle edge cases by clamping coordinates
-            if (x1 < 0) x1 = 0;
-            if (y1 < 0) y1 = 0;
-            if ((uint32_t)x1 >= width - 1) x1 = width - 2;
-            if ((uint32_t)y1 >= height - 1) y1 = height - 2;
+image_t *rgb_to_grayscale(image_t *image) {
+    if (!image || !image->data) {
+        fprintf(stderr, "ERROR: Invalid image for grayscale conversion\n");
+        return NULL;
+    }
 
-            // Coordinates of the other 3 surrounding pixels
-            int x2 = x1 + 1;
-            int y2 = y1 + 1;
+    uint32_t channels = image_gray_channels(image->channels);
+    if (image->channels == channels) {
+        // Already grayscale, no conversion needed.
+        return image;
+    }
 
-            // Get the pixel values of the four neighbors
-            uint8_t Q11 = input[y1][x1]; // Top-left
-            uint8_t Q21 = input[y1][x2]; // Top-right
-            uint8_t Q12 = input[y2][x1]; // Bottom-left
-            uint8_t Q22 = input[y2][x2]; // Bottom-right
+    image_t *gray = image_create_depth(image->width, image->height, channels, image->bit_depth);
+    if (!gray) return NULL;
 
-            // Calculate the fractional distances (weights)
-            float x_frac = x_orig - x1;
-            float y_frac = y_orig - y1;
+    uint64_t start = stats_begin();
+    for (uint32_t y = 0; y < image->height; y++) {
+        image_gray_alpha_row(image_row(image, y), image_row(gray, y), image->width, image->channels,
+                             image->bit_depth);
+    }
+    stats_end(STATS_CONVERT, start, image_row_bytes(image) * image->height);
+    return gray;
+}
 
-            // Interpolate horizontally
-            float R1 = Q11 * (1.0f - x_frac) + Q21 * x_frac; // Top edge
-            float R2 = Q12 * (1.0f - x_frac) + Q22 * x_frac; // Bottom edge
+void palette_to_grayscale(image_t *image) {
+    if (!image || !image->palette) {
+        return;
+    }
+    // The entries are RGBA pixels, so they convert like a row of them
+    image_palette_t *palette = image->palette;
+    uint8_t gray[256];
+    image_gray_row(&palette->entries[0][0], gray, 256, 4);
+    for (uint32_t i = 0; i < 256; i++) {
+        memset(palette->entries[i], gray[i], 3);
+    }
+}
+
+// Just upscaling. Nothing more
+image_t *upscale(const image_t *input) {
+    if(!input) {
+        return NULL;
+    }
 
-            // Interpolate vertically and clamp the final value
-            float value = R1 * (1.0f - y_frac) + R2 * y_frac;
-            if (value > 255.0f) value = 255.0f;
-            if (value < 0.0f) value = 0.0f;
+    uint32_t new_h = input->height * 3;
+    uint32_t new_w = input->width * 3;
+    image_t *output = image_create(new_w, new_h, 1);
+    if(!output) {
+        fprintf(stderr, "ERROR: Could not allocate memory for output in upscale()\n");
+        return NULL;
+    }
 
-            output[y_new][x_new] = (uint8_t)value;
+    for(uint32_t y = 0; y < input->height; y++) {
+        const uint8_t *src = image_row(input, y);
+        for(uint32_t x = 0; x < input->width; x++) {
+            uint8_t pixel_value = src[x];
+            for(uint8_t ky = 0; ky < 3; ky++) {
+                uint8_t *dst = image_row(output, y * 3 + ky);
+                for(uint8_t kx = 0; kx < 3; kx++) {
+                    dst[x * 3 + kx] = pixel_value;
+                }
+            }
         }
     }
+    // apply_convolution(output, output, KERNEL_SHARPEN);
 
     return output;
 }
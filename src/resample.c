@@ -0,0 +1,530 @@
+#include "../include/resample.h"
+#include "../include/stats.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Weights are 14-bit fixed point: a pixel times a weight fits 16 x 16 bit
+// multiplies, and even the largest Lanczos centre weight (a little over 1)
+// stays below INT16_MAX
+#define RESAMPLE_PRECISION 14
+#define RESAMPLE_ONE (1 << RESAMPLE_PRECISION)
+#define RESAMPLE_ROUND (1 << (RESAMPLE_PRECISION - 1))
+
+// Rows per band handed to one task, as in convolution.c
+#define RESAMPLE_BAND_ROWS 64
+
+typedef struct {
+    const char *name;
+    double support;     // radius at scale 1
+} filter_info_t;
+
+static const filter_info_t filters[] = {
+    [RESAMPLE_BOX]      = {"box",      0.5},
+    [RESAMPLE_BILINEAR] = {"bilinear", 1.0},
+    [RESAMPLE_BICUBIC]  = {"bicubic",  2.0},
+    [RESAMPLE_LANCZOS3] = {"lanczos3", 3.0},
+};
+
+#define FILTER_TYPES (sizeof(filters) / sizeof(filters[0]))
+
+// Weights of every output sample along one axis
+typedef struct {
+    uint32_t *start;    // first input sample
+    uint32_t *taps;     // input samples that contribute
+    int16_t *weights;   // `stride` per output sample, zero padded
+    uint32_t stride;    // most taps of any sample, rounded up to a pair
+    uint32_t in_size;   // input samples
+} axis_weights_t;
+
+static double sinc(double x) {
+    if (x == 0.0) {
+        return 1.0;
+    }
+    x *= M_PI;
+    return sin(x) / x;
+}
+
+static double filter_value(resample_filter_t filter, double x) {
+    double ax = fabs(x);
+    switch (filter) {
+        case RESAMPLE_BOX:
+            return (x > -0.5 && x <= 0.5) ? 1.0 : 0.0;
+        case RESAMPLE_BILINEAR:
+            return (ax < 1.0) ? 1.0 - ax : 0.0;
+        case RESAMPLE_BICUBIC: {
+            const double a = -0.5;
+            if (ax < 1.0) {
+                return ((a + 2.0) * ax - (a + 3.0)) * ax * ax + 1.0;
+            }
+            if (ax < 2.0) {
+                return (((ax - 5.0) * ax + 8.0) * ax - 4.0) * a;
+            }
+            return 0.0;
+        }
+        case RESAMPLE_LANCZOS3:
+            return (ax < 3.0) ? sinc(x) * sinc(x / 3.0) : 0.0;
+    }
+    return 0.0;
+}
+
+static void axis_weights_free(axis_weights_t *axis) {
+    free(axis->start);
+    free(axis->taps);
+    free(axis->weights);
+    axis->start = NULL;
+    axis->taps = NULL;
+    axis->weights = NULL;
+}
+
+// Weights mapping `in_size` samples onto `out_size`, pixel centres aligned.
+// When shrinking the filter is stretched by the scale so every input
+// sample contributes; integer weights of each sample sum to exactly one
+static bool axis_weights_init(axis_weights_t *axis, uint32_t in_size, uint32_t out_size,
+                              resample_filter_t filter) {
+    double scale = (double)in_size / out_size;
+    double filter_scale = (scale > 1.0) ? scale : 1.0;
+    double support = filters[filter].support * filter_scale;
+    uint32_t max_taps = (uint32_t)ceil(support) * 2 + 1;
+
+    axis->stride = (max_taps + 1) & ~1u;
+    axis->in_size = in_size;
+    axis->start = malloc(out_size * sizeof(uint32_t));
+    axis->taps = malloc(out_size * sizeof(uint32_t));
+    axis->weights = calloc((size_t)out_size * axis->stride, sizeof(int16_t));
+    double *values = malloc(max_taps * sizeof(double));
+    if (!axis->start || !axis->taps || !axis->weights || !values) {
+        fprintf(stderr, "ERROR: Could not allocate memory for resampling weights\n");
+        axis_weights_free(axis);
+        free(values);
+        return false;
+    }
+
+    for (uint32_t x = 0; x < out_size; x++) {
+        double center = (x + 0.5) * scale;
+        int64_t begin = (int64_t)(center - support + 0.5);
+        int64_t end = (int64_t)(center + support + 0.5);
+        if (begin < 0) begin = 0;
+        if (end > in_size) end = in_size;
+        if (end - begin > max_taps) end = begin + max_taps;
+
+        uint32_t taps = (uint32_t)(end - begin);
+        double total = 0.0;
+        for (uint32_t i = 0; i < taps; i++) {
+            values[i] = filter_value(filter, (begin + i - center + 0.5) / filter_scale);
+            total += values[i];
+        }
+
+        // Drop zero weights at both ends, the box filter has some
+        uint32_t first = 0;
+        while (first < taps && values[first] == 0.0) first++;
+        while (taps > first && values[taps - 1] == 0.0) taps--;
+        if (first == taps || total == 0.0) {
+            // Cannot happen for these filters, but keep the nearest sample
+            first = 0;
+            taps = 1;
+            values[0] = total = 1.0;
+            begin = (int64_t)center < in_size ? (int64_t)center : in_size - 1;
+        }
+
+        int16_t *weights = axis->weights + (size_t)x * axis->stride;
+        int32_t sum = 0;
+        uint32_t largest = 0;
+        for (uint32_t i = first; i < taps; i++) {
+            weights[i - first] = (int16_t)lround(values[i] / total * RESAMPLE_ONE);
+            sum += weights[i - first];
+            if (weights[i - first] > weights[largest]) {
+                largest = i - first;
+            }
+        }
+        // Rounding residue goes to the largest weight so flat areas stay flat
+        weights[largest] = (int16_t)(weights[largest] + RESAMPLE_ONE - sum);
+
+        axis->start[x] = (uint32_t)begin + first;
+        axis->taps[x] = taps - first;
+    }
+
+    free(values);
+    return true;
+}
+
+static inline uint8_t clamp_fixed(int32_t sum) {
+    sum >>= RESAMPLE_PRECISION;
+    return (uint8_t)(sum < 0 ? 0 : sum > 255 ? 255 : sum);
+}
+
+#ifdef __SSE2__
+// A 3 or 4 byte pixel in the low bytes. Three byte pixels are loaded as four
+// whenever that stays inside the row, the extra byte is never used
+static inline uint32_t load_pixel(const uint8_t *p, const uint8_t *row_end) {
+    uint32_t value = 0;
+    if (p + 4 <= row_end) {
+        memcpy(&value, p, 4);
+    } else {
+        memcpy(&value, p, 3);
+    }
+    return value;
+}
+
+// Two neighbouring pixels of up to 4 channels as 16-bit lanes ordered
+// c0 c0' c1 c1' ..., ready for _mm_madd_epi16 against a weight pair
+static inline __m128i pixel_pair(uint32_t a, uint32_t b) {
+    __m128i interleaved = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)a), _mm_cvtsi32_si128((int)b));
+    return _mm_unpacklo_epi8(interleaved, _mm_setzero_si128());
+}
+
+static inline __m128i weight_pair(const int16_t *weights) {
+    return _mm_set1_epi32((int)(((uint32_t)(uint16_t)weights[1] << 16) | (uint16_t)weights[0]));
+}
+#endif
+
+// One output row of the horizontal pass
+static void resample_row_horizontal(const uint8_t *in, uint8_t *out, uint32_t width,
+                                    uint32_t channels, const axis_weights_t *axis) {
+#ifdef __SSE2__
+    const uint8_t *row_end = in + (size_t)axis->in_size * channels;
+#endif
+    for (uint32_t x = 0; x < width; x++) {
+        const int16_t *weights = axis->weights + (size_t)x * axis->stride;
+        const uint8_t *src = in + (size_t)axis->start[x] * channels;
+        uint32_t taps = axis->taps[x];
+        uint8_t *pixel = out + (size_t)x * channels;
+
+#ifdef __SSE2__
+        if (channels >= 3) {
+            // All channels of a pixel in one vector, two taps per madd
+            __m128i sum = _mm_set1_epi32(RESAMPLE_ROUND);
+            uint32_t i = 0;
+            for (; i + 1 < taps; i += 2) {
+                __m128i pair = pixel_pair(load_pixel(src + i * channels, row_end),
+                                          load_pixel(src + (i + 1) * channels, row_end));
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(pair, weight_pair(weights + i)));
+            }
+            if (i < taps) {
+                // The padding weight after the last tap is zero
+                __m128i pair = pixel_pair(load_pixel(src + i * channels, row_end), 0);
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(pair, weight_pair(weights + i)));
+            }
+            sum = _mm_srai_epi32(sum, RESAMPLE_PRECISION);
+            sum = _mm_packs_epi32(sum, sum);
+            uint32_t result = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+            memcpy(pixel, &result, channels);
+            continue;
+        }
+        if (channels == 1) {
+            // Eight taps per step, summed across the lanes at the end
+            __m128i acc = _mm_setzero_si128();
+            uint32_t i = 0;
+            for (; i + 8 <= taps; i += 8) {
+                __m128i values = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(src + i)),
+                                                   _mm_setzero_si128());
+                acc = _mm_add_epi32(acc, _mm_madd_epi16(values, _mm_loadu_si128((const __m128i *)(weights + i))));
+            }
+            acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+            acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+            int32_t sum = RESAMPLE_ROUND + _mm_cvtsi128_si32(acc);
+            for (; i < taps; i++) {
+                sum += src[i] * weights[i];
+            }
+            pixel[0] = clamp_fixed(sum);
+            continue;
+        }
+#endif
+        for (uint32_t c = 0; c < channels; c++) {
+            int32_t sum = RESAMPLE_ROUND;
+            for (uint32_t i = 0; i < taps; i++) {
+                sum += src[(size_t)i * channels + c] * weights[i];
+            }
+            pixel[c] = clamp_fixed(sum);
+        }
+    }
+}
+
+// One output row of the vertical pass from `taps` rows starting at `in`
+static void resample_row_vertical(const uint8_t *in, size_t stride, uint32_t taps, const int16_t *weights,
+                                  uint8_t *out, size_t row_bytes) {
+    size_t x = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 8 <= row_bytes; x += 8) {
+        __m128i lo = _mm_set1_epi32(RESAMPLE_ROUND);
+        __m128i hi = lo;
+        uint32_t i = 0;
+        for (; i < taps; i += 2) {
+            // Bytes of two rows interleaved, so one madd weighs both
+            const uint8_t *row = in + i * stride + x;
+            __m128i a = _mm_loadl_epi64((const __m128i *)row);
+            __m128i b = (i + 1 < taps) ? _mm_loadl_epi64((const __m128i *)(row + stride)) : zero;
+            __m128i ab = _mm_unpacklo_epi8(a, b);
+            __m128i pair = weight_pair(weights + i);
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi8(ab, zero), pair));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi8(ab, zero), pair));
+        }
+        lo = _mm_srai_epi32(lo, RESAMPLE_PRECISION);
+        hi = _mm_srai_epi32(hi, RESAMPLE_PRECISION);
+        __m128i packed = _mm_packs_epi32(lo, hi);
+        _mm_storel_epi64((__m128i *)(out + x), _mm_packus_epi16(packed, packed));
+    }
+#endif
+    for (; x < row_bytes; x++) {
+        int32_t sum = RESAMPLE_ROUND;
+        for (uint32_t i = 0; i < taps; i++) {
+            sum += in[i * stride + x] * weights[i];
+        }
+        out[x] = clamp_fixed(sum);
+    }
+}
+
+// The 16-bit passes, scalar with 64-bit sums: a 16-bit sample times a
+// 14-bit weight leaves no headroom for the taps in 32 bits
+static inline uint16_t clamp_fixed16(int64_t sum) {
+    sum >>= RESAMPLE_PRECISION;
+    return (uint16_t)(sum < 0 ? 0 : sum > 65535 ? 65535 : sum);
+}
+
+static void resample_row_horizontal16(const uint16_t *in, uint16_t *out, uint32_t width,
+                                      uint32_t channels, const axis_weights_t *axis) {
+    for (uint32_t x = 0; x < width; x++) {
+        const int16_t *weights = axis->weights + (size_t)x * axis->stride;
+        const uint16_t *src = in + (size_t)axis->start[x] * channels;
+        for (uint32_t c = 0; c < channels; c++) {
+            int64_t sum = RESAMPLE_ROUND;
+            for (uint32_t i = 0; i < axis->taps[x]; i++) {
+                sum += (int64_t)src[(size_t)i * channels + c] * weights[i];
+            }
+            out[(size_t)x * channels + c] = clamp_fixed16(sum);
+        }
+    }
+}
+
+// `stride` in bytes, as image_t keeps it
+static void resample_row_vertical16(const uint8_t *in, size_t stride, uint32_t taps, const int16_t *weights,
+                                    uint16_t *out, size_t samples) {
+    for (size_t x = 0; x < samples; x++) {
+        int64_t sum = RESAMPLE_ROUND;
+        for (uint32_t i = 0; i < taps; i++) {
+            sum += (int64_t)((const uint16_t *)(in + i * stride))[x] * weights[i];
+        }
+        out[x] = clamp_fixed16(sum);
+    }
+}
+
+typedef struct {
+    const image_t *input;
+    image_t *output;
+    const axis_weights_t *axis;
+    uint32_t row_offset;    // input row of output row 0 (horizontal) or of
+                            // source row 0 (vertical)
+    uint32_t band_rows;
+    uint32_t rows;
+} resample_job_t;
+
+static void horizontal_band(void *arg, uint32_t index) {
+    resample_job_t *job = arg;
+    uint32_t y_begin = index * job->band_rows;
+    uint32_t y_end = (y_begin + job->band_rows < job->rows) ? y_begin + job->band_rows : job->rows;
+    for (uint32_t y = y_begin; y < y_end; y++) {
+        const uint8_t *in = image_row(job->input, y + job->row_offset);
+        if (job->input->bit_depth == 16) {
+            resample_row_horizontal16((const uint16_t *)in, (uint16_t *)image_row(job->output, y),
+                                      job->output->width, job->input->channels, job->axis);
+        } else {
+            resample_row_horizontal(in, image_row(job->output, y), job->output->width,
+                                    job->input->channels, job->axis);
+        }
+    }
+}
+
+static void vertical_band(void *arg, uint32_t index) {
+    resample_job_t *job = arg;
+    const axis_weights_t *axis = job->axis;
+    uint32_t y_begin = index * job->band_rows;
+    uint32_t y_end = (y_begin + job->band_rows < job->rows) ? y_begin + job->band_rows : job->rows;
+    for (uint32_t y = y_begin; y < y_end; y++) {
+        const uint8_t *in = image_row(job->input, axis->start[y] - job->row_offset);
+        const int16_t *weights = axis->weights + (size_t)y * axis->stride;
+        if (job->input->bit_depth == 16) {
+            resample_row_vertical16(in, job->input->stride, axis->taps[y], weights,
+                                    (uint16_t *)image_row(job->output, y), image_row_bytes(job->output) / 2);
+        } else {
+            resample_row_vertical(in, job->input->stride, axis->taps[y], weights,
+                                  image_row(job->output, y), image_row_bytes(job->output));
+        }
+    }
+}
+
+// Split `job->rows` rows into bands on the shared pool, as apply_convolution() does
+static void run_bands(resample_job_t *job, pool_task_fn fn, uint32_t threads) {
+    threads = thread_count_resolve(threads);
+    if (threads == 1 || job->rows < 2) {
+        job->band_rows = job->rows;
+        fn(job, 0);
+        return;
+    }
+
+    thread_pool_t *pool = thread_pool_shared();
+    uint32_t band_rows = RESAMPLE_BAND_ROWS;
+    if (threads < thread_pool_size(pool) + 1 || job->rows / band_rows < threads) {
+        band_rows = (job->rows + threads - 1) / threads;
+    }
+    job->band_rows = band_rows;
+    thread_pool_run(pool, (job->rows + band_rows - 1) / band_rows, fn, job);
+}
+
+static image_t *resample(const image_t *input, uint32_t width, uint32_t height,
+                         resample_filter_t filter, uint32_t threads) {
+    if (!input || width == 0 || height == 0 || (uint32_t)filter >= FILTER_TYPES) {
+        fprintf(stderr, "ERROR: Invalid parameters for resampling\n");
+        return NULL;
+    }
+
+    image_t *output = image_create_depth(width, height, input->channels, input->bit_depth);
+    if (!output) {
+        return NULL;
+    }
+    if (width == input->width && height == input->height) {
+        image_copy(output, input);
+        return output;
+    }
+
+    axis_weights_t rows_axis = {0};
+    axis_weights_t columns_axis = {0};
+    bool vertical = height != input->height;
+    bool horizontal = width != input->width;
+    if ((vertical && !axis_weights_init(&rows_axis, input->height, height, filter)) ||
+        (horizontal && !axis_weights_init(&columns_axis, input->width, width, filter))) {
+        axis_weights_free(&rows_axis);
+        image_free(output);
+        return NULL;
+    }
+
+    // Only the input rows the vertical pass reads go through the horizontal one
+    uint32_t first_row = 0;
+    uint32_t last_row = input->height;
+    if (vertical) {
+        first_row = rows_axis.start[0];
+        last_row = rows_axis.start[height - 1] + rows_axis.taps[height - 1];
+    }
+
+    const image_t *source = input;
+    image_t *temp = NULL;
+    bool ok = true;
+
+    if (horizontal) {
+        // Without a vertical pass the rows land in the output directly
+        temp = vertical ? image_create_depth(width, last_row - first_row, input->channels, input->bit_depth) : output;
+        ok = temp != NULL;
+        if (ok) {
+            resample_job_t job = {
+                .input = input,
+                .output = temp,
+                .axis = &columns_axis,
+                .row_offset = first_row,
+                .rows = last_row - first_row,
+            };
+            run_bands(&job, horizontal_band, threads);
+            source = temp;
+        }
+    }
+
+    if (ok && vertical) {
+        resample_job_t job = {
+            .input = source,
+            .output = output,
+            .axis = &rows_axis,
+            .row_offset = (source == input) ? 0 : first_row,
+            .rows = height,
+        };
+        run_bands(&job, vertical_band, threads);
+    }
+
+    if (temp != output) {
+        image_free(temp);
+    }
+    axis_weights_free(&rows_axis);
+    axis_weights_free(&columns_axis);
+    if (!ok) {
+        image_free(output);
+        return NULL;
+    }
+    return output;
+}
+
+image_t *resample_image(const image_t *input, uint32_t width, uint32_t height,
+                        resample_filter_t filter, uint32_t threads) {
+    uint64_t start = stats_begin();
+    image_t *output = resample(input, width, height, filter, threads);
+    stats_end(STATS_RESAMPLE, start, output ? image_row_bytes(output) * output->height : 0);
+    return output;
+}
+
+bool resample_parse_filter(const char *name, resample_filter_t *filter) {
+    for (uint32_t i = 0; i < FILTER_TYPES; i++) {
+        if (!strcmp(name, filters[i].name)) {
+            *filter = (resample_filter_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *resample_filter_name(resample_filter_t filter) {
+    return ((uint32_t)filter < FILTER_TYPES) ? filters[filter].name : "?";
+}
+
+bool resample_parse_size(const char *text, resample_size_t *size) {
+    memset(size, 0, sizeof(resample_size_t));
+    const char *x = strchr(text, 'x');
+    if (!x) {
+        return false;
+    }
+
+    char *end;
+    if (x != text) {
+        unsigned long width = strtoul(text, &end, 10);
+        if (end != x || width == 0 || width > UINT32_MAX) {
+            return false;
+        }
+        size->width = (uint32_t)width;
+    }
+    if (x[1] != '\0') {
+        unsigned long height = strtoul(x + 1, &end, 10);
+        if (*end != '\0' || height == 0 || height > UINT32_MAX) {
+            return false;
+        }
+        size->height = (uint32_t)height;
+    }
+    return size->width || size->height;
+}
+
+void resample_target_size(uint32_t width, uint32_t height, const resample_size_t *request,
+                          uint32_t *out_width, uint32_t *out_height) {
+    double w, h;
+    if (request->scale > 0.0f) {
+        w = width * (double)request->scale;
+        h = height * (double)request->scale;
+    } else if (request->fit) {
+        double sx = request->width ? (double)request->width / width : INFINITY;
+        double sy = request->height ? (double)request->height / height : INFINITY;
+        double s = (sx < sy) ? sx : sy;
+        if (s > 1.0) {
+            s = 1.0;
+        }
+        w = width * s;
+        h = height * s;
+    } else if (request->width && request->height) {
+        w = request->width;
+        h = request->height;
+    } else if (request->width) {
+        w = request->width;
+        h = (double)height * request->width / width;
+    } else {
+        h = request->height;
+        w = (double)width * request->height / height;
+    }
+
+    // Round to the nearest pixel, and never below one
+    *out_width = (w < 1.0) ? 1 : (w > UINT32_MAX) ? UINT32_MAX : (uint32_t)lround(w);
+    *out_height = (h < 1.0) ? 1 : (h > UINT32_MAX) ? UINT32_MAX : (uint32_t)lround(h);
+}
@@ -0,0 +1,421 @@
+#include "../include/server.h"
+#include "../include/cli.h"
+#include "../include/buffer_cache.h"
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// How often blocked accepts and reads look at the stop flag
+#define SERVER_POLL_MS 200
+
+#define SERVER_READ_BUFFER (64 * 1024)
+#define SERVER_MAX_ARGS 64
+
+typedef struct {
+    int listen_fd;
+    pthread_mutex_t lock;       // guards the queue and the counters
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    int queue[SERVER_QUEUE_SIZE];
+    uint32_t head;
+    uint32_t count;
+    bool closed;
+    uint64_t succeeded;
+    uint64_t failed;
+} server_t;
+
+// Buffered reader over one connection, reused for every connection a
+// worker serves
+typedef struct {
+    int fd;
+    size_t start;
+    size_t end;
+    uint8_t buffer[SERVER_READ_BUFFER];
+} connection_t;
+
+// Per-worker state kept across requests
+typedef struct {
+    connection_t conn;
+    char line[SERVER_LINE_MAX];
+    uint8_t *payload;
+    size_t payload_capacity;
+} worker_t;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop_signal(int signal_number) {
+    (void)signal_number;
+    stop_requested = 1;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void queue_push(server_t *server, int fd) {
+    pthread_mutex_lock(&server->lock);
+    while (server->count == SERVER_QUEUE_SIZE) {
+        pthread_cond_wait(&server->not_full, &server->lock);
+    }
+    server->queue[(server->head + server->count) % SERVER_QUEUE_SIZE] = fd;
+    server->count++;
+    pthread_cond_signal(&server->not_empty);
+    pthread_mutex_unlock(&server->lock);
+}
+
+// Next accepted connection, -1 once the queue is closed and drained
+static int queue_pop(server_t *server) {
+    pthread_mutex_lock(&server->lock);
+    while (server->count == 0 && !server->closed) {
+        pthread_cond_wait(&server->not_empty, &server->lock);
+    }
+    int fd = -1;
+    if (server->count > 0) {
+        fd = server->queue[server->head];
+        server->head = (server->head + 1) % SERVER_QUEUE_SIZE;
+        server->count--;
+        pthread_cond_signal(&server->not_full);
+    }
+    pthread_mutex_unlock(&server->lock);
+    return fd;
+}
+
+static void queue_close(server_t *server) {
+    pthread_mutex_lock(&server->lock);
+    server->closed = true;
+    pthread_cond_broadcast(&server->not_empty);
+    pthread_mutex_unlock(&server->lock);
+}
+
+// Wait until `fd` is readable. False on shutdown or error
+static bool wait_readable(int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    while (!stop_requested) {
+        int ready = poll(&pfd, 1, SERVER_POLL_MS);
+        if (ready > 0) {
+            return true;
+        }
+        if (ready < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+    return false;
+}
+
+// Pull more bytes into the connection buffer, false on EOF, error or shutdown
+static bool connection_fill(connection_t *conn) {
+    if (conn->start > 0) {
+        memmove(conn->buffer, conn->buffer + conn->start, conn->end - conn->start);
+        conn->end -= conn->start;
+        conn->start = 0;
+    }
+    if (conn->end == SERVER_READ_BUFFER || !wait_readable(conn->fd)) {
+        return false;
+    }
+    ssize_t n = read(conn->fd, conn->buffer + conn->end, SERVER_READ_BUFFER - conn->end);
+    if (n <= 0) {
+        return false;
+    }
+    conn->end += (size_t)n;
+    return true;
+}
+
+// Read one line without its newline. False on EOF or a line that does not fit
+static bool connection_read_line(connection_t *conn, char *line, size_t size) {
+    while (true) {
+        uint8_t *newline = memchr(conn->buffer + conn->start, '\n', conn->end - conn->start);
+        if (newline) {
+            size_t length = (size_t)(newline - (conn->buffer + conn->start));
+            if (length >= size) {
+                return false;
+            }
+            memcpy(line, conn->buffer + conn->start, length);
+            line[length] = '\0';
+            conn->start += length + 1;
+            return true;
+        }
+        if (conn->end - conn->start >= size || !connection_fill(conn)) {
+            return false;
+        }
+    }
+}
+
+// Read exactly `size` bytes, whatever is buffered first, the rest straight
+// from the socket
+static bool connection_read_exact(connection_t *conn, uint8_t *data, size_t size) {
+    size_t buffered = conn->end - conn->start;
+    size_t n = (buffered < size) ? buffered : size;
+    memcpy(data, conn->buffer + conn->start, n);
+    conn->start += n;
+
+    while (n < size) {
+        if (!wait_readable(conn->fd)) {
+            return false;
+        }
+        ssize_t got = read(conn->fd, data + n, size - n);
+        if (got <= 0) {
+            return false;
+        }
+        n += (size_t)got;
+    }
+    return true;
+}
+
+static bool send_reply(int fd, const char *reply) {
+    size_t length = strlen(reply);
+    size_t sent = 0;
+    while (sent < length) {
+        // MSG_NOSIGNAL: a client that went away must not kill the server
+        ssize_t n = send(fd, reply + sent, length - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        sent += (size_t)n;
+    }
+    return true;
+}
+
+// Read an inline payload of `size` bytes into the worker's buffer
+static bool read_payload(worker_t *worker, size_t size) {
+    if (size > worker->payload_capacity) {
+        uint8_t *payload = realloc(worker->payload, size);
+        if (!payload) {
+            fprintf(stderr, "ERROR: Could not allocate %zu bytes for request data\n", size);
+            return false;
+        }
+        worker->payload = payload;
+        worker->payload_capacity = size;
+    }
+    return connection_read_exact(&worker->conn, worker->payload, size);
+}
+
+// Run one request and write its reply. Returns false if the connection
+// cannot be used any further
+static bool handle_request(worker_t *worker, bool *ok) {
+    double start = now_ms();
+    char reply[256];
+    *ok = false;
+
+    // argv as the command line would have it: png <input> -o <output> [options]
+    char *argv[SERVER_MAX_ARGS + 3];
+    char *save = NULL;
+    char *input = strtok_r(worker->line, " \t\r", &save);
+    char *output = strtok_r(NULL, " \t\r", &save);
+    if (!input || !output) {
+        return send_reply(worker->conn.fd, "ERR expected <input> <output> [options]\n");
+    }
+
+    // Inline data has to be consumed even if the request turns out bad,
+    // otherwise the next request would start in the middle of it
+    size_t inline_size = 0;
+    bool is_inline = (input[0] == '@');
+    if (is_inline) {
+        char *end = NULL;
+        unsigned long long n = strtoull(input + 1, &end, 10);
+        if (!end || *end != '\0' || end == input + 1 || n > SERVER_INLINE_MAX) {
+            send_reply(worker->conn.fd, "ERR bad inline size\n");
+            return false;
+        }
+        inline_size = (size_t)n;
+        if (!read_payload(worker, inline_size)) {
+            return false;
+        }
+    }
+
+    // The input slot is a placeholder so the parser takes the request as a
+    // plain single-file run; the real input is handled above
+    int argc = 0;
+    argv[argc++] = "png";
+    argv[argc++] = "request.png";
+    argv[argc++] = "-o";
+    argv[argc++] = output;
+    char *token;
+    while ((token = strtok_r(NULL, " \t\r", &save)) != NULL) {
+        if (argc == SERVER_MAX_ARGS + 3) {
+            return send_reply(worker->conn.fd, "ERR too many options\n");
+        }
+        argv[argc++] = token;
+    }
+
+    cli_config_t config;
+    if (!parse_arguments(argc, argv, &config)) {
+        return send_reply(worker->conn.fd, "ERR invalid options\n");
+    }
+    if (config.batch_source || config.serve_socket) {
+        return send_reply(worker->conn.fd, "ERR unsupported mode\n");
+    }
+
+    // Requests are the unit of parallelism, each runs on its own worker
+    process_options_t options = config.process;
+    options.threads = 1;
+    options.verbose = false;
+
+    png_reader_t png;
+    bool opened = is_inline
+                ? png_reader_open_memory(worker->payload, inline_size, "inline data", &png)
+                : png_reader_open(input, &png);
+    double read_done = now_ms();
+
+    int status = PROCESS_FAILED;
+    if (opened) {
+        status = process_png_image(&png, output, &options);
+        png_reader_close(&png);
+    }
+    double done = now_ms();
+    *ok = (status == PROCESS_OK);
+
+    if (*ok) {
+        snprintf(reply, sizeof(reply), "OK total_ms=%.3f read_ms=%.3f process_ms=%.3f\n",
+                 done - start, read_done - start, done - read_done);
+    } else {
+        snprintf(reply, sizeof(reply), "ERR %s failed\n",
+                 !opened ? "reading input" : (status == PROCESS_WRITE_FAILED) ? "writing output" : "processing");
+    }
+    return send_reply(worker->conn.fd, reply);
+}
+
+static void serve_connections(server_t *server) {
+    worker_t *worker = calloc(1, sizeof(worker_t));
+    if (!worker) {
+        fprintf(stderr, "ERROR: Could not allocate memory for server worker\n");
+        return;
+    }
+
+    int fd;
+    while ((fd = queue_pop(server)) >= 0) {
+        worker->conn.fd = fd;
+        worker->conn.start = 0;
+        worker->conn.end = 0;
+
+        while (connection_read_line(&worker->conn, worker->line, sizeof(worker->line))) {
+            bool ok = false;
+            bool usable = handle_request(worker, &ok);
+            buffer_cache_trim();
+
+            pthread_mutex_lock(&server->lock);
+            if (ok) {
+                server->succeeded++;
+            } else {
+                server->failed++;
+            }
+            pthread_mutex_unlock(&server->lock);
+
+            if (!usable) {
+                break;
+            }
+        }
+        close(fd);
+    }
+
+    free(worker->payload);
+    free(worker);
+}
+
+static void accept_connections(server_t *server) {
+    while (wait_readable(server->listen_fd)) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED) {
+                fprintf(stderr, "ERROR: accept failed: %s\n", strerror(errno));
+            }
+            continue;
+        }
+        queue_push(server, fd);
+    }
+    queue_close(server);
+}
+
+// Task 0 accepts, every other task serves connections until shutdown
+static void server_task(void *arg, uint32_t index) {
+    server_t *server = arg;
+    if (index == 0) {
+        accept_connections(server);
+    } else {
+        serve_connections(server);
+    }
+}
+
+static int open_listen_socket(const char *path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "ERROR: Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    // Replace a stale socket from an earlier run, but never a regular file
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Could not create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, 128) != 0) {
+        fprintf(stderr, "ERROR: Could not listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int run_server(const server_config_t *config) {
+    server_t server;
+    memset(&server, 0, sizeof(server_t));
+
+    server.listen_fd = open_listen_socket(config->socket_path);
+    if (server.listen_fd < 0) {
+        return 1;
+    }
+
+    uint32_t jobs = thread_count_resolve(config->jobs);
+    // One thread accepts, `jobs` serve; the calling thread is one of them
+    thread_pool_t *pool = thread_pool_create(jobs);
+    if (!pool) {
+        close(server.listen_fd);
+        unlink(config->socket_path);
+        return 1;
+    }
+
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.not_empty, NULL);
+    pthread_cond_init(&server.not_full, NULL);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    printf("Listening on %s with %u workers\n", config->socket_path, jobs);
+    fflush(stdout);
+    thread_pool_run(pool, jobs + 1, server_task, &server);
+
+    thread_pool_destroy(pool);
+    close(server.listen_fd);
+    unlink(config->socket_path);
+    pthread_cond_destroy(&server.not_full);
+    pthread_cond_destroy(&server.not_empty);
+    pthread_mutex_destroy(&server.lock);
+
+    printf("\nServer stopped: %llu requests ok, %llu failed\n",
+           (unsigned long long)server.succeeded, (unsigned long long)server.failed);
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include "../include/stats.h"
+#include <time.h>
+#include <sys/resource.h>
+
+bool stats_enabled = false;
+
+typedef struct {
+    uint64_t nanoseconds;
+    uint64_t calls;
+    uint64_t bytes;
+} stage_totals_t;
+
+static stage_totals_t totals[STATS_STAGE_COUNT];
+static int64_t tracked_bytes;
+static int64_t tracked_peak;
+
+static const char *const stage_names[STATS_STAGE_COUNT] = {
+    "parse", "inflate", "unfilter", "convert", "convolve",
+    "resample", "filter", "deflate", "write",
+};
+
+void stats_enable(void) {
+    stats_enabled = true;
+}
+
+uint64_t stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Stages are recorded from pool workers too, hence the atomics
+void stats_record(stats_stage_t stage, uint64_t start, uint64_t bytes) {
+    stage_totals_t *t = &totals[stage];
+    __atomic_fetch_add(&t->nanoseconds, stats_now_ns() - start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void stats_track(int64_t delta) {
+    int64_t now = __atomic_add_fetch(&tracked_bytes, delta, __ATOMIC_RELAXED);
+    int64_t peak = __atomic_load_n(&tracked_peak, __ATOMIC_RELAXED);
+    while (now > peak &&
+           !__atomic_compare_exchange_n(&tracked_peak, &peak, now, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static long peak_rss_kb(void) {
+    struct rusage usage;
+    return (getrusage(RUSAGE_SELF, &usage) == 0) ? usage.ru_maxrss : 0;
+}
+
+void stats_print(FILE *out, stats_format_t format, double total_ms) {
+    double peak_mb = (double)tracked_peak / 1e6;
+    double rss_mb = (double)peak_rss_kb() / 1e3;
+
+    if (format == STATS_FORMAT_JSON) {
+        fprintf(out, "{\"total_ms\": %.3f, \"peak_buffer_bytes\": %lld, \"peak_rss_kb\": %ld, \"stages\": [",
+                total_ms, (long long)tracked_peak, peak_rss_kb());
+        bool first = true;
+        for (int i = 0; i < STATS_STAGE_COUNT; i++) {
+            if (totals[i].calls == 0) {
+                continue;
+            }
+            fprintf(out, "%s{\"stage\": \"%s\", \"ms\": %.3f, \"calls\": %llu, \"bytes\": %llu}",
+                    first ? "" : ", ", stage_names[i], totals[i].nanoseconds / 1e6,
+                    (unsigned long long)totals[i].calls, (unsigned long long)totals[i].bytes);
+            first = false;
+        }
+        fprintf(out, "]}\n");
+        return;
+    }
+
+    fprintf(out, "\nStage        time (ms)    calls        MB     MB/s\n");
+    for (int i = 0; i < STATS_STAGE_COUNT; i++) {
+        if (totals[i].calls == 0) {
+            continue;
+        }
+        double ms = totals[i].nanoseconds / 1e6;
+        double mb = totals[i].bytes / 1e6;
+        fprintf(out, "%-10s %11.2f %8llu %9.1f %8.1f\n", stage_names[i], ms,
+                (unsigned long long)totals[i].calls, mb, (ms > 0) ? mb / (ms / 1e3) : 0.0);
+    }
+    fprintf(out, "Total      %11.2f\n", total_ms);
+    fprintf(out, "Peak image and codec buffers: %.1f MB, peak RSS: %.1f MB\n", peak_mb, rss_mb);
+}
@@ -26,56 +26,38 @@ bool isPNG(FILE *file) {
 /**
  * @brief Detects and prints custom ancillary chunks in a PNG file.
  *
- * @param file A pointer to the opened PNG file stream (must be readable).
+ * @param filename Path of the PNG file, it is mapped and indexed read-only.
  * @return true if a hidden chunk was found, false otherwise.
  */
-bool detect(FILE *file) {
-    if(!file) {
-        fprintf(stderr, "ERROR: Invalid file pointer passed to detect()\n");
-        return false;
-    }
-    rewind(file); // Ensure we start from the beginning
-    if(!isPNG(file)) {
+bool detect(const char *filename) {
+    png_map_t map;
+    if(!png_map_open(filename, &map)) {
         return false;
     }
 
-    // isPNG moves the pointer, so we must skip the signature again
-    fseek(file, 8, SEEK_SET);
-
     printf("Searching for hidden chunks...\n");
     bool found_hidden_chunk = false;
-    while(!feof(file)) {
-        uint32_t chunk_size = read_chunk_size(file);
-        uint8_t chunk_type[5] = {0};
-        read_chunk_type(file, chunk_type);
+    for(uint32_t i = 0; i < map.chunk_count; i++) {
+        const png_chunk_t *chunk = &map.chunks[i];
 
-        // Check for private, ancillary chunk (first letter is lowercase)
-        if(chunk_type[0] >= 'a' && chunk_type[0] <= 'z' && memcmp(chunk_type, "tRNS", 4) != 0) {
+        // Check for private, ancillary chunk (first letter is lowercase); our
+        // own strip index is not hidden data
+        if(chunk->type[0] >= 'a' && chunk->type[0] <= 'z' && memcmp(chunk->type, "tRNS", 4) != 0 &&
+           memcmp(chunk->type, PNG_STRIP_CHUNK, 4) != 0) {
             found_hidden_chunk = true;
-            printf("\n✅ Found hidden chunk: \033[31m%s\033[0m\n", chunk_type);
-            printf("   Length: %u bytes\n", chunk_size);
-
-            if(chunk_size > 0) {
-                char *data = (char *)malloc(chunk_size + 1);
-                if(!data) {
-                    fprintf(stderr, "ERROR: Failed to allocate memory for data\n");
-                    fseek(file, chunk_size, SEEK_CUR);
-                } else {
-                    read_bytes(file, data, chunk_size);
-                    data[chunk_size] = '\0';
-                    printf("   Message: \"\033[31m%s\033[0m\"\n", data);
-                    free(data);
-                }
+            printf("\n✅ Found hidden chunk: \033[31m%.4s\033[0m\n", chunk->type);
+            printf("   Length: %u bytes\n", chunk->length);
+            if(!chunk->crc_ok) {
+                printf("   CRC: \033[31mmismatch\033[0m\n");
+            }
+
+            if(chunk->length > 0) {
+                printf("   Message: \"\033[31m%.*s\033[0m\"\n",
+                       (int)strnlen((const char *)png_chunk_data(&map, chunk), chunk->length),
+                       (const char *)png_chunk_data(&map, chunk));
             } else {
                 printf("   Message: (empty)\n");
             }
-        } else {
-            fseek(file, chunk_size, SEEK_CUR);
-        }
-
-        read_chunk_crc(file);
-        if(memcmp(chunk_type, "IEND", 4) == 0) {
-            break;
         }
     }
 
@@ -83,7 +65,7 @@ bool detect(FILE *file) {
         printf("No hidden chunks found!\n");
         printf("\033[32mFile is clean.\033[0m\n");
     }
-    rewind(file);
+    png_map_close(&map);
     return found_hidden_chunk;
 }
 
@@ -150,10 +132,12 @@ void inject_chunk(FILE *file, char type[], char message[]) {
     fseek(file, iend_pos, SEEK_SET);
 
     uint32_t msg_len = strlen(message);
-    write_chunk(file, type, (uint8_t *)message, msg_len);
-
-    // Write IEND back
-    write_bytes(file, iend_chunk_data, sizeof(iend_chunk_data));
+    // Write the chunk, then IEND back
+    if(!write_chunk(file, type, (uint8_t *)message, msg_len) ||
+       !write_bytes(file, iend_chunk_data, sizeof(iend_chunk_data))) {
+        fprintf(stderr, "ERROR: Injection failed...\n");
+        return;
+    }
 
     printf("\n🚀 Successfully injected chunk '%s' with a %u-byte message.\n", type, msg_len);
 }
@@ -240,7 +224,10 @@ void delete_chunk(FILE *file, char type[]) {
 
     // Write the buffer after truncate
     fseek(file, chunk_pos, SEEK_SET);
-    write_bytes(file, buffer, after_data_size);
+    if(!write_bytes(file, buffer, after_data_size)) {
+        free(buffer);
+        return;
+    }
 
     // truncate the file to its new, smaller size
     if(ftruncate(fileno(file), file_size - chunk_size) != 0) {
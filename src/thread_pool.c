@@ -0,0 +1,172 @@
+#include "../include/thread_pool.h"
+#include <pthread.h>
+#include <unistd.h>
+
+struct thread_pool {
+    pthread_t *workers;
+    uint32_t worker_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;   // a new loop was published
+    pthread_cond_t work_done;    // the last task of a loop finished
+    pthread_mutex_t run_lock;    // serializes thread_pool_run() callers
+
+    // Current loop, guarded by lock
+    pool_task_fn fn;
+    void *arg;
+    uint32_t count;
+    uint32_t next;
+    uint32_t finished;
+    uint64_t generation;
+    bool shutdown;
+};
+
+uint32_t cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (uint32_t)n : 1;
+}
+
+uint32_t thread_count_resolve(uint32_t threads) {
+    return threads ? threads : cpu_count();
+}
+
+// Take tasks of the current loop until none are left. Called with lock held
+static void drain_tasks(thread_pool_t *pool) {
+    while (pool->next < pool->count) {
+        uint32_t index = pool->next++;
+        pool_task_fn fn = pool->fn;
+        void *arg = pool->arg;
+
+        pthread_mutex_unlock(&pool->lock);
+        fn(arg, index);
+        pthread_mutex_lock(&pool->lock);
+
+        if (++pool->finished == pool->count) {
+            pthread_cond_broadcast(&pool->work_done);
+        }
+    }
+}
+
+static void *worker_main(void *data) {
+    thread_pool_t *pool = data;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->shutdown && pool->generation == seen) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if (pool->shutdown) {
+            break;
+        }
+        seen = pool->generation;
+        drain_tasks(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+thread_pool_t *thread_pool_create(uint32_t threads) {
+    thread_pool_t *pool = calloc(1, sizeof(thread_pool_t));
+    if (!pool) {
+        fprintf(stderr, "ERROR: Could not allocate memory for thread pool\n");
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->run_lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+
+    if (threads > 0) {
+        pool->workers = malloc(threads * sizeof(pthread_t));
+        if (!pool->workers) {
+            fprintf(stderr, "ERROR: Could not allocate memory for worker threads\n");
+            thread_pool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    for (uint32_t i = 0; i < threads; i++) {
+        if (pthread_create(&pool->workers[i], NULL, worker_main, pool) != 0) {
+            fprintf(stderr, "ERROR: Could not start worker thread %u\n", i);
+            thread_pool_destroy(pool);
+            return NULL;
+        }
+        pool->worker_count++;
+    }
+
+    return pool;
+}
+
+void thread_pool_destroy(thread_pool_t *pool) {
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (uint32_t i = 0; i < pool->worker_count; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->work_done);
+    pthread_mutex_destroy(&pool->run_lock);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+uint32_t thread_pool_size(const thread_pool_t *pool) {
+    return pool ? pool->worker_count : 0;
+}
+
+void thread_pool_run(thread_pool_t *pool, uint32_t count, pool_task_fn fn, void *arg) {
+    if (count == 0) {
+        return;
+    }
+    // Nothing to share, skip the locking
+    if (!pool || pool->worker_count == 0 || count == 1) {
+        for (uint32_t i = 0; i < count; i++) {
+            fn(arg, i);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->run_lock);
+    pthread_mutex_lock(&pool->lock);
+
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->count = count;
+    pool->next = 0;
+    pool->finished = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_ready);
+
+    // The caller works through the loop alongside the workers
+    drain_tasks(pool);
+    while (pool->finished < pool->count) {
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->run_lock);
+}
+
+static thread_pool_t *shared_pool = NULL;
+static pthread_once_t shared_pool_once = PTHREAD_ONCE_INIT;
+
+static void shared_pool_init(void) {
+    // The calling thread is the last worker
+    shared_pool = thread_pool_create(cpu_count() - 1);
+}
+
+thread_pool_t *thread_pool_shared(void) {
+    pthread_once(&shared_pool_once, shared_pool_init);
+    return shared_pool;
+}
@@ -0,0 +1,196 @@
+#include "../include/unpack.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Every input byte of a 1, 2 or 4-bit row expands to 8, 4 or 2 output bytes:
+// sub_byte_tables[depth][scale][byte] holds them, raw and stretched to 0-255
+static uint8_t sub_byte_tables[3][2][256][8];
+static pthread_once_t sub_byte_tables_once = PTHREAD_ONCE_INIT;
+
+static uint32_t depth_index(uint32_t bit_depth) {
+    return (bit_depth == 1) ? 0 : (bit_depth == 2) ? 1 : 2;
+}
+
+static void make_sub_byte_tables(void) {
+    static const uint32_t depths[3] = {1, 2, 4};
+    for (uint32_t d = 0; d < 3; d++) {
+        uint32_t bits = depths[d];
+        uint32_t max = (1u << bits) - 1;
+        for (uint32_t byte = 0; byte < 256; byte++) {
+            for (uint32_t i = 0; i < 8 / bits; i++) {
+                uint32_t value = (byte >> (8 - bits * (i + 1))) & max;
+                sub_byte_tables[d][0][byte][i] = (uint8_t)value;
+                sub_byte_tables[d][1][byte][i] = (uint8_t)(value * 255 / max);
+            }
+        }
+    }
+}
+
+void unpack_sub_byte(const uint8_t *src, uint8_t *dst, size_t count, uint32_t bit_depth, bool scale) {
+    pthread_once(&sub_byte_tables_once, make_sub_byte_tables);
+
+    const uint8_t (*table)[8] = sub_byte_tables[depth_index(bit_depth)][scale ? 1 : 0];
+    size_t per_byte = 8 / bit_depth;
+    size_t full = count / per_byte;
+
+    // Constant sizes so every copy is a single store
+    switch (bit_depth) {
+        case 1:
+            for (size_t i = 0; i < full; i++) memcpy(dst + i * 8, table[src[i]], 8);
+            break;
+        case 2:
+            for (size_t i = 0; i < full; i++) memcpy(dst + i * 4, table[src[i]], 4);
+            break;
+        default:
+            for (size_t i = 0; i < full; i++) memcpy(dst + i * 2, table[src[i]], 2);
+            break;
+    }
+    if (count > full * per_byte) {
+        memcpy(dst + full * per_byte, table[src[full]], count - full * per_byte);
+    }
+}
+
+void unpack_sub_byte_scalar(const uint8_t *src, uint8_t *dst, size_t count, uint32_t bit_depth, bool scale) {
+    uint32_t max = (1u << bit_depth) - 1;
+    for (size_t i = 0; i < count; i++) {
+        size_t bit = i * bit_depth;
+        uint32_t value = (src[bit / 8] >> (8 - bit_depth - bit % 8)) & max;
+        dst[i] = (uint8_t)(scale ? value * 255 / max : value);
+    }
+}
+
+// round(v / 257) without a division: t = v + 128, (t - (t >> 8)) >> 8. The
+// sum only saturates for values that round to 255 anyway
+static inline uint8_t round_16_to_8(uint32_t v) {
+    uint32_t t = v + 128;
+    if (t > 0xFFFF) t = 0xFFFF;
+    return (uint8_t)((t - (t >> 8)) >> 8);
+}
+
+#ifdef __SSE2__
+// Eight big-endian samples as native 16-bit lanes
+static inline __m128i load_be16(const uint8_t *src) {
+    __m128i v = _mm_loadu_si128((const __m128i *)src);
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static inline __m128i round_16_to_8_epi16(__m128i v) {
+    __m128i t = _mm_adds_epu16(v, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_sub_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+#endif
+
+void unpack_16_to_8(const uint8_t *src, uint8_t *dst, size_t count) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= count; i += 16) {
+        __m128i lo = round_16_to_8_epi16(load_be16(src + i * 2));
+        __m128i hi = round_16_to_8_epi16(load_be16(src + i * 2 + 16));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] = round_16_to_8(((uint32_t)src[i * 2] << 8) | src[i * 2 + 1]);
+    }
+}
+
+void unpack_16_to_8_scalar(const uint8_t *src, uint8_t *dst, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        uint32_t v = ((uint32_t)src[i * 2] << 8) | src[i * 2 + 1];
+        dst[i] = (uint8_t)((v * 255 + 32895) >> 16);
+    }
+}
+
+void unpack_16(const uint8_t *src, uint16_t *dst, size_t count) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 8 <= count; i += 8) {
+        _mm_storeu_si128((__m128i *)(dst + i), load_be16(src + i * 2));
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] = (uint16_t)((src[i * 2] << 8) | src[i * 2 + 1]);
+    }
+}
+
+void pack_16(const uint16_t *src, uint8_t *dst, size_t count) {
+    size_t i = 0;
+#ifdef __SSE2__
+    // The swap is its own inverse
+    for (; i + 8 <= count; i += 8) {
+        _mm_storeu_si128((__m128i *)(dst + i * 2), load_be16((const uint8_t *)(src + i)));
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i * 2] = (uint8_t)(src[i] >> 8);
+        dst[i * 2 + 1] = (uint8_t)src[i];
+    }
+}
+
+void pack_sub_byte(const uint8_t *src, uint8_t *dst, size_t count, uint32_t bit_depth) {
+    size_t per_byte = 8 / bit_depth;
+    size_t full = count / per_byte;
+    for (size_t i = 0; i < full; i++) {
+        uint32_t byte = 0;
+        for (size_t j = 0; j < per_byte; j++) {
+            byte = (byte << bit_depth) | src[i * per_byte + j];
+        }
+        dst[i] = (uint8_t)byte;
+    }
+    // A partial last byte is padded with zero bits
+    size_t rest = count - full * per_byte;
+    if (rest > 0) {
+        uint32_t byte = 0;
+        for (size_t j = 0; j < rest; j++) {
+            byte = (byte << bit_depth) | src[full * per_byte + j];
+        }
+        dst[full] = (uint8_t)(byte << (bit_depth * (per_byte - rest)));
+    }
+}
+
+void unpack_palette(const uint8_t *indices, uint8_t *dst, size_t count,
+                    const uint8_t entries[256][4], uint32_t channels) {
+    if (channels == 4) {
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            memcpy(dst + i * 4 + 0, entries[indices[i + 0]], 4);
+            memcpy(dst + i * 4 + 4, entries[indices[i + 1]], 4);
+            memcpy(dst + i * 4 + 8, entries[indices[i + 2]], 4);
+            memcpy(dst + i * 4 + 12, entries[indices[i + 3]], 4);
+        }
+        for (; i < count; i++) {
+            memcpy(dst + i * 4, entries[indices[i]], 4);
+        }
+        return;
+    }
+    // RGB pixels are stored 4 bytes at a time too, each store's extra byte
+    // is overwritten by the next pixel. The last one is copied exactly
+    if (count == 0) {
+        return;
+    }
+    size_t i = 0;
+    for (; i + 4 <= count - 1; i += 4) {
+        memcpy(dst + i * 3 + 0, entries[indices[i + 0]], 4);
+        memcpy(dst + i * 3 + 3, entries[indices[i + 1]], 4);
+        memcpy(dst + i * 3 + 6, entries[indices[i + 2]], 4);
+        memcpy(dst + i * 3 + 9, entries[indices[i + 3]], 4);
+    }
+    for (; i < count - 1; i++) {
+        memcpy(dst + i * 3, entries[indices[i]], 4);
+    }
+    memcpy(dst + i * 3, entries[indices[i]], 3);
+}
+
+void unpack_palette_scalar(const uint8_t *indices, uint8_t *dst, size_t count,
+                           const uint8_t entries[256][4], uint32_t channels) {
+    for (size_t i = 0; i < count; i++) {
+        for (uint32_t c = 0; c < channels; c++) {
+            dst[i * channels + c] = entries[indices[i]][c];
+        }
+    }
+}
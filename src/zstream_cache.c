@@ -0,0 +1,119 @@
+#include "../include/zstream_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+typedef struct {
+    z_stream *inflate;
+    z_stream *deflate;
+    int deflate_level;
+} zstream_slots_t;
+
+static pthread_key_t slots_key;
+static pthread_once_t slots_key_once = PTHREAD_ONCE_INIT;
+
+static void free_slots(void *data) {
+    zstream_slots_t *slots = data;
+    if (slots->inflate) {
+        inflateEnd(slots->inflate);
+        free(slots->inflate);
+    }
+    if (slots->deflate) {
+        deflateEnd(slots->deflate);
+        free(slots->deflate);
+    }
+    free(slots);
+}
+
+static void make_slots_key(void) {
+    pthread_key_create(&slots_key, free_slots);
+}
+
+// This thread's slots, created on first use. NULL if that fails, callers
+// then simply do not cache
+static zstream_slots_t *thread_slots(void) {
+    pthread_once(&slots_key_once, make_slots_key);
+    zstream_slots_t *slots = pthread_getspecific(slots_key);
+    if (!slots) {
+        slots = calloc(1, sizeof(zstream_slots_t));
+        if (slots && pthread_setspecific(slots_key, slots) != 0) {
+            free(slots);
+            slots = NULL;
+        }
+    }
+    return slots;
+}
+
+z_stream *zstream_inflate_acquire(void) {
+    zstream_slots_t *slots = thread_slots();
+    if (slots && slots->inflate) {
+        z_stream *stream = slots->inflate;
+        slots->inflate = NULL;
+        // A reset keeps whatever input the last image left unread
+        stream->next_in = Z_NULL;
+        stream->avail_in = 0;
+        return stream;
+    }
+
+    z_stream *stream = calloc(1, sizeof(z_stream));
+    if (!stream || inflateInit(stream) != Z_OK) {
+        fprintf(stderr, "ERROR: Could not initialize zlib inflate\n");
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+void zstream_inflate_release(z_stream *stream) {
+    if (!stream) {
+        return;
+    }
+    zstream_slots_t *slots = thread_slots();
+    if (slots && !slots->inflate && inflateReset(stream) == Z_OK) {
+        slots->inflate = stream;
+        return;
+    }
+    inflateEnd(stream);
+    free(stream);
+}
+
+z_stream *zstream_deflate_acquire(int level) {
+    zstream_slots_t *slots = thread_slots();
+    if (slots && slots->deflate) {
+        z_stream *stream = slots->deflate;
+        slots->deflate = NULL;
+        // deflateParams() on a reset stream is not safe with every zlib
+        // version, so a different level gets a fresh stream
+        if (slots->deflate_level == level) {
+            stream->next_in = Z_NULL;
+            stream->avail_in = 0;
+            return stream;
+        }
+        deflateEnd(stream);
+        free(stream);
+    }
+
+    z_stream *stream = calloc(1, sizeof(z_stream));
+    if (!stream || deflateInit(stream, level) != Z_OK) {
+        fprintf(stderr, "ERROR: Could not initialize zlib deflate\n");
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+void zstream_deflate_release(z_stream *stream, int level) {
+    if (!stream) {
+        return;
+    }
+    zstream_slots_t *slots = thread_slots();
+    if (slots && !slots->deflate && deflateReset(stream) == Z_OK) {
+        slots->deflate = stream;
+        slots->deflate_level = level;
+        return;
+    }
+    deflateEnd(stream);
+    free(stream);
+}